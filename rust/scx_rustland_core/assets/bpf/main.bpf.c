@@ -30,8 +30,10 @@
 #ifdef LSP
 #define __bpf__
 #include "../../../../scheds/include/scx/common.bpf.h"
+#include "../../../../scheds/include/scx/idle_topo_impl.bpf.h"
 #else
 #include <scx/common.bpf.h>
+#include <scx/idle_topo_impl.bpf.h>
 #endif
 
 #include "intf.h"
@@ -98,24 +100,6 @@ const volatile bool debug;
  */
 const volatile bool smt_enabled = true;
 
-/*
- * Allocate/re-allocate a new cpumask.
- */
-static int calloc_cpumask(struct bpf_cpumask **p_cpumask)
-{
-	struct bpf_cpumask *cpumask;
-
-	cpumask = bpf_cpumask_create();
-	if (!cpumask)
-		return -ENOMEM;
-
-	cpumask = bpf_kptr_xchg(p_cpumask, cpumask);
-	if (cpumask)
-		bpf_cpumask_release(cpumask);
-
-	return 0;
-}
-
 /*
  * Maximum amount of tasks queued between kernel and user-space at a certain
  * time.
@@ -157,8 +141,6 @@ struct {
  * Per-CPU context.
  */
 struct cpu_ctx {
-	struct bpf_cpumask __kptr *l2_cpumask;
-	struct bpf_cpumask __kptr *l3_cpumask;
 	/*
 	 * Prevent the CPU from going idle.
 	 *
@@ -192,12 +174,6 @@ struct cpu_ctx *try_lookup_cpu_ctx(s32 cpu)
  * This contain all the per-task information used internally by the BPF code.
  */
 struct task_ctx {
-	/*
-	 * Temporary cpumask for calculating scheduling domains.
-	 */
-	struct bpf_cpumask __kptr *l2_cpumask;
-	struct bpf_cpumask __kptr *l3_cpumask;
-
 	/*
 	 * Time slice assigned to the task.
 	 */
@@ -400,12 +376,7 @@ static inline u64 task_slice(struct task_struct *p)
  */
 static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu)
 {
-	const struct cpumask *online_cpumask, *idle_smtmask, *idle_cpumask;
-	struct bpf_cpumask *l2_domain, *l3_domain;
-	struct bpf_cpumask *l2_mask, *l3_mask;
-	struct task_ctx *tctx;
-	struct cpu_ctx *cctx;
-	s32 cpu;
+	bool is_idle;
 
 	/*
 	 * If the task isn't allowed to use its previously used CPU it means
@@ -426,156 +397,14 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu)
 		return -ENOENT;
 	}
 
-	tctx = try_lookup_task_ctx(p);
-	if (!tctx)
-		return -ENOENT;
-
-	cctx = try_lookup_cpu_ctx(prev_cpu);
-	if (!cctx)
-		return -ENOENT;
-
-	/*
-	 * Acquire the CPU masks to determine the online and idle CPUs in the
-	 * system.
-	 */
-	online_cpumask = scx_bpf_get_online_cpumask();
-	idle_smtmask = scx_bpf_get_idle_smtmask();
-	idle_cpumask = scx_bpf_get_idle_cpumask();
-
-	/*
-	 * Scheduling domains of the previously used CPU.
-	 */
-	l2_domain = cctx->l2_cpumask;
-	if (!l2_domain)
-		l2_domain = (struct bpf_cpumask *)p->cpus_ptr;
-
-	l3_domain = cctx->l3_cpumask;
-	if (!l3_domain)
-		l3_domain = (struct bpf_cpumask *)p->cpus_ptr;
-
-	/*
-	 * Task's scheduling domains.
-	 */
-	l2_mask = tctx->l2_cpumask;
-	if (!l2_mask) {
-		scx_bpf_error("l2 cpumask not initialized");
-		cpu = -ENOENT;
-		goto out_put_cpumask;
-	}
-	l3_mask = tctx->l3_cpumask;
-	if (!l3_mask) {
-		scx_bpf_error("l3 cpumask not initialized");
-		cpu = -ENOENT;
-		goto out_put_cpumask;
-	}
-
-	/*
-	 * Determine the L2 cache domain as the intersection of the task's
-	 * primary cpumask and the L2 cache domain mask of the previously used
-	 * CPU (ignore if this cpumask completely overlaps with the task's
-	 * cpumask).
-	 */
-	bpf_cpumask_and(l2_mask, p->cpus_ptr, cast_mask(l2_domain));
-
-	/*
-	 * Determine the L3 cache domain as the intersection of the task's
-	 * primary cpumask and the L3 cache domain mask of the previously used
-	 * CPU (ignore if this cpumask completely overlaps with the task's
-	 * cpumask).
-	 */
-	bpf_cpumask_and(l3_mask, p->cpus_ptr, cast_mask(l3_domain));
-
 	/*
-	 * Find the best idle CPU, prioritizing full idle cores in SMT systems.
-	 */
-	if (smt_enabled) {
-		/*
-		 * If the task can still run on the previously used CPU and
-		 * it's a full-idle core, keep using it.
-		 */
-		if (bpf_cpumask_test_cpu(prev_cpu, p->cpus_ptr) &&
-		    bpf_cpumask_test_cpu(prev_cpu, idle_smtmask) &&
-		    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
-			cpu = prev_cpu;
-			goto out_put_cpumask;
-		}
-
-		/*
-		 * Search for any full-idle CPU in the task domain that shares
-		 * the same L2 cache.
-		 */
-		cpu = bpf_cpumask_any_and_distribute(cast_mask(l2_mask), idle_smtmask);
-		if (bpf_cpumask_test_cpu(cpu, online_cpumask) &&
-		    scx_bpf_test_and_clear_cpu_idle(cpu))
-			goto out_put_cpumask;
-
-		/*
-		 * Search for any full-idle CPU in the task domain that shares
-		 * the same L3 cache.
-		 */
-		cpu = bpf_cpumask_any_and_distribute(cast_mask(l3_mask), idle_smtmask);
-		if (bpf_cpumask_test_cpu(cpu, online_cpumask) &&
-		    scx_bpf_test_and_clear_cpu_idle(cpu))
-			goto out_put_cpumask;
-
-		/*
-		 * Otherwise, search for another usable full-idle core.
-		 */
-		cpu = bpf_cpumask_any_and_distribute(p->cpus_ptr, idle_smtmask);
-		if (bpf_cpumask_test_cpu(cpu, online_cpumask) &&
-		    scx_bpf_test_and_clear_cpu_idle(cpu))
-			goto out_put_cpumask;
-	}
-
-	/*
-	 * If a full-idle core can't be found (or if this is not an SMT system)
-	 * try to re-use the same CPU, even if it's not in a full-idle core.
-	 */
-	if (bpf_cpumask_test_cpu(prev_cpu, p->cpus_ptr) &&
-	    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
-		cpu = prev_cpu;
-		goto out_put_cpumask;
-	}
-
-	/*
-	 * Search for any idle CPU in the primary domain that shares the same
-	 * L2 cache.
-	 */
-	cpu = bpf_cpumask_any_and_distribute(cast_mask(l2_mask), idle_cpumask);
-	if (bpf_cpumask_test_cpu(cpu, online_cpumask) &&
-	    scx_bpf_test_and_clear_cpu_idle(cpu))
-		goto out_put_cpumask;
-
-	/*
-	 * Search for any idle CPU in the primary domain that shares the same
-	 * L3 cache.
-	 */
-	cpu = bpf_cpumask_any_and_distribute(cast_mask(l3_mask), idle_cpumask);
-	if (bpf_cpumask_test_cpu(cpu, online_cpumask) &&
-	    scx_bpf_test_and_clear_cpu_idle(cpu))
-		goto out_put_cpumask;
-
-	/*
-	 * If all the previous attempts have failed, try to use any idle CPU in
-	 * the system.
-	 */
-	cpu = bpf_cpumask_any_and_distribute(p->cpus_ptr, idle_cpumask);
-	if (bpf_cpumask_test_cpu(cpu, online_cpumask) &&
-	    scx_bpf_test_and_clear_cpu_idle(cpu))
-		goto out_put_cpumask;
-
-	/*
-	 * If all the previous attempts have failed, dispatch the task to the
-	 * first CPU that will become available.
+	 * Find the best idle CPU walking the L2 and L3 domains of the
+	 * previously used CPU, prioritizing full idle cores in SMT systems.
+	 *
+	 * If all the attempts fail, the task is dispatched to the first CPU
+	 * that will become available.
 	 */
-	cpu = -ENOENT;
-
-out_put_cpumask:
-	scx_bpf_put_cpumask(idle_cpumask);
-	scx_bpf_put_cpumask(idle_smtmask);
-	scx_bpf_put_cpumask(online_cpumask);
-
-	return cpu;
+	return scx_topo_pick_idle_cpu(p, prev_cpu, NULL, smt_enabled, &is_idle);
 }
 
 /*
@@ -698,6 +527,12 @@ int rs_select_cpu(struct task_cpu_arg *input)
 	if (!p)
 		return -EINVAL;
 
+	/*
+	 * Syscall programs are preemptible, so a racing pick on this CPU can
+	 * clobber the scratch masks used for tasks with restricted affinity.
+	 * That only makes the pick less accurate: dispatch_task() bounces
+	 * tasks targeting a CPU they can't run on to the shared DSQ.
+	 */
 	bpf_rcu_read_lock();
 	cpu = pick_idle_cpu(p, input->cpu);
 	bpf_rcu_read_unlock();
@@ -1062,7 +897,6 @@ s32 BPF_STRUCT_OPS(rustland_init_task, struct task_struct *p,
 		   struct scx_init_task_args *args)
 {
 	struct task_ctx *tctx;
-	struct bpf_cpumask *cpumask;
 
 	tctx = bpf_task_storage_get(&task_ctx_stor, p, 0,
 				    BPF_LOCAL_STORAGE_GET_F_CREATE);
@@ -1070,26 +904,6 @@ s32 BPF_STRUCT_OPS(rustland_init_task, struct task_struct *p,
 		return -ENOMEM;
 	tctx->slice_ns = SCX_SLICE_DFL;
 
-	/*
-	 * Create task's L2 cache cpumask.
-	 */
-	cpumask = bpf_cpumask_create();
-	if (!cpumask)
-		return -ENOMEM;
-	cpumask = bpf_kptr_xchg(&tctx->l2_cpumask, cpumask);
-	if (cpumask)
-		bpf_cpumask_release(cpumask);
-
-	/*
-	 * Create task's L3 cache cpumask.
-	 */
-	cpumask = bpf_cpumask_create();
-	if (!cpumask)
-		return -ENOMEM;
-	cpumask = bpf_kptr_xchg(&tctx->l3_cpumask, cpumask);
-	if (cpumask)
-		bpf_cpumask_release(cpumask);
-
 	return 0;
 }
 
@@ -1200,62 +1014,19 @@ static int dsq_init(void)
 	return 0;
 }
 
-static int init_cpumask(struct bpf_cpumask **cpumask)
-{
-	struct bpf_cpumask *mask;
-	int err = 0;
-
-	/*
-	 * Do nothing if the mask is already initialized.
-	 */
-	mask = *cpumask;
-	if (mask)
-		return 0;
-	/*
-	 * Create the CPU mask.
-	 */
-	err = calloc_cpumask(cpumask);
-	if (!err)
-		mask = *cpumask;
-	if (!mask)
-		err = -ENOMEM;
-
-	return err;
-}
-
 SEC("syscall")
 int enable_sibling_cpu(struct domain_arg *input)
 {
-	struct cpu_ctx *cctx;
-	struct bpf_cpumask *mask, **pmask;
-	int err = 0;
-
-	cctx = try_lookup_cpu_ctx(input->cpu_id);
-	if (!cctx)
-		return -ENOENT;
-
-	/* Make sure the target CPU mask is initialized */
 	switch (input->lvl_id) {
 	case 2:
-		pmask = &cctx->l2_cpumask;
-		break;
+		return scx_topo_add_sibling(input->cpu_id, input->sibling_cpu_id,
+					    SCX_TOPO_L2);
 	case 3:
-		pmask = &cctx->l3_cpumask;
-		break;
+		return scx_topo_add_sibling(input->cpu_id, input->sibling_cpu_id,
+					    SCX_TOPO_L3);
 	default:
 		return -EINVAL;
 	}
-	err = init_cpumask(pmask);
-	if (err)
-		return err;
-
-	bpf_rcu_read_lock();
-	mask = *pmask;
-	if (mask)
-		bpf_cpumask_set_cpu(input->sibling_cpu_id, mask);
-	bpf_rcu_read_unlock();
-
-	return err;
 }
 
 /*
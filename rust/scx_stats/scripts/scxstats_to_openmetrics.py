@@ -6,10 +6,14 @@ import socket
 import time
 import tempfile
 from prometheus_client import Gauge, CollectorRegistry, write_to_textfile
+from prometheus_client.core import GaugeHistogramMetricFamily
 from pprint import pprint
 
 verbose = 0
 
+# Must match HIST_SUB_BITS in scx_stats/src/hist.rs.
+HIST_SUB_BITS = 2
+
 def info(line):
     print('[INFO] ' + line, file=sys.stderr)
 
@@ -25,6 +29,48 @@ def request(f, req, args={}):
         raise Exception(f"req: {req} args: {args} failed with {resp['errno']} ({resp['args']['resp']})")
     return resp['args']['resp']
 
+def hist_om_buckets(hist):
+    # Collapse the log-linear buckets of a "hist" field into cumulative
+    # buckets at power-of-two boundaries. The last bucket collects overflows
+    # and is only covered by +Inf.
+    nr_subs = 1 << HIST_SUB_BITS
+    buckets = hist.get('buckets', [])
+    om_buckets = []
+    cum = 0
+    for idx, cnt in enumerate(buckets[:-1]):
+        cum += cnt
+        if (idx + 1) % nr_subs:
+            continue
+        if idx < nr_subs:
+            hi = idx + 1
+        else:
+            shift = (idx >> HIST_SUB_BITS) - 1
+            hi = ((nr_subs | (idx & (nr_subs - 1))) << shift) + (1 << shift)
+        om_buckets.append((str(hi - 1), cum))
+    om_buckets.append(('+Inf', sum(buckets)))
+    return om_buckets
+
+class HistCollector:
+    # "hist" fields carry the histogram of the last interval rather than
+    # monotonic counters, so they're exported as OpenMetrics gauge
+    # histograms. prometheus_client has no settable histogram, so keep the
+    # latest values and build the metric family on collection.
+    def __init__(self, name, desc, labels, registry):
+        self.name = name
+        self.desc = desc
+        self.labels = labels
+        self.hists = {}
+        registry.register(self)
+
+    def set(self, labels, hist):
+        self.hists[tuple(labels)] = hist
+
+    def collect(self):
+        fam = GaugeHistogramMetricFamily(self.name, self.desc, labels=self.labels)
+        for labels, hist in self.hists.items():
+            fam.add_metric(list(labels), hist_om_buckets(hist), hist.get('sum', 0))
+        yield fam
+
 def make_om_metrics(sname, omid, field, labels, meta_db, registry):
     # @sname: The name of the current struct.
     #
@@ -55,6 +101,10 @@ def make_om_metrics(sname, omid, field, labels, meta_db, registry):
                 gname = prefix + omid.rsplit('.', 1)[-1]
                 dbg(f'creating OM metric {gname}@{omid} {labels} "{desc}"')
                 return { omid: Gauge(gname, desc, labels, registry=registry) }
+            case 'hist':
+                gname = prefix + omid.rsplit('.', 1)[-1]
+                dbg(f'creating OM histogram {gname}@{omid} {labels} "{desc}"')
+                return { omid: HistCollector(gname, desc, labels, registry) }
     elif 'dict' in field and 'datum' in field['dict'] and 'struct' in field['dict']['datum']:
         # The only allowed nesting is struct inside dict.
         sname = field['dict']['datum']['struct']
@@ -76,7 +126,11 @@ def make_om_metrics(sname, omid, field, labels, meta_db, registry):
 def update_om_metrics(resp, omid, labels, meta_db, om_metrics):
     for k, v in resp.items():
         k_omid = f'{omid}.{k}'
-        if type(v) == dict:
+        if isinstance(om_metrics.get(k_omid), HistCollector):
+            # Histograms are dicts too but are leaves.
+            dbg(f'updating histogram {k_omid} {labels}')
+            om_metrics[k_omid].set(labels, v)
+        elif type(v) == dict:
             # Descend into dict.
             for dk, dv in v.items():
                 update_om_metrics(dv, k_omid, labels + [dk], meta_db, om_metrics);
@@ -0,0 +1,178 @@
+use serde::{Deserialize, Serialize};
+
+/// Must match SCX_HIST_SUB_BITS in scheds/include/scx/hist.bpf.h.
+pub const HIST_SUB_BITS: u32 = 2;
+/// Must match SCX_HIST_MAX_BITS in scheds/include/scx/hist.bpf.h.
+pub const HIST_MAX_BITS: u32 = 40;
+/// Must match SCX_HIST_NR_BUCKETS in scheds/include/scx/hist.bpf.h.
+pub const HIST_NR_BUCKETS: usize = ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS) as usize;
+
+const HIST_NR_SUBS: u64 = 1 << HIST_SUB_BITS;
+
+/// Percentiles computed by [`StatsHistogram::update_percentiles()`] and
+/// published alongside the raw buckets.
+pub const HIST_PERCENTILES: [(&str, f64); 5] = [
+    ("p50", 50.0),
+    ("p90", 90.0),
+    ("p99", 99.0),
+    ("p999", 99.9),
+    ("max", 100.0),
+];
+
+/// Histogram stats field.
+///
+/// Userspace counterpart of BPF `struct scx_hist`. Fields of this type are
+/// reported as the `hist` kind in stats metadata. The BPF side records into
+/// per-CPU `struct scx_hist` instances which are folded with
+/// [`StatsHistogram::merge()`]. As the full bucket array is exposed, clients
+/// can diff two consecutive snapshots to compute interval percentiles.
+#[derive(Clone, Debug, Default, Serialize, Deserialize)]
+pub struct StatsHistogram {
+    pub buckets: Vec<u64>,
+    pub count: u64,
+    pub sum: u64,
+    pub max: u64,
+    #[serde(default)]
+    pub percentiles: std::collections::BTreeMap<String, u64>,
+}
+
+impl StatsHistogram {
+    /// Map `v` to its bucket index. Equivalent to C `scx_hist_bucket()`.
+    pub fn bucket(v: u64) -> usize {
+        if v < HIST_NR_SUBS {
+            return v as usize;
+        }
+        if v >= 1 << HIST_MAX_BITS {
+            return HIST_NR_BUCKETS - 1;
+        }
+        let msb = 63 - v.leading_zeros();
+        let idx = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) as u64
+            | ((v >> (msb - HIST_SUB_BITS)) & (HIST_NR_SUBS - 1));
+        idx as usize
+    }
+
+    /// Inclusive lower and exclusive upper bounds of the values mapped to
+    /// bucket `idx`.
+    pub fn bucket_range(idx: usize) -> (u64, u64) {
+        let idx = idx as u64;
+        if idx < HIST_NR_SUBS {
+            return (idx, idx + 1);
+        }
+        let shift = (idx >> HIST_SUB_BITS) - 1;
+        let lo = (HIST_NR_SUBS | (idx & (HIST_NR_SUBS - 1))) << shift;
+        (lo, lo + (1 << shift))
+    }
+
+    /// Fold the raw fields of a BPF `struct scx_hist` into `self`.
+    pub fn merge(&mut self, buckets: &[u64], count: u64, sum: u64, max: u64) {
+        if self.buckets.len() < buckets.len() {
+            self.buckets.resize(buckets.len(), 0);
+        }
+        for (dst, src) in self.buckets.iter_mut().zip(buckets.iter()) {
+            *dst += src;
+        }
+        self.count += count;
+        self.sum = self.sum.saturating_add(sum);
+        self.max = self.max.max(max);
+    }
+
+    /// Record a single value from userspace.
+    pub fn record(&mut self, v: u64) {
+        if self.buckets.len() < HIST_NR_BUCKETS {
+            self.buckets.resize(HIST_NR_BUCKETS, 0);
+        }
+        self.buckets[Self::bucket(v)] += 1;
+        self.count += 1;
+        self.sum = self.sum.saturating_add(v);
+        self.max = self.max.max(v);
+    }
+
+    /// Return the delta between `self` and an older snapshot `prev` of the
+    /// same histogram. `max` can't be diffed and is carried over as-is.
+    pub fn delta(&self, prev: &Self) -> Self {
+        let buckets = self
+            .buckets
+            .iter()
+            .enumerate()
+            .map(|(i, v)| v.saturating_sub(*prev.buckets.get(i).unwrap_or(&0)))
+            .collect();
+        Self {
+            buckets,
+            count: self.count.saturating_sub(prev.count),
+            sum: self.sum.saturating_sub(prev.sum),
+            max: self.max,
+            percentiles: Default::default(),
+        }
+    }
+
+    pub fn mean(&self) -> f64 {
+        match self.count {
+            0 => 0.0,
+            cnt => self.sum as f64 / cnt as f64,
+        }
+    }
+
+    /// Value at percentile `pct` (0.0 - 100.0). The upper bound of the bucket
+    /// containing the target rank is returned, capped at `max`, so the result
+    /// over-estimates by at most one sub-bucket width.
+    pub fn percentile(&self, pct: f64) -> u64 {
+        let total: u64 = self.buckets.iter().sum();
+        if total == 0 {
+            return 0;
+        }
+
+        let rank = ((pct.clamp(0.0, 100.0) / 100.0) * total as f64).ceil() as u64;
+        let rank = rank.max(1);
+
+        let mut seen = 0;
+        for (idx, cnt) in self.buckets.iter().enumerate() {
+            seen += cnt;
+            if seen >= rank {
+                let (_, hi) = Self::bucket_range(idx);
+                return match self.max {
+                    0 => hi - 1,
+                    max => (hi - 1).min(max),
+                };
+            }
+        }
+        self.max
+    }
+
+    /// Fill `percentiles` according to [`HIST_PERCENTILES`]. Should be
+    /// called before the histogram is handed to the stats server.
+    pub fn update_percentiles(&mut self) {
+        self.percentiles = HIST_PERCENTILES
+            .iter()
+            .map(|(name, pct)| (name.to_string(), self.percentile(*pct)))
+            .collect();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_bucket_ranges() {
+        for idx in 0..HIST_NR_BUCKETS - 1 {
+            let (lo, hi) = StatsHistogram::bucket_range(idx);
+            assert_eq!(StatsHistogram::bucket(lo), idx);
+            assert_eq!(StatsHistogram::bucket(hi - 1), idx);
+            assert_eq!(StatsHistogram::bucket(hi), idx + 1);
+        }
+        assert_eq!(StatsHistogram::bucket(u64::MAX), HIST_NR_BUCKETS - 1);
+    }
+
+    #[test]
+    fn test_percentile() {
+        let mut hist = StatsHistogram::default();
+        for v in 1..=1000 {
+            hist.record(v);
+        }
+        let p50 = hist.percentile(50.0);
+        let p99 = hist.percentile(99.0);
+        assert!((500..=640).contains(&p50), "p50={}", p50);
+        assert!((990..=1000).contains(&p99), "p99={}", p99);
+        assert_eq!(hist.percentile(100.0), 1000);
+    }
+}
@@ -6,6 +6,9 @@ pub use stats::{
     StatsStructAttrs,
 };
 
+mod hist;
+pub use hist::{StatsHistogram, HIST_MAX_BITS, HIST_NR_BUCKETS, HIST_PERCENTILES, HIST_SUB_BITS};
+
 mod server;
 pub use server::{
     StatsCloser, StatsErrno, StatsOpener, StatsOps, StatsReader, StatsReaderSend, StatsReaderSync,
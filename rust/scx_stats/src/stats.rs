@@ -18,6 +18,8 @@ pub enum StatsKind {
     Float,
     #[serde(rename = "string")]
     String,
+    #[serde(rename = "hist")]
+    Histogram,
     #[serde(rename = "struct")]
     Struct(String),
 }
@@ -36,6 +38,9 @@ impl StatsKind {
                         _ => {}
                     }
                 }
+                if path.segments.last().unwrap().ident == "StatsHistogram" {
+                    return Ok(Self::Histogram);
+                }
                 let name = path.to_token_stream().to_string();
                 paths.insert(name.to_string(), path.clone());
                 return Ok(Self::Struct(name));
@@ -57,6 +62,7 @@ impl std::fmt::Display for StatsKind {
             Self::U64 => write!(f, "u64"),
             Self::Float => write!(f, "float"),
             Self::String => write!(f, "string"),
+            Self::Histogram => write!(f, "hist"),
             Self::Struct(name) => write!(f, "{}", name),
         }
     }
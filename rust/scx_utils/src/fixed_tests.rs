@@ -0,0 +1,312 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+//
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! Checks for the BPF fixed-point helpers in
+//! [fixed_impl.bpf.h](https://github.com/sched-ext/scx/blob/main/scheds/include/scx/fixed_impl.bpf.h)
+//! against the committed lookup tables. The helpers are mirrored here as
+//! they can't be called from userspace.
+
+const FIXED_TABLES_H: &str = include_str!("../bpf_h/scx/fixed_tables.autogen.bpf.h");
+
+// Must match enum scx_fixed_consts in scheds/include/scx/fixed.bpf.h.
+const FIXED_SHIFT: u32 = 16;
+const FIXED_ONE: u64 = 1 << FIXED_SHIFT;
+const LOG2_TBL_BITS: u32 = 6;
+const EXP2_TBL_BITS: u32 = 6;
+const RECIP_SHIFT: u32 = 32;
+
+// sched_prio_to_weight[] and sched_prio_to_wmult[] in kernel/sched/core.c.
+const PRIO_TO_WEIGHT: [u64; 40] = [
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916, 9548, 7620, 6100, 4904,
+    3906, 3121, 2501, 1991, 1586, 1277, 1024, 820, 655, 526, 423, 335, 272, 215, 172, 137, 110, 87,
+    70, 56, 45, 36, 29, 23, 18, 15,
+];
+const PRIO_TO_WMULT: [u32; 40] = [
+    48388, 59856, 76040, 92818, 118348, 147320, 184698, 229616, 287308, 360437, 449829, 563644,
+    704093, 875809, 1099582, 1376151, 1717300, 2157191, 2708050, 3363326, 4194304, 5237765,
+    6557202, 8165337, 10153587, 12820798, 15790321, 19976592, 24970740, 31350126, 39045157,
+    49367440, 61356676, 76695844, 95443717, 119304647, 148102320, 186737708, 238609294, 286331153,
+];
+
+/// Parse the initializer of the C array `name` in FIXED_TABLES_H.
+fn parse_table(name: &str) -> Vec<u64> {
+    let start = FIXED_TABLES_H
+        .find(&format!(" {}[", name))
+        .unwrap_or_else(|| panic!("{} not found", name));
+    let body = &FIXED_TABLES_H[start..];
+    let body = &body[body.find('{').unwrap() + 1..body.find("};").unwrap()];
+    body.split(',')
+        .map(|v| v.trim())
+        .filter(|v| !v.is_empty())
+        .map(|v| v.parse::<u64>().unwrap())
+        .collect()
+}
+
+/// scx_sat_add_u64()
+fn sat_add_u64(a: u64, b: u64) -> u64 {
+    let sum = a.wrapping_add(b);
+    if sum >= a {
+        sum
+    } else {
+        u64::MAX
+    }
+}
+
+/// scx_sat_sub_u64()
+fn sat_sub_u64(a: u64, b: u64) -> u64 {
+    if a > b {
+        a - b
+    } else {
+        0
+    }
+}
+
+/// scx_sat_mul_u64()
+fn sat_mul_u64(a: u64, b: u64) -> u64 {
+    if (a | b) >> 32 == 0 {
+        return a * b;
+    }
+    if a != 0 && b > u64::MAX / a {
+        return u64::MAX;
+    }
+    a.wrapping_mul(b)
+}
+
+/// scx_fixed_log2()
+fn fixed_log2(log2_frac: &[u64], v: u64) -> u64 {
+    let mask = (1u64 << LOG2_TBL_BITS) - 1;
+    if v == 0 {
+        return 0;
+    }
+    // log2_u64() - 1
+    let msb = 63 - v.leading_zeros();
+    let idx = if msb >= LOG2_TBL_BITS {
+        v >> (msb - LOG2_TBL_BITS)
+    } else {
+        v << (LOG2_TBL_BITS - msb)
+    };
+    ((msb as u64) << FIXED_SHIFT) + log2_frac[(idx & mask) as usize]
+}
+
+/// scx_fixed_exp2()
+fn fixed_exp2(exp2_frac: &[u64], x: u64) -> u64 {
+    let mask = (1u64 << EXP2_TBL_BITS) - 1;
+    let ipart = x >> FIXED_SHIFT;
+    if ipart >= 63 {
+        return u64::MAX;
+    }
+    let idx = (x >> (FIXED_SHIFT - EXP2_TBL_BITS)) & mask;
+    let mant = exp2_frac[idx as usize];
+    if ipart >= FIXED_SHIFT as u64 {
+        mant << (ipart - FIXED_SHIFT as u64)
+    } else {
+        mant >> (FIXED_SHIFT as u64 - ipart)
+    }
+}
+
+/// scx_fixed_mul_shr()
+fn fixed_mul_shr(a: u64, b: u32, rshift: u32) -> u64 {
+    let al = (a & 0xffffffff) * b as u64;
+    let ah = (a >> 32) * b as u64;
+    (al >> rshift).wrapping_add(ah << (32 - rshift))
+}
+
+/// scx_recip_u32()
+fn recip_u32(d: u32) -> u32 {
+    if d <= 1 {
+        return u32::MAX;
+    }
+    ((1u64 << RECIP_SHIFT) / d as u64) as u32
+}
+
+/// scx_div_recip()
+fn div_recip(v: u64, recip: u32) -> u64 {
+    fixed_mul_shr(v, recip, RECIP_SHIFT)
+}
+
+#[test]
+fn test_prio_to_wmult_table() {
+    let tbl = parse_table("scx_prio_to_wmult");
+    assert_eq!(tbl.len(), PRIO_TO_WMULT.len());
+    for (i, (got, exp)) in tbl.iter().zip(PRIO_TO_WMULT.iter()).enumerate() {
+        assert_eq!(*got, *exp as u64, "scx_prio_to_wmult[{}]", i);
+    }
+}
+
+#[test]
+fn test_log2_exp2_tables() {
+    let log2_frac = parse_table("scx_fixed_log2_frac");
+    let exp2_frac = parse_table("scx_fixed_exp2_frac");
+    assert_eq!(log2_frac.len(), 1 << LOG2_TBL_BITS);
+    assert_eq!(exp2_frac.len(), 1 << EXP2_TBL_BITS);
+
+    for (i, v) in log2_frac.iter().enumerate() {
+        let exp = (1.0 + i as f64 / log2_frac.len() as f64).log2() * FIXED_ONE as f64;
+        assert!((*v as f64 - exp).abs() <= 0.5, "log2_frac[{}]={}", i, v);
+        assert!(*v < FIXED_ONE);
+    }
+    for (i, v) in exp2_frac.iter().enumerate() {
+        let exp = (i as f64 / exp2_frac.len() as f64).exp2() * FIXED_ONE as f64;
+        assert!((*v as f64 - exp).abs() <= 0.5, "exp2_frac[{}]={}", i, v);
+        assert!(*v >= FIXED_ONE && *v < 2 * FIXED_ONE);
+    }
+}
+
+#[test]
+fn test_fixed_log2() {
+    let log2_frac = parse_table("scx_fixed_log2_frac");
+    // The mantissa index is truncated, so the result may be low by up to
+    // log2(1 + 1 / 64) and is never high by more than the table rounding.
+    let max_err = (1.0 + 1.0 / (1 << LOG2_TBL_BITS) as f64).log2();
+
+    assert_eq!(fixed_log2(&log2_frac, 0), 0);
+    assert_eq!(fixed_log2(&log2_frac, 1), 0);
+    assert_eq!(fixed_log2(&log2_frac, u64::MAX) >> FIXED_SHIFT, 63);
+
+    let mut last = 0;
+    let mut v = 1u64;
+    while v < u64::MAX / 33 * 32 {
+        let got = fixed_log2(&log2_frac, v);
+        let exp = (v as f64).log2();
+        let err = exp - got as f64 / FIXED_ONE as f64;
+        assert!(
+            err > -1.0 / FIXED_ONE as f64 && err < max_err,
+            "v={} got={} exp={}",
+            v,
+            got,
+            exp
+        );
+        assert!(got >= last, "log2 not monotonic at {}", v);
+        last = got;
+        v = v + v / 32 + 1;
+    }
+}
+
+#[test]
+fn test_fixed_exp2() {
+    let log2_frac = parse_table("scx_fixed_log2_frac");
+    let exp2_frac = parse_table("scx_fixed_exp2_frac");
+    let max_err = (1.0 / (1 << EXP2_TBL_BITS) as f64).exp2() - 1.0;
+
+    assert_eq!(fixed_exp2(&exp2_frac, 0), 1);
+    assert_eq!(fixed_exp2(&exp2_frac, 10 << FIXED_SHIFT), 1024);
+    assert_eq!(fixed_exp2(&exp2_frac, 48 << FIXED_SHIFT), 1 << 48);
+
+    // Saturates instead of shifting bits out past bit 63.
+    assert_eq!(fixed_exp2(&exp2_frac, 63 << FIXED_SHIFT), u64::MAX);
+    assert_eq!(fixed_exp2(&exp2_frac, u64::MAX), u64::MAX);
+    let top = fixed_exp2(&exp2_frac, (63 << FIXED_SHIFT) - 1);
+    assert!(top > 1 << 62 && top < u64::MAX, "top={}", top);
+
+    let mut last = 0;
+    for x in (0..63 << FIXED_SHIFT).step_by(997) {
+        let got = fixed_exp2(&exp2_frac, x);
+        let exp = (x as f64 / FIXED_ONE as f64).exp2();
+        // Low by the fraction truncation, and by the final shift when the
+        // result is small.
+        assert!(
+            got as f64 <= exp * (1.0 + 1e-5) && got as f64 >= exp * (1.0 - max_err) - 1.0,
+            "x={} got={} exp={}",
+            x,
+            got,
+            exp
+        );
+        assert!(got >= last, "exp2 not monotonic at {}", x);
+        last = got;
+    }
+
+    // exp2() is the inverse of log2() within the combined error.
+    for v in [1u64, 3, 100, 12345, 1 << 20, 1_000_000_007, 1 << 50] {
+        let got = fixed_exp2(&exp2_frac, fixed_log2(&log2_frac, v));
+        assert!(
+            got <= v && got as f64 >= v as f64 * (1.0 - 2.0 * max_err) - 1.0,
+            "v={} got={}",
+            v,
+            got
+        );
+    }
+}
+
+#[test]
+fn test_sat_ops() {
+    let vals = [
+        0,
+        1,
+        2,
+        u32::MAX as u64,
+        1 << 32,
+        (1 << 32) + 1,
+        1 << 63,
+        u64::MAX - 1,
+        u64::MAX,
+    ];
+    for &a in vals.iter() {
+        for &b in vals.iter() {
+            assert_eq!(sat_add_u64(a, b), a.saturating_add(b), "{} + {}", a, b);
+            assert_eq!(sat_sub_u64(a, b), a.saturating_sub(b), "{} - {}", a, b);
+            assert_eq!(sat_mul_u64(a, b), a.saturating_mul(b), "{} * {}", a, b);
+        }
+    }
+}
+
+#[test]
+fn test_fixed_mul_shr() {
+    let vals = [0, 1, 1023, 1 << 31, u32::MAX as u64, 1 << 40, (1 << 63) - 1];
+    for &a in vals.iter() {
+        for &b in [0, 1, 7, 1 << 16, u32::MAX].iter() {
+            for rshift in [1, 10, 16, 31, 32] {
+                let exp = (a as u128 * b as u128) >> rshift;
+                if exp > u64::MAX as u128 {
+                    continue;
+                }
+                assert_eq!(
+                    fixed_mul_shr(a, b, rshift) as u128,
+                    exp,
+                    "a={} b={} rshift={}",
+                    a,
+                    b,
+                    rshift
+                );
+            }
+        }
+    }
+}
+
+#[test]
+fn test_div_recip_round_trip() {
+    let divisors = (2..1000u32).chain([65535, 1 << 20, 88761, u32::MAX >> 1]);
+    for d in divisors {
+        let recip = recip_u32(d);
+        for v in [0, 1, 999, 1_000_000, 20_000_000_000, 1 << 50] {
+            let exp = v / d as u64;
+            let got = div_recip(v, recip);
+            // Documented bound: relative error below 2^-32 * d, plus the
+            // truncation of the final shift.
+            let slack = ((exp as u128 * d as u128) >> RECIP_SHIFT) as u64 + 1;
+            assert!(
+                got <= exp && exp - got <= slack,
+                "v={} d={} got={} exp={}",
+                v,
+                d,
+                got,
+                exp
+            );
+        }
+    }
+
+    // The weight table is used the same way by scx_div_prio_weight().
+    for (w, wmult) in PRIO_TO_WEIGHT.iter().zip(PRIO_TO_WMULT.iter()) {
+        let v = 1_000_000_000u64;
+        let got = div_recip(v, *wmult) as i64;
+        let exp = (v / w) as i64;
+        assert!(
+            (got - exp).abs() <= exp / 1000 + 1,
+            "w={} got={} exp={}",
+            w,
+            got,
+            exp
+        );
+    }
+}
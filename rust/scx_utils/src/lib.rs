@@ -60,6 +60,9 @@ pub use libbpf_logger::init_libbpf_logging;
 
 pub mod ravg;
 
+#[cfg(test)]
+mod fixed_tests;
+
 mod topology;
 pub use topology::Core;
 pub use topology::CoreType;
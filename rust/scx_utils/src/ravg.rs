@@ -100,3 +100,268 @@ pub fn ravg_read(
     //
     old * (1.0 - normalized_dur(now % half_life) / 2.0) + cur / 2.0
 }
+
+/// Struct-of-arrays snapshot of multiple ravg_data
+///
+/// Collects the fields of many ravg_data which share the same half-life so
+/// that they can be read in one go with [`ravg_read_many()`]. The snapshot
+/// can be cleared and reused across load balancing rounds to avoid
+/// reallocating.
+#[derive(Clone, Debug, Default)]
+pub struct RavgSnapshot {
+    pub val: Vec<u64>,
+    pub val_at: Vec<u64>,
+    pub old: Vec<u64>,
+    pub cur: Vec<u64>,
+}
+
+impl RavgSnapshot {
+    pub fn with_capacity(cap: usize) -> Self {
+        Self {
+            val: Vec::with_capacity(cap),
+            val_at: Vec::with_capacity(cap),
+            old: Vec::with_capacity(cap),
+            cur: Vec::with_capacity(cap),
+        }
+    }
+
+    /// Append the fields of one ravg_data.
+    pub fn push(&mut self, val: u64, val_at: u64, old: u64, cur: u64) {
+        self.val.push(val);
+        self.val_at.push(val_at);
+        self.old.push(old);
+        self.cur.push(cur);
+    }
+
+    pub fn len(&self) -> usize {
+        self.val.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.val.is_empty()
+    }
+
+    pub fn clear(&mut self) {
+        self.val.clear();
+        self.val_at.clear();
+        self.old.clear();
+        self.cur.clear();
+    }
+}
+
+/// Read the running averages of all entries of `@snap`
+///
+/// Batch form of [`ravg_read()`]. Unlike it, the calculation is done in
+/// integer fixed point exactly the same way as C `ravg_accumulate()` and
+/// `ravg_read()` do, and each entry is only converted to f64 at the end.
+/// The per-entry work is branch-light and free of f64 division and
+/// `powi()`, and the fields are read from separate contiguous arrays,
+/// which makes the loop considerably cheaper when reading thousands of
+/// task averages each load balancing round. The results are written to
+/// `@out` which is cleared first.
+pub fn ravg_read_many(
+    snap: &RavgSnapshot,
+    now: u64,
+    half_life: u32,
+    frac_bits: u32,
+    out: &mut Vec<f64>,
+) {
+    let ravg_1: f64 = (1u64 << frac_bits) as f64;
+    let one = 1u64 << frac_bits;
+    let hl = half_life as u64;
+
+    let normalize_dur = |dur: u64| -> u64 {
+        if dur < hl {
+            ((dur << frac_bits) + hl - 1) / hl
+        } else {
+            one
+        }
+    };
+    let decay = |v: u64, shift: u64| -> u64 {
+        if shift >= 64 {
+            0
+        } else {
+            v >> shift
+        }
+    };
+
+    // Everything which only depends on @now is shared by all entries.
+    let now_seq = now / hl;
+    let now_dur = normalize_dur(now % hl);
+    let now_mult = one - now_dur / 2;
+
+    out.clear();
+    out.reserve(snap.len());
+
+    let iter = snap
+        .val
+        .iter()
+        .zip(snap.val_at.iter())
+        .zip(snap.old.iter().zip(snap.cur.iter()));
+
+    for ((&val, &val_at), (&old, &cur)) in iter {
+        // @val_at can be ahead of @now if the entry was updated after @now
+        // was taken. Fall back to the scalar version for these rare cases.
+        if val_at > now {
+            out.push(ravg_read(val, val_at, old, cur, now, half_life, frac_bits));
+            continue;
+        }
+
+        let (val_seq, val_off) = (val_at / hl, val_at % hl);
+        let seq_delta = now_seq - val_seq;
+        let mut old = old;
+        let mut cur = cur;
+
+        // ravg_accumulate() with zero new value
+        if seq_delta > 0 {
+            old = decay(old, seq_delta).saturating_add(decay(cur, seq_delta));
+            cur = 0;
+            if val != 0 {
+                let dur = normalize_dur(hl - val_off);
+                old = old.saturating_add(val * decay(dur, seq_delta));
+                if seq_delta > 1 {
+                    // Sum of the decayed full periods in the middle, the
+                    // closed form of C ravg_full_sum[].
+                    let nr = (seq_delta - 1).min(frac_bits as u64);
+                    let full_sum = one - (1u64 << (frac_bits as u64 - nr));
+                    old = old.saturating_add(val * full_sum);
+                }
+                cur = val * now_dur;
+            }
+        } else if val != 0 {
+            cur += val * normalize_dur(now - val_at);
+        }
+
+        // blend as in ravg_read()
+        let avg = match now_dur {
+            0 => old,
+            _ => ((old as u128 * now_mult as u128) >> frac_bits) as u64 + cur / 2,
+        };
+        out.push(avg as f64 / ravg_1);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const FRAC_BITS: u32 = 20;
+    const HALF_LIFE: u32 = 1_000_000;
+
+    /// ravg_data fields (val, val_at, old, cur) and the u64 BPF ravg_read()
+    /// returns for them at each @now. The values were computed with the
+    /// integer arithmetic of ravg_accumulate() and ravg_read() in
+    /// ravg_impl.bpf.h, not with the code under test.
+    struct Ref {
+        rd: (u64, u64, u64, u64),
+        reads: &'static [(u64, u64)],
+    }
+
+    const REFS: &[Ref] = &[
+        // 1000 since 0. Half a period in, old is 0 and cur is 1000 * 0.5,
+        // so the avg is cur / 2 = 250. It then approaches 1000, limited by
+        // the last ravg_full_sum[] entry.
+        Ref {
+            rd: (1000, 0, 0, 0),
+            reads: &[
+                (0, 0),
+                (500_000, 262_144_000),
+                (1_000_000, 524_288_000),
+                (2_250_000, 819_200_000),
+                (40_000_000, 1_048_575_000),
+                (40_999_999, 1_048_575_999),
+            ],
+        },
+        // Accumulated 4096 for 0.3ms, 0 for 2.4ms, 1024 for 0.35ms and 2048
+        // for 0.05ms starting at 1s, and then 0.
+        Ref {
+            rd: (0, 1_003_100_000, 322_122_240, 161_061_888),
+            reads: &[
+                (1_003_100_000, 386_547_010),
+                (1_003_600_000, 306_016_450),
+                (1_004_000_000, 241_592_064),
+                (1_004_000_001, 241_591_833),
+                (1_010_123_456, 3_541_862),
+                (1_100_000_000, 0),
+            ],
+        },
+        // The same history followed by 512.
+        Ref {
+            rd: (512, 1_003_100_000, 322_122_240, 161_061_888),
+            reads: &[
+                (1_003_100_000, 386_547_010),
+                (1_003_600_000, 440_234_178),
+                (1_004_000_000, 483_183_872),
+                (1_005_250_000, 513_382_608),
+                (1_030_000_000, 536_870_403),
+            ],
+        },
+    ];
+
+    fn ref_to_f64(v: u64) -> f64 {
+        v as f64 / (1u64 << FRAC_BITS) as f64
+    }
+
+    #[test]
+    fn test_ravg_read() {
+        for r in REFS {
+            let (val, val_at, old, cur) = r.rd;
+            for &(now, exp) in r.reads {
+                let got = ravg_read(val, val_at, old, cur, now, HALF_LIFE, FRAC_BITS);
+                let exp = ref_to_f64(exp);
+                // f64 doesn't round the normalized durations.
+                assert!(
+                    (got - exp).abs() <= exp * 1e-5 + 1e-3,
+                    "rd={:?} now={} got={} exp={}",
+                    r.rd,
+                    now,
+                    got,
+                    exp
+                );
+            }
+        }
+
+        // @now in the past of @val_at reads as of @val_at.
+        let (val, val_at, old, cur) = REFS[1].rd;
+        assert_eq!(
+            ravg_read(val, val_at, old, cur, val_at - 1, HALF_LIFE, FRAC_BITS),
+            ravg_read(val, val_at, old, cur, val_at, HALF_LIFE, FRAC_BITS)
+        );
+    }
+
+    #[test]
+    fn test_ravg_read_many() {
+        for r in REFS {
+            let (val, val_at, old, cur) = r.rd;
+            let mut snap = RavgSnapshot::default();
+            for _ in 0..3 {
+                snap.push(val, val_at, old, cur);
+            }
+            let mut out = vec![];
+            for &(now, exp) in r.reads {
+                // Integer arithmetic, so the results must be identical.
+                ravg_read_many(&snap, now, HALF_LIFE, FRAC_BITS, &mut out);
+                assert_eq!(out.len(), snap.len());
+                for got in out.iter() {
+                    assert_eq!(*got, ref_to_f64(exp), "rd={:?} now={}", r.rd, now);
+                }
+            }
+        }
+
+        // Entries updated after @now fall back to ravg_read().
+        let (val, val_at, old, cur) = REFS[2].rd;
+        let mut snap = RavgSnapshot::default();
+        snap.push(val, val_at, old, cur);
+        let mut out = vec![];
+        ravg_read_many(&snap, val_at - 1, HALF_LIFE, FRAC_BITS, &mut out);
+        assert_eq!(
+            out[0],
+            ravg_read(val, val_at, old, cur, val_at - 1, HALF_LIFE, FRAC_BITS)
+        );
+
+        // Reuse clears previous results.
+        snap.clear();
+        ravg_read_many(&snap, val_at, HALF_LIFE, FRAC_BITS, &mut out);
+        assert!(out.is_empty());
+    }
+}
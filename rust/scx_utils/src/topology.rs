@@ -266,6 +266,104 @@ impl Topology {
         Self::instantiate(span, nodes)
     }
 
+    /// Build a synthetic Topology of `nr_nodes` NUMA nodes, each with
+    /// `llcs_per_node` LLCs of `cores_per_llc` cores with `cpus_per_core`
+    /// hardware threads. SMT siblings are numbered nr_cores apart as on most
+    /// x86 machines. This is for offline simulations and the total number of
+    /// CPUs can't exceed NR_CPU_IDS of the host as Cpumask is sized by it.
+    pub fn synthetic(
+        nr_nodes: usize,
+        llcs_per_node: usize,
+        cores_per_llc: usize,
+        cpus_per_core: usize,
+    ) -> Result<Topology> {
+        let nr_cores = nr_nodes * llcs_per_node * cores_per_llc;
+        let nr_cpus = nr_cores * cpus_per_core;
+        if nr_cpus == 0 {
+            bail!("Synthetic topology must have at least one CPU");
+        }
+        if nr_cpus > *NR_CPU_IDS {
+            bail!(
+                "Synthetic topology has {} CPUs, more than NR_CPU_IDS {}",
+                nr_cpus,
+                *NR_CPU_IDS
+            );
+        }
+
+        let mut span = Cpumask::new();
+        let mut nodes = BTreeMap::new();
+
+        for node_id in 0..nr_nodes {
+            let mut node = Node {
+                id: node_id,
+                llcs: BTreeMap::new(),
+                span: Cpumask::new(),
+                all_cores: BTreeMap::new(),
+                all_cpus: BTreeMap::new(),
+                #[cfg(feature = "gpu-topology")]
+                gpus: BTreeMap::new(),
+            };
+
+            for llc_idx in 0..llcs_per_node {
+                let llc_id = node_id * llcs_per_node + llc_idx;
+                let mut llc = Llc {
+                    id: llc_id,
+                    kernel_id: llc_id,
+                    cores: BTreeMap::new(),
+                    span: Cpumask::new(),
+                    node_id,
+                    all_cpus: BTreeMap::new(),
+                };
+
+                for core_idx in 0..cores_per_llc {
+                    let core_id = llc_id * cores_per_llc + core_idx;
+                    let mut core = Core {
+                        id: core_id,
+                        kernel_id: core_id,
+                        cpus: BTreeMap::new(),
+                        span: Cpumask::new(),
+                        core_type: CoreType::Big { turbo: false },
+                        llc_id,
+                        node_id,
+                    };
+
+                    for thread in 0..cpus_per_core {
+                        let cpu_id = thread * nr_cores + core_id;
+                        core.cpus.insert(
+                            cpu_id,
+                            Arc::new(Cpu {
+                                id: cpu_id,
+                                min_freq: 0,
+                                max_freq: 0,
+                                base_freq: 0,
+                                trans_lat_ns: 0,
+                                l2_id: core_id,
+                                l3_id: llc_id,
+                                core_type: CoreType::Big { turbo: false },
+                                core_id,
+                                llc_id,
+                                node_id,
+                                package_id: node_id,
+                            }),
+                        );
+                        core.span.set_cpu(cpu_id)?;
+                        llc.span.set_cpu(cpu_id)?;
+                        node.span.set_cpu(cpu_id)?;
+                        span.set_cpu(cpu_id)?;
+                    }
+
+                    llc.cores.insert(core_id, Arc::new(core));
+                }
+
+                node.llcs.insert(llc_id, Arc::new(llc));
+            }
+
+            nodes.insert(node_id, node);
+        }
+
+        Self::instantiate(span, nodes)
+    }
+
     /// Get a vec of all GPUs on the hosts.
     #[cfg(feature = "gpu-topology")]
     pub fn gpus(&self) -> BTreeMap<GpuIndex, &Gpu> {
@@ -592,6 +592,20 @@ static __always_inline void __write_once_size(volatile void *p, void *res, int s
 	__u.__val;						\
 })
 
+/*
+ * smp_load_acquire() and smp_store_release() as in the kernel, for 32 and 64bit
+ * values. BPF load-acquire and store-release instructions need -mcpu=v4 and a
+ * recent kernel. Without them, fall back to BPF atomics with fetch which are
+ * fully ordered.
+ */
+#ifdef __BPF_FEATURE_LOAD_ACQ_STORE_REL
+#define smp_load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, val)	__atomic_store_n((p), (val), __ATOMIC_RELEASE)
+#else
+#define smp_load_acquire(p)		__sync_fetch_and_add((p), 0)
+#define smp_store_release(p, val)	((void)__sync_lock_test_and_set((p), (val)))
+#endif
+
 /*
  * log2_u32 - Compute the base 2 logarithm of a 32-bit exponential value.
  * @v: The value for which we're computing the base 2 logarithm.
@@ -0,0 +1,22 @@
+#ifndef __SCX_FIXED_BPF_H__
+#define __SCX_FIXED_BPF_H__
+
+/*
+ * Fixed-point math helpers to be used in BPF progs. Assumes vmlinux.h has
+ * already been included.
+ *
+ * The lookup tables in fixed_tables.autogen.bpf.h are generated by
+ * scripts/gen_fixed_tables.py which must be kept in sync with the constants
+ * below.
+ */
+enum scx_fixed_consts {
+	SCX_FIXED_SHIFT		= 16,		/* 65536 is 1.0 */
+	SCX_FIXED_ONE		= 1 << SCX_FIXED_SHIFT,
+
+	SCX_FIXED_LOG2_TBL_BITS	= 6,		/* log2 mantissa resolution */
+	SCX_FIXED_EXP2_TBL_BITS	= 6,		/* exp2 fraction resolution */
+
+	SCX_FIXED_RECIP_SHIFT	= 32,		/* reciprocals are 2^32 / d */
+};
+
+#endif /* __SCX_FIXED_BPF_H__ */
@@ -0,0 +1,159 @@
+/* to be included in the main bpf.c file after common.bpf.h */
+#include "fixed.bpf.h"
+#include "fixed_tables.autogen.bpf.h"
+
+#define SCX_FIXED_FN_ATTRS	inline __attribute__((unused, always_inline))
+
+/**
+ * scx_sat_add_u64 - Saturating addition
+ * @a: augend
+ * @b: addend
+ */
+static SCX_FIXED_FN_ATTRS u64 scx_sat_add_u64(u64 a, u64 b)
+{
+	u64 sum = a + b;
+
+	return sum >= a ? sum : -1;
+}
+
+/**
+ * scx_sat_sub_u64 - Subtraction clamped at zero
+ * @a: minuend
+ * @b: subtrahend
+ */
+static SCX_FIXED_FN_ATTRS u64 scx_sat_sub_u64(u64 a, u64 b)
+{
+	return a > b ? a - b : 0;
+}
+
+/**
+ * scx_sat_mul_u64 - Saturating multiplication
+ * @a: multiplicand
+ * @b: multiplier
+ *
+ * Only falls back to a division to detect overflows if either operand is
+ * wider than 32 bits, which is rare for the values used in heuristics.
+ */
+static SCX_FIXED_FN_ATTRS u64 scx_sat_mul_u64(u64 a, u64 b)
+{
+	if (!((a | b) >> 32))
+		return a * b;
+	if (a && b > (u64)-1 / a)
+		return -1;
+	return a * b;
+}
+
+/**
+ * scx_fixed_mul_shr - Calculate ((u64 * u32) >> rshift) without overflowing
+ * @a: multiplicand
+ * @b: multiplier
+ * @rshift: number of bits to shift right, must be <= 32
+ *
+ * The same as u64_x_u32_rshift() in ravg_impl.bpf.h, duplicated so that the
+ * two headers can be used independently. The caller must ensure that the
+ * final shifted result fits in u64.
+ */
+static SCX_FIXED_FN_ATTRS u64 scx_fixed_mul_shr(u64 a, u32 b, u32 rshift)
+{
+	u64 al = (a & 0xffffffffLLU) * b;
+	u64 ah = (a >> 32) * b;
+
+	return (al >> rshift) + (ah << (32 - rshift));
+}
+
+/**
+ * scx_recip_u32 - Calculate the reciprocal of @d for scx_div_recip()
+ * @d: divisor, must be > 1
+ *
+ * Performs a division, call it when @d changes and cache the result.
+ */
+static SCX_FIXED_FN_ATTRS u32 scx_recip_u32(u32 d)
+{
+	if (d <= 1)
+		return (u32)-1;
+	return (1LLU << SCX_FIXED_RECIP_SHIFT) / d;
+}
+
+/**
+ * scx_div_recip - Divide @v by a divisor using its cached reciprocal
+ * @v: dividend
+ * @recip: reciprocal of the divisor from scx_recip_u32()
+ *
+ * Equivalent to @v / d with a relative error below 2^-32 * d, which is
+ * plenty for scheduling heuristics.
+ */
+static SCX_FIXED_FN_ATTRS u64 scx_div_recip(u64 v, u32 recip)
+{
+	return scx_fixed_mul_shr(v, recip, SCX_FIXED_RECIP_SHIFT);
+}
+
+/**
+ * scx_div_prio_weight - Divide @v by sched_prio_to_weight[@prio]
+ * @v: dividend
+ * @prio: index into the kernel's sched_prio_to_weight[], clamped to [0, 39]
+ *
+ * Uses the precomputed 2^32 / weight table the same way the kernel's
+ * __calc_delta() does, so no division is needed.
+ */
+static SCX_FIXED_FN_ATTRS u64 scx_div_prio_weight(u64 v, u32 prio)
+{
+	const u32 nr_prios = sizeof(scx_prio_to_wmult) / sizeof(scx_prio_to_wmult[0]);
+
+	if (prio >= nr_prios)
+		prio = nr_prios - 1;
+	return scx_div_recip(v, scx_prio_to_wmult[prio]);
+}
+
+/**
+ * scx_fixed_log2 - Calculate log2(@v) in fixed-point
+ * @v: input value
+ *
+ * Returns log2(@v) << SCX_FIXED_SHIFT, 0 for @v == 0. The fractional part is
+ * looked up from the top SCX_FIXED_LOG2_TBL_BITS bits of the mantissa and is
+ * accurate to about 1/45 which, unlike log2_u64(), keeps values within the
+ * same power of two distinguishable.
+ */
+static SCX_FIXED_FN_ATTRS u64 scx_fixed_log2(u64 v)
+{
+	const u32 mask = (1 << SCX_FIXED_LOG2_TBL_BITS) - 1;
+	u32 msb, idx;
+
+	if (!v)
+		return 0;
+
+	/* log2_u64() returns the number of significant bits */
+	msb = log2_u64(v) - 1;
+	if (msb >= SCX_FIXED_LOG2_TBL_BITS)
+		idx = v >> (msb - SCX_FIXED_LOG2_TBL_BITS);
+	else
+		idx = v << (SCX_FIXED_LOG2_TBL_BITS - msb);
+
+	return ((u64)msb << SCX_FIXED_SHIFT) + scx_fixed_log2_frac[idx & mask];
+}
+
+/**
+ * scx_fixed_exp2 - Calculate 2^@x for a fixed-point @x
+ * @x: exponent << SCX_FIXED_SHIFT
+ *
+ * Returns 2^(@x / SCX_FIXED_ONE) as an integer, saturating at U64_MAX. The
+ * inverse of scx_fixed_log2().
+ */
+static SCX_FIXED_FN_ATTRS u64 scx_fixed_exp2(u64 x)
+{
+	const u32 mask = (1 << SCX_FIXED_EXP2_TBL_BITS) - 1;
+	u64 ipart = x >> SCX_FIXED_SHIFT;
+	u64 mant;
+	u32 idx;
+
+	/* the mantissa is < 2^17, anything shifted past bit 63 saturates */
+	if (ipart >= 63)
+		return -1;
+
+	idx = (x >> (SCX_FIXED_SHIFT - SCX_FIXED_EXP2_TBL_BITS)) & mask;
+	mant = scx_fixed_exp2_frac[idx];
+
+	if (ipart >= SCX_FIXED_SHIFT)
+		return mant << (ipart - SCX_FIXED_SHIFT);
+	else
+		return mant >> (SCX_FIXED_SHIFT - ipart);
+}
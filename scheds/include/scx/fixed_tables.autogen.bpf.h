@@ -0,0 +1,49 @@
+/*
+ * WARNING: This file is autogenerated from scripts/gen_fixed_tables.py. If
+ * you change the table parameters, update scheds/include/scx/fixed.bpf.h to
+ * match and run the script from the root directory to update this file.
+ */
+
+/*
+ * [i] = log2(1 + i / 64) * 65536
+ */
+static const u32 scx_fixed_log2_frac[64] = {
+	0, 1466, 2909, 4331, 5732, 7112, 8473, 9814,
+	11136, 12440, 13727, 14996, 16248, 17484, 18704, 19909,
+	21098, 22272, 23433, 24579, 25711, 26830, 27936, 29029,
+	30109, 31178, 32234, 33279, 34312, 35334, 36346, 37346,
+	38336, 39316, 40286, 41246, 42196, 43137, 44068, 44990,
+	45904, 46809, 47705, 48593, 49472, 50344, 51207, 52063,
+	52911, 53751, 54584, 55410, 56229, 57040, 57845, 58643,
+	59434, 60219, 60997, 61769, 62534, 63294, 64047, 64794,
+};
+
+/*
+ * [i] = 2^(i / 64) * 65536
+ */
+static const u32 scx_fixed_exp2_frac[64] = {
+	65536, 66250, 66971, 67700, 68438, 69183, 69936, 70698,
+	71468, 72246, 73032, 73828, 74632, 75444, 76266, 77096,
+	77936, 78785, 79642, 80510, 81386, 82273, 83169, 84074,
+	84990, 85915, 86851, 87796, 88752, 89719, 90696, 91684,
+	92682, 93691, 94711, 95743, 96785, 97839, 98905, 99982,
+	101070, 102171, 103283, 104408, 105545, 106694, 107856, 109031,
+	110218, 111418, 112631, 113858, 115098, 116351, 117618, 118899,
+	120194, 121502, 122825, 124163, 125515, 126882, 128263, 129660,
+};
+
+/*
+ * [i] = 2^32 / sched_prio_to_weight[i], the same as the
+ * kernel's sched_prio_to_wmult[].
+ */
+static const u32 scx_prio_to_wmult[40] = {
+	48388, 59856, 76040, 92818, 118348,
+	147320, 184698, 229616, 287308, 360437,
+	449829, 563644, 704093, 875809, 1099582,
+	1376151, 1717300, 2157191, 2708050, 3363326,
+	4194304, 5237765, 6557202, 8165337, 10153587,
+	12820798, 15790321, 19976592, 24970740, 31350126,
+	39045157, 49367440, 61356676, 76695844, 95443717,
+	119304647, 148102320, 186737708, 238609294, 286331153,
+};
+
@@ -0,0 +1,55 @@
+#ifndef __SCX_HIST_BPF_H__
+#define __SCX_HIST_BPF_H__
+
+/*
+ * Log-bucketed histogram helpers to be used in BPF progs. Assumes vmlinux.h
+ * or an equivalent set of u32/u64 typedefs has already been included so that
+ * the struct can also be shared with userspace through intf.h.
+ */
+enum scx_hist_consts {
+	/*
+	 * Each power-of-two range is split into 1 << SCX_HIST_SUB_BITS linear
+	 * sub-buckets which bounds the relative error of a bucket to
+	 * 1 / (1 << SCX_HIST_SUB_BITS).
+	 */
+	SCX_HIST_SUB_BITS	= 2,
+	SCX_HIST_NR_SUBS	= 1 << SCX_HIST_SUB_BITS,
+
+	/*
+	 * Values at or above 1 << SCX_HIST_MAX_BITS are accounted in the last
+	 * bucket. 40 bits of nanoseconds is a bit more than 18 minutes.
+	 */
+	SCX_HIST_MAX_BITS	= 40,
+	SCX_HIST_NR_BUCKETS	= (SCX_HIST_MAX_BITS - SCX_HIST_SUB_BITS + 1) <<
+				  SCX_HIST_SUB_BITS,
+};
+
+/*
+ * HDR-style histogram with log2 major buckets and linear minor buckets.
+ * Values below SCX_HIST_NR_SUBS map 1:1 onto the first buckets. For larger
+ * values with the most significant bit at position msb, the bucket index is:
+ *
+ *   ((msb - SCX_HIST_SUB_BITS + 1) << SCX_HIST_SUB_BITS) |
+ *   ((v >> (msb - SCX_HIST_SUB_BITS)) & (SCX_HIST_NR_SUBS - 1))
+ *
+ * Intended to be instantiated per-CPU so that scx_hist_record() doesn't need
+ * any synchronization. Instances shared between CPUs must be updated with
+ * scx_hist_record_atomic() instead. Readers merge the instances with
+ * scx_hist_merge() or in userspace. Zeroing is enough for initialization.
+ *
+ * See hist_impl.bpf.h and scx_stats::StatsHistogram for details.
+ */
+struct scx_hist {
+	u64			buckets[SCX_HIST_NR_BUCKETS];
+
+	/* number of recorded values, equals the sum of @buckets */
+	u64			count;
+
+	/* sum of recorded values, saturates at U64_MAX */
+	u64			sum;
+
+	/* largest recorded value */
+	u64			max;
+};
+
+#endif /* __SCX_HIST_BPF_H__ */
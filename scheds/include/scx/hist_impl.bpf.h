@@ -0,0 +1,121 @@
+/* to be included in the main bpf.c file after common.bpf.h */
+#include "hist.bpf.h"
+
+#define SCX_HIST_FN_ATTRS	inline __attribute__((unused, always_inline))
+
+/**
+ * scx_hist_bucket - Map a value to its histogram bucket index
+ * @v: value to map
+ *
+ * Branch-light O(1) mapping, see struct scx_hist for the layout.
+ */
+static SCX_HIST_FN_ATTRS u32 scx_hist_bucket(u64 v)
+{
+	u32 msb, idx;
+
+	if (v < SCX_HIST_NR_SUBS)
+		return v;
+	if (v >= 1LLU << SCX_HIST_MAX_BITS)
+		return SCX_HIST_NR_BUCKETS - 1;
+
+	/* log2_u64() returns the number of significant bits */
+	msb = log2_u64(v) - 1;
+	idx = (msb - SCX_HIST_SUB_BITS + 1) << SCX_HIST_SUB_BITS;
+	idx |= (v >> (msb - SCX_HIST_SUB_BITS)) & (SCX_HIST_NR_SUBS - 1);
+
+	return idx;
+}
+
+/**
+ * scx_hist_record - Record a value
+ * @h: histogram to record into
+ * @v: value to record
+ *
+ * @h must not be updated concurrently, e.g. it should be a per-CPU instance
+ * updated with preemption disabled, which is the case for all sched_ext ops.
+ */
+static SCX_HIST_FN_ATTRS void scx_hist_record(struct scx_hist *h, u64 v)
+{
+	u32 idx = scx_hist_bucket(v);
+	u64 sum;
+
+	/* keep the verifier convinced about the bounds */
+	if (idx >= SCX_HIST_NR_BUCKETS)
+		idx = SCX_HIST_NR_BUCKETS - 1;
+
+	h->buckets[idx]++;
+	h->count++;
+
+	sum = h->sum + v;
+	h->sum = sum >= h->sum ? sum : -1;
+
+	if (v > h->max)
+		h->max = v;
+}
+
+/**
+ * scx_hist_record_atomic - Record a value into a shared histogram
+ * @h: histogram to record into
+ * @v: value to record
+ *
+ * Like scx_hist_record() but @h may be updated concurrently, e.g. when an
+ * instance is shared by the CPUs of an LLC to keep the footprint independent
+ * of the number of CPUs. Unlike scx_hist_record(), @h->sum wraps instead of
+ * saturating and a racing larger value may win over @v for @h->max.
+ */
+static SCX_HIST_FN_ATTRS void scx_hist_record_atomic(struct scx_hist *h, u64 v)
+{
+	u32 idx = scx_hist_bucket(v);
+	u64 max;
+	int i;
+
+	/* keep the verifier convinced about the bounds */
+	if (idx >= SCX_HIST_NR_BUCKETS)
+		idx = SCX_HIST_NR_BUCKETS - 1;
+
+	__sync_fetch_and_add(&h->buckets[idx], 1);
+	__sync_fetch_and_add(&h->count, 1);
+	__sync_fetch_and_add(&h->sum, v);
+
+	/* a few attempts are plenty, a lost update only delays the max */
+	bpf_for(i, 0, 4) {
+		max = READ_ONCE(h->max);
+		if (v <= max || __sync_val_compare_and_swap(&h->max, max, v) == max)
+			break;
+	}
+}
+
+/**
+ * scx_hist_merge - Fold one histogram into another
+ * @dst: histogram to merge into
+ * @src: histogram to merge from
+ *
+ * O(SCX_HIST_NR_BUCKETS). @src may be concurrently updated, in which case
+ * the result can be off by the values recorded during the merge.
+ */
+static SCX_HIST_FN_ATTRS void scx_hist_merge(struct scx_hist *dst,
+					     const struct scx_hist *src)
+{
+	u64 sum;
+	u32 i;
+
+	bpf_for(i, 0, SCX_HIST_NR_BUCKETS)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+
+	sum = dst->sum + src->sum;
+	dst->sum = sum >= dst->sum ? sum : -1;
+
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/**
+ * scx_hist_reset - Clear a histogram
+ * @h: histogram to clear
+ */
+static SCX_HIST_FN_ATTRS void scx_hist_reset(struct scx_hist *h)
+{
+	__builtin_memset(h, 0, sizeof(*h));
+}
@@ -0,0 +1,18 @@
+#ifndef __SCX_IDLE_TOPO_BPF_H__
+#define __SCX_IDLE_TOPO_BPF_H__
+
+/*
+ * Topology-aware idle CPU picker shared across schedulers. Can be included
+ * from intf.h so that userspace can use the same level IDs when populating
+ * the topology with scx_topo_add_sibling().
+ *
+ * See idle_topo_impl.bpf.h for details.
+ */
+enum scx_topo_lvl {
+	SCX_TOPO_L2,			/* CPUs sharing the L2 cache */
+	SCX_TOPO_L3,			/* CPUs sharing the LLC */
+	SCX_TOPO_NODE,			/* CPUs in the same NUMA node */
+	SCX_TOPO_NR_LVLS,
+};
+
+#endif /* __SCX_IDLE_TOPO_BPF_H__ */
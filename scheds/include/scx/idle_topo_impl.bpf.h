@@ -0,0 +1,469 @@
+/* to be included in the main bpf.c file after common.bpf.h */
+#include "idle_topo.bpf.h"
+
+#define SCX_TOPO_FN_ATTRS	inline __attribute__((unused, always_inline))
+
+/*
+ * Used by bpfland, flash and rustland_core. lavd and layered keep their own
+ * pickers: lavd searches its active/overflow sets intersected with the core
+ * type chosen by core compaction, both of which change every interval, and
+ * can probe CPUs without claiming them. layered confines the search to the
+ * layer's CPUs, which userspace resizes, and scans per-LLC idle summaries
+ * instead of cpumasks.
+ */
+
+/*
+ * Per-CPU topology context.
+ *
+ * The raw topology masks (@l2, @l3, @node) are populated once from userspace
+ * through scx_topo_add_sibling() which also records the level in @populated.
+ * Levels which aren't in @populated are ignored. The @dom_* masks cache the
+ * same masks intersected with the scheduling domain passed to
+ * scx_topo_pick_idle_cpu() and are rebuilt lazily whenever
+ * scx_topo_domain_changed() is called. Rebuilt masks are published with
+ * bpf_kptr_xchg() so that concurrent pickers walking the previous masks
+ * never see a partially updated one.
+ *
+ * The @tmp_* masks are scratch space used to intersect the topology masks
+ * with the allowed CPUs of tasks with restricted affinity. They are only ever
+ * used by the CPU owning the context, which replaces the per-task scratch
+ * cpumasks schedulers used to allocate. Picks from preemptible SEC("syscall")
+ * programs can race other picks on the same CPU and end up with a CPU outside
+ * the task's affinity; callers must tolerate that.
+ */
+struct scx_topo_cpu {
+	struct bpf_cpumask __kptr *l2;
+	struct bpf_cpumask __kptr *l3;
+	struct bpf_cpumask __kptr *node;
+	u32 populated;		/* bitmask of (1 << enum scx_topo_lvl) */
+
+	struct bpf_cpumask __kptr *dom_l2;
+	struct bpf_cpumask __kptr *dom_l3;
+	struct bpf_cpumask __kptr *dom_node;
+	u64 dom_seq;
+
+	struct bpf_cpumask __kptr *tmp_l2;
+	struct bpf_cpumask __kptr *tmp_l3;
+	struct bpf_cpumask __kptr *tmp_node;
+	struct bpf_cpumask __kptr *tmp_dom;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct scx_topo_cpu);
+	__uint(max_entries, 1);
+} scx_topo_cpu_stor SEC(".maps");
+
+/*
+ * Scheduling domain generation. Starts at 1 so that the zeroed per-CPU
+ * contexts are considered stale.
+ */
+static u64 scx_topo_dom_seq = 1;
+
+static SCX_TOPO_FN_ATTRS struct scx_topo_cpu *scx_topo_cpu_ctx(s32 cpu)
+{
+	const u32 idx = 0;
+
+	return bpf_map_lookup_percpu_elem(&scx_topo_cpu_stor, &idx, cpu);
+}
+
+static int scx_topo_calloc_cpumask(struct bpf_cpumask **p_cpumask)
+{
+	struct bpf_cpumask *cpumask;
+
+	if (*p_cpumask)
+		return 0;
+
+	cpumask = bpf_cpumask_create();
+	if (!cpumask)
+		return -ENOMEM;
+
+	cpumask = bpf_kptr_xchg(p_cpumask, cpumask);
+	if (cpumask)
+		bpf_cpumask_release(cpumask);
+
+	return 0;
+}
+
+static int scx_topo_init_cpu(struct scx_topo_cpu *tc)
+{
+	if (scx_topo_calloc_cpumask(&tc->l2) ||
+	    scx_topo_calloc_cpumask(&tc->l3) ||
+	    scx_topo_calloc_cpumask(&tc->node) ||
+	    scx_topo_calloc_cpumask(&tc->dom_l2) ||
+	    scx_topo_calloc_cpumask(&tc->dom_l3) ||
+	    scx_topo_calloc_cpumask(&tc->dom_node) ||
+	    scx_topo_calloc_cpumask(&tc->tmp_l2) ||
+	    scx_topo_calloc_cpumask(&tc->tmp_l3) ||
+	    scx_topo_calloc_cpumask(&tc->tmp_node) ||
+	    scx_topo_calloc_cpumask(&tc->tmp_dom))
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * scx_topo_add_sibling - Mark @sibling as sharing topology level @lvl with @cpu
+ * @cpu: CPU whose topology mask to update
+ * @sibling: CPU to add to @cpu's mask, may be @cpu itself
+ * @lvl: enum scx_topo_lvl
+ *
+ * Must be called from a sleepable context, typically a SEC("syscall")
+ * program invoked by userspace for every pair of CPUs sharing @lvl before
+ * the scheduler is attached. Levels which are never populated are skipped
+ * by scx_topo_pick_idle_cpu().
+ */
+static int scx_topo_add_sibling(s32 cpu, s32 sibling, u32 lvl)
+{
+	struct bpf_cpumask *mask, **pmask;
+	struct scx_topo_cpu *tc;
+	int err;
+
+	tc = scx_topo_cpu_ctx(cpu);
+	if (!tc)
+		return -ENOENT;
+
+	err = scx_topo_init_cpu(tc);
+	if (err)
+		return err;
+
+	switch (lvl) {
+	case SCX_TOPO_L2:
+		pmask = &tc->l2;
+		break;
+	case SCX_TOPO_L3:
+		pmask = &tc->l3;
+		break;
+	case SCX_TOPO_NODE:
+		pmask = &tc->node;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	bpf_rcu_read_lock();
+	mask = *pmask;
+	if (mask)
+		bpf_cpumask_set_cpu(sibling, mask);
+	bpf_rcu_read_unlock();
+
+	tc->populated |= 1 << lvl;
+
+	/* force the domain masks to be recomputed */
+	tc->dom_seq = 0;
+
+	return 0;
+}
+
+/**
+ * scx_topo_domain_changed - Invalidate the cached domain masks
+ *
+ * Must be called whenever the scheduling domain passed to
+ * scx_topo_pick_idle_cpu() is updated. Each CPU's cached masks are
+ * recomputed on the next pick around that CPU.
+ */
+static SCX_TOPO_FN_ATTRS void scx_topo_domain_changed(void)
+{
+	__sync_fetch_and_add(&scx_topo_dom_seq, 1);
+}
+
+/**
+ * scx_topo_cpumask - Return @cpu's raw topology mask at @lvl
+ * @cpu: CPU to look up
+ * @lvl: enum scx_topo_lvl
+ *
+ * Returns NULL if @lvl hasn't been populated for @cpu.
+ */
+static SCX_TOPO_FN_ATTRS const struct cpumask *scx_topo_cpumask(s32 cpu, u32 lvl)
+{
+	struct scx_topo_cpu *tc;
+	struct bpf_cpumask *mask;
+
+	tc = scx_topo_cpu_ctx(cpu);
+	if (!tc || lvl >= SCX_TOPO_NR_LVLS || !(tc->populated & (1 << lvl)))
+		return NULL;
+
+	switch (lvl) {
+	case SCX_TOPO_L2:
+		mask = tc->l2;
+		break;
+	case SCX_TOPO_L3:
+		mask = tc->l3;
+		break;
+	case SCX_TOPO_NODE:
+		mask = tc->node;
+		break;
+	default:
+		return NULL;
+	}
+
+	return mask ? cast_mask(mask) : NULL;
+}
+
+/*
+ * Build @src & @with into a new cpumask and publish it in *@dst. The old mask
+ * is released through RCU so pickers still walking it aren't affected.
+ */
+static SCX_TOPO_FN_ATTRS void scx_topo_publish_and(struct bpf_cpumask **dst,
+						   struct bpf_cpumask *src,
+						   const struct cpumask *with)
+{
+	struct bpf_cpumask *mask;
+
+	if (!src || !(mask = bpf_cpumask_create()))
+		return;
+
+	bpf_cpumask_and(mask, cast_mask(src), with);
+	mask = bpf_kptr_xchg(dst, mask);
+	if (mask)
+		bpf_cpumask_release(mask);
+}
+
+static void scx_topo_refresh_dom(struct scx_topo_cpu *tc, const struct cpumask *domain)
+{
+	u64 old = tc->dom_seq, seq = READ_ONCE(scx_topo_dom_seq);
+
+	/*
+	 * Elect a single refresher. Others keep using the previous masks
+	 * until the new ones are published.
+	 */
+	if (__sync_val_compare_and_swap(&tc->dom_seq, old, seq) != old)
+		return;
+
+	scx_topo_publish_and(&tc->dom_l2, tc->l2, domain);
+	scx_topo_publish_and(&tc->dom_l3, tc->l3, domain);
+	scx_topo_publish_and(&tc->dom_node, tc->node, domain);
+}
+
+/*
+ * Return @tc's mask at @lvl, intersected with @domain if set, or NULL if the
+ * level hasn't been populated.
+ */
+static SCX_TOPO_FN_ATTRS struct bpf_cpumask *
+scx_topo_lvl_mask(struct scx_topo_cpu *tc, u32 lvl, const struct cpumask *domain)
+{
+	if (lvl >= SCX_TOPO_NR_LVLS || !(tc->populated & (1 << lvl)))
+		return NULL;
+
+	switch (lvl) {
+	case SCX_TOPO_L2:
+		return domain ? tc->dom_l2 : tc->l2;
+	case SCX_TOPO_L3:
+		return domain ? tc->dom_l3 : tc->l3;
+	case SCX_TOPO_NODE:
+		return domain ? tc->dom_node : tc->node;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Return @mask restricted to the CPUs allowed for @p using @tmp as scratch
+ * space, or NULL if the level isn't populated.
+ */
+static SCX_TOPO_FN_ATTRS const struct cpumask *
+scx_topo_task_mask(const struct task_struct *p, struct bpf_cpumask *mask,
+		   struct bpf_cpumask *tmp, bool restricted)
+{
+	if (!mask)
+		return NULL;
+	if (!restricted)
+		return cast_mask(mask);
+	if (!tmp)
+		return NULL;
+
+	bpf_cpumask_and(tmp, cast_mask(mask), p->cpus_ptr);
+	return cast_mask(tmp);
+}
+
+static SCX_TOPO_FN_ATTRS s32 scx_topo_try_pick(const struct cpumask *mask, u64 flags)
+{
+	if (!mask)
+		return -EBUSY;
+
+	return scx_bpf_pick_idle_cpu(mask, flags);
+}
+
+/**
+ * scx_topo_pick_idle_cpu - Pick an idle CPU topologically close to @prev_cpu
+ * @p: task to pick a CPU for
+ * @prev_cpu: CPU to search around, usually the one @p last ran on
+ * @domain: CPUs the scheduler prefers to use, NULL for all CPUs
+ * @smt: prioritize fully idle SMT cores
+ * @is_idle: set to %true if the returned CPU was idle and has been claimed
+ *
+ * The search order is, with every step restricted to @domain and the CPUs
+ * allowed for @p:
+ *
+ *   1. @prev_cpu if its whole core is idle (@smt only)
+ *   2. a fully idle core in @prev_cpu's L2, LLC, node, @domain, anywhere
+ *      (@smt only)
+ *   3. @prev_cpu if it is idle
+ *   4. any idle CPU in @prev_cpu's L2, LLC, node, @domain, anywhere
+ *
+ * Tasks which can run on all CPUs use the cached per-CPU masks directly, so
+ * the common path doesn't perform any cpumask operation besides the idle
+ * picks themselves. Tasks with restricted affinity intersect each level with
+ * @p->cpus_ptr once into the current CPU's scratch masks.
+ *
+ * Returns the picked CPU or -EBUSY if no idle CPU could be found.
+ */
+static s32 scx_topo_pick_idle_cpu(const struct task_struct *p, s32 prev_cpu,
+				  const struct cpumask *domain, bool smt,
+				  bool *is_idle)
+{
+	const struct cpumask *idle_smtmask, *l2, *l3, *node, *dom;
+	struct bpf_cpumask *l2_src, *l3_src, *node_src;
+	struct scx_topo_cpu *tc, *this_tc;
+	bool restricted, prev_allowed;
+	s32 cpu;
+
+	*is_idle = false;
+
+	/*
+	 * Per-CPU tasks have nowhere else to go, don't bother walking the
+	 * topology.
+	 */
+	if (p->nr_cpus_allowed == 1) {
+		if (bpf_cpumask_test_cpu(prev_cpu, p->cpus_ptr) &&
+		    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
+			*is_idle = true;
+			return prev_cpu;
+		}
+		return -EBUSY;
+	}
+
+	tc = scx_topo_cpu_ctx(prev_cpu);
+	if (!tc)
+		return -ENOENT;
+
+	if (domain && tc->dom_seq != READ_ONCE(scx_topo_dom_seq))
+		scx_topo_refresh_dom(tc, domain);
+
+	l2_src = scx_topo_lvl_mask(tc, SCX_TOPO_L2, domain);
+	l3_src = scx_topo_lvl_mask(tc, SCX_TOPO_L3, domain);
+	node_src = scx_topo_lvl_mask(tc, SCX_TOPO_NODE, domain);
+
+	restricted = p->nr_cpus_allowed < scx_bpf_nr_cpu_ids();
+	if (restricted) {
+		this_tc = scx_topo_cpu_ctx(bpf_get_smp_processor_id());
+		if (!this_tc)
+			return -ENOENT;
+
+		l2 = scx_topo_task_mask(p, l2_src, this_tc->tmp_l2, true);
+		l3 = scx_topo_task_mask(p, l3_src, this_tc->tmp_l3, true);
+		node = scx_topo_task_mask(p, node_src, this_tc->tmp_node, true);
+		if (domain) {
+			struct bpf_cpumask *tmp = this_tc->tmp_dom;
+
+			if (!tmp)
+				return -ENOENT;
+			bpf_cpumask_and(tmp, domain, p->cpus_ptr);
+			dom = cast_mask(tmp);
+		} else {
+			dom = NULL;
+		}
+	} else {
+		l2 = scx_topo_task_mask(p, l2_src, NULL, false);
+		l3 = scx_topo_task_mask(p, l3_src, NULL, false);
+		node = scx_topo_task_mask(p, node_src, NULL, false);
+		dom = domain;
+	}
+
+	prev_allowed = bpf_cpumask_test_cpu(prev_cpu, dom ?: p->cpus_ptr);
+
+	if (smt) {
+		bool prev_core_idle;
+
+		idle_smtmask = scx_bpf_get_idle_smtmask();
+		prev_core_idle = bpf_cpumask_test_cpu(prev_cpu, idle_smtmask);
+		scx_bpf_put_cpumask(idle_smtmask);
+
+		if (prev_allowed && prev_core_idle &&
+		    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
+			cpu = prev_cpu;
+			goto found;
+		}
+
+		cpu = scx_topo_try_pick(l2, SCX_PICK_IDLE_CORE);
+		if (cpu >= 0)
+			goto found;
+		cpu = scx_topo_try_pick(l3, SCX_PICK_IDLE_CORE);
+		if (cpu >= 0)
+			goto found;
+		cpu = scx_topo_try_pick(node, SCX_PICK_IDLE_CORE);
+		if (cpu >= 0)
+			goto found;
+		cpu = scx_topo_try_pick(dom, SCX_PICK_IDLE_CORE);
+		if (cpu >= 0)
+			goto found;
+		cpu = scx_topo_try_pick(p->cpus_ptr, SCX_PICK_IDLE_CORE);
+		if (cpu >= 0)
+			goto found;
+	}
+
+	if (prev_allowed && scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
+		cpu = prev_cpu;
+		goto found;
+	}
+
+	cpu = scx_topo_try_pick(l2, 0);
+	if (cpu >= 0)
+		goto found;
+	cpu = scx_topo_try_pick(l3, 0);
+	if (cpu >= 0)
+		goto found;
+	cpu = scx_topo_try_pick(node, 0);
+	if (cpu >= 0)
+		goto found;
+	cpu = scx_topo_try_pick(dom, 0);
+	if (cpu >= 0)
+		goto found;
+	cpu = scx_topo_try_pick(p->cpus_ptr, 0);
+	if (cpu >= 0)
+		goto found;
+
+	return -EBUSY;
+
+found:
+	*is_idle = true;
+	return cpu;
+}
+
+/**
+ * scx_topo_any_cpu - Pick a random CPU around @cpu at topology level @lvl
+ * @p: task to pick a CPU for
+ * @cpu: CPU whose topology mask to use
+ * @lvl: enum scx_topo_lvl
+ * @domain: CPUs the scheduler prefers to use, NULL for all CPUs
+ *
+ * Fallback for when scx_topo_pick_idle_cpu() can't find an idle CPU. The
+ * CPU is picked from @cpu's mask at @lvl, restricted to @domain and the CPUs
+ * allowed for @p. If @lvl isn't populated, @domain is used as a whole.
+ *
+ * Returns the picked CPU or -EBUSY if there's no eligible CPU.
+ */
+static s32 scx_topo_any_cpu(const struct task_struct *p, s32 cpu, u32 lvl,
+			    const struct cpumask *domain)
+{
+	struct bpf_cpumask *lvl_mask;
+	struct scx_topo_cpu *tc;
+	const struct cpumask *mask;
+
+	tc = scx_topo_cpu_ctx(cpu);
+	if (!tc)
+		return -ENOENT;
+
+	if (domain && tc->dom_seq != READ_ONCE(scx_topo_dom_seq))
+		scx_topo_refresh_dom(tc, domain);
+
+	lvl_mask = scx_topo_lvl_mask(tc, lvl, domain);
+	mask = lvl_mask ? cast_mask(lvl_mask) : domain ?: p->cpus_ptr;
+
+	cpu = bpf_cpumask_any_and_distribute(mask, p->cpus_ptr);
+	if (cpu >= scx_bpf_nr_cpu_ids())
+		return -EBUSY;
+
+	return cpu;
+}
@@ -45,4 +45,11 @@ struct domain_arg {
 	s32 sibling_cpu_id;
 };
 
+struct pick_idle_arg {
+	s32 pid;
+	s32 prev_cpu;
+	s32 cpu;		/* out: picked CPU or -errno */
+	u64 pick_ns;		/* out: duration of the pick */
+};
+
 #endif /* __INTF_H */
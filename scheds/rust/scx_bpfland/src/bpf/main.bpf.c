@@ -3,6 +3,7 @@
  * Copyright (c) 2024 Andrea Righi <andrea.righi@linux.dev>
  */
 #include <scx/common.bpf.h>
+#include <scx/idle_topo_impl.bpf.h>
 #include "intf.h"
 
 char _license[] SEC("license") = "GPL";
@@ -125,8 +126,6 @@ struct cpu_ctx {
 	u64 tot_runtime;
 	u64 prev_runtime;
 	u64 last_running;
-	struct bpf_cpumask __kptr *l2_cpumask;
-	struct bpf_cpumask __kptr *l3_cpumask;
 };
 
 struct {
@@ -151,13 +150,6 @@ struct cpu_ctx *try_lookup_cpu_ctx(s32 cpu)
  * This contain all the per-task information used internally by the BPF code.
  */
 struct task_ctx {
-	/*
-	 * Temporary cpumask for calculating scheduling domains.
-	 */
-	struct bpf_cpumask __kptr *cpumask;
-	struct bpf_cpumask __kptr *l2_cpumask;
-	struct bpf_cpumask __kptr *l3_cpumask;
-
 	/*
 	 * Task's average used time slice.
 	 */
@@ -281,73 +273,6 @@ static u64 task_deadline(const struct task_struct *p, struct task_ctx *tctx)
 	return tctx->deadline;
 }
 
-static void task_set_domain(struct task_struct *p, s32 cpu,
-			    const struct cpumask *cpumask)
-{
-	struct bpf_cpumask *primary, *l2_domain, *l3_domain;
-	struct bpf_cpumask *p_mask, *l2_mask, *l3_mask;
-	struct task_ctx *tctx;
-	struct cpu_ctx *cctx;
-
-	tctx = try_lookup_task_ctx(p);
-	if (!tctx)
-		return;
-
-	cctx = try_lookup_cpu_ctx(cpu);
-	if (!cctx)
-		return;
-
-	primary = primary_cpumask;
-	if (!primary)
-		return;
-
-	l2_domain = cctx->l2_cpumask;
-	if (!l2_domain)
-		l2_domain = primary;
-
-	l3_domain = cctx->l3_cpumask;
-	if (!l3_domain)
-		l3_domain = primary;
-
-	p_mask = tctx->cpumask;
-	if (!p_mask) {
-		scx_bpf_error("cpumask not initialized");
-		return;
-	}
-
-	l2_mask = tctx->l2_cpumask;
-	if (!l2_mask) {
-		scx_bpf_error("l2 cpumask not initialized");
-		return;
-	}
-
-	l3_mask = tctx->l3_cpumask;
-	if (!l3_mask) {
-		scx_bpf_error("l3 cpumask not initialized");
-		return;
-	}
-
-	/*
-	 * Determine the task's scheduling domain.
-	 * idle CPU, re-try again with the primary scheduling domain.
-	 */
-	bpf_cpumask_and(p_mask, cpumask, cast_mask(primary));
-
-	/*
-	 * Determine the L2 cache domain as the intersection of the task's
-	 * primary cpumask and the L2 cache domain mask of the previously used
-	 * CPU.
-	 */
-	bpf_cpumask_and(l2_mask, cast_mask(p_mask), cast_mask(l2_domain));
-
-	/*
-	 * Determine the L3 cache domain as the intersection of the task's
-	 * primary cpumask and the L3 cache domain mask of the previously used
-	 * CPU.
-	 */
-	bpf_cpumask_and(l3_mask, cast_mask(p_mask), cast_mask(l3_domain));
-}
-
 static bool is_wake_sync(const struct task_struct *p,
 			 const struct task_struct *current,
 			 s32 prev_cpu, s32 cpu, u64 wake_flags)
@@ -381,53 +306,16 @@ static bool is_wake_sync(const struct task_struct *p,
  */
 static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bool *is_idle)
 {
-	const struct cpumask *idle_smtmask, *idle_cpumask;
-	const struct cpumask *primary, *p_mask, *l2_mask, *l3_mask;
+	const struct cpumask *primary, *l3_domain;
 	struct task_struct *current = (void *)bpf_get_current_task_btf();
-	struct task_ctx *tctx;
-	bool is_prev_llc_affine = false;
-	s32 cpu;
+	s32 cpu, dom_cpu = prev_cpu;
 
 	*is_idle = false;
 
-	tctx = try_lookup_task_ctx(p);
-	if (!tctx)
-		return -ENOENT;
-
 	primary = cast_mask(primary_cpumask);
 	if (!primary)
 		return -EINVAL;
 
-	/*
-	 * Acquire the CPU masks to determine the idle CPUs in the system.
-	 */
-	idle_smtmask = scx_bpf_get_idle_smtmask();
-	idle_cpumask = scx_bpf_get_idle_cpumask();
-
-	/*
-	 * Task's scheduling domains.
-	 */
-	p_mask = cast_mask(tctx->cpumask);
-	if (!p_mask) {
-		scx_bpf_error("cpumask not initialized");
-		cpu = -EINVAL;
-		goto out_put_cpumask;
-	}
-
-	l2_mask = cast_mask(tctx->l2_cpumask);
-	if (!l2_mask) {
-		scx_bpf_error("l2 cpumask not initialized");
-		cpu = -EINVAL;
-		goto out_put_cpumask;
-	}
-
-	l3_mask = cast_mask(tctx->l3_cpumask);
-	if (!l3_mask) {
-		scx_bpf_error("l3 cpumask not initialized");
-		cpu = -EINVAL;
-		goto out_put_cpumask;
-	}
-
 	/*
 	 * If the current task is waking up another task and releasing the CPU
 	 * (WAKE_SYNC), attempt to migrate the wakee on the same CPU as the
@@ -435,20 +323,13 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 	 */
 	cpu = bpf_get_smp_processor_id();
 	if (is_wake_sync(p, current, cpu, prev_cpu, wake_flags)) {
-		const struct cpumask *curr_l3_domain;
-		struct cpu_ctx *cctx;
+		const struct cpumask *curr_l3_domain, *idle_cpumask;
 		bool share_llc, has_idle;
 
 		/*
 		 * Determine waker CPU scheduling domain.
 		 */
-		cctx = try_lookup_cpu_ctx(cpu);
-		if (!cctx) {
-			cpu = -EINVAL;
-			goto out_put_cpumask;
-		}
-
-		curr_l3_domain = cast_mask(cctx->l3_cpumask);
+		curr_l3_domain = scx_topo_cpumask(cpu, SCX_TOPO_L3);
 		if (!curr_l3_domain)
 			curr_l3_domain = primary;
 
@@ -459,168 +340,59 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 		share_llc = bpf_cpumask_test_cpu(prev_cpu, curr_l3_domain);
 		if (share_llc &&
 		    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
-			cpu = prev_cpu;
 			*is_idle = true;
-			goto out_put_cpumask;
+			return prev_cpu;
 		}
 
-		/*
-		 * Migrate the wakee to the same domain as the waker in case of
-		 * a sync wakeup.
-		 */
-		if (!share_llc)
-			task_set_domain(p, cpu, p->cpus_ptr);
-
 		/*
 		 * If the waker's L3 domain is not saturated attempt to migrate
 		 * the wakee on the same CPU as the waker (since it's going to
 		 * block and release the current CPU).
 		 */
+		idle_cpumask = scx_bpf_get_idle_cpumask();
 		has_idle = bpf_cpumask_intersects(curr_l3_domain, idle_cpumask);
+		scx_bpf_put_cpumask(idle_cpumask);
+
 		if (has_idle &&
-		    bpf_cpumask_test_cpu(cpu, p_mask) &&
+		    bpf_cpumask_test_cpu(cpu, p->cpus_ptr) &&
+		    bpf_cpumask_test_cpu(cpu, primary) &&
 		    !(current->flags & PF_EXITING) &&
 		    scx_bpf_dsq_nr_queued(SCX_DSQ_LOCAL_ON | cpu) == 0) {
 			*is_idle = true;
-			goto out_put_cpumask;
-		}
-	}
-
-	/*
-	 * Check if the previously used CPU is still in the L3 task domain. If
-	 * not, we may want to move the task back to its original L3 domain.
-	 */
-	is_prev_llc_affine = bpf_cpumask_test_cpu(prev_cpu, l3_mask);
-
-	/*
-	 * Find the best idle CPU, prioritizing full idle cores in SMT systems.
-	 */
-	if (smt_enabled) {
-		/*
-		 * If the task can still run on the previously used CPU and
-		 * it's a full-idle core, keep using it.
-		 */
-		if (is_prev_llc_affine &&
-		    bpf_cpumask_test_cpu(prev_cpu, idle_smtmask) &&
-		    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
-			cpu = prev_cpu;
-			*is_idle = true;
-			goto out_put_cpumask;
-		}
-
-		/*
-		 * Search for any full-idle CPU in the primary domain that
-		 * shares the same L2 cache.
-		 */
-		cpu = scx_bpf_pick_idle_cpu(l2_mask, SCX_PICK_IDLE_CORE);
-		if (cpu >= 0) {
-			*is_idle = true;
-			goto out_put_cpumask;
-		}
-
-		/*
-		 * Search for any full-idle CPU in the primary domain that
-		 * shares the same L3 cache.
-		 */
-		cpu = scx_bpf_pick_idle_cpu(l3_mask, SCX_PICK_IDLE_CORE);
-		if (cpu >= 0) {
-			*is_idle = true;
-			goto out_put_cpumask;
+			return cpu;
 		}
 
 		/*
-		 * Search for any other full-idle core in the primary domain.
-		 */
-		cpu = scx_bpf_pick_idle_cpu(p_mask, SCX_PICK_IDLE_CORE);
-		if (cpu >= 0) {
-			*is_idle = true;
-			goto out_put_cpumask;
-		}
-
-		/*
-		 * Search for any full-idle core usable by the task.
+		 * Migrate the wakee to the same domain as the waker in case of
+		 * a sync wakeup.
 		 */
-		cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, SCX_PICK_IDLE_CORE);
-		if (cpu >= 0) {
-			*is_idle = true;
-			goto out_put_cpumask;
-		}
-	}
-
-	/*
-	 * If a full-idle core can't be found (or if this is not an SMT system)
-	 * try to re-use the same CPU, even if it's not in a full-idle core.
-	 */
-	if (is_prev_llc_affine &&
-	    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
-		cpu = prev_cpu;
-		*is_idle = true;
-		goto out_put_cpumask;
-	}
-
-	/*
-	 * Search for any idle CPU in the primary domain that shares the same
-	 * L2 cache.
-	 */
-	cpu = scx_bpf_pick_idle_cpu(l2_mask, 0);
-	if (cpu >= 0) {
-		*is_idle = true;
-		goto out_put_cpumask;
-	}
-
-	/*
-	 * Search for any idle CPU in the primary domain that shares the same
-	 * L3 cache.
-	 */
-	cpu = scx_bpf_pick_idle_cpu(l3_mask, 0);
-	if (cpu >= 0) {
-		*is_idle = true;
-		goto out_put_cpumask;
-	}
-
-	/*
-	 * Search for any idle CPU in the scheduling domain.
-	 */
-	cpu = scx_bpf_pick_idle_cpu(p_mask, 0);
-	if (cpu >= 0) {
-		*is_idle = true;
-		goto out_put_cpumask;
+		if (!share_llc)
+			dom_cpu = cpu;
 	}
 
 	/*
-	 * Search for any idle CPU usable by the task.
+	 * Find the best idle CPU walking the topology around the task's
+	 * domain CPU, prioritizing full idle cores in SMT systems.
 	 */
-	cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, 0);
-	if (cpu >= 0) {
-		*is_idle = true;
-		goto out_put_cpumask;
-	}
+	cpu = scx_topo_pick_idle_cpu(p, dom_cpu, primary, smt_enabled, is_idle);
+	if (cpu >= 0)
+		return cpu;
 
 	/*
 	 * We couldn't find any idle CPU, return the previous CPU if it is in
 	 * the task's L3 domain.
 	 */
-	if (is_prev_llc_affine) {
-		cpu = prev_cpu;
-		goto out_put_cpumask;
-	}
+	l3_domain = scx_topo_cpumask(dom_cpu, SCX_TOPO_L3) ?: primary;
+	if (bpf_cpumask_test_cpu(prev_cpu, l3_domain) &&
+	    bpf_cpumask_test_cpu(prev_cpu, primary) &&
+	    bpf_cpumask_test_cpu(prev_cpu, p->cpus_ptr))
+		return prev_cpu;
 
 	/*
 	 * Otherwise, return a random CPU in the task's L3 domain (if
 	 * available).
 	 */
-	cpu = bpf_cpumask_any_distribute(l3_mask);
-	if (cpu >= nr_cpu_ids)
-		cpu = prev_cpu;
-
-out_put_cpumask:
-	scx_bpf_put_cpumask(idle_cpumask);
-	scx_bpf_put_cpumask(idle_smtmask);
-
-	/*
-	 * If we couldn't find any CPU, or in case of error, return the
-	 * previously used CPU.
-	 */
+	cpu = scx_topo_any_cpu(p, dom_cpu, SCX_TOPO_L3, primary);
 	if (cpu < 0)
 		cpu = prev_cpu;
 
@@ -923,14 +695,6 @@ void BPF_STRUCT_OPS(bpfland_cpu_release, s32 cpu, struct scx_cpu_release_args *a
 	scx_bpf_reenqueue_local();
 }
 
-void BPF_STRUCT_OPS(bpfland_set_cpumask, struct task_struct *p,
-		    const struct cpumask *cpumask)
-{
-	s32 cpu = bpf_get_smp_processor_id();
-
-	task_set_domain(p, cpu, cpumask);
-}
-
 void BPF_STRUCT_OPS(bpfland_enable, struct task_struct *p)
 {
 	struct task_ctx *tctx;
@@ -949,43 +713,12 @@ void BPF_STRUCT_OPS(bpfland_enable, struct task_struct *p)
 s32 BPF_STRUCT_OPS(bpfland_init_task, struct task_struct *p,
 		   struct scx_init_task_args *args)
 {
-	s32 cpu = bpf_get_smp_processor_id();
 	struct task_ctx *tctx;
-	struct bpf_cpumask *cpumask;
 
 	tctx = bpf_task_storage_get(&task_ctx_stor, p, 0,
 				    BPF_LOCAL_STORAGE_GET_F_CREATE);
 	if (!tctx)
 		return -ENOMEM;
-	/*
-	 * Create task's primary cpumask.
-	 */
-	cpumask = bpf_cpumask_create();
-	if (!cpumask)
-		return -ENOMEM;
-	cpumask = bpf_kptr_xchg(&tctx->cpumask, cpumask);
-	if (cpumask)
-		bpf_cpumask_release(cpumask);
-	/*
-	 * Create task's L2 cache cpumask.
-	 */
-	cpumask = bpf_cpumask_create();
-	if (!cpumask)
-		return -ENOMEM;
-	cpumask = bpf_kptr_xchg(&tctx->l2_cpumask, cpumask);
-	if (cpumask)
-		bpf_cpumask_release(cpumask);
-	/*
-	 * Create task's L3 cache cpumask.
-	 */
-	cpumask = bpf_cpumask_create();
-	if (!cpumask)
-		return -ENOMEM;
-	cpumask = bpf_kptr_xchg(&tctx->l3_cpumask, cpumask);
-	if (cpumask)
-		bpf_cpumask_release(cpumask);
-
-	task_set_domain(p, cpu, p->cpus_ptr);
 
 	return 0;
 }
@@ -1031,36 +764,16 @@ static int init_cpumask(struct bpf_cpumask **cpumask)
 SEC("syscall")
 int enable_sibling_cpu(struct domain_arg *input)
 {
-	struct cpu_ctx *cctx;
-	struct bpf_cpumask *mask, **pmask;
-	int err = 0;
-
-	cctx = try_lookup_cpu_ctx(input->cpu_id);
-	if (!cctx)
-		return -ENOENT;
-
-	/* Make sure the target CPU mask is initialized */
 	switch (input->lvl_id) {
 	case 2:
-		pmask = &cctx->l2_cpumask;
-		break;
+		return scx_topo_add_sibling(input->cpu_id, input->sibling_cpu_id,
+					    SCX_TOPO_L2);
 	case 3:
-		pmask = &cctx->l3_cpumask;
-		break;
+		return scx_topo_add_sibling(input->cpu_id, input->sibling_cpu_id,
+					    SCX_TOPO_L3);
 	default:
 		return -EINVAL;
 	}
-	err = init_cpumask(pmask);
-	if (err)
-		return err;
-
-	bpf_rcu_read_lock();
-	mask = *pmask;
-	if (mask)
-		bpf_cpumask_set_cpu(input->sibling_cpu_id, mask);
-	bpf_rcu_read_unlock();
-
-	return err;
 }
 
 SEC("syscall")
@@ -1090,9 +803,61 @@ int enable_primary_cpu(struct cpu_arg *input)
 	}
 	bpf_rcu_read_unlock();
 
+	/* Refresh the cached topology masks of the primary domain */
+	scx_topo_domain_changed();
+
 	return err;
 }
 
+/*
+ * Run the idle CPU picker once for @input->pid around @input->prev_cpu and
+ * report the picked CPU and the time the pick took. Used by the tests in
+ * main.rs through BPF_PROG_TEST_RUN while the scheduler is attached, as idle
+ * tracking is only active then.
+ *
+ * The picked CPU is kicked so that it goes through idle again and gets its
+ * idle state back.
+ */
+SEC("syscall")
+int test_pick_idle_cpu(struct pick_idle_arg *input)
+{
+	const struct cpumask *primary;
+	struct task_struct *p;
+	bool is_idle;
+	int ret = 0;
+	u64 start;
+	s32 cpu;
+
+	p = bpf_task_from_pid(input->pid);
+	if (!p)
+		return -ESRCH;
+
+	bpf_rcu_read_lock();
+	primary = cast_mask(primary_cpumask);
+	if (!primary) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	start = bpf_ktime_get_ns();
+	cpu = scx_topo_pick_idle_cpu(p, input->prev_cpu, primary, smt_enabled, &is_idle);
+	input->pick_ns = bpf_ktime_get_ns() - start;
+	input->cpu = cpu;
+
+	if (cpu >= 0) {
+		scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+		if (!is_idle || !bpf_cpumask_test_cpu(cpu, p->cpus_ptr))
+			ret = -EINVAL;
+	} else if (cpu != -EBUSY) {
+		ret = cpu;
+	}
+out:
+	bpf_rcu_read_unlock();
+	bpf_task_release(p);
+
+	return ret;
+}
+
 /*
  * Initialize cpufreq performance level on all the online CPUs.
  */
@@ -1156,7 +921,6 @@ SCX_OPS_DEFINE(bpfland_ops,
 	       .stopping		= (void *)bpfland_stopping,
 	       .runnable		= (void *)bpfland_runnable,
 	       .cpu_release		= (void *)bpfland_cpu_release,
-	       .set_cpumask		= (void *)bpfland_set_cpumask,
 	       .enable			= (void *)bpfland_enable,
 	       .init_task		= (void *)bpfland_init_task,
 	       .init			= (void *)bpfland_init,
@@ -655,3 +655,63 @@ fn main() -> Result<()> {
 
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Idle tracking is only active while a sched_ext scheduler is attached,
+    // so this needs root and a sched_ext enabled kernel. Run with:
+    //
+    //   cargo test -p scx_bpfland -- --ignored --nocapture
+    #[test]
+    #[ignore]
+    fn test_pick_idle_cpu() {
+        let opts = Opts::parse_from([SCHEDULER_NAME]);
+        let mut open_object = MaybeUninit::uninit();
+        let mut sched = Scheduler::init(&opts, &mut open_object).unwrap();
+
+        let mut nr_found = 0;
+        let mut pick_ns = vec![];
+        for prev_cpu in 0..*NR_CPU_IDS {
+            let mut args = pick_idle_arg {
+                pid: std::process::id() as c_int,
+                prev_cpu: prev_cpu as c_int,
+                cpu: -1,
+                pick_ns: 0,
+            };
+            let input = ProgramInput {
+                context_in: Some(unsafe {
+                    std::slice::from_raw_parts_mut(
+                        &mut args as *mut _ as *mut u8,
+                        std::mem::size_of_val(&args),
+                    )
+                }),
+                ..Default::default()
+            };
+            let out = sched.skel.progs.test_pick_idle_cpu.test_run(input).unwrap();
+            assert_eq!(
+                out.return_value, 0,
+                "prev_cpu={} picked invalid CPU {}",
+                prev_cpu, args.cpu
+            );
+            assert!(args.cpu < *NR_CPU_IDS as c_int);
+            if args.cpu >= 0 {
+                nr_found += 1;
+            }
+            pick_ns.push(args.pick_ns);
+        }
+
+        pick_ns.sort();
+        println!(
+            "{} picks, {} found idle, ns/pick avg={} p50={} max={}",
+            pick_ns.len(),
+            nr_found,
+            pick_ns.iter().sum::<u64>() / pick_ns.len() as u64,
+            pick_ns[pick_ns.len() / 2],
+            pick_ns[pick_ns.len() - 1],
+        );
+
+        sched.struct_ops.take();
+    }
+}
@@ -3,6 +3,8 @@
  * Copyright (c) 2024 Andrea Righi <arighi@nvidia.com>
  */
 #include <scx/common.bpf.h>
+#include <scx/fixed_impl.bpf.h>
+#include <scx/idle_topo_impl.bpf.h>
 #include "intf.h"
 
 char _license[] SEC("license") = "GPL";
@@ -77,40 +79,12 @@ static u64 vtime_now;
  */
 static u64 nr_cpu_ids;
 
-/*
- * Per-CPU context.
- */
-struct cpu_ctx {
-	struct bpf_cpumask __kptr *llc_mask;
-};
-
-struct {
-	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
-	__type(key, u32);
-	__type(value, struct cpu_ctx);
-	__uint(max_entries, 1);
-} cpu_ctx_stor SEC(".maps");
-
-/*
- * Return a CPU context.
- */
-struct cpu_ctx *try_lookup_cpu_ctx(s32 cpu)
-{
-	const u32 idx = 0;
-	return bpf_map_lookup_percpu_elem(&cpu_ctx_stor, &idx, cpu);
-}
-
 /*
  * Per-task local storage.
  *
  * This contain all the per-task information used internally by the BPF code.
  */
 struct task_ctx {
-	/*
-	 * Temporary cpumask for calculating scheduling domains.
-	 */
-	struct bpf_cpumask __kptr *llc_mask;
-
 	/*
 	 * Voluntary context switches metrics.
 	 */
@@ -279,24 +253,6 @@ int BPF_PROG(fexit_vfs_fsync_range, struct file *file, u64 start, u64 end, int d
 	return 0;
 }
 
-/*
- * Allocate/re-allocate a new cpumask.
- */
-static int calloc_cpumask(struct bpf_cpumask **p_cpumask)
-{
-	struct bpf_cpumask *cpumask;
-
-	cpumask = bpf_cpumask_create();
-	if (!cpumask)
-		return -ENOMEM;
-
-	cpumask = bpf_kptr_xchg(p_cpumask, cpumask);
-	if (cpumask)
-		bpf_cpumask_release(cpumask);
-
-	return 0;
-}
-
 /*
  * Exponential weighted moving average (EWMA).
  *
@@ -408,9 +364,13 @@ static u64 max_sched_prio(void)
 }
 
 /*
- * Convert task priority to weight (following fair.c logic).
+ * Scale @value inversely to the weight of the latency priority @prio
+ * (following fair.c logic).
+ *
+ * Use the precomputed reciprocals of sched_prio_to_weight[] to avoid a
+ * division in the enqueue path.
  */
-static u64 sched_prio_to_latency_weight(u64 prio)
+static u64 scale_inverse_latency_weight(u64 value, u64 prio)
 {
 	u64 max_prio = max_sched_prio();
 
@@ -419,7 +379,7 @@ static u64 sched_prio_to_latency_weight(u64 prio)
 		return 0;
 	}
 
-	return sched_prio_to_weight[max_prio - prio - 1];
+	return scx_div_prio_weight(value, max_prio - prio - 1);
 }
 
 /*
@@ -430,7 +390,7 @@ static u64 sched_prio_to_latency_weight(u64 prio)
  */
 static u64 task_deadline(struct task_struct *p, struct task_ctx *tctx)
 {
-	u64 avg_run_scaled, lat_prio, lat_weight;
+	u64 avg_run_scaled, lat_prio;
 
 	/*
 	 * Evaluate the "latency priority" as a function of the average amount
@@ -464,9 +424,7 @@ static u64 task_deadline(struct task_struct *p, struct task_ctx *tctx)
 	 * Lastly, translate the latency priority into a weight and apply it to
 	 * the task's average runtime to determine the task's deadline.
 	 */
-	lat_weight = sched_prio_to_latency_weight(lat_prio);
-
-	return tctx->avg_runtime * 1024 / lat_weight;
+	return scale_inverse_latency_weight(tctx->avg_runtime * 1024, lat_prio);
 }
 
 /*
@@ -509,40 +467,6 @@ static void task_refill_slice(struct task_struct *p)
 	p->scx.slice = CLAMP(slice, SLICE_MIN, slice_max);
 }
 
-static void task_set_domain(struct task_struct *p, s32 cpu,
-			    const struct cpumask *cpumask)
-{
-	const struct cpumask *llc_domain;
-	struct bpf_cpumask *llc_mask;
-	struct task_ctx *tctx;
-	struct cpu_ctx *cctx;
-
-	tctx = try_lookup_task_ctx(p);
-	if (!tctx)
-		return;
-
-	cctx = try_lookup_cpu_ctx(cpu);
-	if (!cctx)
-		return;
-
-	llc_domain = cast_mask(cctx->llc_mask);
-	if (!llc_domain)
-		llc_domain = p->cpus_ptr;
-
-	llc_mask = tctx->llc_mask;
-	if (!llc_mask) {
-		scx_bpf_error("LLC cpumask not initialized");
-		return;
-	}
-
-	/*
-	 * Determine the LLC cache domain as the intersection of the task's
-	 * primary cpumask and the LLC cache domain mask of the previously used
-	 * CPU.
-	 */
-	bpf_cpumask_and(llc_mask, p->cpus_ptr, llc_domain);
-}
-
 /*
  * Find an idle CPU in the system.
  *
@@ -554,40 +478,10 @@ static void task_set_domain(struct task_struct *p, s32 cpu,
  */
 static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bool *is_idle)
 {
-	const struct cpumask *idle_smtmask, *idle_cpumask;
-	const struct cpumask *llc_mask;
-	struct task_ctx *tctx;
-	bool is_prev_llc_affine = false;
 	s32 cpu;
 
 	*is_idle = false;
 
-	tctx = try_lookup_task_ctx(p);
-	if (!tctx)
-		return -ENOENT;
-
-	/*
-	 * Acquire the CPU masks to determine the idle CPUs in the system.
-	 */
-	idle_smtmask = scx_bpf_get_idle_smtmask();
-	idle_cpumask = scx_bpf_get_idle_cpumask();
-
-	/*
-	 * Task's scheduling domains.
-	 */
-	llc_mask = cast_mask(tctx->llc_mask);
-	if (!llc_mask) {
-		scx_bpf_error("LLC cpumask not initialized");
-		cpu = -EINVAL;
-		goto out_put_cpumask;
-	}
-
-	/*
-	 * Check if the previously used CPU is still in the LLC task domain. If
-	 * not, we may want to move the task back to its original LLC domain.
-	 */
-	is_prev_llc_affine = bpf_cpumask_test_cpu(prev_cpu, llc_mask);
-
 	/*
 	 * If the current task is waking up another task and releasing the CPU
 	 * (WAKE_SYNC), attempt to migrate the wakee on the same CPU as the
@@ -595,21 +489,14 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 	 */
 	if (wake_flags & SCX_WAKE_SYNC) {
 		struct task_struct *current = (void *)bpf_get_current_task_btf();
-		const struct cpumask *curr_llc_domain;
-		struct cpu_ctx *cctx;
+		const struct cpumask *curr_llc_domain, *idle_cpumask;
 		bool share_llc, has_idle;
 
 		/*
 		 * Determine waker CPU scheduling domain.
 		 */
 		cpu = bpf_get_smp_processor_id();
-		cctx = try_lookup_cpu_ctx(cpu);
-		if (!cctx) {
-			cpu = -EINVAL;
-			goto out_put_cpumask;
-		}
-
-		curr_llc_domain = cast_mask(cctx->llc_mask);
+		curr_llc_domain = scx_topo_cpumask(cpu, SCX_TOPO_L3);
 		if (!curr_llc_domain)
 			curr_llc_domain = p->cpus_ptr;
 
@@ -620,9 +507,8 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 		share_llc = bpf_cpumask_test_cpu(prev_cpu, curr_llc_domain);
 		if (share_llc &&
 		    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
-			cpu = prev_cpu;
 			*is_idle = true;
-			goto out_put_cpumask;
+			return prev_cpu;
 		}
 
 		/*
@@ -630,106 +516,38 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 		 * the wakee on the same CPU as the waker (since it's going to
 		 * block and release the current CPU).
 		 */
+		idle_cpumask = scx_bpf_get_idle_cpumask();
 		has_idle = bpf_cpumask_intersects(curr_llc_domain, idle_cpumask);
+		scx_bpf_put_cpumask(idle_cpumask);
+
 		if (has_idle &&
 		    bpf_cpumask_test_cpu(cpu, p->cpus_ptr) &&
 		    !(current->flags & PF_EXITING) &&
 		    scx_bpf_dsq_nr_queued(SCX_DSQ_LOCAL_ON | cpu) == 0) {
 			*is_idle = true;
-			goto out_put_cpumask;
+			return cpu;
 		}
 	}
 
 	/*
-	 * Find the best idle CPU, prioritizing full idle cores in SMT systems.
+	 * Find the best idle CPU walking the LLC of the previously used CPU
+	 * first, prioritizing full idle cores in SMT systems.
 	 */
-	if (smt_enabled) {
-		/*
-		 * If the task can still run on the previously used CPU and
-		 * it's a full-idle core, keep using it.
-		 */
-		if (is_prev_llc_affine &&
-		    bpf_cpumask_test_cpu(prev_cpu, idle_smtmask) &&
-		    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
-			cpu = prev_cpu;
-			*is_idle = true;
-			goto out_put_cpumask;
-		}
-
-		/*
-		 * Search for any full-idle CPU in the primary domain that
-		 * shares the same LLC domain.
-		 */
-		cpu = scx_bpf_pick_idle_cpu(llc_mask, SCX_PICK_IDLE_CORE);
-		if (cpu >= 0) {
-			*is_idle = true;
-			goto out_put_cpumask;
-		}
-
-		/*
-		 * Search for any other full-idle core in the task's domain.
-		 */
-		cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, SCX_PICK_IDLE_CORE);
-		if (cpu >= 0) {
-			*is_idle = true;
-			goto out_put_cpumask;
-		}
-	}
-
-	/*
-	 * If a full-idle core can't be found (or if this is not an SMT system)
-	 * try to re-use the same CPU, even if it's not in a full-idle core.
-	 */
-	if (is_prev_llc_affine &&
-	    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
-		cpu = prev_cpu;
-		*is_idle = true;
-		goto out_put_cpumask;
-	}
-
-	/*
-	 * Search for any idle CPU in the primary domain that shares the same
-	 * LLC domain.
-	 */
-	cpu = scx_bpf_pick_idle_cpu(llc_mask, 0);
-	if (cpu >= 0) {
-		*is_idle = true;
-		goto out_put_cpumask;
-	}
-
-	/*
-	 * Search for any idle CPU in the task's scheduling domain.
-	 */
-	cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, 0);
-	if (cpu >= 0) {
-		*is_idle = true;
-		goto out_put_cpumask;
-	}
-
-	/*
-	 * We couldn't find any idle CPU, return the previous CPU if it is in
-	 * the task's LLC domain.
-	 */
-	if (is_prev_llc_affine) {
-		cpu = prev_cpu;
-		goto out_put_cpumask;
-	}
+	cpu = scx_topo_pick_idle_cpu(p, prev_cpu, NULL, smt_enabled, is_idle);
+	if (cpu >= 0)
+		return cpu;
 
 	/*
-	 * Otherwise, return a random CPU in the task's LLC domain.
+	 * We couldn't find any idle CPU, return the previous CPU if the task
+	 * can still use it.
 	 */
-	cpu = bpf_cpumask_any_distribute(llc_mask);
-	if (cpu >= nr_cpu_ids)
-		cpu = prev_cpu;
-
-out_put_cpumask:
-	scx_bpf_put_cpumask(idle_cpumask);
-	scx_bpf_put_cpumask(idle_smtmask);
+	if (bpf_cpumask_test_cpu(prev_cpu, p->cpus_ptr))
+		return prev_cpu;
 
 	/*
-	 * If we couldn't find any CPU, or in case of error, return the
-	 * previously used CPU.
+	 * Otherwise, return a random CPU in the previous CPU's LLC domain.
 	 */
+	cpu = scx_topo_any_cpu(p, prev_cpu, SCX_TOPO_L3, NULL);
 	if (cpu < 0)
 		cpu = prev_cpu;
 
@@ -760,7 +578,7 @@ s32 BPF_STRUCT_OPS(flash_select_cpu, struct task_struct *p,
 /*
  * Try to wake up an idle CPU that can immediately process the task.
  */
-static void kick_task_cpu(const struct task_struct *p, const struct task_ctx *tctx)
+static void kick_task_cpu(const struct task_struct *p)
 {
 	const struct cpumask *idle_cpumask, *llc_mask;
 	s32 cpu;
@@ -779,17 +597,15 @@ static void kick_task_cpu(const struct task_struct *p, const struct task_ctx *tc
 	 * Note that we do not want to mark the CPU as busy, since we don't
 	 * know at this stage if we will actually dispatch any task on it.
 	 */
-	llc_mask = cast_mask(tctx->llc_mask);
-	if (!llc_mask) {
-		scx_bpf_error("l3 cpumask not initialized");
-		return;
-	}
+	llc_mask = scx_topo_cpumask(scx_bpf_task_cpu(p), SCX_TOPO_L3);
+	if (!llc_mask)
+		llc_mask = p->cpus_ptr;
 
 	idle_cpumask = scx_bpf_get_idle_cpumask();
 	cpu = bpf_cpumask_any_and_distribute(llc_mask, idle_cpumask);
 	scx_bpf_put_cpumask(idle_cpumask);
 
-	if (cpu < nr_cpu_ids)
+	if (cpu < nr_cpu_ids && bpf_cpumask_test_cpu(cpu, p->cpus_ptr))
 		scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
 }
 
@@ -828,7 +644,7 @@ void BPF_STRUCT_OPS(flash_enqueue, struct task_struct *p, u64 enq_flags)
 	 * Try to proactively wake up an idle CPU, so that it can
 	 * immediately execute the task in case its current CPU is busy.
 	 */
-	kick_task_cpu(p, tctx);
+	kick_task_cpu(p);
 }
 
 void BPF_STRUCT_OPS(flash_dispatch, s32 cpu, struct task_struct *prev)
@@ -957,14 +773,6 @@ void BPF_STRUCT_OPS(flash_runnable, struct task_struct *p, u64 enq_flags)
 	tctx->sum_runtime = 0;
 }
 
-void BPF_STRUCT_OPS(flash_set_cpumask, struct task_struct *p,
-		    const struct cpumask *cpumask)
-{
-	s32 cpu = bpf_get_smp_processor_id();
-
-	task_set_domain(p, cpu, cpumask);
-}
-
 void BPF_STRUCT_OPS(flash_enable, struct task_struct *p)
 {
 	u64 now = scx_bpf_now();
@@ -989,76 +797,21 @@ void BPF_STRUCT_OPS(flash_enable, struct task_struct *p)
 s32 BPF_STRUCT_OPS(flash_init_task, struct task_struct *p,
 		   struct scx_init_task_args *args)
 {
-	s32 cpu = bpf_get_smp_processor_id();
 	struct task_ctx *tctx;
-	struct bpf_cpumask *cpumask;
 
 	tctx = bpf_task_storage_get(&task_ctx_stor, p, 0,
 				    BPF_LOCAL_STORAGE_GET_F_CREATE);
 	if (!tctx)
 		return -ENOMEM;
-	/*
-	 * Create task's LLC cpumask.
-	 */
-	cpumask = bpf_cpumask_create();
-	if (!cpumask)
-		return -ENOMEM;
-	cpumask = bpf_kptr_xchg(&tctx->llc_mask, cpumask);
-	if (cpumask)
-		bpf_cpumask_release(cpumask);
-
-	task_set_domain(p, cpu, p->cpus_ptr);
 
 	return 0;
 }
 
-static int init_cpumask(struct bpf_cpumask **cpumask)
-{
-	struct bpf_cpumask *mask;
-	int err = 0;
-
-	/*
-	 * Do nothing if the mask is already initialized.
-	 */
-	mask = *cpumask;
-	if (mask)
-		return 0;
-	/*
-	 * Create the CPU mask.
-	 */
-	err = calloc_cpumask(cpumask);
-	if (!err)
-		mask = *cpumask;
-	if (!mask)
-		err = -ENOMEM;
-
-	return err;
-}
-
 SEC("syscall")
 int enable_sibling_cpu(struct domain_arg *input)
 {
-	struct cpu_ctx *cctx;
-	struct bpf_cpumask *mask, **pmask;
-	int err = 0;
-
-	cctx = try_lookup_cpu_ctx(input->cpu_id);
-	if (!cctx)
-		return -ENOENT;
-
-	/* Make sure the target CPU mask is initialized */
-	pmask = &cctx->llc_mask;
-	err = init_cpumask(pmask);
-	if (err)
-		return err;
-
-	bpf_rcu_read_lock();
-	mask = *pmask;
-	if (mask)
-		bpf_cpumask_set_cpu(input->sibling_cpu_id, mask);
-	bpf_rcu_read_unlock();
-
-	return err;
+	return scx_topo_add_sibling(input->cpu_id, input->sibling_cpu_id,
+				    SCX_TOPO_L3);
 }
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(flash_init)
@@ -1094,7 +847,6 @@ SCX_OPS_DEFINE(flash_ops,
 	       .running			= (void *)flash_running,
 	       .stopping		= (void *)flash_stopping,
 	       .runnable		= (void *)flash_runnable,
-	       .set_cpumask		= (void *)flash_set_cpumask,
 	       .enable			= (void *)flash_enable,
 	       .init_task		= (void *)flash_init_task,
 	       .init			= (void *)flash_init,
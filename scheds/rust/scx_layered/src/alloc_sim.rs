@@ -0,0 +1,426 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! # Layer CPU allocation simulator
+//!
+//! Drives the userspace CPU allocator - calc_target_nr_cpus(),
+//! weighted_target_nr_cpus() and resize_layers() - with a per-layer
+//! utilization time series instead of the running scheduler so that growth
+//! algorithms can be compared on a topology offline. Each layer spec is
+//! replayed once per [`LayerGrowthAlgo`] with all layers switched to that
+//! algorithm and the following is reported:
+//!
+//! - churn: CPUs added to or removed from layers.
+//! - llc_excess: LLCs spanned by a layer beyond the minimum its CPUs fit in,
+//!   averaged over the intervals where the layer has CPUs.
+//! - ttt: time-to-target, how long a layer takes to reach its weighted target
+//!   once it diverges from it. Layers still off target at the end are counted
+//!   as unconverged.
+//!
+//! Utilization traces are text files with one line per scheduling interval,
+//! each listing the utilization of every layer in number of CPUs, which
+//! corresponds to the owned utilization the scheduler feeds the allocator
+//! after decaying. Empty lines and lines starting with '#' are ignored:
+//!
+//! ```text
+//! # batch immediate stress-ng normal
+//! 2.5 0.3 0.0 10.1
+//! 2.7 0.4 8.0 10.0
+//! ```
+//!
+//! Synthetic traces are generated with "synthetic:STEPS[:SEED]" instead of a
+//! path. SEED also seeds the randomized growth orders so that runs are
+//! reproducible. Trace files use seed 0, same as the scheduler.
+//!
+//! Tasks in open layers and the latency targets of wait_p99_target_us are not
+//! modeled.
+
+use std::fs::File;
+use std::io::BufRead;
+use std::io::BufReader;
+use std::sync::Arc;
+
+use anyhow::anyhow;
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+use scx_layered::*;
+use scx_utils::Cpumask;
+use scx_utils::Topology;
+
+use crate::Layer;
+use crate::Scheduler;
+use crate::LAYER_USAGE_OWNED;
+use crate::NR_LAYER_USAGES;
+
+const ALGOS: [LayerGrowthAlgo; 9] = [
+    LayerGrowthAlgo::Sticky,
+    LayerGrowthAlgo::Linear,
+    LayerGrowthAlgo::Reverse,
+    LayerGrowthAlgo::Random,
+    LayerGrowthAlgo::Topo,
+    LayerGrowthAlgo::RoundRobin,
+    LayerGrowthAlgo::BigLittle,
+    LayerGrowthAlgo::LittleBig,
+    LayerGrowthAlgo::RandomTopo,
+];
+
+#[derive(Clone, Debug, Default)]
+struct LayerResult {
+    churn: usize,
+    llc_excess_sum: usize,
+    nr_populated: usize,
+    ttt_sum: usize,
+    ttt_max: usize,
+    nr_converged: usize,
+    unconverged: bool,
+}
+
+impl LayerResult {
+    fn llc_excess(&self) -> f64 {
+        match self.nr_populated {
+            0 => 0.0,
+            n => self.llc_excess_sum as f64 / n as f64,
+        }
+    }
+
+    fn ttt_avg(&self) -> f64 {
+        match self.nr_converged {
+            0 => 0.0,
+            n => self.ttt_sum as f64 / n as f64,
+        }
+    }
+}
+
+/// Parse "NODES:LLCS_PER_NODE:CORES_PER_LLC:CPUS_PER_CORE".
+fn synthetic_topology(spec: &str) -> Result<Topology> {
+    let dims = spec
+        .split(':')
+        .map(|v| v.parse::<usize>())
+        .collect::<Result<Vec<usize>, _>>()
+        .with_context(|| format!("Invalid topology {:?}", spec))?;
+    if dims.len() != 4 {
+        bail!(
+            "Invalid topology {:?}, expected NODES:LLCS_PER_NODE:CORES_PER_LLC:CPUS_PER_CORE",
+            spec
+        );
+    }
+    Topology::synthetic(dims[0], dims[1], dims[2], dims[3])
+}
+
+fn read_trace(path: &str, nr_layers: usize) -> Result<Vec<Vec<f64>>> {
+    let file = File::open(path).with_context(|| format!("Failed to open {:?}", path))?;
+    parse_trace(BufReader::new(file), path, nr_layers)
+}
+
+/// Parse a utilization trace from `reader`. `name` is only used in error
+/// messages.
+fn parse_trace(reader: impl BufRead, name: &str, nr_layers: usize) -> Result<Vec<Vec<f64>>> {
+    let mut trace = vec![];
+
+    for (lnr, line) in reader.lines().enumerate() {
+        let line = line?;
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+
+        let utils = line
+            .split_whitespace()
+            .map(|v| v.parse::<f64>())
+            .collect::<Result<Vec<f64>, _>>()
+            .with_context(|| format!("{}:{}: invalid utilization", name, lnr + 1))?;
+        if utils.len() != nr_layers {
+            bail!(
+                "{}:{}: {} utilization values for {} layers",
+                name,
+                lnr + 1,
+                utils.len(),
+                nr_layers
+            );
+        }
+        trace.push(utils);
+    }
+
+    Ok(trace)
+}
+
+/// Parse "synthetic:STEPS[:SEED]" into (STEPS, SEED). SEED defaults to 0.
+fn parse_synthetic_spec(spec: &str) -> Result<(usize, u64)> {
+    let args: Vec<&str> = spec.split(':').skip(1).collect();
+    Ok(match args.as_slice() {
+        [steps] => (steps.parse::<usize>()?, 0),
+        [steps, seed] => (steps.parse::<usize>()?, seed.parse::<u64>()?),
+        _ => bail!(
+            "Invalid synthetic trace {:?}, expected synthetic:STEPS[:SEED]",
+            spec
+        ),
+    })
+}
+
+/// Each layer does a random walk of +-10% per interval around a random level
+/// and jumps to a new level with 2% probability to exercise both gradual and
+/// abrupt changes.
+fn synthetic_trace(steps: usize, seed: u64, nr_layers: usize, nr_cpus: usize) -> Vec<Vec<f64>> {
+    let mut rng = fastrand::Rng::with_seed(seed);
+    let max_util = nr_cpus as f64 / nr_layers.max(1) as f64;
+    let mut utils: Vec<f64> = (0..nr_layers).map(|_| rng.f64() * max_util).collect();
+    let mut trace = vec![];
+
+    for _ in 0..steps {
+        for util in utils.iter_mut() {
+            if rng.f64() < 0.02 {
+                *util = rng.f64() * max_util;
+            } else {
+                *util = (*util * (0.9 + rng.f64() * 0.2)).min(nr_cpus as f64);
+            }
+        }
+        trace.push(utils.clone());
+    }
+
+    trace
+}
+
+fn llc_excess(topo: &Topology, cpus: &Cpumask, max_llc_cpus: usize) -> usize {
+    let nr_llcs = topo
+        .all_llcs
+        .values()
+        .filter(|llc| !llc.span.and(cpus).is_empty())
+        .count();
+    nr_llcs.saturating_sub(cpus.weight().div_ceil(max_llc_cpus))
+}
+
+fn simulate_algo(
+    topo: &Arc<Topology>,
+    specs: &[LayerSpec],
+    trace: &[Vec<f64>],
+    seed: u64,
+) -> Result<Vec<LayerResult>> {
+    let nr_cpus = topo.all_cpus.len();
+    let max_llc_cpus = topo
+        .all_llcs
+        .values()
+        .map(|llc| llc.span.weight())
+        .max()
+        .unwrap_or(1)
+        .max(1);
+
+    let mut cpu_pool = CpuPool::new(topo.clone())?;
+    let core_orders = LayerGrowthAlgo::layer_core_orders(&cpu_pool, specs, topo, seed);
+    let mut layers = specs
+        .iter()
+        .enumerate()
+        .map(|(idx, spec)| Layer::new(spec, topo, &core_orders[&idx]))
+        .collect::<Result<Vec<Layer>>>()?;
+
+    let mut results = vec![LayerResult::default(); layers.len()];
+    let mut off_target_since: Vec<Option<usize>> = vec![None; layers.len()];
+    let mut utils = vec![vec![0.0; NR_LAYER_USAGES]; layers.len()];
+
+    for (step, step_utils) in trace.iter().enumerate() {
+        for (util, &v) in utils.iter_mut().zip(step_utils.iter()) {
+            util[LAYER_USAGE_OWNED] = v;
+        }
+
+        let prev_cpus: Vec<Cpumask> = layers.iter().map(|l| l.cpus.clone()).collect();
+        let targets = Scheduler::calc_target_nr_cpus(&layers, &utils, nr_cpus);
+        let targets = Scheduler::weighted_target_nr_cpus(&layers, &targets, nr_cpus);
+        Scheduler::resize_layers(&mut layers, &mut cpu_pool, &targets)?;
+
+        for (idx, layer) in layers.iter().enumerate() {
+            let res = &mut results[idx];
+
+            res.churn += layer.cpus.xor(&prev_cpus[idx]).weight();
+            if layer.nr_cpus > 0 {
+                res.llc_excess_sum += llc_excess(topo, &layer.cpus, max_llc_cpus);
+                res.nr_populated += 1;
+            }
+
+            if let LayerKind::Open { .. } = layer.kind {
+                continue;
+            }
+
+            match (off_target_since[idx], layer.nr_cpus == targets[idx]) {
+                (None, false) => off_target_since[idx] = Some(step),
+                (Some(since), true) => {
+                    let ttt = step + 1 - since;
+                    res.ttt_sum += ttt;
+                    res.ttt_max = res.ttt_max.max(ttt);
+                    res.nr_converged += 1;
+                    off_target_since[idx] = None;
+                }
+                _ => {}
+            }
+        }
+    }
+
+    for (res, since) in results.iter_mut().zip(off_target_since.iter()) {
+        res.unconverged = since.is_some();
+    }
+
+    Ok(results)
+}
+
+/// Replay the utilization trace `spec` through the CPU allocator for each
+/// growth algorithm and print the results. `topo_spec` selects a synthetic
+/// topology, the host's is used if `None`. `intv` is the scheduling interval
+/// in seconds which a trace line represents.
+pub fn simulate(
+    spec: &str,
+    topo_spec: Option<&str>,
+    layer_specs: &[LayerSpec],
+    intv: f64,
+) -> Result<()> {
+    let topo = Arc::new(match topo_spec {
+        Some(topo_spec) => synthetic_topology(topo_spec)?,
+        None => Topology::new()?,
+    });
+    let nr_layers = layer_specs.len();
+
+    let (trace, seed) = if spec.starts_with("synthetic:") {
+        let (steps, seed) = parse_synthetic_spec(spec)?;
+        let trace = synthetic_trace(steps, seed, nr_layers, topo.all_cpus.len());
+        (trace, seed)
+    } else {
+        (read_trace(spec, nr_layers)?, 0)
+    };
+    if trace.is_empty() {
+        return Err(anyhow!("No utilization samples in {:?}", spec));
+    }
+
+    println!(
+        "topology: nodes={} llcs={} cores={} cpus={} intervals={} ({:.1}s)",
+        topo.nodes.len(),
+        topo.all_llcs.len(),
+        topo.all_cores.len(),
+        topo.all_cpus.len(),
+        trace.len(),
+        trace.len() as f64 * intv,
+    );
+
+    let name_width = layer_specs
+        .iter()
+        .map(|spec| spec.name.len())
+        .max()
+        .unwrap_or(0)
+        .max(4);
+
+    for algo in ALGOS.iter() {
+        let specs: Vec<LayerSpec> = layer_specs
+            .iter()
+            .cloned()
+            .map(|mut spec| {
+                spec.kind.common_mut().growth_algo = algo.clone();
+                spec
+            })
+            .collect();
+
+        let results = simulate_algo(&topo, &specs, &trace, seed)
+            .with_context(|| format!("Failed to simulate {:?}", algo))?;
+
+        let churn: usize = results.iter().map(|r| r.churn).sum();
+        let nr_converged: usize = results.iter().map(|r| r.nr_converged).sum();
+        let ttt_sum: usize = results.iter().map(|r| r.ttt_sum).sum();
+        let ttt_max = results.iter().map(|r| r.ttt_max).max().unwrap_or(0);
+        let unconverged = results.iter().filter(|r| r.unconverged).count();
+        let llc_excess = results.iter().map(|r| r.llc_excess()).sum::<f64>();
+
+        println!(
+            "\n{:?}: churn={} ({:.2}/intv) llc_excess={:.2} ttt avg/max={:.2}/{:.2}s unconverged={}",
+            algo,
+            churn,
+            churn as f64 / trace.len() as f64,
+            llc_excess,
+            match nr_converged {
+                0 => 0.0,
+                n => ttt_sum as f64 / n as f64 * intv,
+            },
+            ttt_max as f64 * intv,
+            unconverged,
+        );
+
+        for (spec, res) in specs.iter().zip(results.iter()) {
+            println!(
+                "  {:<width$}: churn={:6} llc_excess={:5.2} ttt avg/max={:.2}/{:.2}s{}",
+                spec.name,
+                res.churn,
+                res.llc_excess(),
+                res.ttt_avg() * intv,
+                res.ttt_max as f64 * intv,
+                if res.unconverged { " unconverged" } else { "" },
+                width = name_width,
+            );
+        }
+    }
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_trace() {
+        let input = "# a b\n\n2.5 0.3\n  # comment\n2.7 0.4\n";
+        let trace = parse_trace(input.as_bytes(), "test", 2).unwrap();
+        assert_eq!(trace, vec![vec![2.5, 0.3], vec![2.7, 0.4]]);
+
+        let err = parse_trace("1.0 2.0\n1.0\n".as_bytes(), "test", 2).unwrap_err();
+        assert!(err.to_string().starts_with("test:2:"));
+        assert!(parse_trace("1.0 x\n".as_bytes(), "test", 2).is_err());
+    }
+
+    #[test]
+    fn test_read_trace() {
+        let path = std::env::temp_dir().join(format!("alloc_sim_trace.{}", std::process::id()));
+        std::fs::write(&path, "1.0 2.0 3.0\n").unwrap();
+        let trace = read_trace(path.to_str().unwrap(), 3);
+        std::fs::remove_file(&path).unwrap();
+        assert_eq!(trace.unwrap(), vec![vec![1.0, 2.0, 3.0]]);
+
+        assert!(read_trace("/nonexistent/alloc_sim_trace", 3).is_err());
+    }
+
+    #[test]
+    fn test_synthetic_trace() {
+        assert_eq!(parse_synthetic_spec("synthetic:100").unwrap(), (100, 0));
+        assert_eq!(parse_synthetic_spec("synthetic:10:7").unwrap(), (10, 7));
+        assert!(parse_synthetic_spec("synthetic:").is_err());
+        assert!(parse_synthetic_spec("synthetic:1:2:3").is_err());
+
+        let trace = synthetic_trace(50, 7, 3, 16);
+        assert_eq!(trace.len(), 50);
+        for utils in trace.iter() {
+            assert_eq!(utils.len(), 3);
+            assert!(utils.iter().all(|&u| (0.0..=16.0).contains(&u)));
+        }
+        assert_eq!(trace, synthetic_trace(50, 7, 3, 16));
+        assert_ne!(trace, synthetic_trace(50, 8, 3, 16));
+    }
+
+    #[test]
+    fn test_llc_excess() {
+        // 2 LLCs of CPUs 0-1 and 2-3. Skip if the host's NR_CPU_IDS is
+        // smaller than that.
+        let topo = match Topology::synthetic(1, 2, 2, 1) {
+            Ok(topo) => topo,
+            Err(_) => return,
+        };
+        let mask = |cpus: &[usize]| {
+            let mut mask = Cpumask::new();
+            for &cpu in cpus {
+                mask.set_cpu(cpu).unwrap();
+            }
+            mask
+        };
+
+        assert_eq!(llc_excess(&topo, &mask(&[]), 2), 0);
+        assert_eq!(llc_excess(&topo, &mask(&[0, 1]), 2), 0);
+        assert_eq!(llc_excess(&topo, &mask(&[0, 2]), 2), 1);
+        assert_eq!(llc_excess(&topo, &mask(&[0, 1, 2]), 2), 0);
+        assert_eq!(llc_excess(&topo, &mask(&[0, 1, 2, 3]), 2), 0);
+    }
+}
@@ -22,19 +22,27 @@ typedef long long s64;
 typedef unsigned long long u64;
 #endif
 
+#ifdef LSP
+#define __bpf__
+#include "../../../../include/scx/hist.bpf.h"
+#else
+#include <scx/hist.bpf.h>
+#endif
+
 enum consts {
 	CACHELINE_SIZE		= 64,
 	MAX_CPUS_SHIFT		= 9,
 	MAX_CPUS		= 1 << MAX_CPUS_SHIFT,
 	MAX_CPUS_U8		= MAX_CPUS / 8,
-	MAX_TASKS		= 131072,
+	MAX_MATCH_CACHE_ENTRIES	= 16384,
 	MAX_PATH		= 4096,
 	MAX_NUMA_NODES		= 64,
 	MAX_LLCS		= 64,
+	MAX_LLC_CPUS		= 64,
 	MAX_COMM		= 16,
 	MAX_LAYER_MATCH_ORS	= 32,
 	MAX_LAYER_NAME		= 64,
-	MAX_LAYERS		= 16,
+	MAX_LAYERS		= 64,
 	MAX_LAYER_WEIGHT	= 10000,
 	MIN_LAYER_WEIGHT	= 1,
 	DEFAULT_LAYER_WEIGHT	= 100,
@@ -50,8 +58,8 @@ enum consts {
 	DSQ_ID_LLC_MASK		= (1LLU << DSQ_ID_LAYER_SHIFT) - 1,		/* 0x0000ffff */
 	DSQ_ID_LAYER_MASK	= ~DSQ_ID_LAYER_SHIFT & ~DSQ_ID_SPECIAL_MASK,	/* 0x3fff0000 */
 
-	/* XXX remove */
-	MAX_CGRP_PREFIXES	= 32,
+	MAX_CGRP_PREFIXES	= 64,
+	MAX_CGRP_NAME		= 256,
 
 	NSEC_PER_USEC		= 1000ULL,
 	NSEC_PER_MSEC		= (1000ULL * NSEC_PER_USEC),
@@ -70,8 +78,12 @@ static inline void ___consts_sanity_check___(void) {
 	/* layer->llcs_to_drain uses u64 as LLC bitmap */
 	_Static_assert(MAX_LLCS <= 64, "MAX_LLCS too high");
 	_Static_assert(MAX_LLCS <= (1 << DSQ_ID_LAYER_SHIFT), "MAX_LLCS too high");
+	/* llc_ctx idle summaries use u64 as per-LLC CPU bitmap */
+	_Static_assert(MAX_LLC_CPUS <= 64, "MAX_LLC_CPUS too high");
 	_Static_assert(MAX_LAYERS <= (DSQ_ID_LAYER_MASK >> DSQ_ID_LAYER_SHIFT) + 1,
 		       "MAX_LAYERS too high");
+	/* cgrp_prefix_ctx uses u64 as cgroup prefix bitmap */
+	_Static_assert(MAX_CGRP_PREFIXES <= 64, "MAX_CGRP_PREFIXES too high");
 }
 
 enum layer_kind {
@@ -100,6 +112,9 @@ enum global_stat_id {
 	GSTAT_LO_FB_EVENTS,
 	GSTAT_LO_FB_USAGE,
 	GSTAT_FB_CPU_USAGE,
+	GSTAT_MATCH_CACHE_HIT,
+	GSTAT_MATCH_CACHE_MISS,
+	GSTAT_GROUP_REFRESH,
 	NR_GSTATS,
 };
 
@@ -134,6 +149,8 @@ enum layer_stat_id {
 	LSTAT_XLAYER_REWAKE,
 	LSTAT_LLC_DRAIN_TRY,
 	LSTAT_LLC_DRAIN,
+	LSTAT_IDLE_PICK,
+	LSTAT_IDLE_PICK_STEPS,
 	NR_LSTATS,
 };
 
@@ -169,9 +186,7 @@ struct cpu_ctx {
 	bool			running_fallback;
 	u64			running_at;
 
-	u64			layer_usages[MAX_LAYERS][NR_LAYER_USAGES];
 	u64			gstats[NR_GSTATS];
-	u64			lstats[MAX_LAYERS][NR_LSTATS];
 	u64			ran_current_for;
 
 	u64			usage;
@@ -183,6 +198,7 @@ struct cpu_ctx {
 	u32			layer_id;
 	u32			task_layer_id;
 	u32			llc_id;
+	u32			llc_idx;	/* index in llc_ctx->cpus[] */
 	u32			node_id;
 	u32			perf;
 
@@ -201,6 +217,16 @@ struct cpu_ctx {
 	struct cpu_prox_map	prox_map;
 };
 
+/*
+ * Per-CPU per-layer counters. These live in the layer_cpu_ctxs percpu array
+ * which is sized to the number of configured layers at load time instead of
+ * being embedded in cpu_ctx for MAX_LAYERS.
+ */
+struct layer_cpu_ctx {
+	u64			usages[NR_LAYER_USAGES];
+	u64			lstats[NR_LSTATS];
+};
+
 struct llc_prox_map {
 	u16			llcs[MAX_LLCS];
 	u32			node_end;
@@ -215,7 +241,32 @@ struct llc_ctx {
 	u64			queued_runtime[MAX_LAYERS];
 	u64			lo_fb_seq;
 	u64			lstats[MAX_LAYERS][NR_LLC_LSTATS];
+
+	/*
+	 * Oldest runnable_at, in jiffies, of the tasks queued on each DSQ
+	 * since the DSQ was last seen empty, 0 if not known. Lets
+	 * antistall_scan() skip DSQs which can't be stalled.
+	 */
+	u64			layer_dsq_since[MAX_LAYERS];
+	u64			hi_fb_dsq_since;
+	u64			lo_fb_dsq_since;
+	/* the most delayed DSQ for the CPUs of this LLC to consume */
+	u64			antistall_dsq;
 	struct llc_prox_map	prox_map;
+
+	/*
+	 * Idle summaries indexed by cpu_ctx->llc_idx so that finding an idle
+	 * CPU of a layer in this LLC is a single word scan. idle_cpus follows
+	 * layered_update_idle(), idle_cores has the CPUs whose SMT siblings
+	 * are also idle and layer_cpus[] the CPUs owned by each layer as of
+	 * the last refresh_cpumasks(). These are hints, CPUs are still claimed
+	 * with scx_bpf_test_and_clear_cpu_idle(). Not maintained if nr_cpus >
+	 * MAX_LLC_CPUS.
+	 */
+	u64			idle_cpus;
+	u64			idle_cores;
+	u64			layer_cpus[MAX_LAYERS];
+	s32			cpus[MAX_LLC_CPUS];
 };
 
 struct node_ctx {
@@ -248,7 +299,7 @@ enum layer_match_kind {
 
 struct layer_match {
 	int		kind;
-	char		cgroup_prefix[MAX_PATH];
+	u32		cgroup_prefix_id;
 	char		comm_prefix[MAX_COMM];
 	char		pcomm_prefix[MAX_COMM];
 	int		nice;
@@ -297,11 +348,15 @@ struct layer {
 	bool			preempt_first;
 	bool			exclusive;
 	bool			allow_node_aligned;
+	bool			track_wait;	/* record into layer_llc_wait_hists */
 	int			growth_algo;
 
 	u64			nr_tasks;
 
 	u64			cpus_seq;
+	/* bumped when the layer's CPUs in the LLC or node change */
+	u64			llc_cpus_seq[MAX_LLCS];
+	u64			node_cpus_seq[MAX_NUMA_NODES];
 	u64			node_mask;
 	u64			llc_mask;
 	bool			check_no_idle;
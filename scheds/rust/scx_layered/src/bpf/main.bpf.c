@@ -6,9 +6,11 @@
 #define LSP_INC
 #include "../../../../include/scx/common.bpf.h"
 #include "../../../../include/scx/namespace_impl.bpf.h"
+#include "../../../../include/scx/hist_impl.bpf.h"
 #else
 #include <scx/common.bpf.h>
 #include <scx/namespace_impl.bpf.h>
+#include <scx/hist_impl.bpf.h>
 #endif
 
 #include <errno.h>
@@ -43,6 +45,10 @@ const volatile s32 __sibling_cpu[MAX_CPUS];
 const volatile bool monitor_disable = false;
 const volatile unsigned char all_cpus[MAX_CPUS_U8];
 const volatile u32 layer_iteration_order[MAX_LAYERS];
+const volatile u32 nr_match_cached_layers;
+const volatile u32 nr_cgrp_prefixes;
+const volatile u64 cgrp_prefix_empty_mask;	/* "" */
+const volatile u64 cgrp_prefix_root_mask;	/* prefixes of "/" */
 const volatile u32 nr_op_layers;	/* open && preempt */
 const volatile u32 nr_on_layers;	/* open && !preempt */
 const volatile u32 nr_gp_layers;	/* grouped && preempt */
@@ -56,11 +62,14 @@ const volatile u32 lo_fb_share_ppk = 128;	/* !0 for veristat */
 const volatile bool enable_antistall = true;
 /* Delay permitted, in seconds, before antistall activates */
 const volatile u64 antistall_sec = 3;
+/* Use the per-LLC idle summaries in llc_ctx to find idle CPUs */
+const volatile bool enable_llc_idle_summary = true;
 const u32 zero_u32 = 0;
 
 private(all_cpumask) struct bpf_cpumask __kptr *all_cpumask;
 private(big_cpumask) struct bpf_cpumask __kptr *big_cpumask;
 struct layer layers[MAX_LAYERS];
+char cgrp_prefixes[MAX_CGRP_PREFIXES][MAX_PATH];
 u32 fallback_cpu;
 u32 layered_root_tgid = 0;
 
@@ -229,11 +238,68 @@ static void gstat_inc(u32 id, struct cpu_ctx *cpuc)
 	gstat_add(id, cpuc, 1);
 }
 
+/* resized to nr_layers by userspace */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct layer_cpu_ctx);
+	__uint(max_entries, MAX_LAYERS);
+} layer_cpu_ctxs SEC(".maps");
+
+static struct layer_cpu_ctx *lookup_layer_cpu_ctx(u32 layer_id, int cpu)
+{
+	struct layer_cpu_ctx *lcpuc;
+
+	if (cpu < 0)
+		lcpuc = bpf_map_lookup_elem(&layer_cpu_ctxs, &layer_id);
+	else
+		lcpuc = bpf_map_lookup_percpu_elem(&layer_cpu_ctxs, &layer_id, cpu);
+
+	if (!lcpuc) {
+		scx_bpf_error("no layer_cpu_ctx for layer %u cpu %d", layer_id, cpu);
+		return NULL;
+	}
+
+	return lcpuc;
+}
+
+/*
+ * Runnable -> running delays of each layer's tasks in ns, indexed by
+ * layer_id * nr_llcs + llc_id and resized by userspace. An instance is shared
+ * by the CPUs of an LLC instead of living in layer_cpu_ctx so that the
+ * footprint doesn't scale with the number of CPUs. The atomic updates stay
+ * within the LLC and are only made for layers with layer->track_wait, i.e. a
+ * wait SLO, so that other layers don't pay for them on every context switch.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct scx_hist);
+	__uint(max_entries, MAX_LAYERS * MAX_LLCS);
+} layer_llc_wait_hists SEC(".maps");
+
+static void record_layer_wait(u32 layer_id, u32 llc_id, u64 wait)
+{
+	u32 key = layer_id * nr_llcs + llc_id;
+	struct scx_hist *hist;
+
+	if (!(hist = bpf_map_lookup_elem(&layer_llc_wait_hists, &key))) {
+		scx_bpf_error("no wait hist for layer %u llc %u", layer_id, llc_id);
+		return;
+	}
+
+	scx_hist_record_atomic(hist, wait);
+}
+
 static void lstat_add(u32 id, struct layer *layer, struct cpu_ctx *cpuc, s64 delta)
 {
+	struct layer_cpu_ctx *lcpuc;
 	u64 *vptr;
 
-	if ((vptr = MEMBER_VPTR(*cpuc, .lstats[layer->id][id])))
+	if (!(lcpuc = lookup_layer_cpu_ctx(layer->id, cpuc->cpu)))
+		return;
+
+	if ((vptr = MEMBER_VPTR(*lcpuc, .lstats[id])))
 		(*vptr) += delta;
 	else
 		scx_bpf_error("invalid layer or stat ids: %d, %d", id, layer->id);
@@ -279,7 +345,9 @@ static void layer_llc_drain_disable(struct layer *layer, u32 llc_id)
 }
 
 /*
- * Returns if any cpus were added to the layer.
+ * Apply the layer's new CPUs set by userspace. Only the LLCs and nodes whose
+ * CPUs actually changed get their layer->llc/node_cpus_seq[] bumped so that
+ * tasks elsewhere can keep their cached per-LLC and per-node cpumasks.
  */
 static void refresh_cpumasks(u32 layer_id)
 {
@@ -287,7 +355,9 @@ static void refresh_cpumasks(u32 layer_id)
 	struct layer_cpumask_wrapper *cpumaskw;
 	struct layer *layer;
 	struct cpu_ctx *cpuc;
-	int cpu, llc_id;
+	struct llc_ctx *llcc;
+	u64 llcs_changed = 0, nodes_changed = 0, *seqp, *llc_cpusp;
+	int cpu, llc_id, node_id;
 
 	layer = MEMBER_VPTR(layers, [layer_id]);
 	if (!layer) {
@@ -315,7 +385,25 @@ static void refresh_cpumasks(u32 layer_id)
 		}
 
 		if ((u8_ptr = MEMBER_VPTR(layers, [layer_id].cpus[cpu / 8]))) {
-			if (*u8_ptr & (1 << (cpu % 8))) {
+			bool in_layer = *u8_ptr & (1 << (cpu % 8));
+
+			if (in_layer != bpf_cpumask_test_cpu(cpu, cast_mask(layer_cpumask))) {
+				llcs_changed |= 1LLU << (cpuc->llc_id & (MAX_LLCS - 1));
+				nodes_changed |= 1LLU << (cpuc->node_id & (MAX_NUMA_NODES - 1));
+
+				/* only this function writes the layer's word */
+				if ((llcc = lookup_llc_ctx(cpuc->llc_id)) &&
+				    (llc_cpusp = MEMBER_VPTR(llcc->layer_cpus, [layer_id]))) {
+					u64 bit = 1LLU << (cpuc->llc_idx & (MAX_LLC_CPUS - 1));
+
+					if (in_layer)
+						WRITE_ONCE(*llc_cpusp, *llc_cpusp | bit);
+					else
+						WRITE_ONCE(*llc_cpusp, *llc_cpusp & ~bit);
+				}
+			}
+
+			if (in_layer) {
 				/* a CPU can be shared by multiple open layers */
 				if (layer->kind == LAYER_KIND_OPEN) {
 					cpuc->in_open_layers = true;
@@ -340,7 +428,26 @@ static void refresh_cpumasks(u32 layer_id)
 	bpf_rcu_read_unlock();
 
 	__sync_fetch_and_add(&layer->cpus_seq, 1);	/* MB, see below */
-	trace("LAYER[%d] now has %d cpus, seq=%llu", layer_id, layer->nr_cpus, layer->cpus_seq);
+	trace("LAYER[%d] now has %d cpus, seq=%llu llcs_changed=0x%llx",
+	      layer_id, layer->nr_cpus, layer->cpus_seq, llcs_changed);
+
+	/*
+	 * The llc/node seqs must be bumped after layer->cpus_seq. Readers
+	 * snapshot them before layer->cpus_seq, see pick_idle_cpu().
+	 */
+	bpf_for(llc_id, 0, nr_llcs) {
+		if (!(llcs_changed & (1LLU << llc_id)))
+			continue;
+		if ((seqp = MEMBER_VPTR(*layer, .llc_cpus_seq[llc_id])))
+			__sync_fetch_and_add(seqp, 1);
+	}
+
+	bpf_for(node_id, 0, nr_nodes) {
+		if (!(nodes_changed & (1LLU << node_id)))
+			continue;
+		if ((seqp = MEMBER_VPTR(*layer, .node_cpus_seq[node_id])))
+			__sync_fetch_and_add(seqp, 1);
+	}
 
 	/*
 	 * layer->nr_llc_cpus[] were updated by the userspace and we've passed a
@@ -389,6 +496,9 @@ struct task_ctx {
 	u32			layer_id;
 	pid_t			last_waker;
 	bool			refresh_layer;
+	u64			group_gen;	/* leader only, see tp_cgroup_attach_task */
+	u64			group_gen_seen;
+	u64			group_refresh_seq;
 	struct cached_cpus	layered_cpus;
 	/*
 	 * XXX: Old kernels can't track a bpf_cpumask on nested structs
@@ -401,6 +511,7 @@ struct task_ctx {
 	bool			all_cpus_allowed;
 	bool			cpus_node_aligned;
 	u64			runnable_at;
+	u64			queued_at;	/* for layer_llc_wait_hists */
 	u64			running_at;
 	u64			runtime_avg;
 	u64			dsq_id;
@@ -435,21 +546,26 @@ static struct task_ctx *lookup_task_ctx(struct task_struct *p)
 	return taskc;
 }
 
+/*
+ * Bumped after any thread group is moved between cgroups. Lets threads skip
+ * looking up their leader's group_gen while nothing moved.
+ */
+u64 group_refresh_seq;
+
 /*
  * Because the layer membership is by the default hierarchy cgroups rather than
- * the CPU controller membership, we can't use ops.cgroup_move(). Let's iterate
- * the tasks manually and set refresh_layer.
+ * the CPU controller membership, we can't use ops.cgroup_move(). Let's set
+ * refresh_layer on the leader and, for thread group moves, bump the leader's
+ * group_gen instead of iterating all the threads. Each thread notices the
+ * change lazily in task_group_refresh_pending(), which keeps the tracepoint
+ * O(1) regardless of the number of threads.
  *
- * The iteration isn't synchronized and may fail spuriously. It's not a big
- * practical problem as process migrations are very rare in most modern systems.
  * That said, we eventually want this to be based on CPU controller membership.
  */
 SEC("tp_btf/cgroup_attach_task")
 int BPF_PROG(tp_cgroup_attach_task, struct cgroup *cgrp, const char *cgrp_path,
 	     struct task_struct *leader, bool threadgroup)
 {
-	struct list_head *thread_head;
-	struct task_struct *next;
 	struct task_ctx *taskc;
 
 	if (!(taskc = lookup_task_ctx_may_fail(leader)))
@@ -459,39 +575,41 @@ int BPF_PROG(tp_cgroup_attach_task, struct cgroup *cgrp, const char *cgrp_path,
 	if (!threadgroup)
 		return 0;
 
-	thread_head = &leader->signal->thread_head;
-
-	if (!(next = bpf_task_acquire(leader))) {
-		scx_bpf_error("failed to acquire leader");
-		return 0;
-	}
-
-	bpf_repeat(MAX_TASKS) {
-		struct task_struct *p;
-		int pid;
+	/*
+	 * group_gen must be updated before group_refresh_seq so that threads
+	 * which see the new seq also see the new group_gen.
+	 */
+	__sync_fetch_and_add(&taskc->group_gen, 1);
+	__sync_fetch_and_add(&group_refresh_seq, 1);
+	return 0;
+}
 
-		p = container_of(next->thread_node.next, struct task_struct, thread_node);
-		bpf_task_release(next);
+/*
+ * Returns whether @p's thread group has been moved to another cgroup since
+ * @p's layer was last refreshed.
+ */
+static bool task_group_refresh_pending(struct task_struct *p, struct task_ctx *taskc)
+{
+	/* pairs with the fully ordered bumps in tp_cgroup_attach_task() */
+	u64 seq = smp_load_acquire(&group_refresh_seq);
+	struct task_ctx *leader_taskc;
+	bool pending = false;
+	u64 gen;
 
-		if (&p->thread_node == thread_head) {
-			next = NULL;
-			break;
-		}
+	if (seq == taskc->group_refresh_seq)
+		return false;
+	taskc->group_refresh_seq = seq;
 
-		pid = BPF_CORE_READ(p, pid);
-		next = bpf_task_from_pid(pid);
-		if (!next) {
-			bpf_printk("scx_layered: tp_cgroup_attach_task: thread iteration failed");
-			break;
-		}
+	if (!(leader_taskc = bpf_task_storage_get(&task_ctxs, p->group_leader, 0, 0)))
+		return false;
 
-		if ((taskc = lookup_task_ctx(next)))
-			taskc->refresh_layer = true;
+	gen = READ_ONCE(leader_taskc->group_gen);
+	if (gen != taskc->group_gen_seen) {
+		taskc->group_gen_seen = gen;
+		pending = true;
 	}
 
-	if (next)
-		bpf_task_release(next);
-	return 0;
+	return pending;
 }
 
 static int handle_cmd(struct task_ctx *taskc, struct scx_cmd *cmd)
@@ -585,9 +703,9 @@ void refresh_cached_cpus(struct bpf_cpumask *mask,
 	}
 
 	/*
-	 * XXX - We're assuming that the updated @layer_cpumask matching the new
-	 * @layer_seq is visible which may not be true. For now, leave it as-is.
-	 * Let's update once BPF grows enough memory ordering constructs.
+	 * The seqs are read with smp_load_acquire() and bumped with fully
+	 * ordered atomics after the cpumask updates, so @cpus_a/b are at least
+	 * as new as @cpus_seq.
 	 */
 	bpf_cpumask_and(mask, cpus_a, cpus_b);
 	ccpus->id = id;
@@ -606,8 +724,40 @@ static void maybe_refresh_layered_cpus(struct task_struct *p, struct task_ctx *t
 	}
 }
 
+/*
+ * The per-LLC and per-node caches are derived from ->layered_mask but track
+ * layer->llc/node_cpus_seq[] instead of layer->cpus_seq, so that they're
+ * only rebuilt when the layer's CPUs in the task's LLC or node change.
+ *
+ * @cpus_seq must have been read with layer_llc/node_cpus_seq() before the
+ * layer->cpus_seq that ->layered_mask was refreshed against. As
+ * refresh_cpumasks() bumps the llc/node seqs after layer->cpus_seq, this
+ * guarantees that ->layered_mask already reflects the layer cpumask
+ * @cpus_seq is recorded for.
+ */
+static u64 layer_llc_cpus_seq(struct layer *layer, s32 llc_id)
+{
+	u64 *seqp;
+
+	if (!(seqp = MEMBER_VPTR(*layer, .llc_cpus_seq[llc_id]))) {
+		scx_bpf_error("invalid llc_id %d", llc_id);
+		return 0;
+	}
+	return smp_load_acquire(seqp);
+}
+
+static u64 layer_node_cpus_seq(struct layer *layer, s32 node_id)
+{
+	u64 *seqp;
+
+	if (!(seqp = MEMBER_VPTR(*layer, .node_cpus_seq[node_id]))) {
+		scx_bpf_error("invalid node_id %d", node_id);
+		return 0;
+	}
+	return smp_load_acquire(seqp);
+}
+
 static void maybe_refresh_layered_cpus_llc(struct task_struct *p, struct task_ctx *taskc,
-					   const struct cpumask *layer_cpumask,
 					   s32 llc_id, u64 cpus_seq)
 {
 	if (should_refresh_cached_cpus(&taskc->layered_cpus_llc, llc_id, cpus_seq)) {
@@ -625,7 +775,6 @@ static void maybe_refresh_layered_cpus_llc(struct task_struct *p, struct task_ct
 }
 
 static void maybe_refresh_layered_cpus_node(struct task_struct *p, struct task_ctx *taskc,
-					    const struct cpumask *layer_cpumask,
 					    s32 node_id, u64 cpus_seq)
 {
 	if (should_refresh_cached_cpus(&taskc->layered_cpus_node, node_id, cpus_seq)) {
@@ -642,6 +791,122 @@ static void maybe_refresh_layered_cpus_node(struct task_struct *p, struct task_c
 	}
 }
 
+/* index of the lowest set bit, @v must not be 0 */
+static __always_inline u32 lowest_bit_idx(u64 v)
+{
+	u32 idx = 0;
+
+	if (!(v & 0xffffffffLLU)) {
+		v >>= 32;
+		idx += 32;
+	}
+	if (!(v & 0xffffLLU)) {
+		v >>= 16;
+		idx += 16;
+	}
+	if (!(v & 0xffLLU)) {
+		v >>= 8;
+		idx += 8;
+	}
+	if (!(v & 0xfLLU)) {
+		v >>= 4;
+		idx += 4;
+	}
+	if (!(v & 0x3LLU)) {
+		v >>= 2;
+		idx += 2;
+	}
+	if (!(v & 0x1LLU))
+		idx += 1;
+
+	return idx;
+}
+
+static bool llc_idle_summary_usable(struct llc_ctx *llcc)
+{
+	return enable_llc_idle_summary && llcc->nr_cpus <= MAX_LLC_CPUS;
+}
+
+static void llc_idle_update(struct cpu_ctx *cpuc, bool idle)
+{
+	struct cpu_ctx *sib_cpuc;
+	struct llc_ctx *llcc;
+	u64 bit, core_bits, old;
+	s32 sib;
+
+	if (!(llcc = lookup_llc_ctx(cpuc->llc_id)) || !llc_idle_summary_usable(llcc))
+		return;
+
+	bit = 1LLU << (cpuc->llc_idx & (MAX_LLC_CPUS - 1));
+	core_bits = bit;
+	if (smt_enabled && (sib = sibling_cpu(cpuc->cpu)) >= 0 &&
+	    (sib_cpuc = lookup_cpu_ctx(sib)))
+		core_bits |= 1LLU << (sib_cpuc->llc_idx & (MAX_LLC_CPUS - 1));
+
+	if (idle) {
+		old = __sync_fetch_and_or(&llcc->idle_cpus, bit);
+		if (((old | bit) & core_bits) == core_bits)
+			__sync_fetch_and_or(&llcc->idle_cores, core_bits);
+	} else {
+		__sync_fetch_and_and(&llcc->idle_cpus, ~bit);
+		__sync_fetch_and_and(&llcc->idle_cores, ~core_bits);
+	}
+}
+
+/*
+ * Claim an idle CPU of @layer_id in @llcc using the idle summaries. Like
+ * pick_idle_cpu_from(), @prev_cpu and wholly idle cores are preferred. A stale
+ * bit only costs a failed claim. *@nr_steps is incremented for each claim
+ * attempt.
+ */
+static __always_inline
+s32 pick_idle_cpu_llc(struct llc_ctx *llcc, u32 layer_id, s32 prev_cpu,
+		      u32 *nr_steps)
+{
+	struct cpu_ctx *prev_cpuc;
+	u64 owned, cands, bit, prev_bit = 0, tried = 0;
+	s32 *cpup;
+	int i, j;
+
+	if (layer_id >= MAX_LAYERS ||
+	    !(owned = READ_ONCE(llcc->layer_cpus[layer_id])))
+		return -1;
+
+	if (prev_cpu >= 0 && cpu_to_llc_id(prev_cpu) == llcc->id &&
+	    (prev_cpuc = lookup_cpu_ctx(prev_cpu)))
+		prev_bit = 1LLU << (prev_cpuc->llc_idx & (MAX_LLC_CPUS - 1));
+
+	/* the first pass looks for wholly idle cores, the second any CPU */
+	bpf_for(i, smt_enabled ? 0 : 1, 2) {
+		cands = owned & ~tried &
+			READ_ONCE(i ? llcc->idle_cpus : llcc->idle_cores);
+
+		if (cands & prev_bit) {
+			(*nr_steps)++;
+			if (scx_bpf_test_and_clear_cpu_idle(prev_cpu))
+				return prev_cpu;
+			tried |= prev_bit;
+			cands &= ~prev_bit;
+		}
+
+		bpf_for(j, 0, MAX_LLC_CPUS) {
+			if (!cands)
+				break;
+			bit = cands & -cands;
+			cands &= ~bit;
+			tried |= bit;
+
+			if (!(cpup = MEMBER_VPTR(llcc->cpus, [lowest_bit_idx(bit)])))
+				break;
+			(*nr_steps)++;
+			if (scx_bpf_test_and_clear_cpu_idle(*cpup))
+				return *cpup;
+		}
+	}
+
+	return -1;
+}
+
 static s32 pick_idle_cpu_from(const struct cpumask *cand_cpumask, s32 prev_cpu,
 			      const struct cpumask *idle_smtmask)
 {
@@ -750,8 +1015,8 @@ s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu,
 {
 	const struct cpumask *idle_smtmask, *layer_cpumask, *layered_cpumask, *cpumask;
 	struct cpu_ctx *prev_cpuc;
-	u32 layer_id = layer->id;
-	u64 cpus_seq;
+	u32 layer_id = layer->id, nr_steps = 0;
+	u64 cpus_seq, llc_cpus_seq = 0, node_cpus_seq = 0;
 	s32 cpu;
 
 	if (layer_id >= MAX_LAYERS || !(layer_cpumask = lookup_layer_cpumask(layer_id)))
@@ -765,7 +1030,21 @@ s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu,
 		return prev_cpu;
 	}
 
-	cpus_seq = READ_ONCE(layers->cpus_seq);
+	if ((nr_llcs > 1 || nr_nodes > 1) &&
+	    !(prev_cpuc = lookup_cpu_ctx(prev_cpu)))
+		return -1;
+
+	/*
+	 * The llc/node seqs must be snapshotted before layer->cpus_seq, see
+	 * maybe_refresh_layered_cpus_llc(). Otherwise, a racing
+	 * refresh_cpumasks() can make the per-LLC/node caches record the new
+	 * seqs while being built from a stale ->layered_mask.
+	 */
+	if (nr_llcs > 1)
+		llc_cpus_seq = layer_llc_cpus_seq(layer, prev_cpuc->llc_id);
+	if (nr_nodes > 1)
+		node_cpus_seq = layer_node_cpus_seq(layer, prev_cpuc->node_id);
+	cpus_seq = smp_load_acquire(&layer->cpus_seq);
 
 	/*
 	 * If @p prefers to preempt @prev_cpu than finding an idle CPU and
@@ -801,9 +1080,6 @@ s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu,
 			return -1;
 	}
 
-	if ((nr_llcs > 1 || nr_nodes > 1) &&
-	    !(prev_cpuc = lookup_cpu_ctx(prev_cpu)))
-		return -1;
 	if (!(idle_smtmask = scx_bpf_get_idle_smtmask()))
 		return -1;
 
@@ -821,17 +1097,34 @@ s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu,
 	if (nr_llcs > 1) {
 		struct llc_ctx *prev_llcc;
 
-		maybe_refresh_layered_cpus_llc(p, taskc, layer_cpumask,
-					       prev_cpuc->llc_id, cpus_seq);
-		if (!(cpumask = cast_mask(taskc->layered_llc_mask))) {
+		if (!(prev_llcc = lookup_llc_ctx(prev_cpuc->llc_id))) {
 			cpu = -1;
 			goto out_put;
 		}
-		if ((cpu = pick_idle_cpu_from(cpumask, prev_cpu, idle_smtmask)) >= 0)
-			goto out_put;
 
-		if (!(prev_llcc = lookup_llc_ctx(prev_cpuc->llc_id)) ||
-		    prev_llcc->queued_runtime[layer_id] < layer->xllc_mig_min_ns) {
+		/*
+		 * Without affinity restrictions, the layer's CPUs in the LLC
+		 * are what the summary tracks and a single word scan replaces
+		 * the cpumask intersections. If the summary misses an idle CPU,
+		 * the layer-wide search below still finds it.
+		 */
+		if (taskc->all_cpus_allowed && llc_idle_summary_usable(prev_llcc)) {
+			if ((cpu = pick_idle_cpu_llc(prev_llcc, layer_id, prev_cpu,
+						     &nr_steps)) >= 0)
+				goto out_put;
+		} else {
+			maybe_refresh_layered_cpus_llc(p, taskc, prev_cpuc->llc_id,
+						       llc_cpus_seq);
+			if (!(cpumask = cast_mask(taskc->layered_llc_mask))) {
+				cpu = -1;
+				goto out_put;
+			}
+			nr_steps++;
+			if ((cpu = pick_idle_cpu_from(cpumask, prev_cpu, idle_smtmask)) >= 0)
+				goto out_put;
+		}
+
+		if (prev_llcc->queued_runtime[layer_id] < layer->xllc_mig_min_ns) {
 			lstat_inc(LSTAT_XLLC_MIGRATION_SKIP, layer, cpuc);
 			cpu = -1;
 			goto out_put;
@@ -842,31 +1135,37 @@ s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu,
 	 * Next try a CPU in the current node
 	 */
 	if (nr_nodes > 1) {
-		maybe_refresh_layered_cpus_node(p, taskc, layer_cpumask,
-						prev_cpuc->node_id, cpus_seq);
+		maybe_refresh_layered_cpus_node(p, taskc, prev_cpuc->node_id, node_cpus_seq);
 		if (!(cpumask = cast_mask(taskc->layered_node_mask))) {
 			cpu = -1;
 			goto out_put;
 		}
+		nr_steps++;
 		if ((cpu = pick_idle_cpu_from(cpumask, prev_cpu, idle_smtmask)) >= 0)
 			goto out_put;
 	}
 
+	nr_steps++;
 	if ((cpu = pick_idle_cpu_from(layered_cpumask, prev_cpu, idle_smtmask)) >= 0)
 		goto out_put;
 
 	/*
 	 * If the layer is an open one, we can try the whole machine.
 	 */
-	if (layer->kind != LAYER_KIND_CONFINED &&
-	    (cpu = pick_idle_cpu_from(p->cpus_ptr, prev_cpu, idle_smtmask)) >= 0) {
-		lstat_inc(LSTAT_OPEN_IDLE, layer, cpuc);
-		goto out_put;
+	if (layer->kind != LAYER_KIND_CONFINED) {
+		nr_steps++;
+		if ((cpu = pick_idle_cpu_from(p->cpus_ptr, prev_cpu, idle_smtmask)) >= 0) {
+			lstat_inc(LSTAT_OPEN_IDLE, layer, cpuc);
+			goto out_put;
+		}
 	}
 
 	cpu = -1;
 
 out_put:
+	lstat_inc(LSTAT_IDLE_PICK, layer, cpuc);
+	lstat_add(LSTAT_IDLE_PICK_STEPS, layer, cpuc, nr_steps);
+
 	/*
 	 * Update check_no_idle. Cleared if any idle CPU is found. Set if no
 	 * idle CPU is found for a task without affinity restriction. Use
@@ -1104,10 +1403,30 @@ static void task_uncharge_qrt(struct task_ctx *taskc)
 	taskc->qrt_llc_id = MAX_LLCS;
 }
 
-static void layer_kick_idle_cpu(struct layer *layer)
+static void layer_kick_idle_cpu(struct layer *layer, struct cpu_ctx *cpuc)
 {
-	const struct cpumask *layer_cpumask, *idle_smtmask;;
+	const struct cpumask *layer_cpumask, *idle_smtmask;
+	struct llc_ctx *llcc;
+	u32 nr_steps = 0;
+	bool summarized = true;
 	s32 cpu;
+	int i;
+
+	/* walk the idle summaries starting from the local LLC */
+	bpf_for(i, 0, nr_llcs) {
+		if (!(llcc = lookup_llc_ctx((cpuc->llc_id + i) % nr_llcs)))
+			return;
+		if (!llc_idle_summary_usable(llcc)) {
+			summarized = false;
+			break;
+		}
+		if ((cpu = pick_idle_cpu_llc(llcc, layer->id, -1, &nr_steps)) >= 0) {
+			scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+			return;
+		}
+	}
+	if (summarized)
+		return;
 
 	if (!(layer_cpumask = lookup_layer_cpumask(layer->id)) ||
 	    !(idle_smtmask = scx_bpf_get_idle_smtmask()))
@@ -1119,6 +1438,25 @@ static void layer_kick_idle_cpu(struct layer *layer)
 	scx_bpf_put_idle_cpumask(idle_smtmask);
 }
 
+/*
+ * Lower *@sincep to @p's runnable_at. Only lowering it matters for
+ * correctness, so give up after a few failed attempts. The DSQ is then
+ * still covered once the winning timestamp gets old enough.
+ */
+static void dsq_since_update(u64 *sincep, struct task_struct *p)
+{
+	u64 since, runnable_at = READ_ONCE(p->scx.runnable_at) ?: 1;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		since = READ_ONCE(*sincep);
+		if (since && !time_before(runnable_at, since))
+			return;
+		if (__sync_val_compare_and_swap(sincep, since, runnable_at) == since)
+			return;
+	}
+}
+
 void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 {
 	struct cpu_ctx *cpuc, *task_cpuc;
@@ -1162,6 +1500,13 @@ void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 			lstat_inc(LSTAT_ENQ_EXPIRE, layer, cpuc);
 	}
 
+	/*
+	 * Wakeups are stamped in runnable. Also cover slice expirations and
+	 * preemptions which re-enqueue without going through runnable.
+	 */
+	if (!taskc->queued_at)
+		taskc->queued_at = scx_bpf_now();
+
 	/*
 	 * Limit the amount of budget that an idling task can accumulate
 	 * to one slice.
@@ -1186,6 +1531,7 @@ void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 			lstat_inc(LSTAT_AFFN_VIOL, layer, cpuc);
 
 		taskc->dsq_id = task_cpuc->hi_fb_dsq_id;
+		dsq_since_update(&llcc->hi_fb_dsq_since, p);
 		scx_bpf_dsq_insert(p, taskc->dsq_id, layer->slice_ns, enq_flags);
 		goto preempt;
 	}
@@ -1215,6 +1561,7 @@ void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 		 */
 		if (!scx_bpf_dsq_nr_queued(taskc->dsq_id))
 			llcc->lo_fb_seq++;
+		dsq_since_update(&llcc->lo_fb_dsq_since, p);
 		scx_bpf_dsq_insert(p, taskc->dsq_id, layer->slice_ns, enq_flags);
 		goto preempt;
 	}
@@ -1247,6 +1594,7 @@ void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 	lstats[LLC_LSTAT_CNT]++;
 
 	taskc->dsq_id = layer_dsq_id(layer_id, llc_id);
+	dsq_since_update(&llcc->layer_dsq_since[layer_id], p);
 	if (layer->fifo)
 		scx_bpf_dsq_insert(p, taskc->dsq_id, layer->slice_ns, enq_flags);
 	else
@@ -1263,7 +1611,7 @@ void BPF_STRUCT_OPS(layered_enqueue, struct task_struct *p, u64 enq_flags)
 	 */
 	if (!layer->nr_llc_cpus[llc_id]) {
 		layer_llc_drain_enable(layer, llc_id);
-		layer_kick_idle_cpu(layer);
+		layer_kick_idle_cpu(layer, cpuc);
 	}
 
 preempt:
@@ -1369,6 +1717,21 @@ struct {
 	__uint(max_entries, 1);
 } antistall_cpu_max_delay SEC(".maps");
 
+/**
+ * jiffies_delay_sec() - get the delay since a point in time in seconds.
+ * @at: start of the delay, in jiffies.
+ * @jiffies_now: time from which to measure delay, in jiffies.
+ *
+ * Return: delay, if any exists, in seconds.
+ */
+static u64 jiffies_delay_sec(u64 at, u64 jiffies_now)
+{
+	if (time_before(at, jiffies_now))
+		return (jiffies_now - at) / CONFIG_HZ;
+	else
+		return 0;
+}
+
 /**
  * get_delay_sec() - get runnable_at delay of a task_struct in seconds.
  * @p: task_struct *p
@@ -1378,16 +1741,43 @@ struct {
  */
 int get_delay_sec(struct task_struct *p, u64 jiffies_now)
 {
-	u64 runnable_at, delta_secs;
-	runnable_at = READ_ONCE(p->scx.runnable_at);
+	return jiffies_delay_sec(READ_ONCE(p->scx.runnable_at), jiffies_now);
+}
 
-	if (time_before(runnable_at, jiffies_now)) {
-		delta_secs = (jiffies_now - runnable_at) / CONFIG_HZ;
-	} else {
-		delta_secs = 0;
+/*
+ * Consume the delayed DSQ in *@dsq_idp and clear it once the DSQ can't be
+ * consumed or its head is no longer delayed.
+ */
+static bool antistall_consume_dsq(u64 *dsq_idp, struct cpu_ctx *cpuc)
+{
+	u64 dsq_id = READ_ONCE(*dsq_idp), jiffies_now, cur_delay = 0;
+	struct task_struct *p;
+	bool consumed;
+
+	if (dsq_id == SCX_DSQ_INVALID)
+		return false;
+
+	consumed = scx_bpf_dsq_move_to_local(dsq_id);
+
+	if (!consumed)
+		goto reset;
+
+	jiffies_now = bpf_jiffies64();
+
+	bpf_for_each(scx_dsq, p, dsq_id, 0) {
+		cur_delay = get_delay_sec(p, jiffies_now);
+
+		if (cur_delay > antistall_sec)
+			return consumed;
+
+		goto reset;
 	}
 
-	return delta_secs;
+reset:
+	trace("antistall reset DSQ[%llu] SELECTED_CPU[%llu] DELAY[%llu]",
+	      dsq_id, cpuc->cpu, cur_delay);
+	WRITE_ONCE(*dsq_idp, SCX_DSQ_INVALID);
+	return consumed;
 }
 
 /**
@@ -1402,16 +1792,15 @@ int get_delay_sec(struct task_struct *p, u64 jiffies_now)
  * stalling when all CPUs which can process them are continually consuming
  * other DSQs.
  *
+ * The DSQ assigned to this CPU specifically is tried first, then the most
+ * delayed DSQ of the CPU's LLC.
+ *
  * Return: bool indicating if a DSQ was consumed or not.
  */
 bool antistall_consume(struct cpu_ctx *cpuc)
 {
-	u64 *antistall_dsq, jiffies_now, cur_delay;
-	bool consumed;
-	struct task_struct *p;
-
-	cur_delay = 0;
-	consumed = false;
+	struct llc_ctx *llcc;
+	u64 *antistall_dsq;
 
 	if (!enable_antistall || !cpuc)
 		return false;
@@ -1423,30 +1812,13 @@ bool antistall_consume(struct cpu_ctx *cpuc)
 		return false;
 	}
 
-	if (*antistall_dsq == SCX_DSQ_INVALID)
-		return false;
-
-	consumed = scx_bpf_dsq_move_to_local(*antistall_dsq);
-
-	if (!consumed)
-		goto reset;
-
-	jiffies_now = bpf_jiffies64();
-
-	bpf_for_each(scx_dsq, p, *antistall_dsq, 0) {
-		cur_delay = get_delay_sec(p, jiffies_now);
-
-		if (cur_delay > antistall_sec)
-			return consumed;
+	if (antistall_consume_dsq(antistall_dsq, cpuc))
+		return true;
 
-		goto reset;
-	}
+	if (!(llcc = lookup_llc_ctx(cpuc->llc_id)))
+		return false;
 
-reset:
-	trace("antistall reset DSQ[%llu] SELECTED_CPU[%llu] DELAY[%llu]",
-	      *antistall_dsq, cpuc->cpu, cur_delay);
-	*antistall_dsq = SCX_DSQ_INVALID;
-	return consumed;
+	return antistall_consume_dsq(&llcc->antistall_dsq, cpuc);
 }
 
 static bool try_drain_layer_llcs(struct layer *layer, struct cpu_ctx *cpuc)
@@ -1750,15 +2122,228 @@ void BPF_STRUCT_OPS(layered_dispatch, s32 cpu, struct task_struct *prev)
 		return;
 }
 
+/*
+ * Cgroup prefix matching. Userspace deduplicates the cgroup prefixes of all
+ * layers into cgrp_prefixes[] and each cgroup caches which of them match its
+ * path. As the path of a cgroup extends its parent's, the bitmap is derived
+ * from the parent's by only comparing the prefixes which are still pending,
+ * i.e. which are longer than the parent's path and agree with it so far,
+ * against the cgroup's own name. Task refreshes thus never need to format the
+ * full path and evaluate all prefixes of a cgroup in one walk of its
+ * ancestors.
+ *
+ * The path is formatted the same way as format_cgrp_path(). Like the layer
+ * match cache, the result isn't updated when a cgroup is renamed.
+ */
+struct cgrp_prefix_ctx {
+	u64			matched;	/* prefixes of the path */
+	u64			pending;	/* longer prefixes the path agrees with */
+	u32			len;		/* path length including the trailing '/' */
+	u32			state;		/* CGRP_PREFIX_*, acquire/release */
+};
+
+enum cgrp_prefix_state {
+	CGRP_PREFIX_EMPTY,
+	CGRP_PREFIX_BUSY,	/* being published */
+	CGRP_PREFIX_VALID,
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_CGRP_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct cgrp_prefix_ctx);
+} cgrp_prefix_ctxs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(key_size, sizeof(u32));
+	/* one more for the trailing '/' */
+	__uint(value_size, MAX_CGRP_NAME + 1);
+	__uint(max_entries, 1);
+} cgrp_name_bufs SEC(".maps");
+
+/*
+ * Compare cgrp_prefixes[@id] starting at @off against @name of @len bytes.
+ * Returns 1 if the prefix ends within @name, 0 if @name is a prefix of the
+ * remainder and -1 on mismatch.
+ */
+static __noinline int cgrp_prefix_cmp(u32 id, u32 off, const char *name, u32 len)
+{
+	u32 i, pos;
+	char c;
+
+	if (id >= MAX_CGRP_PREFIXES || len > MAX_CGRP_NAME + 1)
+		return -1;
+
+	bpf_for(i, 0, len) {
+		pos = off + i;
+		if (pos >= MAX_PATH || i > MAX_CGRP_NAME)
+			return -1;
+		c = cgrp_prefixes[id][pos];
+		if (!c)
+			return 1;
+		if (c != name[i])
+			return -1;
+	}
+
+	pos = off + len;
+	if (pos >= MAX_PATH)
+		return -1;
+	return cgrp_prefixes[id][pos] ? 0 : 1;
+}
+
+static int cgrp_prefix_step(struct cgrp_prefix_ctx *cgc,
+			    const struct cgrp_prefix_ctx *parent,
+			    struct cgroup *cgrp)
+{
+	u32 zero = 0, len, id;
+	char *name;
+	int ret;
+
+	cgc->matched = parent->matched;
+	cgc->pending = 0;
+	cgc->len = parent->len;
+
+	/* nothing to compare, skip reading the name */
+	if (!parent->pending)
+		return 0;
+
+	if (!(name = bpf_map_lookup_elem(&cgrp_name_bufs, &zero))) {
+		scx_bpf_error("cgrp_name_buf lookup failed");
+		return -ENOENT;
+	}
+
+	ret = bpf_probe_read_kernel_str(name, MAX_CGRP_NAME, BPF_CORE_READ(cgrp, kn, name));
+	if (ret < 1) {
+		scx_bpf_error("bpf_probe_read_kernel_str failed");
+		return -EINVAL;
+	}
+
+	len = ret - 1;
+	if (len >= MAX_CGRP_NAME) {
+		scx_bpf_error("cgrp name too long");
+		return -EINVAL;
+	}
+	name[len++] = '/';
+	cgc->len += len;
+
+	bpf_for(id, 0, nr_cgrp_prefixes) {
+		if (!(parent->pending & (1LLU << id)))
+			continue;
+
+		switch (cgrp_prefix_cmp(id, parent->len, name, len)) {
+		case 1:
+			cgc->matched |= 1LLU << id;
+			break;
+		case 0:
+			cgc->pending |= 1LLU << id;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int task_cgrp_prefix_mask(struct task_struct *p, u64 *maskp)
+{
+	struct cgrp_prefix_ctx parent, next, *cgc;
+	struct cgroup *cgrp, *anc;
+	u32 level, max_level;
+	int ret = 0;
+
+	*maskp = 0;
+	if (!nr_cgrp_prefixes)
+		return 0;
+
+	if (!(cgrp = bpf_cgroup_from_id(BPF_CORE_READ(p, cgroups, dfl_cgrp, kn, id))))
+		return -ENOENT;
+
+	if (!cgrp->level) {
+		*maskp = cgrp_prefix_root_mask;
+		goto out_release;
+	}
+
+	cgc = bpf_cgrp_storage_get(&cgrp_prefix_ctxs, cgrp, 0, 0);
+	if (cgc && smp_load_acquire(&cgc->state) == CGRP_PREFIX_VALID) {
+		*maskp = cgc->matched;
+		goto out_release;
+	}
+
+	/* the path of level 1 cgroups doesn't start with '/' unlike the root's */
+	parent.matched = cgrp_prefix_empty_mask;
+	parent.pending = ~cgrp_prefix_empty_mask;
+	parent.len = 0;
+
+	/* same as format_cgrp_path() */
+	max_level = cgrp->level;
+	if (max_level > 127)
+		max_level = 127;
+
+	bpf_for(level, 1, max_level + 1) {
+		if (!(anc = bpf_cgroup_ancestor(cgrp, level))) {
+			ret = -ENOENT;
+			goto out_release;
+		}
+
+		cgc = bpf_cgrp_storage_get(&cgrp_prefix_ctxs, anc, 0,
+					   BPF_LOCAL_STORAGE_GET_F_CREATE);
+		if (!cgc) {
+			bpf_cgroup_release(anc);
+			scx_bpf_error("cgrp_prefix_ctx creation failed");
+			ret = -ENOMEM;
+			goto out_release;
+		}
+
+		if (smp_load_acquire(&cgc->state) == CGRP_PREFIX_VALID) {
+			parent.matched = cgc->matched;
+			parent.pending = cgc->pending;
+			parent.len = cgc->len;
+			bpf_cgroup_release(anc);
+			continue;
+		}
+
+		if ((ret = cgrp_prefix_step(&next, &parent, anc))) {
+			bpf_cgroup_release(anc);
+			goto out_release;
+		}
+
+		/*
+		 * Racing CPUs compute the same result. Only the one which claims
+		 * @cgc publishes it and the fields must be visible before the
+		 * state on weakly ordered archs.
+		 */
+		if (__sync_val_compare_and_swap(&cgc->state, CGRP_PREFIX_EMPTY,
+						CGRP_PREFIX_BUSY) == CGRP_PREFIX_EMPTY) {
+			cgc->matched = next.matched;
+			cgc->pending = next.pending;
+			cgc->len = next.len;
+			smp_store_release(&cgc->state, CGRP_PREFIX_VALID);
+		}
+
+		parent = next;
+		bpf_cgroup_release(anc);
+	}
+
+	*maskp = parent.matched;
+out_release:
+	bpf_cgroup_release(cgrp);
+	return ret;
+}
+
 static __noinline bool match_one(struct layer_match *match,
-				 struct task_struct *p, const char *cgrp_path)
+				 struct task_struct *p, u64 cgrp_prefix_mask)
 {
 	bool result = false;
 	const struct cred *cred;
 
 	switch (match->kind) {
 	case MATCH_CGROUP_PREFIX: {
-		return match_prefix(match->cgroup_prefix, cgrp_path, MAX_PATH);
+		if (match->cgroup_prefix_id >= MAX_CGRP_PREFIXES)
+			return false;
+		return cgrp_prefix_mask & (1LLU << match->cgroup_prefix_id);
 	}
 	case MATCH_COMM_PREFIX: {
 		char comm[MAX_COMM];
@@ -1849,7 +2434,7 @@ static __noinline bool match_one(struct layer_match *match,
 	}
 }
 
-int match_layer(u32 layer_id, pid_t pid, const char *cgrp_path)
+int match_layer(u32 layer_id, pid_t pid, u64 cgrp_prefix_mask)
 {
 
 	struct task_struct *p;
@@ -1891,7 +2476,7 @@ int match_layer(u32 layer_id, pid_t pid, const char *cgrp_path)
 				goto err;
 
 			match = &ands->matches[and_id];
-			if (!match_one(match, p, cgrp_path)) {
+			if (!match_one(match, p, cgrp_prefix_mask)) {
 				matched = false;
 				break;
 			}
@@ -1911,33 +2496,115 @@ err:
 	return -EINVAL;
 }
 
+/*
+ * Layer match decision cache. Userspace sets nr_match_cached_layers to the
+ * number of leading layers whose matches only look at the cgroup, comm and
+ * euid. Evaluating those layers in order is then a function of (cgroup id,
+ * comm, euid) and the outcome is cached here. A value below
+ * nr_match_cached_layers is the matched layer. nr_match_cached_layers means
+ * that none of them matched and matching should resume from there.
+ *
+ * cgroup IDs aren't recycled. A renamed cgroup keeps its stale entries until
+ * they age out of the LRU which is fine as cgroup renames are very rare.
+ */
+struct match_cache_key {
+	u64			cgid;
+	char			comm[MAX_COMM];
+	u32			euid;
+	u32			pad;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_MATCH_CACHE_ENTRIES);
+	__type(key, struct match_cache_key);
+	__type(value, u32);
+} match_cache SEC(".maps");
+
+static bool match_cache_key_init(struct match_cache_key *key, struct task_struct *p)
+{
+	const struct cred *cred;
+	bool ret = false;
+
+	__builtin_memset(key, 0, sizeof(*key));
+	key->cgid = p->cgroups->dfl_cgrp->kn->id;
+	__builtin_memcpy(key->comm, p->comm, MAX_COMM);
+
+	bpf_rcu_read_lock();
+	cred = p->real_cred;
+	if (cred) {
+		key->euid = cred->euid.val;
+		ret = true;
+	}
+	bpf_rcu_read_unlock();
+
+	return ret;
+}
+
 static void maybe_refresh_layer(struct task_struct *p, struct task_ctx *taskc)
 {
-	const char *cgrp_path;
-	bool matched = false;
+	struct match_cache_key key;
+	u64 cgrp_prefix_mask;
+	bool matched = false, use_cache = false;
 	u64 layer_id;	// XXX - int makes verifier unhappy
+	u64 start_id = 0;
+	struct cpu_ctx *cpuc;
+	u32 *cached = NULL;
 	pid_t pid = p->pid;
 
+	if (task_group_refresh_pending(p, taskc) && !taskc->refresh_layer) {
+		if ((cpuc = lookup_cpu_ctx(-1)))
+			gstat_inc(GSTAT_GROUP_REFRESH, cpuc);
+		taskc->refresh_layer = true;
+	}
+
 	if (!taskc->refresh_layer)
 		return;
 	taskc->refresh_layer = false;
 
-	if (!(cgrp_path = format_cgrp_path(p->cgroups->dfl_cgrp)))
-		return;
+	if (nr_match_cached_layers && match_cache_key_init(&key, p)) {
+		if (!(cpuc = lookup_cpu_ctx(-1)))
+			return;
 
-	if (taskc->layer_id >= 0 && taskc->layer_id < nr_layers)
-		__sync_fetch_and_add(&layers[taskc->layer_id].nr_tasks, -1);
+		use_cache = true;
+		cached = bpf_map_lookup_elem(&match_cache, &key);
+		if (cached) {
+			gstat_inc(GSTAT_MATCH_CACHE_HIT, cpuc);
+			layer_id = *cached;
+			if (layer_id < nr_match_cached_layers)
+				matched = true;
+			else
+				start_id = nr_match_cached_layers;
+		} else {
+			gstat_inc(GSTAT_MATCH_CACHE_MISS, cpuc);
+		}
+	}
 
-	bpf_for(layer_id, 0, nr_layers) {
-		if (match_layer(layer_id, pid, cgrp_path) == 0) {
-			matched = true;
-			break;
+	if (!matched) {
+		if (task_cgrp_prefix_mask(p, &cgrp_prefix_mask))
+			return;
+
+		bpf_for(layer_id, start_id, nr_layers) {
+			if (match_layer(layer_id, pid, cgrp_prefix_mask) == 0) {
+				matched = true;
+				break;
+			}
+		}
+
+		if (use_cache && !cached) {
+			u32 val = nr_match_cached_layers;
+
+			if (matched && layer_id < nr_match_cached_layers)
+				val = layer_id;
+			bpf_map_update_elem(&match_cache, &key, &val, BPF_ANY);
 		}
 	}
 
-	if (matched) {
+	if (taskc->layer_id >= 0 && taskc->layer_id < nr_layers)
+		__sync_fetch_and_add(&layers[taskc->layer_id].nr_tasks, -1);
+
+	if (matched && layer_id < nr_layers) {
 		struct layer *layer = &layers[layer_id];
-		struct cpu_ctx *cpuc;
 		struct llc_ctx *llcc;
 
 		if (!(cpuc = lookup_cpu_ctx(scx_bpf_task_cpu(p))) ||
@@ -1946,9 +2613,10 @@ static void maybe_refresh_layer(struct task_struct *p, struct task_ctx *taskc)
 
 		taskc->layer_id = layer_id;
 		taskc->llc_id = cpuc->llc_id;
-		taskc->layered_cpus.seq = layer->cpus_seq - 1;
-		taskc->layered_cpus_llc.seq = layer->cpus_seq - 1;
-		taskc->layered_cpus_node.seq = layer->cpus_seq - 1;
+		/* the seqs of the new layer are unrelated, invalidate by id */
+		taskc->layered_cpus.id = -1;
+		taskc->layered_cpus_llc.id = -1;
+		taskc->layered_cpus_node.id = -1;
 		__sync_fetch_and_add(&layer->nr_tasks, 1);
 		/*
 		 * XXX - To be correct, we'd need to calculate the vtime
@@ -1965,9 +2633,13 @@ static void maybe_refresh_layer(struct task_struct *p, struct task_ctx *taskc)
 		scx_bpf_error("[%s]%d didn't match any layer", p->comm, p->pid);
 	}
 
-	if (taskc->layer_id < nr_layers - 1)
-		trace("LAYER=%d %s[%d] cgrp=\"%s\"",
-		      taskc->layer_id, p->comm, p->pid, cgrp_path);
+	if (debug > 1 && taskc->layer_id < nr_layers - 1) {
+		const char *cgrp_path = format_cgrp_path(p->cgroups->dfl_cgrp);
+
+		if (cgrp_path)
+			trace("LAYER=%d %s[%d] cgrp=\"%s\"",
+			      taskc->layer_id, p->comm, p->pid, cgrp_path);
+	}
 }
 
 static s32 create_save_cpumask(struct bpf_cpumask **kptr)
@@ -2048,13 +2720,15 @@ static s32 create_llc(u32 llc_id)
 	struct llc_ctx *llcc;
 	struct cpu_ctx *cpuc;
 	struct llc_prox_map *pmap;
-	u32 cpu;
+	u32 cpu, idx;
 	s32 i, ret;
 
 	if (!(llcc = lookup_llc_ctx(llc_id)))
 		return -ENOENT;
 	llcc->id = llc_id;
 
+	llcc->antistall_dsq = SCX_DSQ_INVALID;
+
 	ret = create_save_cpumask(&llcc->cpumask);
 	if (ret)
 		return ret;
@@ -2078,6 +2752,10 @@ static s32 create_llc(u32 llc_id)
 			continue;
 
 		bpf_cpumask_set_cpu(cpu, cpumask);
+		if ((idx = llcc->nr_cpus) < MAX_LLC_CPUS) {
+			cpuc->llc_idx = idx;
+			llcc->cpus[idx] = cpu;
+		}
 		llcc->nr_cpus++;
 		cpuc->llc_id = llc_id;
 		cpuc->hi_fb_dsq_id = hi_fb_dsq_id(llc_id);
@@ -2140,6 +2818,7 @@ void BPF_STRUCT_OPS(layered_runnable, struct task_struct *p, u64 enq_flags)
 		return;
 
 	taskc->runnable_at = now;
+	taskc->queued_at = now;
 	maybe_refresh_layer(p, taskc);
 
 	if (enq_flags & SCX_ENQ_WAKEUP)
@@ -2190,6 +2869,17 @@ void BPF_STRUCT_OPS(layered_running, struct task_struct *p)
 	cpuc->running_at = now;
 	taskc->running_at = now;
 
+	if (taskc->queued_at) {
+		if (layer->track_wait) {
+			u64 wait = 0;
+
+			if (time_before(taskc->queued_at, now))
+				wait = now - taskc->queued_at;
+			record_layer_wait(layer_id, cpuc->llc_id, wait);
+		}
+		taskc->queued_at = 0;
+	}
+
 	/* running an owned task if the task is on the layer owning the CPU */
 	if (layer->kind == LAYER_KIND_OPEN) {
 		cpuc->running_owned = cpuc->in_open_layers;
@@ -2230,6 +2920,7 @@ void BPF_STRUCT_OPS(layered_running, struct task_struct *p)
 void BPF_STRUCT_OPS(layered_stopping, struct task_struct *p, bool runnable)
 {
 	struct cpu_ctx *cpuc;
+	struct layer_cpu_ctx *lcpuc;
 	struct task_ctx *taskc;
 	struct layer *task_layer;
 	u64 now = scx_bpf_now();
@@ -2256,14 +2947,17 @@ void BPF_STRUCT_OPS(layered_stopping, struct task_struct *p, bool runnable)
 	 * the execution duration to the layer that just ran which may be
 	 * different from the layer that is protected on the CPU. Oh well...
 	 */
+	if (!(lcpuc = lookup_layer_cpu_ctx(task_lid, -1)))
+		return;
+
 	if (cpuc->running_owned) {
-		cpuc->layer_usages[task_lid][LAYER_USAGE_OWNED] += used;
+		lcpuc->usages[LAYER_USAGE_OWNED] += used;
 		if (cpuc->protect_owned)
-			cpuc->layer_usages[task_lid][LAYER_USAGE_PROTECTED] += used;
+			lcpuc->usages[LAYER_USAGE_PROTECTED] += used;
 		if (cpuc->protect_owned_preempt)
-			cpuc->layer_usages[task_lid][LAYER_USAGE_PROTECTED_PREEMPT] += used;
+			lcpuc->usages[LAYER_USAGE_PROTECTED_PREEMPT] += used;
 	} else {
-		cpuc->layer_usages[task_lid][LAYER_USAGE_OPEN] += used;
+		lcpuc->usages[LAYER_USAGE_OPEN] += used;
 	}
 
 	if (taskc->dsq_id & HI_FB_DSQ_BASE) {
@@ -2405,13 +3099,22 @@ void BPF_STRUCT_OPS(layered_set_cpumask, struct task_struct *p,
 		return;
 
 	refresh_cpus_flags(taskc, cpumask);
+
+	/* the cached masks are intersections with the old ->cpus_ptr */
+	taskc->layered_cpus.id = -1;
+	taskc->layered_cpus_llc.id = -1;
+	taskc->layered_cpus_node.id = -1;
 }
 
 void BPF_STRUCT_OPS(layered_update_idle, s32 cpu, bool idle)
 {
 	struct cpu_ctx *cpuc;
 
-	if (!idle || !(cpuc = lookup_cpu_ctx(cpu)))
+	if (!(cpuc = lookup_cpu_ctx(cpu)))
+		return;
+
+	llc_idle_update(cpuc, idle);
+	if (!idle)
 		return;
 
 	cpuc->protect_owned = false;
@@ -2434,7 +3137,7 @@ static int init_cached_cpus(struct cached_cpus *ccpus)
 s32 BPF_STRUCT_OPS(layered_init_task, struct task_struct *p,
 		   struct scx_init_task_args *args)
 {
-	struct task_ctx *taskc;
+	struct task_ctx *taskc, *leader_taskc;
 	struct bpf_cpumask *cpumask;
 	s32 ret;
 
@@ -2504,6 +3207,19 @@ s32 BPF_STRUCT_OPS(layered_init_task, struct task_struct *p,
 	 */
 	taskc->runtime_avg = slice_ns / 4;
 
+	/*
+	 * The layer is selected on the first runnable() anyway. Start in sync
+	 * with the thread group so that earlier group moves don't trigger
+	 * another refresh, see task_group_refresh_pending(). Read the seq first
+	 * so that a racing move is noticed later rather than missed.
+	 */
+	taskc->group_refresh_seq = smp_load_acquire(&group_refresh_seq);
+	if (p->group_leader != p &&
+	    (leader_taskc = bpf_task_storage_get(&task_ctxs, p->group_leader, 0, 0)))
+		taskc->group_gen_seen = READ_ONCE(leader_taskc->group_gen);
+	else
+		taskc->group_gen_seen = taskc->group_gen;
+
 	refresh_cpus_flags(taskc, p->cpus_ptr);
 
 	/*
@@ -2643,22 +3359,28 @@ static bool layered_monitor(void)
 
 /**
  * antistall_set() - set antistall flags.
+ * @llcc: LLC the DSQ belongs to.
  * @dsq_id: Dsq to check for delayed tasks.
  * @jiffies_now: Time to check against in jiffies.
  *
- * This function sets entries in antistall_cpu_dsq used by antistall.
- * It checks the given DSQ to see if delay exceeds antistall_sec.
- * It tries to find a CPU satisfying the constraints of "can run the first
- * task in the provided DSQ" and "is not already flagged for use in antistall".
- * If it cannot find such a CPU to flag, it will try to flag a CPU flagged to
- * process another with a lesser delay if one exists.
+ * This function checks the given DSQ to see if delay exceeds antistall_sec.
+ * If the first task can run in @llcc, its delay is returned and the caller
+ * nominates the DSQ for @llcc's CPUs to consume. Otherwise, it sets entries
+ * in antistall_cpu_dsq. It tries to find a CPU satisfying the constraints of
+ * "can run the first task in the provided DSQ" and "is not already flagged
+ * for use in antistall". If it cannot find such a CPU to flag, it will try
+ * to flag a CPU flagged to process another with a lesser delay if one exists.
+ *
+ * Return: the delay of the first task if @llcc should consume the DSQ, 0
+ * otherwise.
  */
-u64 antistall_set(u64 dsq_id, u64 jiffies_now)
+static u64 antistall_set(struct llc_ctx *llcc, u64 dsq_id, u64 jiffies_now)
 {
 	struct task_struct *__p, *p = NULL;
+	const struct cpumask *cpumask, *llc_cpumask;
 	struct task_ctx *taskc;
 	s32 cpu;
-	u64 *antistall_dsq, *delay, cur_delay;
+	u64 *antistall_dsq, *delay, cur_delay, ret = 0;
 	int pass;
 
 	if (!dsq_id || !jiffies_now)
@@ -2681,17 +3403,21 @@ u64 antistall_set(u64 dsq_id, u64 jiffies_now)
 			// check head task in dsq
 			goto unlock;
 
-		#pragma unroll
-		for (pass = 0; pass < 2; ++pass) bpf_for(cpu, 0, nr_possible_cpus) {
-			const struct cpumask *cpumask;
+		if (!(cpumask = cast_mask(taskc->layered_mask)))
+			goto unlock;
 
-			if (!(cpumask = cast_mask(taskc->layered_mask)))
-				goto unlock;
+		/* for affinity violating tasks, target all allowed CPUs */
+		if (bpf_cpumask_empty(cpumask))
+			cpumask = p->cpus_ptr;
 
-			/* for affinity violating tasks, target all allowed CPUs */
-			if (bpf_cpumask_empty(cpumask))
-				cpumask = p->cpus_ptr;
+		if ((llc_cpumask = cast_mask(llcc->cpumask)) &&
+		    bpf_cpumask_intersects(cpumask, llc_cpumask)) {
+			ret = cur_delay;
+			goto unlock;
+		}
 
+		#pragma unroll
+		for (pass = 0; pass < 2; ++pass) bpf_for(cpu, 0, nr_possible_cpus) {
 			if (!bpf_cpumask_test_cpu(cpu, cpumask))
 				continue;
 
@@ -2719,18 +3445,52 @@ unlock:
 	if (p)
 		bpf_task_release(p);
 	bpf_rcu_read_unlock();
-	return 0;
+	return ret;
+}
+
+/*
+ * Check @dsq_id for stalls and update *@best_dsq and *@best_delay if it is
+ * the most delayed DSQ of @llcc so far. Empty DSQs and DSQs where *@sincep
+ * shows that no queued task can be delayed long enough are skipped without
+ * walking them.
+ */
+static void antistall_check(struct llc_ctx *llcc, u64 dsq_id, u64 *sincep,
+			    u64 jiffies_now, u64 *best_dsq, u64 *best_delay)
+{
+	u64 since = READ_ONCE(*sincep), delay;
+
+	if (!scx_bpf_dsq_nr_queued(dsq_id)) {
+		/*
+		 * If this races an enqueue, the DSQ ends up non-empty with
+		 * *@sincep cleared and is walked until it's seen empty again.
+		 */
+		if (since)
+			__sync_val_compare_and_swap(sincep, since, 0);
+		return;
+	}
+
+	if (since && jiffies_delay_sec(since, jiffies_now) <= antistall_sec)
+		return;
+
+	delay = antistall_set(llcc, dsq_id, jiffies_now);
+	if (delay > *best_delay) {
+		*best_dsq = dsq_id;
+		*best_delay = delay;
+	}
 }
 
 /**
- * antistall_scan() - call antistall_set on all DSQs.
+ * antistall_scan() - check all DSQs for stalls.
  *
- * This function calls antistall_set on all DSQs.
- * This is where antistall figures out what work, if any, needs
- * to be prioritized to keep runnable_at delay at or below antistall_sec.
+ * This function calls antistall_check on all DSQs and nominates the most
+ * delayed DSQ of each LLC. This is where antistall figures out what work,
+ * if any, needs to be prioritized to keep runnable_at delay at or below
+ * antistall_sec. Only DSQs which may be stalled are walked.
  */
 static bool antistall_scan(void)
 {
+	struct llc_ctx *llcc;
+	u64 *sincep;
 	s32 llc;
 	u64 layer_id;
 	u64 jiffies_now;
@@ -2740,13 +3500,28 @@ static bool antistall_scan(void)
 
 	jiffies_now = bpf_jiffies64();
 
-	bpf_for(layer_id, 0, nr_layers)
-		bpf_for(llc, 0, nr_llcs)
-			antistall_set(layer_dsq_id(layer_id, llc), jiffies_now);
-
 	bpf_for(llc, 0, nr_llcs) {
-		antistall_set(hi_fb_dsq_id(llc), jiffies_now);
-		antistall_set(lo_fb_dsq_id(llc), jiffies_now);
+		u64 best_dsq = SCX_DSQ_INVALID, best_delay = 0;
+
+		if (!(llcc = lookup_llc_ctx(llc)))
+			break;
+
+		bpf_for(layer_id, 0, nr_layers) {
+			if (!(sincep = MEMBER_VPTR(*llcc, .layer_dsq_since[layer_id])))
+				break;
+			antistall_check(llcc, layer_dsq_id(layer_id, llc), sincep,
+					jiffies_now, &best_dsq, &best_delay);
+		}
+
+		antistall_check(llcc, hi_fb_dsq_id(llc), &llcc->hi_fb_dsq_since,
+				jiffies_now, &best_dsq, &best_delay);
+		antistall_check(llcc, lo_fb_dsq_id(llc), &llcc->lo_fb_dsq_since,
+				jiffies_now, &best_dsq, &best_delay);
+
+		if (best_dsq != SCX_DSQ_INVALID)
+			trace("antistall set DSQ[%llu] SELECTED_LLC[%d] DELAY[%llu]",
+			      best_dsq, llc, best_delay);
+		WRITE_ONCE(llcc->antistall_dsq, best_dsq);
 	}
 
 	return true;
@@ -2767,9 +3542,9 @@ bool run_timer_cb(int key)
 }
 
 struct layered_timer layered_timers[MAX_TIMERS] = {
-	{15LLU * NSEC_PER_SEC, CLOCK_BOOTTIME, 0},
-	{1LLU * NSEC_PER_SEC, CLOCK_BOOTTIME, 0},
-	{0LLU, CLOCK_BOOTTIME, 0},
+	[LAYERED_MONITOR]	= { .interval_ns = 15LLU * NSEC_PER_SEC },
+	[ANTISTALL_TIMER]	= { .interval_ns = 1LLU * NSEC_PER_SEC },
+	[NOOP_TIMER]		= { .interval_ns = 0 },
 };
 
 /*
@@ -2826,7 +3601,9 @@ static s32 init_layer(int layer_id)
 
 			switch (match->kind) {
 			case MATCH_CGROUP_PREFIX:
-				dbg("%s CGROUP_PREFIX \"%s\"", header, match->cgroup_prefix);
+				if (match->cgroup_prefix_id < MAX_CGRP_PREFIXES)
+					dbg("%s CGROUP_PREFIX \"%s\"", header,
+					    cgrp_prefixes[match->cgroup_prefix_id]);
 				break;
 			case MATCH_COMM_PREFIX:
 				dbg("%s COMM_PREFIX \"%s\"", header, match->comm_prefix);
@@ -18,84 +18,142 @@
 #include "timer.bpf.h"
 #include "util.bpf.h"
 
-struct timer_wrapper {
-	struct bpf_timer timer;
-	int	key;
+struct timer_wheel {
+	struct bpf_timer	timer;
 };
 
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
-	__uint(max_entries, MAX_TIMERS);
+	__uint(max_entries, 1);
 	__type(key, int);
-	__type(value, struct timer_wrapper);
-} layered_timer_data SEC(".maps");
+	__type(value, struct timer_wheel);
+} layered_timer_wheel SEC(".maps");
 
-
-static int layered_timer_cb(void *map, int key, struct timer_wrapper *timerw)
+static struct timer_wheel *lookup_timer_wheel(void)
 {
-	if (timerw->key < 0 || timerw->key > MAX_TIMERS) {
-		return 0;
+	struct timer_wheel *wheel;
+	int idx = 0;
+
+	if (!(wheel = bpf_map_lookup_elem(&layered_timer_wheel, &idx))) {
+		scx_bpf_error("Failed to lookup layered timer wheel");
+		return NULL;
 	}
+	return wheel;
+}
 
-	struct layered_timer *cb_timer = &layered_timers[timerw->key];
-	bool resched = run_timer_cb(timerw->key);
+static int timer_wheel_start(struct timer_wheel *wheel, u64 expires_at)
+{
+	u64 now = bpf_ktime_get_boot_ns();
 
-	if (!resched || !cb_timer || cb_timer->interval_ns == 0) {
-		trace("TIMER timer %d stopped", timerw->key);
-		return 0;
-	}
+	return bpf_timer_start(&wheel->timer,
+			       expires_at > now ? expires_at - now : 0, 0);
+}
+
+/*
+ * Run all logical timers which expire within TIMER_WHEEL_SLACK_NS and re-arm
+ * the wheel for the earliest remaining one. The wheel is only ever armed from
+ * here and start_layered_timers(), so there's nothing to race against. A timer
+ * whose callback returns false, or a one-shot, is no longer pending and isn't
+ * run again. Once no timer is pending the wheel is left idle.
+ */
+static int layered_timer_wheel_cb(void *map, int *key, struct timer_wheel *wheel)
+{
+	u64 now = bpf_ktime_get_boot_ns();
+	u64 next = 0, expires_at, started_at, runtime;
+	struct layered_timer *t;
+	bool resched;
+	int i;
+
+	bpf_for(i, 0, MAX_TIMERS) {
+		if (!(t = MEMBER_VPTR(layered_timers, [i])))
+			break;
+
+		expires_at = READ_ONCE(t->expires_at);
+		if (!expires_at)
+			continue;
+
+		if (expires_at > now + TIMER_WHEEL_SLACK_NS) {
+			if (!next || expires_at < next)
+				next = expires_at;
+			continue;
+		}
+
+		if (now > expires_at)
+			t->late_ns += now - expires_at;
 
-	bpf_timer_start(&timerw->timer,
-			cb_timer->interval_ns,
-			cb_timer->start_flags);
+		/* cleared before running so that the callback can re-arm */
+		WRITE_ONCE(t->expires_at, 0);
 
+		started_at = bpf_ktime_get_ns();
+		resched = run_timer_cb(i);
+		runtime = bpf_ktime_get_ns() - started_at;
+
+		t->nr_runs++;
+		t->runtime_ns += runtime;
+		if (runtime > t->max_runtime_ns)
+			t->max_runtime_ns = runtime;
+
+		if (resched && t->interval_ns && !READ_ONCE(t->expires_at)) {
+			/* keep the phase unless whole periods were missed */
+			expires_at += t->interval_ns;
+			if (expires_at <= now)
+				expires_at = now + t->interval_ns;
+			WRITE_ONCE(t->expires_at, expires_at);
+		}
+
+		expires_at = READ_ONCE(t->expires_at);
+		if (!expires_at) {
+			trace("TIMER timer %d stopped", i);
+			continue;
+		}
+		if (!next || expires_at < next)
+			next = expires_at;
+	}
+
+	if (next)
+		timer_wheel_start(wheel, next);
 	return 0;
 }
 
 int start_layered_timers(void)
 {
-	struct timer_wrapper *timerw;
+	struct timer_wheel *wheel;
+	struct layered_timer *t;
+	u64 now, next = 0;
 	int timer_id, err;
 
-	bpf_for(timer_id, 0, MAX_TIMERS) {
-		timerw = bpf_map_lookup_elem(&layered_timer_data, &timer_id);
-		if (!timerw) {
-			scx_bpf_error("Failed to lookup layered timer");
-			return -ENOENT;
-		}
-		if (timer_id < 0 || timer_id > MAX_TIMERS) {
-			scx_bpf_error("Failed to lookup layered timer");
-			return -ENOENT;
-		}
+	if (!(wheel = lookup_timer_wheel()))
+		return -ENOENT;
 
-		struct layered_timer *new_timer = &layered_timers[timer_id];
-		if (!new_timer) {
-			scx_bpf_error("can't happen");
-			return -ENOENT;
-		}
-		timerw->key = timer_id;
+	err = bpf_timer_init(&wheel->timer, &layered_timer_wheel, CLOCK_BOOTTIME);
+	if (err < 0) {
+		scx_bpf_error("Failed to init layered timer wheel");
+		return err;
+	}
 
-		err = bpf_timer_init(&timerw->timer,
-				     &layered_timer_data,
-				     new_timer->init_flags);
-		if (err < 0) {
-			scx_bpf_error("can't happen");
-			return -ENOENT;
-		}
+	err = bpf_timer_set_callback(&wheel->timer, &layered_timer_wheel_cb);
+	if (err < 0) {
+		scx_bpf_error("Failed to set layered timer wheel callback");
+		return err;
+	}
 
-		err = bpf_timer_set_callback(&timerw->timer, &layered_timer_cb);
-		if (err < 0) {
-			scx_bpf_error("can't happen");
-			return -ENOENT;
-		}
+	now = bpf_ktime_get_boot_ns();
 
-		err = bpf_timer_start(&timerw->timer,
-				      new_timer->interval_ns,
-				      new_timer->start_flags);
-		if (err < 0) {
-			scx_bpf_error("can't happen");
+	bpf_for(timer_id, 0, MAX_TIMERS) {
+		if (!(t = MEMBER_VPTR(layered_timers, [timer_id]))) {
+			scx_bpf_error("Failed to lookup layered timer");
 			return -ENOENT;
 		}
+
+		t->expires_at = now + t->interval_ns;
+		if (!next || t->expires_at < next)
+			next = t->expires_at;
+	}
+
+	err = timer_wheel_start(wheel, next);
+	if (err < 0) {
+		scx_bpf_error("Failed to start layered timer wheel");
+		return err;
 	}
 
 	return 0;
@@ -14,13 +14,30 @@
 enum timer_consts {
 	// kernel definitions
 	CLOCK_BOOTTIME		= 7,
+
+	/*
+	 * Logical timers expiring within this window of the earliest one are
+	 * run from the same wheel expiration to coalesce timer interrupts.
+	 */
+	TIMER_WHEEL_SLACK_NS	= 500 * 1000,
 };
 
+/*
+ * All logical timers are multiplexed onto a single bpf_timer, the timer
+ * wheel, which is always armed for the earliest pending expiration. Adding
+ * a periodic or one-shot callback only takes a new layer_timer_callbacks
+ * entry and doesn't add another kernel timer.
+ */
 struct layered_timer {
 	// if set to 0 the timer will only be scheduled once
 	u64 interval_ns;
-	u64 init_flags;
-	int start_flags;
+
+	/* managed by timer.bpf.c, expires_at is 0 if not pending */
+	u64 expires_at;
+	u64 nr_runs;
+	u64 runtime_ns;		/* total callback runtime */
+	u64 max_runtime_ns;
+	u64 late_ns;		/* total delay past expires_at */
 };
 
 enum layer_timer_callbacks {
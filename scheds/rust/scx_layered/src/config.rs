@@ -77,6 +77,17 @@ pub enum LayerMatch {
     IsGroupLeader(bool),
 }
 
+impl LayerMatch {
+    /// Whether the match only depends on the cgroup, comm and euid of the
+    /// task, which is what the BPF side keys its match cache on.
+    pub fn is_cacheable(&self) -> bool {
+        matches!(
+            self,
+            LayerMatch::CgroupPrefix(_) | LayerMatch::CommPrefix(_) | LayerMatch::UIDEquals(_)
+        )
+    }
+}
+
 #[derive(Clone, Debug, Serialize, Deserialize)]
 pub struct LayerCommon {
     #[serde(default)]
@@ -110,6 +121,8 @@ pub struct LayerCommon {
     #[serde(default)]
     pub perf: u64,
     #[serde(default)]
+    pub wait_p99_target_us: u64,
+    #[serde(default)]
     pub nodes: Vec<usize>,
     #[serde(default)]
     pub llcs: Vec<usize>,
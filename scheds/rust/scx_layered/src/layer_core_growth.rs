@@ -70,17 +70,21 @@ impl LayerGrowthAlgo {
         }
     }
 
+    /// Generate the core growth order of each layer. `seed` perturbs the
+    /// randomized orders (Random, RandomTopo and RoundRobin) so that offline
+    /// simulations can be reproduced per seed. The scheduler uses 0.
     pub fn layer_core_orders(
         cpu_pool: &CpuPool,
         layer_specs: &[LayerSpec],
         topo: &Topology,
+        seed: u64,
     ) -> BTreeMap<usize, Vec<usize>> {
         let mut core_orders = BTreeMap::new();
 
         for (idx, spec) in layer_specs.iter().enumerate() {
             let layer_growth_algo = spec.kind.common().growth_algo.clone();
             let core_order =
-                layer_growth_algo.layer_core_order(cpu_pool, layer_specs, spec, idx, topo);
+                layer_growth_algo.layer_core_order(cpu_pool, layer_specs, spec, idx, topo, seed);
             core_orders.insert(idx, core_order);
         }
 
@@ -94,6 +98,7 @@ impl LayerGrowthAlgo {
         spec: &LayerSpec,
         layer_idx: usize,
         topo: &Topology,
+        seed: u64,
     ) -> Vec<usize> {
         let generator = LayerCoreOrderGenerator {
             cpu_pool,
@@ -101,6 +106,7 @@ impl LayerGrowthAlgo {
             spec,
             layer_idx,
             topo,
+            seed,
         };
         match self {
             LayerGrowthAlgo::Sticky => generator.grow_sticky(),
@@ -128,9 +134,18 @@ struct LayerCoreOrderGenerator<'a> {
     spec: &'a LayerSpec,
     layer_idx: usize,
     topo: &'a Topology,
+    seed: u64,
 }
 
 impl<'a> LayerCoreOrderGenerator<'a> {
+    /// Each layer gets its own stream. Seed 0 keeps the historical
+    /// per-layer_idx orders.
+    fn rng(&self) -> fastrand::Rng {
+        fastrand::Rng::with_seed(
+            self.seed.wrapping_mul(0x9e37_79b9_7f4a_7c15) ^ self.layer_idx as u64,
+        )
+    }
+
     fn rotate_layer_offset(&self, vec: &'a mut Vec<usize>) -> &Vec<usize> {
         let num_cores = self.topo.all_cores.len();
         let chunk = num_cores.div_ceil(self.layer_specs.len()) as usize;
@@ -183,17 +198,17 @@ impl<'a> LayerCoreOrderGenerator<'a> {
     }
 
     fn grow_round_robin(&self) -> Vec<usize> {
-        fastrand::seed(self.layer_idx.try_into().unwrap());
+        let mut rng = self.rng();
 
         let mut nodes: Vec<_> = self.topo.nodes.values().collect();
-        fastrand::shuffle(&mut nodes);
+        rng.shuffle(&mut nodes);
 
         let interleaved_llcs = IteratorInterleaver::new(
             nodes
                 .iter()
                 .map(|n| {
                     let mut llcs: Vec<_> = n.llcs.values().collect();
-                    fastrand::shuffle(&mut llcs);
+                    rng.shuffle(&mut llcs);
                     llcs.into_iter()
                 })
                 .collect(),
@@ -203,7 +218,7 @@ impl<'a> LayerCoreOrderGenerator<'a> {
             interleaved_llcs
                 .map(|llc| {
                     let mut cores: Vec<_> = llc.cores.values().collect();
-                    fastrand::shuffle(&mut cores);
+                    rng.shuffle(&mut cores);
                     cores.into_iter()
                 })
                 .collect(),
@@ -214,8 +229,7 @@ impl<'a> LayerCoreOrderGenerator<'a> {
 
     fn grow_random(&self) -> Vec<usize> {
         let mut core_order = self.grow_linear();
-        fastrand::seed(self.layer_idx.try_into().unwrap());
-        fastrand::shuffle(&mut core_order);
+        self.rng().shuffle(&mut core_order);
         core_order
     }
 
@@ -280,25 +294,28 @@ impl<'a> LayerCoreOrderGenerator<'a> {
     }
 
     fn grow_random_topo(&self) -> Vec<usize> {
-        fastrand::seed(self.layer_idx.try_into().unwrap());
+        let mut rng = self.rng();
+        let mut core_order = vec![];
 
         let mut nodes: Vec<_> = self.topo.nodes.values().collect();
-        fastrand::shuffle(&mut nodes);
+        rng.shuffle(&mut nodes);
 
-        nodes
-            .into_iter()
-            .flat_map(|node| {
-                let mut llcs: Vec<_> = node.llcs.values().collect();
-                fastrand::shuffle(&mut llcs);
-                llcs.into_iter()
-            })
-            .flat_map(|llc| {
+        for node in nodes {
+            let mut llcs: Vec<_> = node.llcs.values().collect();
+            rng.shuffle(&mut llcs);
+
+            for llc in llcs {
                 let mut cores: Vec<_> = llc.cores.values().collect();
-                fastrand::shuffle(&mut cores);
-                cores.into_iter()
-            })
-            .map(|c| self.cpu_pool.get_core_topological_id(c))
-            .collect()
+                rng.shuffle(&mut cores);
+                core_order.extend(
+                    cores
+                        .into_iter()
+                        .map(|c| self.cpu_pool.get_core_topological_id(c)),
+                );
+            }
+        }
+
+        core_order
     }
 }
 
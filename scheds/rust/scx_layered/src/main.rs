@@ -2,10 +2,12 @@
 
 // This software may be used and distributed according to the terms of the
 // GNU General Public License version 2.
+mod alloc_sim;
 mod bpf_skel;
 mod stats;
 
 use std::collections::BTreeMap;
+use std::collections::BTreeSet;
 use std::collections::HashMap;
 use std::ffi::CString;
 use std::fs;
@@ -65,6 +67,7 @@ use stats::SysStats;
 
 const MAX_PATH: usize = bpf_intf::consts_MAX_PATH as usize;
 const MAX_COMM: usize = bpf_intf::consts_MAX_COMM as usize;
+const MAX_CGRP_PREFIXES: usize = bpf_intf::consts_MAX_CGRP_PREFIXES as usize;
 const MAX_LAYER_WEIGHT: u32 = bpf_intf::consts_MAX_LAYER_WEIGHT;
 const MIN_LAYER_WEIGHT: u32 = bpf_intf::consts_MIN_LAYER_WEIGHT;
 const MAX_LAYER_MATCH_ORS: usize = bpf_intf::consts_MAX_LAYER_MATCH_ORS as usize;
@@ -88,6 +91,11 @@ const NR_LLC_LSTATS: usize = bpf_intf::llc_layer_stat_id_NR_LLC_LSTATS as usize;
 
 const NR_LAYER_MATCH_KINDS: usize = bpf_intf::layer_match_kind_NR_LAYER_MATCH_KINDS as usize;
 
+// p99 wait of a layer with wait_p99_target_us is evaluated once this many
+// samples have accumulated or WAIT_SLO_WINDOW has passed, whichever is first.
+const WAIT_SLO_MIN_SAMPLES: u64 = 200;
+const WAIT_SLO_WINDOW: Duration = Duration::from_secs(1);
+
 lazy_static! {
     static ref USAGE_DECAY: f64 = 0.5f64.powf(1.0 / USAGE_HALF_LIFE_F64);
     static ref DFL_DISALLOW_OPEN_AFTER_US: u64 = 2 * scx_enums.SCX_SLICE_DFL / 1000;
@@ -120,6 +128,7 @@ lazy_static! {
                         xllc_mig_min_us: 1000.0,
                         growth_algo: LayerGrowthAlgo::Sticky,
                         perf: 1024,
+                        wait_p99_target_us: 0,
                         nodes: vec![],
                         llcs: vec![],
                     },
@@ -149,6 +158,7 @@ lazy_static! {
                         xllc_mig_min_us: 0.0,
                         growth_algo: LayerGrowthAlgo::Sticky,
                         perf: 1024,
+                        wait_p99_target_us: 0,
                         nodes: vec![],
                         llcs: vec![],
                     },
@@ -180,6 +190,7 @@ lazy_static! {
                         xllc_mig_min_us: 0.0,
                         growth_algo: LayerGrowthAlgo::Topo,
                         perf: 1024,
+                        wait_p99_target_us: 0,
                         nodes: vec![],
                         llcs: vec![],
                     },
@@ -208,6 +219,7 @@ lazy_static! {
                         xllc_mig_min_us: 100.0,
                         growth_algo: LayerGrowthAlgo::Linear,
                         perf: 1024,
+                        wait_p99_target_us: 0,
                         nodes: vec![],
                         llcs: vec![],
                     },
@@ -372,6 +384,13 @@ lazy_static! {
 ///   between 1 and 1024 indicates the performance level CPUs running tasks
 ///   in this layer are configured to using scx_bpf_cpuperf_set().
 ///
+/// - wait_p99_target_us: Target p99 of the time the layer's tasks spend
+///   runnable before getting on a CPU. 0 means no target. Only applies to
+///   Confined and Grouped layers. If the observed p99 exceeds the target,
+///   the layer is grown beyond what util_range asks for, still within
+///   cpus_range and subject to weights under contention. Wait times are
+///   only recorded and reported for layers with a target.
+///
 /// - nodes: If set the layer will use the set of NUMA nodes for scheduling
 ///   decisions. If unset then all available NUMA nodes will be used. If the
 ///   llcs value is set the cpuset of NUMA nodes will be or'ed with the LLC
@@ -532,6 +551,12 @@ struct Opts {
     #[clap(long, default_value = "false")]
     disable_antistall: bool,
 
+    /// Disable the per-LLC idle CPU summaries and find idle CPUs by
+    /// scanning cpumasks instead. Compare the idle_steps stat to see the
+    /// difference.
+    #[clap(long, default_value = "false")]
+    disable_llc_idle_summary: bool,
+
     /// Enable netdev IRQ balancing. This is experimental and should be used with caution.
     #[clap(long, default_value = "false")]
     netdev_irq_balance: bool,
@@ -544,6 +569,20 @@ struct Opts {
     #[clap(long)]
     help_stats: bool,
 
+    /// Replay a per-layer utilization trace through the CPU allocator for
+    /// each growth algorithm and report CPU churn, LLC fragmentation and
+    /// time-to-target. "synthetic:STEPS[:SEED]" generates random walks
+    /// instead. The scheduler is not launched. See src/alloc_sim.rs for
+    /// the trace format.
+    #[clap(long)]
+    alloc_sim: Option<String>,
+
+    /// Topology for --alloc-sim as
+    /// "NODES:LLCS_PER_NODE:CORES_PER_LLC:CPUS_PER_CORE". The host topology
+    /// is used if not specified.
+    #[clap(long)]
+    alloc_sim_topo: Option<String>,
+
     /// Layer specification. See --help.
     specs: Vec<String>,
 }
@@ -652,16 +691,48 @@ fn read_cpu_ctxs(skel: &BpfSkel) -> Result<Vec<bpf_intf::cpu_ctx>> {
     Ok(cpu_ctxs)
 }
 
+// Returns [layer][cpu].
+fn read_layer_cpu_ctxs(
+    skel: &BpfSkel,
+    nr_layers: usize,
+) -> Result<Vec<Vec<bpf_intf::layer_cpu_ctx>>> {
+    let mut layer_cpu_ctxs = vec![];
+    for layer in 0..nr_layers {
+        let vec = skel
+            .maps
+            .layer_cpu_ctxs
+            .lookup_percpu(&(layer as u32).to_ne_bytes(), libbpf_rs::MapFlags::ANY)
+            .context("Failed to lookup layer_cpu_ctx")?
+            .unwrap();
+        layer_cpu_ctxs.push(
+            (0..*NR_CPUS_POSSIBLE)
+                .map(|cpu| unsafe {
+                    *(vec[cpu].as_slice().as_ptr() as *const bpf_intf::layer_cpu_ctx)
+                })
+                .collect(),
+        );
+    }
+    Ok(layer_cpu_ctxs)
+}
+
 #[derive(Clone, Debug)]
 struct BpfStats {
     gstats: Vec<u64>,
     lstats: Vec<Vec<u64>>,
     lstats_sums: Vec<u64>,
     llc_lstats: Vec<Vec<Vec<u64>>>, // [layer][llc][stat]
+    timer_runs: u64,
+    timer_runtime_ns: u64,
+    timer_max_runtime_ns: u64,
+    timer_late_ns: u64,
 }
 
 impl BpfStats {
-    fn read(skel: &BpfSkel, cpu_ctxs: &[bpf_intf::cpu_ctx]) -> Self {
+    fn read(
+        skel: &BpfSkel,
+        cpu_ctxs: &[bpf_intf::cpu_ctx],
+        layer_cpu_ctxs: &[Vec<bpf_intf::layer_cpu_ctx>],
+    ) -> Self {
         let nr_layers = skel.maps.rodata_data.nr_layers as usize;
         let nr_llcs = skel.maps.rodata_data.nr_llcs as usize;
         let mut gstats = vec![0u64; NR_GSTATS];
@@ -674,7 +745,7 @@ impl BpfStats {
             }
             for layer in 0..nr_layers {
                 for stat in 0..NR_LSTATS {
-                    lstats[layer][stat] += cpu_ctxs[cpu].lstats[layer][stat];
+                    lstats[layer][stat] += layer_cpu_ctxs[layer][cpu].lstats[stat];
                 }
             }
         }
@@ -710,11 +781,22 @@ impl BpfStats {
             }
         }
 
+        // Summed over all logical timers, see timer.bpf.c.
+        let timers = &skel.maps.data_data.layered_timers;
+        let timer_runs = timers.iter().map(|t| t.nr_runs).sum();
+        let timer_runtime_ns = timers.iter().map(|t| t.runtime_ns).sum();
+        let timer_max_runtime_ns = timers.iter().map(|t| t.max_runtime_ns).max().unwrap_or(0);
+        let timer_late_ns = timers.iter().map(|t| t.late_ns).sum();
+
         Self {
             gstats,
             lstats,
             lstats_sums,
             llc_lstats,
+            timer_runs,
+            timer_runtime_ns,
+            timer_max_runtime_ns,
+            timer_late_ns,
         }
     }
 }
@@ -750,6 +832,11 @@ impl<'a, 'b> Sub<&'b BpfStats> for &'a BpfStats {
                         .collect()
                 })
                 .collect(),
+            timer_runs: self.timer_runs - rhs.timer_runs,
+            timer_runtime_ns: self.timer_runtime_ns - rhs.timer_runtime_ns,
+            // Max is not subtractable, take L side.
+            timer_max_runtime_ns: self.timer_max_runtime_ns,
+            timer_late_ns: self.timer_late_ns - rhs.timer_late_ns,
         }
     }
 }
@@ -776,17 +863,49 @@ struct Stats {
     prev_processing_dur: Duration,
 
     layer_slice_us: Vec<u64>,
+
+    layer_wait_hists: Vec<StatsHistogram>,
+    prev_layer_wait_hists: Vec<StatsHistogram>,
 }
 
 impl Stats {
-    fn read_layer_usages(cpu_ctxs: &[bpf_intf::cpu_ctx], nr_layers: usize) -> Vec<Vec<u64>> {
+    /// Merge the per-LLC wait histograms of each layer, see
+    /// layer_llc_wait_hists in main.bpf.c.
+    fn read_layer_wait_hists(skel: &BpfSkel, nr_layers: usize) -> Result<Vec<StatsHistogram>> {
+        let nr_llcs = skel.maps.rodata_data.nr_llcs as usize;
+        let mut hists = vec![StatsHistogram::default(); nr_layers];
+
+        for layer in 0..nr_layers {
+            for llc in 0..nr_llcs {
+                let key = (layer * nr_llcs + llc) as u32;
+                let v = skel
+                    .maps
+                    .layer_llc_wait_hists
+                    .lookup(&key.to_ne_bytes(), libbpf_rs::MapFlags::ANY)
+                    .context("Failed to lookup layer wait hist")?
+                    .unwrap();
+                let h = unsafe {
+                    std::ptr::read_unaligned(v.as_slice().as_ptr() as *const bpf_intf::scx_hist)
+                };
+                hists[layer].merge(&h.buckets, h.count, h.sum, h.max);
+            }
+        }
+
+        Ok(hists)
+    }
+
+    fn read_layer_usages(
+        cpu_ctxs: &[bpf_intf::cpu_ctx],
+        layer_cpu_ctxs: &[Vec<bpf_intf::layer_cpu_ctx>],
+        nr_layers: usize,
+    ) -> Vec<Vec<u64>> {
         let now = now_monotonic();
         let mut layer_usages = vec![vec![0u64; NR_LAYER_USAGES]; nr_layers];
 
         for cpu in 0..*NR_CPUS_POSSIBLE {
             for layer in 0..nr_layers {
                 for usage in 0..NR_LAYER_USAGES {
-                    layer_usages[layer][usage] += cpu_ctxs[cpu].layer_usages[layer][usage];
+                    layer_usages[layer][usage] += layer_cpu_ctxs[layer][cpu].usages[usage];
                 }
             }
         }
@@ -821,7 +940,8 @@ impl Stats {
     fn new(skel: &mut BpfSkel, proc_reader: &procfs::ProcReader) -> Result<Self> {
         let nr_layers = skel.maps.rodata_data.nr_layers as usize;
         let cpu_ctxs = read_cpu_ctxs(skel)?;
-        let bpf_stats = BpfStats::read(skel, &cpu_ctxs);
+        let layer_cpu_ctxs = read_layer_cpu_ctxs(skel, nr_layers)?;
+        let bpf_stats = BpfStats::read(skel, &cpu_ctxs, &layer_cpu_ctxs);
         let nr_nodes = skel.maps.rodata_data.nr_nodes as usize;
 
         Ok(Self {
@@ -833,7 +953,7 @@ impl Stats {
 
             total_util: 0.0,
             layer_utils: vec![vec![0.0; NR_LAYER_USAGES]; nr_layers],
-            prev_layer_usages: Self::read_layer_usages(&cpu_ctxs, nr_layers),
+            prev_layer_usages: Self::read_layer_usages(&cpu_ctxs, &layer_cpu_ctxs, nr_layers),
 
             cpu_busy: 0.0,
             prev_total_cpu: read_total_cpu(&proc_reader)?,
@@ -845,6 +965,9 @@ impl Stats {
             prev_processing_dur: Default::default(),
 
             layer_slice_us: vec![0; nr_layers],
+
+            layer_wait_hists: vec![StatsHistogram::default(); nr_layers],
+            prev_layer_wait_hists: Self::read_layer_wait_hists(skel, nr_layers)?,
         })
     }
 
@@ -858,6 +981,7 @@ impl Stats {
         let elapsed = now.duration_since(self.at);
         let elapsed_f64 = elapsed.as_secs_f64();
         let cpu_ctxs = read_cpu_ctxs(skel)?;
+        let layer_cpu_ctxs = read_layer_cpu_ctxs(skel, self.nr_layers)?;
 
         let nr_layer_tasks: Vec<usize> = skel
             .maps
@@ -876,7 +1000,7 @@ impl Stats {
             .map(|layer| layer.slice_ns / 1000 as u64)
             .collect();
 
-        let cur_layer_usages = Self::read_layer_usages(&cpu_ctxs, self.nr_layers);
+        let cur_layer_usages = Self::read_layer_usages(&cpu_ctxs, &layer_cpu_ctxs, self.nr_layers);
         // See read_layer_usages() on why saturating_sub is used below.
         let cur_layer_utils: Vec<Vec<f64>> = cur_layer_usages
             .iter()
@@ -905,9 +1029,16 @@ impl Stats {
         let cur_total_cpu = read_total_cpu(proc_reader)?;
         let cpu_busy = calc_util(&cur_total_cpu, &self.prev_total_cpu)?;
 
-        let cur_bpf_stats = BpfStats::read(skel, &cpu_ctxs);
+        let cur_bpf_stats = BpfStats::read(skel, &cpu_ctxs, &layer_cpu_ctxs);
         let bpf_stats = &cur_bpf_stats - &self.prev_bpf_stats;
 
+        let cur_layer_wait_hists = Self::read_layer_wait_hists(skel, self.nr_layers)?;
+        let layer_wait_hists = cur_layer_wait_hists
+            .iter()
+            .zip(self.prev_layer_wait_hists.iter())
+            .map(|(cur, prev)| cur.delta(prev))
+            .collect();
+
         let processing_dur = cur_processing_dur
             .checked_sub(self.prev_processing_dur)
             .unwrap();
@@ -933,6 +1064,9 @@ impl Stats {
             prev_processing_dur: cur_processing_dur,
 
             layer_slice_us,
+
+            layer_wait_hists,
+            prev_layer_wait_hists: cur_layer_wait_hists,
         };
         Ok(())
     }
@@ -948,6 +1082,13 @@ struct Layer {
     nr_llc_cpus: Vec<usize>,
     cpus: Cpumask,
     allowed_cpus: Cpumask,
+
+    wait_acc: StatsHistogram,
+    wait_acc_since: Instant,
+    wait_p99_ns: Option<u64>,
+    // Set when wait_p99_ns was evaluated from a new window and cleared once
+    // calc_target_nr_cpus() has acted on it.
+    wait_p99_fresh: bool,
 }
 
 impl Layer {
@@ -1045,9 +1186,41 @@ impl Layer {
             nr_llc_cpus: vec![0; topo.all_llcs.len()],
             cpus: Cpumask::new(),
             allowed_cpus,
+
+            wait_acc: StatsHistogram::default(),
+            wait_acc_since: Instant::now(),
+            wait_p99_ns: None,
+            wait_p99_fresh: false,
         })
     }
 
+    /// Fold the wait histogram of the last scheduling interval into the
+    /// accumulator and update the p99 used for SLO sizing once enough
+    /// samples are in. A window which closes without enough samples
+    /// clears the p99 so that an idle layer falls back to util sizing.
+    fn update_wait_p99(&mut self, hist: &StatsHistogram, now: Instant) {
+        if self.kind.common().wait_p99_target_us == 0 {
+            return;
+        }
+
+        self.wait_acc
+            .merge(&hist.buckets, hist.count, hist.sum, hist.max);
+
+        if self.wait_acc.count < WAIT_SLO_MIN_SAMPLES
+            && now.duration_since(self.wait_acc_since) < WAIT_SLO_WINDOW
+        {
+            return;
+        }
+
+        self.wait_p99_ns = match self.wait_acc.count {
+            cnt if cnt >= WAIT_SLO_MIN_SAMPLES => Some(self.wait_acc.percentile(99.0)),
+            _ => None,
+        };
+        self.wait_p99_fresh = self.wait_p99_ns.is_some();
+        self.wait_acc = StatsHistogram::default();
+        self.wait_acc_since = now;
+    }
+
     fn free_some_cpus(&mut self, cpu_pool: &mut CpuPool, max_to_free: usize) -> Result<usize> {
         let cpus_to_free = match cpu_pool.next_to_free(&self.cpus, self.core_order.iter().rev())? {
             Some(ret) => ret.clone(),
@@ -1122,6 +1295,7 @@ impl<'a> Scheduler<'a> {
 
         let mut layer_iteration_order = (0..specs.len()).collect::<Vec<_>>();
         let mut layer_weights: Vec<usize> = vec![];
+        let mut cgrp_prefixes: Vec<&str> = vec![];
 
         for (spec_i, spec) in specs.iter().enumerate() {
             let layer = &mut skel.maps.bss_data.layers[spec_i];
@@ -1132,7 +1306,16 @@ impl<'a> Scheduler<'a> {
                     match and {
                         LayerMatch::CgroupPrefix(prefix) => {
                             mt.kind = bpf_intf::layer_match_kind_MATCH_CGROUP_PREFIX as i32;
-                            copy_into_cstr(&mut mt.cgroup_prefix, prefix.as_str());
+                            mt.cgroup_prefix_id = match cgrp_prefixes
+                                .iter()
+                                .position(|pfx| *pfx == prefix.as_str())
+                            {
+                                Some(id) => id as u32,
+                                None => {
+                                    cgrp_prefixes.push(prefix.as_str());
+                                    (cgrp_prefixes.len() - 1) as u32
+                                }
+                            };
                         }
                         LayerMatch::CommPrefix(prefix) => {
                             mt.kind = bpf_intf::layer_match_kind_MATCH_COMM_PREFIX as i32;
@@ -1216,6 +1399,7 @@ impl<'a> Scheduler<'a> {
                     disallow_open_after_us,
                     disallow_preempt_after_us,
                     xllc_mig_min_us,
+                    wait_p99_target_us,
                     ..
                 } = spec.kind.common();
 
@@ -1236,6 +1420,7 @@ impl<'a> Scheduler<'a> {
                 layer.preempt_first.write(*preempt_first);
                 layer.exclusive.write(*exclusive);
                 layer.allow_node_aligned.write(*allow_node_aligned);
+                layer.track_wait.write(*wait_p99_target_us > 0);
                 layer.growth_algo = growth_algo.as_bpf_enum();
                 layer.weight = *weight;
                 layer.disallow_open_after_ns = match disallow_open_after_us.unwrap() {
@@ -1266,6 +1451,37 @@ impl<'a> Scheduler<'a> {
             skel.maps.rodata_data.layer_iteration_order[idx] = *layer_idx as u32;
         }
 
+        // BPF tracks which of the deduplicated cgroup prefixes match each
+        // cgroup as a bitmap, see cgrp_prefix_ctx in main.bpf.c.
+        let mut cgrp_prefix_empty_mask = 0u64;
+        let mut cgrp_prefix_root_mask = 0u64;
+        for (id, prefix) in cgrp_prefixes.iter().enumerate() {
+            copy_into_cstr(&mut skel.maps.bss_data.cgrp_prefixes[id], prefix);
+            if prefix.is_empty() {
+                cgrp_prefix_empty_mask |= 1 << id;
+            }
+            if "/".starts_with(prefix) {
+                cgrp_prefix_root_mask |= 1 << id;
+            }
+        }
+        skel.maps.rodata_data.nr_cgrp_prefixes = cgrp_prefixes.len() as u32;
+        skel.maps.rodata_data.cgrp_prefix_empty_mask = cgrp_prefix_empty_mask;
+        skel.maps.rodata_data.cgrp_prefix_root_mask = cgrp_prefix_root_mask;
+
+        // Layers are matched in order. As long as all the leading layers only
+        // match on keys that BPF caches on, their combined outcome can be
+        // cached too. See match_cache in main.bpf.c.
+        let nr_match_cached_layers = specs
+            .iter()
+            .take_while(|spec| spec.matches.iter().flatten().all(|m| m.is_cacheable()))
+            .count();
+        skel.maps.rodata_data.nr_match_cached_layers = nr_match_cached_layers as u32;
+        debug!(
+            "layer match cache covers {}/{} layers",
+            nr_match_cached_layers,
+            specs.len()
+        );
+
         if perf_set && !compat::ksym_exists("scx_bpf_cpuperf_set")? {
             warn!("cpufreq support not available, ignoring perf configurations");
         }
@@ -1686,6 +1902,7 @@ impl<'a> Scheduler<'a> {
         skel.maps.rodata_data.lo_fb_wait_ns = opts.lo_fb_wait_us * 1000;
         skel.maps.rodata_data.lo_fb_share_ppk = ((opts.lo_fb_share * 1024.0) as u32).clamp(1, 1024);
         skel.maps.rodata_data.enable_antistall = !opts.disable_antistall;
+        skel.maps.rodata_data.enable_llc_idle_summary = !opts.disable_llc_idle_summary;
 
         for (cpu, sib) in topo.sibling_cpus().iter().enumerate() {
             skel.maps.rodata_data.__sibling_cpu[cpu] = *sib;
@@ -1753,11 +1970,19 @@ impl<'a> Scheduler<'a> {
         Self::init_layers(&mut skel, &layer_specs, &topo)?;
         Self::init_nodes(&mut skel, opts, &topo);
 
+        // Size the per-layer and per-LLC tables to the actual configuration.
+        skel.maps.layer_cpu_ctxs.set_max_entries(nr_layers as u32)?;
+        let nr_llcs = skel.maps.rodata_data.nr_llcs.max(1);
+        skel.maps.llc_data.set_max_entries(nr_llcs)?;
+        skel.maps
+            .layer_llc_wait_hists
+            .set_max_entries(nr_layers as u32 * nr_llcs)?;
+
         let mut skel = scx_ops_load!(skel, layered, uei)?;
 
         let mut layers = vec![];
         let layer_growth_orders =
-            LayerGrowthAlgo::layer_core_orders(&cpu_pool, &layer_specs, &topo);
+            LayerGrowthAlgo::layer_core_orders(&cpu_pool, &layer_specs, &topo, 0);
         for (idx, spec) in layer_specs.iter().enumerate() {
             let growth_order = layer_growth_orders
                 .get(&idx)
@@ -1874,15 +2099,25 @@ impl<'a> Scheduler<'a> {
     /// no competition. The CPU range is determined by applying the inverse
     /// of util_range and then capping by cpus_range. If the current
     /// allocation is within the acceptable range, no change is made.
+    ///
+    /// Layers with wait_p99_target_us are further adjusted by their recent
+    /// p99 wait. Above the target, the layer grows by an eighth of its
+    /// current size (at least one CPU) regardless of util_range, once per
+    /// freshly evaluated p99 so that growth doesn't compound over the
+    /// intervals of a single wait window. Otherwise, at or above half the
+    /// target, the layer is held at its current size so that util_range
+    /// doesn't immediately take back CPUs that were added for latency.
+    /// Below half, util_range alone decides.
     /// Returns (target, min) pair for each layer.
-    fn calc_target_nr_cpus(&self) -> Vec<(usize, usize)> {
-        let nr_cpus = self.cpu_pool.topo.all_cpus.len();
-        let utils = &self.sched_stats.layer_utils;
-
+    fn calc_target_nr_cpus(
+        layers: &[Layer],
+        utils: &[Vec<f64>],
+        nr_cpus: usize,
+    ) -> Vec<(usize, usize)> {
         let mut records: Vec<(u64, u64, u64, usize, usize, usize)> = vec![];
         let mut targets: Vec<(usize, usize)> = vec![];
 
-        for (idx, layer) in self.layers.iter().enumerate() {
+        for (idx, layer) in layers.iter().enumerate() {
             targets.push(match &layer.kind {
                 LayerKind::Confined {
                     util_range,
@@ -1910,9 +2145,21 @@ impl<'a> Scheduler<'a> {
                     let util = if util < 0.01 { 0.0 } else { util };
                     let low = (util / util_range.1).ceil() as usize;
                     let high = ((util / util_range.0).floor() as usize).max(low);
-                    let target = layer.cpus.weight().clamp(low, high);
+                    let cur = layer.cpus.weight();
+                    let mut target = cur.clamp(low, high);
                     let cpus_range = cpus_range.unwrap_or((0, nr_cpus));
 
+                    let slo_ns = layer.kind.common().wait_p99_target_us * 1000;
+                    match layer.wait_p99_ns {
+                        Some(p99) if slo_ns > 0 && p99 > slo_ns && layer.wait_p99_fresh => {
+                            target = target.max(cur + (cur / 8).max(1));
+                        }
+                        Some(p99) if slo_ns > 0 && p99 >= slo_ns / 2 => {
+                            target = target.max(cur);
+                        }
+                        _ => {}
+                    }
+
                     records.push((
                         (owned * 100.0) as u64,
                         (open * 100.0) as u64,
@@ -1936,10 +2183,13 @@ impl<'a> Scheduler<'a> {
     /// Given (target, min) pair for each layer which was determined
     /// assuming infinite number of CPUs, distribute the actual CPUs
     /// according to their weights.
-    fn weighted_target_nr_cpus(&self, targets: &Vec<(usize, usize)>) -> Vec<usize> {
-        let mut nr_left = self.cpu_pool.topo.all_cpus.len();
-        let weights: Vec<usize> = self
-            .layers
+    fn weighted_target_nr_cpus(
+        layers: &[Layer],
+        targets: &[(usize, usize)],
+        nr_cpus: usize,
+    ) -> Vec<usize> {
+        let mut nr_left = nr_cpus;
+        let weights: Vec<usize> = layers
             .iter()
             .map(|layer| layer.kind.common().weight as usize)
             .collect();
@@ -1950,7 +2200,7 @@ impl<'a> Scheduler<'a> {
             .map(|(i, ((target, min), weight))| (i, (*target, *min, *weight)))
             .collect();
         let mut weight_sum: usize = weights.iter().sum();
-        let mut weighted: Vec<usize> = vec![0; self.layers.len()];
+        let mut weighted: Vec<usize> = vec![0; layers.len()];
 
         trace!("cands: {:?}", &cands);
 
@@ -2011,23 +2261,28 @@ impl<'a> Scheduler<'a> {
         weighted
     }
 
-    fn refresh_cpumasks(&mut self) -> Result<()> {
+    /// Shrink and grow the confined and grouped layers towards the
+    /// weighted targets and give the remaining CPUs to the open layers.
+    /// Returns whether each layer's CPUs changed. Only the layers and the
+    /// CPU pool are touched so that this can also be driven by alloc_sim.
+    fn resize_layers(
+        layers: &mut [Layer],
+        cpu_pool: &mut CpuPool,
+        targets: &[usize],
+    ) -> Result<Vec<bool>> {
         let layer_is_open = |layer: &Layer| match layer.kind {
             LayerKind::Open { .. } => true,
             _ => false,
         };
 
-        let mut updated = false;
-        let targets = self.calc_target_nr_cpus();
-        let targets = self.weighted_target_nr_cpus(&targets);
+        let mut updated = vec![false; layers.len()];
 
         let mut ascending: Vec<(usize, usize)> = targets.iter().copied().enumerate().collect();
         ascending.sort_by(|a, b| a.1.cmp(&b.1));
 
         // If any layer is growing, guarantee that the largest layer that is
         // freeing CPUs frees at least one CPU.
-        let mut force_free = self
-            .layers
+        let mut force_free = layers
             .iter()
             .zip(targets.iter())
             .any(|(layer, &target)| layer.nr_cpus < target);
@@ -2036,7 +2291,7 @@ impl<'a> Scheduler<'a> {
         // redistribution. Do so in the descending target number of CPUs
         // order.
         for &(idx, target) in ascending.iter().rev() {
-            let layer = &mut self.layers[idx];
+            let layer = &mut layers[idx];
             if layer_is_open(layer) {
                 continue;
             }
@@ -2053,8 +2308,6 @@ impl<'a> Scheduler<'a> {
             // behavior.
             let nr_to_break_at = nr_to_free / 2;
 
-            let mut freed = false;
-
             while nr_to_free > 0 {
                 let max_to_free = if force_free {
                     force_free = false;
@@ -2063,23 +2316,18 @@ impl<'a> Scheduler<'a> {
                     nr_to_free
                 };
 
-                let nr_freed = layer.free_some_cpus(&mut self.cpu_pool, max_to_free)?;
+                let nr_freed = layer.free_some_cpus(cpu_pool, max_to_free)?;
                 if nr_freed == 0 {
                     break;
                 }
 
                 nr_to_free = nr_to_free.saturating_sub(nr_freed);
-                freed = true;
+                updated[idx] = true;
 
                 if nr_to_free <= nr_to_break_at {
                     break;
                 }
             }
-
-            if freed {
-                Self::update_bpf_layer_cpumask(layer, &mut self.skel.maps.bss_data.layers[idx]);
-                updated = true;
-            }
         }
 
         // Grow layers. Do so in the ascending target number of CPUs order
@@ -2088,7 +2336,7 @@ impl<'a> Scheduler<'a> {
         // bigger layers as work conservation should still be achieved
         // through open execution.
         for &(idx, target) in &ascending {
-            let layer = &mut self.layers[idx];
+            let layer = &mut layers[idx];
 
             if layer_is_open(layer) {
                 continue;
@@ -2100,39 +2348,52 @@ impl<'a> Scheduler<'a> {
             }
 
             let mut nr_to_alloc = target - nr_cur;
-            let mut alloced = false;
 
             while nr_to_alloc > 0 {
-                let nr_alloced = layer.alloc_some_cpus(&mut self.cpu_pool)?;
+                let nr_alloced = layer.alloc_some_cpus(cpu_pool)?;
                 if nr_alloced == 0 {
                     break;
                 }
-                alloced = true;
+                updated[idx] = true;
                 nr_to_alloc -= nr_alloced.min(nr_to_alloc);
             }
-
-            if alloced {
-                Self::update_bpf_layer_cpumask(layer, &mut self.skel.maps.bss_data.layers[idx]);
-                updated = true;
-            }
         }
 
         // Give the rest to the open layers.
-        if updated {
-            for (idx, layer) in self.layers.iter_mut().enumerate() {
+        if updated.iter().any(|&u| u) {
+            for (idx, layer) in layers.iter_mut().enumerate() {
                 if !layer_is_open(layer) {
                     continue;
                 }
 
-                let bpf_layer = &mut self.skel.maps.bss_data.layers[idx];
-                let available_cpus = self.cpu_pool.available_cpus().and(&layer.allowed_cpus);
-                let nr_available_cpus = available_cpus.weight();
-
                 // Open layers need the intersection of allowed cpus and
                 // available cpus.
+                let available_cpus = cpu_pool.available_cpus().and(&layer.allowed_cpus);
+                layer.nr_cpus = available_cpus.weight();
                 layer.cpus = available_cpus;
-                layer.nr_cpus = nr_available_cpus;
-                Self::update_bpf_layer_cpumask(layer, bpf_layer);
+                updated[idx] = true;
+            }
+        }
+
+        Ok(updated)
+    }
+
+    fn refresh_cpumasks(&mut self) -> Result<()> {
+        let nr_cpus = self.cpu_pool.topo.all_cpus.len();
+        let targets =
+            Self::calc_target_nr_cpus(&self.layers, &self.sched_stats.layer_utils, nr_cpus);
+        for layer in self.layers.iter_mut() {
+            layer.wait_p99_fresh = false;
+        }
+        let targets = Self::weighted_target_nr_cpus(&self.layers, &targets, nr_cpus);
+
+        let updated = Self::resize_layers(&mut self.layers, &mut self.cpu_pool, &targets)?;
+
+        if updated.iter().any(|&u| u) {
+            for (idx, layer) in self.layers.iter().enumerate() {
+                if updated[idx] {
+                    Self::update_bpf_layer_cpumask(layer, &mut self.skel.maps.bss_data.layers[idx]);
+                }
             }
 
             self.skel.maps.bss_data.fallback_cpu = self.cpu_pool.fallback_cpu as u32;
@@ -2178,6 +2439,13 @@ impl<'a> Scheduler<'a> {
             started_at,
             self.processing_dur,
         )?;
+        for (layer, hist) in self
+            .layers
+            .iter_mut()
+            .zip(self.sched_stats.layer_wait_hists.iter())
+        {
+            layer.update_wait_p99(hist, started_at);
+        }
         self.refresh_cpumasks()?;
         self.processing_dur += Instant::now().duration_since(started_at);
         Ok(())
@@ -2281,6 +2549,22 @@ fn verify_layer_specs(specs: &[LayerSpec]) -> Result<()> {
         bail!("Too many layer specs");
     }
 
+    let mut cgrp_prefixes = BTreeSet::new();
+    for spec in specs.iter() {
+        for one in spec.matches.iter().flatten() {
+            if let LayerMatch::CgroupPrefix(prefix) = one {
+                cgrp_prefixes.insert(prefix);
+            }
+        }
+    }
+    if cgrp_prefixes.len() > MAX_CGRP_PREFIXES {
+        bail!(
+            "Too many ({}) distinct cgroup prefixes, max {}",
+            cgrp_prefixes.len(),
+            MAX_CGRP_PREFIXES
+        );
+    }
+
     for (idx, spec) in specs.iter().enumerate() {
         if idx < nr_specs - 1 {
             if spec.matches.len() == 0 {
@@ -2498,6 +2782,15 @@ fn main() -> Result<()> {
     debug!("specs={}", serde_json::to_string_pretty(&layer_config)?);
     verify_layer_specs(&layer_config.specs)?;
 
+    if let Some(spec) = &opts.alloc_sim {
+        return alloc_sim::simulate(
+            spec,
+            opts.alloc_sim_topo.as_deref(),
+            &layer_config.specs,
+            opts.interval,
+        );
+    }
+
     let mut open_object = MaybeUninit::uninit();
     loop {
         let mut sched = Scheduler::init(&opts, &layer_config.specs, &mut open_object)?;
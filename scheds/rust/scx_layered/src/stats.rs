@@ -37,6 +37,9 @@ const GSTAT_HI_FB_USAGE: usize = bpf_intf::global_stat_id_GSTAT_HI_FB_USAGE as u
 const GSTAT_LO_FB_EVENTS: usize = bpf_intf::global_stat_id_GSTAT_LO_FB_EVENTS as usize;
 const GSTAT_LO_FB_USAGE: usize = bpf_intf::global_stat_id_GSTAT_LO_FB_USAGE as usize;
 const GSTAT_FB_CPU_USAGE: usize = bpf_intf::global_stat_id_GSTAT_FB_CPU_USAGE as usize;
+const GSTAT_MATCH_CACHE_HIT: usize = bpf_intf::global_stat_id_GSTAT_MATCH_CACHE_HIT as usize;
+const GSTAT_MATCH_CACHE_MISS: usize = bpf_intf::global_stat_id_GSTAT_MATCH_CACHE_MISS as usize;
+const GSTAT_GROUP_REFRESH: usize = bpf_intf::global_stat_id_GSTAT_GROUP_REFRESH as usize;
 
 const LSTAT_SEL_LOCAL: usize = bpf_intf::layer_stat_id_LSTAT_SEL_LOCAL as usize;
 const LSTAT_ENQ_WAKEUP: usize = bpf_intf::layer_stat_id_LSTAT_ENQ_WAKEUP as usize;
@@ -68,6 +71,8 @@ const LSTAT_XLAYER_WAKE: usize = bpf_intf::layer_stat_id_LSTAT_XLAYER_WAKE as us
 const LSTAT_XLAYER_REWAKE: usize = bpf_intf::layer_stat_id_LSTAT_XLAYER_REWAKE as usize;
 const LSTAT_LLC_DRAIN_TRY: usize = bpf_intf::layer_stat_id_LSTAT_LLC_DRAIN_TRY as usize;
 const LSTAT_LLC_DRAIN: usize = bpf_intf::layer_stat_id_LSTAT_LLC_DRAIN as usize;
+const LSTAT_IDLE_PICK: usize = bpf_intf::layer_stat_id_LSTAT_IDLE_PICK as usize;
+const LSTAT_IDLE_PICK_STEPS: usize = bpf_intf::layer_stat_id_LSTAT_IDLE_PICK_STEPS as usize;
 
 const LLC_LSTAT_LAT: usize = bpf_intf::llc_layer_stat_id_LLC_LSTAT_LAT as usize;
 const LLC_LSTAT_CNT: usize = bpf_intf::llc_layer_stat_id_LLC_LSTAT_CNT as usize;
@@ -182,6 +187,8 @@ pub struct LayerStats {
     pub llc_drain_try: f64,
     #[stat(desc = "% LLC draining succeeded")]
     pub llc_drain: f64,
+    #[stat(desc = "average idle CPU searches and claim attempts per idle CPU pick")]
+    pub idle_pick_steps: f64,
     #[stat(desc = "mask of allocated CPUs", _om_skip)]
     pub cpus: Vec<u32>,
     #[stat(desc = "count of CPUs assigned")]
@@ -194,6 +201,10 @@ pub struct LayerStats {
     pub nr_llc_cpus: Vec<u32>,
     #[stat(desc = "slice duration config")]
     pub slice_us: u64,
+    #[stat(desc = "runnable to running wait time distribution (ns), only with wait_p99_target_us")]
+    pub wait_hist: StatsHistogram,
+    #[stat(desc = "p99 wait time target (us), 0 if not set")]
+    pub wait_p99_target_us: u64,
     #[stat(desc = "Per-LLC scheduling event fractions")]
     pub llc_fracs: Vec<f64>,
     #[stat(desc = "Per-LLC average latency")]
@@ -288,12 +299,22 @@ impl LayerStats {
             xllc_migration_skip: lstat_pct(LSTAT_XLLC_MIGRATION_SKIP),
             llc_drain_try: lstat_pct(LSTAT_LLC_DRAIN_TRY),
             llc_drain: lstat_pct(LSTAT_LLC_DRAIN),
+            idle_pick_steps: match lstat(LSTAT_IDLE_PICK) {
+                0 => 0.0,
+                picks => lstat(LSTAT_IDLE_PICK_STEPS) as f64 / picks as f64,
+            },
             cpus: Self::bitvec_to_u32s(layer.cpus.as_raw_bitvec()),
             cur_nr_cpus: layer.cpus.weight() as u32,
             min_nr_cpus: nr_cpus_range.0 as u32,
             max_nr_cpus: nr_cpus_range.1 as u32,
             nr_llc_cpus: layer.nr_llc_cpus.iter().map(|&v| v as u32).collect(),
             slice_us: stats.layer_slice_us[lidx],
+            wait_hist: {
+                let mut hist = stats.layer_wait_hists[lidx].clone();
+                hist.update_percentiles();
+                hist
+            },
+            wait_p99_target_us: layer.kind.common().wait_p99_target_us,
             llc_fracs: {
                 let sid = LLC_LSTAT_CNT;
                 let sum = bstats.llc_lstats[lidx]
@@ -379,12 +400,13 @@ impl LayerStats {
 
         writeln!(
             w,
-            "  {:<width$}  xlayer_wake/re={}/{} llc_drain/try={}/{}",
+            "  {:<width$}  xlayer_wake/re={}/{} llc_drain/try={}/{} idle_steps={:.2}",
             "",
             fmt_pct(self.xlayer_wake),
             fmt_pct(self.xlayer_rewake),
             fmt_pct(self.llc_drain),
             fmt_pct(self.llc_drain_try),
+            self.idle_pick_steps,
             width = header_width,
         )?;
 
@@ -398,6 +420,23 @@ impl LayerStats {
             width = header_width
         )?;
 
+        // Waits are only recorded for layers with a target.
+        if self.wait_p99_target_us > 0 {
+            let wait_pct = |name: &str| {
+                self.wait_hist.percentiles.get(name).copied().unwrap_or(0) as f64 / 1000.0
+            };
+            writeln!(
+                w,
+                "  {:<width$}  wait_us p50/p99/max={:.1}/{:.1}/{:.1} target={}",
+                "",
+                wait_pct("p50"),
+                wait_pct("p99"),
+                wait_pct("max"),
+                self.wait_p99_target_us,
+                width = header_width
+            )?;
+        }
+
         let mut cpus = self
             .cpus
             .iter()
@@ -491,6 +530,20 @@ pub struct SysStats {
         desc = "count of times an idle sibling CPU was woken up after an excl task is finished"
     )]
     pub excl_wakeup: f64,
+    #[stat(desc = "# of layer match cache hits")]
+    pub match_cache_hit: u64,
+    #[stat(desc = "# of layer match cache misses")]
+    pub match_cache_miss: u64,
+    #[stat(desc = "# of lazy layer refreshes after thread group cgroup moves")]
+    pub group_refresh: u64,
+    #[stat(desc = "# of BPF timer callback runs")]
+    pub timer_runs: u64,
+    #[stat(desc = "average BPF timer callback runtime (us)")]
+    pub timer_runtime_us: f64,
+    #[stat(desc = "max BPF timer callback runtime since start (us)")]
+    pub timer_max_runtime_us: f64,
+    #[stat(desc = "average delay of BPF timer callbacks past expiration (us)")]
+    pub timer_late_us: f64,
     #[stat(desc = "CPU time this binary consumed during the period")]
     pub proc_ms: u64,
     #[stat(desc = "CPU busy % (100% means all CPU)")]
@@ -512,6 +565,8 @@ pub struct SysStats {
 impl SysStats {
     pub fn new(stats: &Stats, bstats: &BpfStats, fallback_cpu: usize) -> Result<Self> {
         let lsum = |idx| stats.bpf_stats.lstats_sums[idx];
+        let timer_per_run_us =
+            |ns: u64| calc_frac(ns as f64, bstats.timer_runs as f64) / 100.0 / 1000.0;
         let total = lsum(LSTAT_SEL_LOCAL)
             + lsum(LSTAT_ENQ_WAKEUP)
             + lsum(LSTAT_ENQ_EXPIRE)
@@ -545,6 +600,13 @@ impl SysStats {
             excl_preempt: lsum_pct(LSTAT_EXCL_PREEMPT),
             excl_idle: bstats.gstats[GSTAT_EXCL_IDLE] as f64 / total as f64,
             excl_wakeup: bstats.gstats[GSTAT_EXCL_WAKEUP] as f64 / total as f64,
+            match_cache_hit: bstats.gstats[GSTAT_MATCH_CACHE_HIT],
+            match_cache_miss: bstats.gstats[GSTAT_MATCH_CACHE_MISS],
+            group_refresh: bstats.gstats[GSTAT_GROUP_REFRESH],
+            timer_runs: bstats.timer_runs,
+            timer_runtime_us: timer_per_run_us(bstats.timer_runtime_ns),
+            timer_max_runtime_us: bstats.timer_max_runtime_ns as f64 / 1000.0,
+            timer_late_us: timer_per_run_us(bstats.timer_late_ns),
             proc_ms: stats.processing_dur.as_millis() as u64,
             busy: stats.cpu_busy * 100.0,
             util: stats.total_util * 100.0,
@@ -591,6 +653,18 @@ impl SysStats {
             self.excl_collision, self.excl_preempt, self.excl_idle, self.excl_wakeup
         )?;
 
+        writeln!(
+            w,
+            "match_cache hit/miss={}/{} group_refresh={}",
+            self.match_cache_hit, self.match_cache_miss, self.group_refresh
+        )?;
+
+        writeln!(
+            w,
+            "timer runs={} runtime/max={:.1}/{:.1}us late={:.1}us",
+            self.timer_runs, self.timer_runtime_us, self.timer_max_runtime_us, self.timer_late_us
+        )?;
+
         Ok(())
     }
 
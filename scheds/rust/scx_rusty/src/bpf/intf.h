@@ -28,7 +28,8 @@ typedef unsigned long long u64;
 
 enum consts {
 	MAX_CPUS		= 512,
-	MAX_DOMS		= 64,	/* limited to avoid complex bitmask ops */
+	MAX_DOMS		= 256,
+	DOM_MASK_WORDS		= MAX_DOMS / 64,	/* u64 words in a domain mask */
 	MAX_NUMA_NODES		= MAX_DOMS,	/* Assume at least 1 domain per NUMA node */
 	CACHELINE_SIZE		= 64,
 	NO_DOM_FOUND		= MAX_DOMS + 1,
@@ -39,6 +40,26 @@ enum consts {
 	LB_LOAD_BUCKETS		= 100,	/* Must be a factor of LB_MAX_WEIGHT */
 	LB_WEIGHT_PER_BUCKET	= LB_MAX_WEIGHT / LB_LOAD_BUCKETS,
 
+	/*
+	 * In-BPF load balancer parameters. Domains whose load deviates from the
+	 * average by more than LB_IMBAL_HIGH_PCT are balanced by moving up to
+	 * LB_XFER_TARGET_PCT of the smaller of the push / pull imbalances at a
+	 * time. These match the userspace load balancer's domain ratios. At
+	 * most LB_BPF_MAX_XFERS tasks are retargeted per round and each
+	 * attempt scans up to LB_BPF_MAX_SCAN tasks of the push domain's task
+	 * index starting from the load class of the transfer target.
+	 */
+	LB_IMBAL_HIGH_PCT	= 5,
+	LB_XFER_TARGET_PCT	= 50,
+	LB_BPF_MAX_XFERS	= 8,
+	LB_BPF_MAX_SCAN		= 256,
+
+	/*
+	 * Per-CPU duty cycle accumulators of an active domain bucket are folded
+	 * at least every load_half_life / DCYCLE_FOLD_FRAC.
+	 */
+	DCYCLE_FOLD_FRAC	= 16,
+
 	/* Time constants */
 	MSEC_PER_SEC		= 1000LLU,
 	USEC_PER_MSEC		= 1000LLU,
@@ -47,6 +68,14 @@ enum consts {
 	USEC_PER_SEC            = USEC_PER_MSEC * MSEC_PER_SEC,
 	NSEC_PER_SEC            = NSEC_PER_USEC * USEC_PER_SEC,
 
+	/*
+	 * Each NUMA node keeps a summary of its STEAL_NR_CANDS domains most
+	 * worth stealing from, refreshed at most every STEAL_REFRESH_NS by
+	 * whichever CPU of the node runs out of work first.
+	 */
+	STEAL_NR_CANDS		= 4,
+	STEAL_REFRESH_NS	= 1 * NSEC_PER_MSEC,
+
 	/* Constants used for determining a task's deadline */
 	DL_RUNTIME_SCALE	= 2, /* roughly scales average runtime to */
 				     /* same order of magnitude as waker  */
@@ -54,16 +83,20 @@ enum consts {
 	DL_MAX_LATENCY_NS	= (50 * NSEC_PER_MSEC),
 	DL_FREQ_FT_MAX		= 100000,
 	DL_MAX_LAT_PRIO		= 39,
+	DL_BENCH_ITERS		= 1 << 16,
 
 	/*
-	 * When userspace load balancer is trying to determine the tasks to push
-	 * out from an overloaded domain, it looks at the the following number
-	 * of recently active tasks of the domain. While this may lead to
-	 * spurious migration victim selection failures in pathological cases,
-	 * this isn't a practical problem as the LB rounds are best-effort
-	 * anyway and will be retried until loads are balanced.
+	 * Each domain indexes its runnable tasks by load class, the number of
+	 * significant bits of the task's load as seen by the load balancer.
+	 * A task's class is refreshed at most every load_half_life /
+	 * LB_TASK_IDX_REFRESH_FRAC while it's running. When the userspace load
+	 * balancer is trying to determine the tasks to push out from an
+	 * overloaded domain, it walks the classes from the heaviest down until
+	 * it has found at least LB_DOM_TOP_TASKS migratable tasks.
 	 */
-	MAX_DOM_ACTIVE_TPTRS	= 1024,
+	LB_TASK_IDX_CLASSES	= 40,
+	LB_TASK_IDX_REFRESH_FRAC = 4,
+	LB_DOM_TOP_TASKS	= 1024,
 };
 
 /* Statistics */
@@ -85,6 +118,7 @@ enum stat_idx {
 	RUSTY_STAT_REPATRIATE,
 	RUSTY_STAT_KICK_GREEDY,
 	RUSTY_STAT_LOAD_BALANCE,
+	RUSTY_STAT_STEAL_PROBES,
 
 	/* Errors */
 	RUSTY_STAT_TASK_GET_ERR,
@@ -113,16 +147,19 @@ enum stat_idx {
  */
 
 struct dom_ctx;
+struct task_ctx;
 #if defined(__BPF_FEATURE_ADDR_SPACE_CAST) && !defined(BPF_ARENA_FORCE_ASM)
 typedef struct dom_ctx __attribute__((address_space(1))) *dom_ptr;
+typedef struct task_ctx __attribute__((address_space(1))) *task_ptr;
 #else
 typedef struct dom_ctx *dom_ptr;
+typedef struct task_ctx *task_ptr;
 #endif
 
 struct task_ctx {
 	/* The domains this task can run on */
-	u64 dom_mask;
-	u64 preferred_dom_mask;
+	u64 dom_mask[DOM_MASK_WORDS];
+	u64 preferred_dom_mask[DOM_MASK_WORDS];
 
 	/* Arena pointer to this task's domain. */
 	dom_ptr domc;
@@ -130,13 +167,30 @@ struct task_ctx {
 	u32 target_dom;
 	u32 weight;
 	bool runnable;
-	u64 dom_active_tasks_gen;
 	u64 deadline;
 
+	/*
+	 * Linkage in the load class index of the domain. idx_dom is
+	 * NO_DOM_FOUND while unlinked. See dom_task_idx_update().
+	 */
+	task_ptr idx_prev;
+	task_ptr idx_next;
+	u32 idx_dom;
+	u32 idx_class;
+	u64 idx_updated_at;
+
 	u64 sum_runtime;
 	u64 avg_runtime;
 	u64 last_run_at;
 
+	/* inputs, intermediate results and result of the last task_compute_dl() */
+	u32 dl_weight;
+	u32 dl_weight_recip;
+	u64 dl_freq_key;
+	u64 dl_freq_prio;
+	u64 dl_avg_runtime;
+	u64 dl_cached;
+
 	/* frequency with which a task is blocked (consumer) */
 	u64 blocked_freq;
 	u64 last_blocked_at;
@@ -157,24 +211,26 @@ struct task_ctx {
 	struct ravg_data dcyc_rd;
 };
 
-/* XXXETSAL Same rationale as for dom_ptr. Remove once we dump Clang 18.*/
-
-#if defined(__BPF_FEATURE_ADDR_SPACE_CAST) && !defined(BPF_ARENA_FORCE_ASM)
-typedef struct task_ctx __attribute__((address_space(1))) *task_ptr;
-#else
-typedef struct task_ctx *task_ptr;
-#endif
-
 struct bucket_ctx {
+	/* runnable count as of the last fold, may wrap below zero transiently */
 	u64 dcycle;
 	struct ravg_data rd;
+	/* per-CPU accumulator totals as of the last fold */
+	u64 pcpu_adj;
+	u64 pcpu_adj_at;
+	/* when the hot path last elected a CPU to fold, see dom_dcycle_adj() */
+	u64 folded_at;
 };
 
-struct dom_active_tasks {
-	u64 gen;
-	u64 read_idx;
-	u64 write_idx;
-	task_ptr tasks[MAX_DOM_ACTIVE_TPTRS];
+/*
+ * Per-domain doubly-linked lists of the domain's tasks, one per load class.
+ * Modified under the domain's dom_task_idx_locks entry. Readers walk the lists
+ * without locking and must tolerate tasks moving between lists underneath
+ * them.
+ */
+struct dom_task_idx {
+	task_ptr heads[LB_TASK_IDX_CLASSES];
+	u64 nr[LB_TASK_IDX_CLASSES];
 };
 
 struct dom_ctx {
@@ -183,7 +239,21 @@ struct dom_ctx {
 
 	u64 dbg_dcycle_printed_at;
 	struct bucket_ctx buckets[LB_LOAD_BUCKETS];
-	struct dom_active_tasks active_tasks;
+	/* sum of the buckets' dcycle, may wrap below zero transiently */
+	u64 nr_runnable;
+	/* nr_runnable weighted by the buckets' mid-point weights */
+	u64 runnable_load;
+	struct dom_task_idx task_idx;
+};
+
+/*
+ * Sent through the lb_triggers ring buffer when a domain's runnable load
+ * deviates from the average of its NUMA node by more than lb_trigger_pct.
+ */
+struct lb_trigger {
+	u32 dom_id;
+	u64 load;
+	u64 avg;
 };
 
 struct node_ctx {
@@ -40,9 +40,11 @@
 #define __bpf__
 #include "../../../../include/scx/common.bpf.h"
 #include "../../../../include/scx/ravg_impl.bpf.h"
+#include "../../../../include/scx/fixed_impl.bpf.h"
 #else
 #include <scx/common.bpf.h>
 #include <scx/ravg_impl.bpf.h>
+#include <scx/fixed_impl.bpf.h>
 #include <lib/sdt_task.h>
 #endif
 
@@ -75,12 +77,21 @@ const volatile u32 cpu_dom_id_map[MAX_CPUS];
 const volatile u32 dom_numa_id_map[MAX_DOMS];
 const volatile u64 dom_cpumasks[MAX_DOMS][MAX_CPUS / 64];
 const volatile u64 numa_cpumasks[MAX_NUMA_NODES][MAX_CPUS / 64];
+const volatile u64 node_dom_masks[MAX_NUMA_NODES][DOM_MASK_WORDS];
 const volatile u32 load_half_life = 1000000000	/* 1s */;
+const volatile u64 lb_interval_ns;	/* !0 enables the in-BPF load balancer */
+const volatile u32 node_nr_doms[MAX_NUMA_NODES];
+const volatile u32 lb_trigger_pct;	/* !0 enables load balancing triggers */
+const volatile u64 lb_trigger_gap_ns;
+/* reciprocals of the latency weights indexed by lat_prio, see task_compute_dl() */
+const volatile u32 dl_lat_scale_recips[DL_MAX_LAT_PRIO];
 
 const volatile bool kthreads_local;
+const volatile bool balanced_kworkers;
 const volatile bool fifo_sched = false;
 const volatile bool direct_greedy_numa;
 const volatile bool mempolicy_affinity;
+const volatile bool tune_bpf_util;	/* account pcpu_ctx->busy_ns for the tuner */
 const volatile u32 greedy_threshold;
 const volatile u32 greedy_threshold_x_numa;
 const volatile u32 debug;
@@ -169,6 +180,12 @@ static struct bpf_cpumask *scx_percpu_tmpmask(void)
 struct pcpu_ctx {
 	u32 dom_rr_cur; /* used when scanning other doms */
 	u32 dom_id;
+	/*
+	 * Time spent running tasks, read by the tuner if tune_bpf_util. While a
+	 * task is running, running_at is when it started, 0 otherwise.
+	 */
+	u64 busy_ns;
+	u64 running_at;
 	/*
 	 * Add some padding so that libbpf-rs can generate the rest of the
 	 * padding to CACHELINE_SIZE. This is necessary for now because most
@@ -207,6 +224,32 @@ struct {
 	__uint(map_flags, 0);
 } dom_dcycle_locks SEC(".maps");
 
+/*
+ * Per-CPU partial duty cycle accumulators indexed the same way as
+ * dom_dcycle_locks. See dom_dcycle_adj().
+ */
+struct dcycle_pcpu {
+	u64 adj;	/* sum of runnable count adjustments */
+	u64 adj_at;	/* sum of adjustment * timestamp */
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct dcycle_pcpu);
+	__uint(max_entries, MAX_DOMS * LB_LOAD_BUCKETS);
+	__uint(map_flags, 0);
+} dom_dcycle_pcpu SEC(".maps");
+
+/* protects the domains' task_idx, see dom_task_idx_update() */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct lock_wrapper);
+	__uint(max_entries, MAX_DOMS);
+	__uint(map_flags, 0);
+} dom_task_idx_locks SEC(".maps");
+
 const u64 ravg_1 = 1 << RAVG_FRAC_BITS;
 
 struct {
@@ -340,43 +383,258 @@ static u64 scale_inverse_fair(u64 value, u64 weight)
 	return value * 100 / weight;
 }
 
-static void dom_dcycle_adj(dom_ptr domc, u32 weight, u64 now, bool runnable)
+static u64 dcycle_val(u64 dcycle)
+{
+	/* racing folds can make the count transiently negative */
+	return (s64)dcycle > 0 ? dcycle : 0;
+}
+
+/*
+ * Fold the per-CPU accumulator totals @adj and @adj_at into @bucket as of
+ * @now. Must be called with the bucket's dom_dcycle_locks entry held. Returns
+ * the change in the bucket's runnable count.
+ */
+static u64 dom_dcycle_fold_locked(struct bucket_ctx *bucket, u64 adj, u64 adj_at,
+				  u64 now)
+{
+	struct ravg_data *rd = &bucket->rd;
+	u64 from = rd->val_at, dur, area, lo, frac;
+
+	/* a fold with a later timestamp already got in */
+	if (time_before(now, from))
+		return 0;
+
+	/* the adjustments since the last fold */
+	adj -= bucket->pcpu_adj;
+	adj_at -= bucket->pcpu_adj_at;
+	bucket->pcpu_adj += adj;
+	bucket->pcpu_adj_at += adj_at;
+
+	/*
+	 * The area under the runnable count curve between @from and @now. Each
+	 * adjustment made at t contributes adj * (@now - t). The sums wrap but
+	 * the final result fits and is thus exact.
+	 */
+	dur = now - from;
+	area = dcycle_val(bucket->dcycle) * dur + adj * now - adj_at;
+	if ((s64)area < 0)
+		area = 0;
+
+	bucket->dcycle += adj;
+
+	/*
+	 * Replay the area as two steps, the truncated average count followed by
+	 * one more for the remainder, and then switch to the new count. This
+	 * keeps the accumulated duty cycle exact while only losing where within
+	 * [@from, @now] the transitions happened.
+	 */
+	if (dur) {
+		lo = area / dur;
+		frac = area - lo * dur;
+		rd->val = lo;
+		if (frac)
+			ravg_accumulate(rd, lo + 1, now - frac, load_half_life);
+	}
+	ravg_accumulate(rd, dcycle_val(bucket->dcycle), now, load_half_life);
+	return adj;
+}
+
+static u64 lb_bucket_weight(u32 bucket)
+{
+	/* use the mid-point of the bucket, see LoadBalancer::bucket_weight() */
+	return bucket * LB_WEIGHT_PER_BUCKET + 1 + LB_WEIGHT_PER_BUCKET / 2;
+}
+
+static u64 abs_diff(u64 a, u64 b)
+{
+	return a >= b ? a - b : b - a;
+}
+
+/* runnable load sums of the domains of each node and of all domains */
+u64 node_runnable_loads[MAX_NUMA_NODES];
+u64 all_runnable_load;
+u64 lb_triggered_at;
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 4096);
+} lb_triggers SEC(".maps");
+
+/*
+ * Account @adj runnable tasks in @domc's bucket @bucket_idx to the runnable
+ * load sums and, if enabled, tell userspace when @domc's load now deviates from
+ * the average of its node by more than lb_trigger_pct. Domains which are alone
+ * in their node are compared against the average of all domains. Triggers are
+ * rate limited to one per lb_trigger_gap_ns.
+ */
+static void dom_runnable_load_adj(dom_ptr domc, u32 bucket_idx, u64 adj, u64 now)
+{
+	u64 delta = adj * lb_bucket_weight(bucket_idx);
+	u64 load, node_load, total, avg, at;
+	const volatile u32 *nidp, *nr_domsp;
+	struct lb_trigger *trig;
+	u64 *node_loadp;
+
+	load = __sync_fetch_and_add(&domc->runnable_load, delta) + delta;
+	total = __sync_fetch_and_add(&all_runnable_load, delta) + delta;
+
+	nidp = MEMBER_VPTR(dom_numa_id_map, [domc->id]);
+	if (!nidp)
+		return;
+	node_loadp = MEMBER_VPTR(node_runnable_loads, [*nidp]);
+	nr_domsp = MEMBER_VPTR(node_nr_doms, [*nidp]);
+	if (!node_loadp || !nr_domsp)
+		return;
+	node_load = __sync_fetch_and_add(node_loadp, delta) + delta;
+
+	if (!lb_trigger_pct || nr_doms <= 1)
+		return;
+
+	if (*nr_domsp > 1)
+		avg = dcycle_val(node_load) / *nr_domsp;
+	else
+		avg = dcycle_val(total) / nr_doms;
+	load = dcycle_val(load);
+
+	if (!avg || abs_diff(load, avg) * 100 <= avg * lb_trigger_pct)
+		return;
+
+	at = READ_ONCE(lb_triggered_at);
+	if (now - at < lb_trigger_gap_ns ||
+	    __sync_val_compare_and_swap(&lb_triggered_at, at, now) != at)
+		return;
+
+	trig = bpf_ringbuf_reserve(&lb_triggers, sizeof(*trig), 0);
+	if (!trig)
+		return;
+
+	trig->dom_id = domc->id;
+	trig->load = load;
+	trig->avg = avg;
+
+	/* userspace drains the ring buffer from its main loop, don't wake it */
+	bpf_ringbuf_submit(trig, BPF_RB_NO_WAKEUP);
+}
+
+/*
+ * Sum the per-CPU accumulators of dom_dcycle_pcpu entry @key into @adjp and
+ * @adj_atp.
+ */
+static void dom_dcycle_pcpu_sum(u32 key, u64 *adjp, u64 *adj_atp)
+{
+	u64 adj = 0, adj_at = 0;
+	s32 cpu;
+
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		struct dcycle_pcpu *pc;
+
+		pc = bpf_map_lookup_percpu_elem(&dom_dcycle_pcpu, &key, cpu);
+		if (!pc)
+			continue;
+
+		adj += READ_ONCE(pc->adj);
+		adj_at += READ_ONCE(pc->adj_at);
+	}
+
+	*adjp = adj;
+	*adj_atp = adj_at;
+}
+
+/*
+ * Propagate a change of @adj in the runnable count of @domc's bucket
+ * @bucket_idx, as returned by dom_dcycle_fold_locked(), to the domain's totals.
+ */
+static void dom_dcycle_apply(dom_ptr domc, u32 bucket_idx, u64 adj, u64 now)
 {
+	if (!adj)
+		return;
+
+	__sync_fetch_and_add(&domc->nr_runnable, adj);
+	dom_runnable_load_adj(domc, bucket_idx, adj, now);
+}
+
+/*
+ * Fold the per-CPU accumulators of @domc's bucket @bucket_idx into the bucket's
+ * running avg. Called from dom_dcycle_adj() by the CPU elected to fold and
+ * before the buckets are read.
+ */
+static void dom_dcycle_fold(dom_ptr domc, u32 bucket_idx, u64 now)
+{
+	u32 key = domc->id * LB_LOAD_BUCKETS + bucket_idx;
 	struct bucket_ctx *bucket;
 	struct lock_wrapper *lockw;
-	s64 adj = runnable ? 1 : -1;
-	u32 bucket_idx = 0;
-	u32 dom_id;
-
-	cast_kern(domc);
+	u64 adj, adj_at;
 
-	dom_id = domc->id;
+	if (bucket_idx >= LB_LOAD_BUCKETS)
+		return;
 
-	bucket = lookup_dom_bucket(domc, weight, &bucket_idx);
-	lockw = lookup_dom_bkt_lock(dom_id, weight);
+	dom_dcycle_pcpu_sum(key, &adj, &adj_at);
 
-	if (!bucket || !lockw)
+	bucket = (struct bucket_ctx *)&domc->buckets[bucket_idx];
+	lockw = bpf_map_lookup_elem(&dom_dcycle_locks, &key);
+	if (!lockw) {
+		scx_bpf_error("Failed to lookup dom lock");
 		return;
+	}
 
 	bpf_spin_lock(&lockw->lock);
-	bucket->dcycle += adj;
-	ravg_accumulate(&bucket->rd, bucket->dcycle, now, load_half_life);
+	adj = dom_dcycle_fold_locked(bucket, adj, adj_at, now);
 	bpf_spin_unlock(&lockw->lock);
 
-	if (adj < 0 && (s64)bucket->dcycle < 0)
-		scx_bpf_error("cpu%d dom%u bucket%u load underflow (dcycle=%lld adj=%lld)",
-			      bpf_get_smp_processor_id(), dom_id, bucket_idx,
-			      bucket->dcycle, adj);
+	dom_dcycle_apply(domc, bucket_idx, adj, now);
 
 	if (debug >=2 &&
 	    (!domc->dbg_dcycle_printed_at || now - domc->dbg_dcycle_printed_at >= 1000000000)) {
-		bpf_printk("DCYCLE ADJ dom=%u bucket=%u adj=%lld dcycle=%u avg_dcycle=%llu",
-			   dom_id, bucket_idx, adj, bucket->dcycle,
+		bpf_printk("DCYCLE FOLD dom=%u bucket=%u dcycle=%lld avg_dcycle=%llu",
+			   domc->id, bucket_idx, bucket->dcycle,
 			   ravg_read(&bucket->rd, now, load_half_life) >> RAVG_FRAC_BITS);
 		domc->dbg_dcycle_printed_at = now;
 	}
 }
 
+/*
+ * Record a runnable count adjustment of @domc's bucket for @weight. This is on
+ * the hot path of every runnable / quiescent transition and only updates the
+ * local CPU's accumulator without locking. While the bucket is active, one CPU
+ * every load_half_life / DCYCLE_FOLD_FRAC is elected through @bucket->folded_at
+ * to fold the accumulators. They are also folded whenever the buckets are read.
+ */
+static void dom_dcycle_adj(dom_ptr domc, u32 weight, u64 now, bool runnable)
+{
+	u64 adj = runnable ? 1 : -1;
+	struct dcycle_pcpu *pc;
+	struct bucket_ctx *bucket;
+	u32 bucket_idx = 0, key;
+	u64 at;
+
+	cast_kern(domc);
+
+	bucket = lookup_dom_bucket(domc, weight, &bucket_idx);
+	if (!bucket)
+		return;
+
+	key = domc->id * LB_LOAD_BUCKETS + bucket_idx;
+	pc = bpf_map_lookup_elem(&dom_dcycle_pcpu, &key);
+	if (!pc) {
+		scx_bpf_error("Failed to lookup dom%u dcycle accumulator", domc->id);
+		return;
+	}
+
+	/* only the local CPU writes, remote readers tolerate tearing */
+	WRITE_ONCE(pc->adj, pc->adj + adj);
+	WRITE_ONCE(pc->adj_at, pc->adj_at + adj * now);
+
+	/*
+	 * The fold scans all CPUs' accumulators and takes the bucket lock. Only
+	 * let the CPU which wins the cmpxchg do it so that the others don't
+	 * pile up behind it once the interval has passed.
+	 */
+	at = READ_ONCE(bucket->folded_at);
+	if ((s64)(now - at) >= load_half_life / DCYCLE_FOLD_FRAC &&
+	    __sync_val_compare_and_swap(&bucket->folded_at, at, now) == at)
+		dom_dcycle_fold(domc, bucket_idx, now);
+}
+
 static void dom_dcycle_xfer_task(struct task_struct *p, struct task_ctx *taskc,
 			         dom_ptr from_domc,
 				 dom_ptr to_domc, u64 now)
@@ -386,6 +644,7 @@ static void dom_dcycle_xfer_task(struct task_struct *p, struct task_ctx *taskc,
 	struct lock_wrapper *from_lockw, *to_lockw;
 	struct ravg_data task_dcyc_rd;
 	u64 from_dcycle[2], to_dcycle[2], task_dcycle;
+	u64 from_adj, from_adj_at, to_adj, to_adj_at;
 
 	from_lockw = lookup_dom_bkt_lock(from_domc->id, weight);
 	to_lockw = lookup_dom_bkt_lock(to_domc->id, weight);
@@ -397,6 +656,15 @@ static void dom_dcycle_xfer_task(struct task_struct *p, struct task_ctx *taskc,
 	if (!from_bucket || !to_bucket)
 		return;
 
+	/*
+	 * Both buckets are brought up to date with the per-CPU accumulators in
+	 * the same critical sections as the transfer below.
+	 */
+	dom_dcycle_pcpu_sum(from_domc->id * LB_LOAD_BUCKETS + idx,
+			    &from_adj, &from_adj_at);
+	dom_dcycle_pcpu_sum(to_domc->id * LB_LOAD_BUCKETS + idx,
+			    &to_adj, &to_adj_at);
+
 	/*
 	 * @p is moving from @from_domc to @to_domc. Its duty cycle
 	 * contribution in the relevant bucket of @from_domc should be moved
@@ -411,13 +679,16 @@ static void dom_dcycle_xfer_task(struct task_struct *p, struct task_ctx *taskc,
 
 	/* transfer out of @from_domc */
 	bpf_spin_lock(&from_lockw->lock);
-	if (taskc->runnable)
+	from_adj = dom_dcycle_fold_locked(from_bucket, from_adj, from_adj_at, now);
+	if (taskc->runnable) {
 		from_bucket->dcycle--;
+		from_adj--;
+	}
 
 	if (debug >= 2)
 		from_dcycle[0] = ravg_read(&from_bucket->rd, now, load_half_life);
 
-	ravg_transfer(&from_bucket->rd, from_bucket->dcycle,
+	ravg_transfer(&from_bucket->rd, dcycle_val(from_bucket->dcycle),
 		      &task_dcyc_rd, taskc->runnable, load_half_life, false);
 
 	if (debug >= 2)
@@ -427,13 +698,16 @@ static void dom_dcycle_xfer_task(struct task_struct *p, struct task_ctx *taskc,
 
 	/* transfer into @to_domc */
 	bpf_spin_lock(&to_lockw->lock);
-	if (taskc->runnable)
+	to_adj = dom_dcycle_fold_locked(to_bucket, to_adj, to_adj_at, now);
+	if (taskc->runnable) {
 		to_bucket->dcycle++;
+		to_adj++;
+	}
 
 	if (debug >= 2)
 		to_dcycle[0] = ravg_read(&to_bucket->rd, now, load_half_life);
 
-	ravg_transfer(&to_bucket->rd, to_bucket->dcycle,
+	ravg_transfer(&to_bucket->rd, dcycle_val(to_bucket->dcycle),
 		      &task_dcyc_rd, taskc->runnable, load_half_life, true);
 
 	if (debug >= 2)
@@ -441,6 +715,9 @@ static void dom_dcycle_xfer_task(struct task_struct *p, struct task_ctx *taskc,
 
 	bpf_spin_unlock(&to_lockw->lock);
 
+	dom_dcycle_apply(from_domc, idx, from_adj, now);
+	dom_dcycle_apply(to_domc, idx, to_adj, now);
+
 	if (debug >= 2)
 		bpf_printk("XFER DCYCLE dom%u->%u task=%lu from=%lu->%lu to=%lu->%lu",
 			   from_domc->id, to_domc->id,
@@ -504,6 +781,7 @@ struct tune_input{
 	u64 slice_ns;
 	u64 direct_greedy_cpumask[MAX_CPUS / 64];
 	u64 kick_greedy_cpumask[MAX_CPUS / 64];
+	bool lb_apply_weight;
 } tune_input;
 
 u64 tune_params_gen;
@@ -574,50 +852,10 @@ static u64 min(u64 a, u64 b)
 	return a <= b ? a : b;
 }
 
-/*
- * ** Taken directly from fair.c in the Linux kernel **
- *
- * We use this table to inversely scale deadline according to a task's
- * calculated latency factor. We preserve the comment directly from the table
- * in fair.c:
- *
- * "Nice levels are multiplicative, with a gentle 10% change for every
- * nice level changed. I.e. when a CPU-bound task goes from nice 0 to
- * nice 1, it will get ~10% less CPU time than another CPU-bound task
- * that remained on nice 0.
- *
- * The "10% effect" is relative and cumulative: from _any_ nice level,
- * if you go up 1 level, it's -10% CPU usage, if you go down 1 level
- * it's +10% CPU usage. (to achieve that we use a multiplier of 1.25.
- * If a task goes up by ~10% and another task goes down by ~10% then
- * the relative distance between them is ~25%.)"
- */
-const int sched_prio_to_weight[DL_MAX_LAT_PRIO + 1] = {
- /* -20 */     88761,     71755,     56483,     46273,     36291,
- /* -15 */     29154,     23254,     18705,     14949,     11916,
- /* -10 */      9548,      7620,      6100,      4904,      3906,
- /*  -5 */      3121,      2501,      1991,      1586,      1277,
- /*   0 */      1024,       820,       655,       526,       423,
- /*   5 */       335,       272,       215,       172,       137,
- /*  10 */       110,        87,        70,        56,        45,
- /*  15 */        36,        29,        23,        18,        15,
-};
-
-static __noinline u64 sched_prio_to_latency_weight(u64 prio)
-{
-	if (prio >= DL_MAX_LAT_PRIO) {
-		scx_bpf_error("Invalid prio index");
-		return 0;
-	}
-
-	return sched_prio_to_weight[DL_MAX_LAT_PRIO - prio - 1];
-}
-
-static u64 task_compute_dl(struct task_struct *p, struct task_ctx *taskc,
-			   u64 enq_flags)
+static u64 task_compute_dl(struct task_ctx *taskc, u32 weight)
 {
-	u64 waker_freq, blocked_freq;
-	u64 lat_prio, lat_scale, avg_run_raw, avg_run;
+	u64 waker_freq, blocked_freq, freq_key, dl;
+	u64 lat_prio, lat_scale_recip, avg_run_raw, avg_run;
 	u64 freq_factor;
 
 	/*
@@ -688,22 +926,42 @@ static u64 task_compute_dl(struct task_struct *p, struct task_ctx *taskc,
 	 */
 	waker_freq = min(taskc->waker_freq, DL_FREQ_FT_MAX);
 	blocked_freq = min(taskc->blocked_freq, DL_FREQ_FT_MAX);
-	freq_factor = blocked_freq * waker_freq * waker_freq;
 
 	/*
-	 * Scale the frequency factor according to the task's weight. A task
-	 * with higher weight is given a higher frequency factor than a task
-	 * with a lower weight.
+	 * The inputs usually haven't changed since the last call, e.g. when
+	 * the deadline computed in ops.stopping() is recomputed on enqueue.
+	 * Reuse the last result then. The weight and frequency derived parts
+	 * are also cached separately as the runtime changes more often.
 	 */
-	freq_factor = scale_up_fair(freq_factor, p->scx.weight);
+	freq_key = (blocked_freq << 32) | waker_freq;
+	if (weight == taskc->dl_weight && freq_key == taskc->dl_freq_key &&
+	    taskc->avg_runtime == taskc->dl_avg_runtime)
+		return taskc->dl_cached;
+
+	if (weight != taskc->dl_weight) {
+		taskc->dl_weight = weight;
+		taskc->dl_weight_recip = scx_recip_u32(weight);
+		taskc->dl_freq_key = -1;
+	}
 
-	/*
-	 * The above frequencies roughly follow an exponential distribution, so
-	 * use log2_u64() to linearize it to a boost priority that we can then
-	 * scale to a weight factor below.
-	 */
-	lat_prio = log2_u64(freq_factor + 1);
-	lat_prio = min(lat_prio, DL_MAX_LAT_PRIO);
+	if (freq_key != taskc->dl_freq_key) {
+		/*
+		 * Scale the frequency factor according to the task's weight. A
+		 * task with higher weight is given a higher frequency factor
+		 * than a task with a lower weight.
+		 */
+		freq_factor = blocked_freq * waker_freq * waker_freq;
+		freq_factor = scale_up_fair(freq_factor, weight);
+
+		/*
+		 * The above frequencies roughly follow an exponential
+		 * distribution, so use log2_u64() to linearize it to a boost
+		 * priority that we can then scale to a weight factor below.
+		 */
+		taskc->dl_freq_prio = min(log2_u64(freq_factor + 1), DL_MAX_LAT_PRIO);
+		taskc->dl_freq_key = freq_key;
+	}
+	lat_prio = taskc->dl_freq_prio;
 
 	/*
 	 * Next calculate a task's average runtime, and apply it to deadline
@@ -721,7 +979,7 @@ static u64 task_compute_dl(struct task_struct *p, struct task_ctx *taskc,
 	 */
 	avg_run_raw = taskc->avg_runtime / DL_RUNTIME_SCALE;
 	avg_run_raw = min(avg_run_raw, DL_MAX_LATENCY_NS);
-	avg_run_raw = scale_inverse_fair(avg_run_raw, p->scx.weight);
+	avg_run_raw = scx_div_recip(avg_run_raw * 100, taskc->dl_weight_recip);
 	avg_run = log2_u64(avg_run_raw + 1);
 
 	if (avg_run < lat_prio) {
@@ -744,9 +1002,16 @@ static u64 task_compute_dl(struct task_struct *p, struct task_ctx *taskc,
 	 * this can and almost certainly will likely change to something more
 	 * generic and/or continuous and flexible so that it can also
 	 * accommodate cgroups.
+	 *
+	 * The weight is looked up from the kernel's sched_prio_to_weight[],
+	 * capped at LB_MAX_WEIGHT. Userspace precomputes the reciprocals into
+	 * dl_lat_scale_recips[] so that no division is needed.
 	 */
-	lat_scale = sched_prio_to_latency_weight(lat_prio);
-	lat_scale = min(lat_scale, LB_MAX_WEIGHT);
+	if (lat_prio >= DL_MAX_LAT_PRIO) {
+		scx_bpf_error("Invalid prio index");
+		return 0;
+	}
+	lat_scale_recip = dl_lat_scale_recips[lat_prio];
 
 	/*
 	 * Finally, with our 'lat_scale' weight, we compute the length of the
@@ -757,7 +1022,11 @@ static u64 task_compute_dl(struct task_struct *p, struct task_ctx *taskc,
 	 * In other words, the "CPU request length" which is used to determine
 	 * the actual absolute vtime that the task is dispatched with.
 	 */
-	return scale_inverse_fair(taskc->avg_runtime, lat_scale);
+	dl = scx_div_recip(taskc->avg_runtime * 100, lat_scale_recip);
+
+	taskc->dl_avg_runtime = taskc->avg_runtime;
+	taskc->dl_cached = dl;
+	return dl;
 }
 
 static void clamp_task_vtime(struct task_struct *p, struct task_ctx *taskc, u64 enq_flags)
@@ -778,13 +1047,155 @@ static void clamp_task_vtime(struct task_struct *p, struct task_ctx *taskc, u64
 	 */
 	if (time_before(p->scx.dsq_vtime, min_vruntime)) {
 		p->scx.dsq_vtime = min_vruntime;
-		taskc->deadline = p->scx.dsq_vtime + task_compute_dl(p, taskc, enq_flags);
+		taskc->deadline = p->scx.dsq_vtime + task_compute_dl(taskc, p->scx.weight);
 		stat_add(RUSTY_STAT_DL_CLAMP, 1);
 	} else {
 		stat_add(RUSTY_STAT_DL_PRESET, 1);
 	}
 }
 
+/*
+ * The load of @taskc as seen by the load balancers. The duty cycle is scaled by
+ * the weight if @apply_weight, by LB_DEFAULT_WEIGHT otherwise.
+ */
+static u64 task_lb_load(struct task_ctx *taskc, u64 now, bool apply_weight)
+{
+	u64 load = ravg_read(&taskc->dcyc_rd, now, load_half_life);
+
+	return load * (apply_weight ? min(taskc->weight, LB_MAX_WEIGHT) : LB_DEFAULT_WEIGHT);
+}
+
+static u32 task_load_class(u64 load)
+{
+	/* log2_u64() returns the number of significant bits */
+	return min(log2_u64(load), LB_TASK_IDX_CLASSES - 1);
+}
+
+static void dom_task_idx_unlink_locked(dom_ptr domc, struct task_ctx *taskc)
+{
+	task_ptr prev = taskc->idx_prev, next = taskc->idx_next;
+	u32 class = taskc->idx_class;
+
+	if (class >= LB_TASK_IDX_CLASSES)
+		return;
+
+	cast_kern(prev);
+	cast_kern(next);
+
+	if (prev)
+		prev->idx_next = taskc->idx_next;
+	else
+		domc->task_idx.heads[class] = taskc->idx_next;
+
+	if (next)
+		next->idx_prev = taskc->idx_prev;
+
+	domc->task_idx.nr[class]--;
+	taskc->idx_prev = NULL;
+	taskc->idx_next = NULL;
+}
+
+static void dom_task_idx_link_locked(dom_ptr domc, struct task_ctx *taskc,
+				     task_ptr self, u32 class)
+{
+	task_ptr head;
+
+	if (class >= LB_TASK_IDX_CLASSES)
+		return;
+
+	head = domc->task_idx.heads[class];
+	taskc->idx_prev = NULL;
+	taskc->idx_next = head;
+	taskc->idx_class = class;
+
+	cast_kern(head);
+	if (head)
+		head->idx_prev = self;
+
+	domc->task_idx.heads[class] = self;
+	domc->task_idx.nr[class]++;
+}
+
+static struct lock_wrapper *lookup_dom_task_idx_lock(u32 dom_id)
+{
+	struct lock_wrapper *lockw;
+
+	lockw = bpf_map_lookup_elem(&dom_task_idx_locks, &dom_id);
+	if (!lockw)
+		scx_bpf_error("Failed to lookup dom%u task_idx lock", dom_id);
+
+	return lockw;
+}
+
+/*
+ * Move @p to load class @class of domain @dom_id's task index. NO_DOM_FOUND
+ * removes @p from the index. Each task is only ever updated from its own
+ * scheduling events, so only the lists need locking.
+ */
+static void dom_task_idx_update(struct task_struct *p, struct task_ctx *taskc,
+				u32 dom_id, u32 class)
+{
+	task_ptr self = (task_ptr)sdt_task_data(p);
+	struct lock_wrapper *lockw;
+	dom_ptr old_domc, domc;
+
+	if (taskc->idx_dom == dom_id && taskc->idx_class == class)
+		return;
+
+	cast_user(self);
+
+	if (taskc->idx_dom != NO_DOM_FOUND) {
+		if (!(old_domc = lookup_dom_ctx(taskc->idx_dom)) ||
+		    !(lockw = lookup_dom_task_idx_lock(taskc->idx_dom)))
+			return;
+
+		bpf_spin_lock(&lockw->lock);
+		dom_task_idx_unlink_locked(old_domc, taskc);
+		if (taskc->idx_dom == dom_id)
+			dom_task_idx_link_locked(old_domc, taskc, self, class);
+		bpf_spin_unlock(&lockw->lock);
+
+		if (taskc->idx_dom == dom_id)
+			return;
+		taskc->idx_dom = NO_DOM_FOUND;
+	}
+
+	if (dom_id == NO_DOM_FOUND)
+		return;
+
+	if (!(domc = lookup_dom_ctx(dom_id)) ||
+	    !(lockw = lookup_dom_task_idx_lock(dom_id)))
+		return;
+
+	bpf_spin_lock(&lockw->lock);
+	dom_task_idx_link_locked(domc, taskc, self, class);
+	bpf_spin_unlock(&lockw->lock);
+
+	taskc->idx_dom = dom_id;
+}
+
+/*
+ * Keep runnable @p's position in @domc's task index roughly up to date so that
+ * the load balancers can find the heaviest tasks without scanning. @p is linked
+ * when it becomes runnable, reclassified while it keeps running and unlinked in
+ * rusty_quiescent() so that sleeping tasks don't linger in heavy classes while
+ * their loads decay. The load balancers read the actual loads and tolerate
+ * classes which are stale by up to load_half_life / LB_TASK_IDX_REFRESH_FRAC.
+ */
+static void task_idx_refresh(struct task_struct *p, struct task_ctx *taskc,
+			     dom_ptr domc, u64 now)
+{
+	u64 load;
+
+	if (taskc->idx_dom == domc->id &&
+	    now - taskc->idx_updated_at < load_half_life / LB_TASK_IDX_REFRESH_FRAC)
+		return;
+
+	load = task_lb_load(taskc, now, tune_input.lb_apply_weight);
+	dom_task_idx_update(p, taskc, domc->id, task_load_class(load));
+	taskc->idx_updated_at = now;
+}
+
 static bool task_set_domain(struct task_struct *p __arg_trusted,
 			    u32 new_dom_id, bool init_dsq_vtime)
 {
@@ -835,8 +1246,12 @@ static bool task_set_domain(struct task_struct *p __arg_trusted,
 	if (bpf_cpumask_intersects(cast_mask(d_cpumask), p->cpus_ptr)) {
 		u64 now = scx_bpf_now();
 
-		if (!init_dsq_vtime)
+		if (!init_dsq_vtime) {
 			dom_xfer_task(p, new_dom_id, now);
+			if (taskc->idx_dom != NO_DOM_FOUND)
+				dom_task_idx_update(p, taskc, new_dom_id,
+						    taskc->idx_class);
+		}
 
 		taskc->target_dom = new_dom_id;
 		taskc->domc = new_domc;
@@ -1259,21 +1674,83 @@ u32 dom_node_id(u32 dom_id)
 }
 
 /*
- * Returns the dom mask for a node.
+ * Domain masks are bitmaps of DOM_MASK_WORDS u64 words indexed by domain ID.
  */
-static u64 node_dom_mask(u32 node_id)
+static bool dom_mask_test(const u64 *mask, u32 dom_id)
 {
-	u64 mask = 0;
-	u32 dom_id = 0;
+	if (dom_id >= MAX_DOMS)
+		return false;
+	return mask[dom_id / 64] & (1LLU << (dom_id % 64));
+}
 
-	bpf_for(dom_id, 0, nr_doms) {
-		if (dom_node_id(dom_id) != node_id)
-			continue;
+static void dom_mask_set(u64 *mask, u32 dom_id)
+{
+	if (dom_id < MAX_DOMS)
+		mask[dom_id / 64] |= 1LLU << (dom_id % 64);
+}
+
+static void dom_mask_clear(u64 *mask, u32 dom_id)
+{
+	if (dom_id < MAX_DOMS)
+		mask[dom_id / 64] &= ~(1LLU << (dom_id % 64));
+}
+
+static void dom_mask_zero(u64 *mask)
+{
+	u32 w;
+
+	for (w = 0; w < DOM_MASK_WORDS; w++)
+		mask[w] = 0;
+}
+
+static bool dom_mask_empty(const u64 *mask)
+{
+	u64 bits = 0;
+	u32 w;
+
+	for (w = 0; w < DOM_MASK_WORDS; w++)
+		bits |= mask[w];
+
+	return !bits;
+}
 
-		mask |= 1LLU << dom_id;
+/*
+ * Returns the first domain set in @mask at or after @from, NO_DOM_FOUND if
+ * there's none. Clear words are skipped as a whole.
+ */
+static u32 dom_mask_next(const u64 *mask, u32 from)
+{
+	u32 w;
+
+	for (w = 0; w < DOM_MASK_WORDS; w++) {
+		u64 bits = mask[w];
+
+		if (w < from / 64)
+			continue;
+		if (w == from / 64)
+			bits &= -1LLU << (from % 64);
+		/* log2_u64() of the lowest set bit is its index + 1 */
+		if (bits)
+			return w * 64 + log2_u64(bits & -bits) - 1;
 	}
 
-	return mask;
+	return NO_DOM_FOUND;
+}
+
+/*
+ * ORs the domains of @node_id into @mask.
+ */
+static void node_dom_mask_or(u32 node_id, u64 *mask)
+{
+	const volatile u64 *nmask;
+	u32 w;
+
+	nmask = MEMBER_VPTR(node_dom_masks, [node_id]);
+	if (!nmask)
+		return;
+
+	for (w = 0; w < DOM_MASK_WORDS; w++)
+		mask[w] |= nmask[w];
 }
 
 /*
@@ -1288,7 +1765,7 @@ static void task_set_preferred_mempolicy_dom_mask(struct task_struct *p,
 	u32 val = 0;
 	void *mask;
 
-	taskc->preferred_dom_mask = 0;
+	dom_mask_zero(taskc->preferred_dom_mask);
 
 	p_cpumask = lookup_task_bpfmask(p);
 
@@ -1304,8 +1781,8 @@ static void task_set_preferred_mempolicy_dom_mask(struct task_struct *p,
 	// usage of the node can be checked to follow the same algorithm for
 	// where memory allocations will occur.
 	if ((int)p->mempolicy->home_node >= 0) {
-		taskc->preferred_dom_mask =
-			node_dom_mask((u32)p->mempolicy->home_node);
+		node_dom_mask_or((u32)p->mempolicy->home_node,
+				 taskc->preferred_dom_mask);
 		return;
 	}
 
@@ -1317,15 +1794,166 @@ static void task_set_preferred_mempolicy_dom_mask(struct task_struct *p,
 		if (!(val & 1 << node_id))
 			continue;
 
-		taskc->preferred_dom_mask |= node_dom_mask(node_id);
+		node_dom_mask_or(node_id, taskc->preferred_dom_mask);
 	}
 
 	return;
 }
 
+/*
+ * Load-aware work stealing
+ *
+ * Instead of probing every domain round-robin, an idle CPU first tries the
+ * domains of the node's steal summary which are ranked by the number of queued
+ * tasks. Only if all of them come up empty, the rest of the candidates are
+ * walked round-robin.
+ */
+struct node_steal_ctx {
+	u64 refreshed_at;
+	u32 nr_cands;
+	u32 cands[STEAL_NR_CANDS];
+};
+
+struct node_steal_ctx node_steal_ctxs[MAX_NUMA_NODES];
+
+/*
+ * Rank by the live number of queued tasks alone. @domc->nr_runnable would make
+ * a finer tie-breaker but is only updated when the per-CPU adjustments are
+ * folded and can be arbitrarily stale in between.
+ */
+static u64 dom_steal_score(u32 dom_id)
+{
+	s32 nr_queued = scx_bpf_dsq_nr_queued(dom_id);
+
+	return nr_queued > 0 ? nr_queued : 0;
+}
+
+static void node_steal_refresh(struct node_steal_ctx *nsc,
+			       const volatile u64 *node_doms)
+{
+	u64 doms[DOM_MASK_WORDS], scores[STEAL_NR_CANDS] = {};
+	u32 cands[STEAL_NR_CANDS] = {}, nr_cands = 0, i, j, w;
+
+	for (w = 0; w < DOM_MASK_WORDS; w++)
+		doms[w] = node_doms[w];
+
+	bpf_for(i, 0, nr_doms) {
+		u32 dom = dom_mask_next(doms, 0), pos;
+		u64 score;
+
+		if (dom == NO_DOM_FOUND)
+			break;
+		dom_mask_clear(doms, dom);
+
+		if (!(score = dom_steal_score(dom)))
+			continue;
+
+		/* insert into the top STEAL_NR_CANDS sorted by score */
+		for (pos = 0; pos < nr_cands && pos < STEAL_NR_CANDS; pos++)
+			if (score > scores[pos])
+				break;
+		if (pos >= STEAL_NR_CANDS)
+			continue;
+
+		for (j = STEAL_NR_CANDS - 1; j > pos; j--) {
+			scores[j] = scores[j - 1];
+			cands[j] = cands[j - 1];
+		}
+		scores[pos] = score;
+		cands[pos] = dom;
+		if (nr_cands < STEAL_NR_CANDS)
+			nr_cands++;
+	}
+
+	/* racing readers may see a mix of old and new, both are fine */
+	for (j = 0; j < STEAL_NR_CANDS; j++)
+		WRITE_ONCE(nsc->cands[j], cands[j]);
+	WRITE_ONCE(nsc->nr_cands, nr_cands);
+}
+
+/*
+ * Try the summarized candidates of @node_id which are in @doms. Probed domains
+ * are cleared from @doms so that dispatch_steal() doesn't visit them again.
+ */
+static bool dispatch_steal_summary(u32 node_id, u64 *doms, u32 max_queued)
+{
+	const volatile u64 *node_doms;
+	struct node_steal_ctx *nsc;
+	u64 now = scx_bpf_now(), refreshed_at;
+	u32 i;
+
+	nsc = MEMBER_VPTR(node_steal_ctxs, [node_id]);
+	node_doms = MEMBER_VPTR(node_dom_masks, [node_id]);
+	if (!nsc || !node_doms)
+		return false;
+
+	/* elect one CPU to refresh the stale summary, the others use it as-is */
+	refreshed_at = READ_ONCE(nsc->refreshed_at);
+	if (now - refreshed_at >= STEAL_REFRESH_NS &&
+	    __sync_val_compare_and_swap(&nsc->refreshed_at, refreshed_at, now) == refreshed_at)
+		node_steal_refresh(nsc, node_doms);
+
+	bpf_for(i, 0, STEAL_NR_CANDS) {
+		u32 dom;
+
+		if (i >= READ_ONCE(nsc->nr_cands) || i >= STEAL_NR_CANDS)
+			break;
+
+		dom = READ_ONCE(nsc->cands[i]);
+		if (!dom_mask_test(doms, dom))
+			continue;
+		dom_mask_clear(doms, dom);
+
+		if (max_queued && scx_bpf_dsq_nr_queued(dom) >= max_queued)
+			continue;
+
+		stat_add(RUSTY_STAT_STEAL_PROBES, 1);
+		if (scx_bpf_dsq_move_to_local(dom))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Try to move a task from one of the domains in @doms to the local DSQ,
+ * visiting only the set bits round-robin from the CPU's cursor. Empty domains
+ * aren't probed and ones with @max_queued or more queued tasks are skipped if
+ * @max_queued is set. @doms is consumed.
+ */
+static bool dispatch_steal(struct pcpu_ctx *pcpuc, u64 *doms, u32 max_queued)
+{
+	u32 dom = pcpuc->dom_rr_cur++ % nr_doms, i;
+
+	bpf_for(i, 0, nr_doms) {
+		u32 next = dom_mask_next(doms, dom);
+		u64 nr_queued;
+
+		if (next == NO_DOM_FOUND)
+			next = dom_mask_next(doms, 0);
+		if (next == NO_DOM_FOUND)
+			break;
+
+		dom_mask_clear(doms, next);
+		dom = next + 1;
+
+		nr_queued = scx_bpf_dsq_nr_queued(next);
+		if (!nr_queued || (max_queued && nr_queued >= max_queued))
+			continue;
+
+		stat_add(RUSTY_STAT_STEAL_PROBES, 1);
+		if (scx_bpf_dsq_move_to_local(next))
+			return true;
+	}
+
+	return false;
+}
+
 void BPF_STRUCT_OPS(rusty_dispatch, s32 cpu, struct task_struct *prev)
 {
-	u32 curr_dom = cpu_to_dom_id(cpu), dom;
+	u32 curr_dom = cpu_to_dom_id(cpu), w, i;
+	const volatile u64 *node_doms;
+	u64 doms[DOM_MASK_WORDS];
 	struct pcpu_ctx *pcpuc;
 	u32 my_node;
 
@@ -1352,35 +1980,50 @@ void BPF_STRUCT_OPS(rusty_dispatch, s32 cpu, struct task_struct *prev)
 		return;
 
 	my_node = dom_node_id(curr_dom);
+	node_doms = MEMBER_VPTR(node_dom_masks, [my_node]);
+	if (!node_doms)
+		return;
 
 	/* try to steal a task from domains on the current NUMA node */
-	bpf_repeat(nr_doms - 1) {
-		dom = pcpuc->dom_rr_cur++ % nr_doms;
-		if (dom == curr_dom || dom_node_id(dom) != my_node)
-			continue;
+	for (w = 0; w < DOM_MASK_WORDS; w++)
+		doms[w] = node_doms[w];
+	dom_mask_clear(doms, curr_dom);
 
-		if (scx_bpf_dsq_move_to_local(dom)) {
-			stat_add(RUSTY_STAT_GREEDY_LOCAL, 1);
-			return;
-		}
+	if (dispatch_steal_summary(my_node, doms, 0) ||
+	    dispatch_steal(pcpuc, doms, 0)) {
+		stat_add(RUSTY_STAT_GREEDY_LOCAL, 1);
+		return;
 	}
 
 	if (!greedy_threshold_x_numa || nr_nodes == 1)
 		return;
 
 	/* try to steal a task from domains on other NUMA nodes */
-	bpf_repeat(nr_doms - 1) {
-		dom = pcpuc->dom_rr_cur++ % nr_doms;
+	for (w = 0; w < DOM_MASK_WORDS; w++) {
+		u64 valid;
 
-		if (dom_node_id(dom) == my_node || dom == curr_dom ||
-		    scx_bpf_dsq_nr_queued(dom) >= greedy_threshold_x_numa)
-			continue;
+		if ((w + 1) * 64 <= nr_doms)
+			valid = -1LLU;
+		else if (w * 64 < nr_doms)
+			valid = (1LLU << (nr_doms % 64)) - 1;
+		else
+			valid = 0;
+
+		doms[w] = valid & ~node_doms[w];
+	}
 
-		if (scx_bpf_dsq_move_to_local(dom)) {
+	bpf_for(i, 1, nr_nodes) {
+		if (dispatch_steal_summary((my_node + i) % nr_nodes, doms,
+					   greedy_threshold_x_numa)) {
 			stat_add(RUSTY_STAT_GREEDY_XNUMA, 1);
 			return;
 		}
 	}
+
+	if (dispatch_steal(pcpuc, doms, greedy_threshold_x_numa)) {
+		stat_add(RUSTY_STAT_GREEDY_XNUMA, 1);
+		return;
+	}
 }
 
 /*
@@ -1408,6 +2051,7 @@ void BPF_STRUCT_OPS(rusty_runnable, struct task_struct *p, u64 enq_flags)
 	u64 now = scx_bpf_now(), interval;
 	struct task_struct *waker;
 	struct task_ctx *wakee_ctx, *waker_ctx;
+	dom_ptr domc;
 
 	if (!(wakee_ctx = lookup_task_ctx(p)))
 		return;
@@ -1417,6 +2061,9 @@ void BPF_STRUCT_OPS(rusty_runnable, struct task_struct *p, u64 enq_flags)
 	task_load_adj(wakee_ctx, now, true);
 	dom_dcycle_adj(wakee_ctx->domc, wakee_ctx->weight, now, true);
 
+	if ((domc = task_domain(wakee_ctx)))
+		task_idx_refresh(p, wakee_ctx, domc, now);
+
 	if (fifo_sched)
 		return;
 
@@ -1448,10 +2095,13 @@ static void running_update_vtime(struct task_struct *p,
 
 void BPF_STRUCT_OPS(rusty_running, struct task_struct *p)
 {
-	task_ptr usrptr = (task_ptr)sdt_task_data(p);
+	u64 now = scx_bpf_now();
+	struct pcpu_ctx *pcpuc;
 	struct task_ctx *taskc;
 	dom_ptr domc;
-	u32 dap_gen;
+
+	if (tune_bpf_util && (pcpuc = lookup_pcpu_ctx(bpf_get_smp_processor_id())))
+		WRITE_ONCE(pcpuc->running_at, now);
 
 	if (!(taskc = lookup_task_ctx(p)))
 		return;
@@ -1462,34 +2112,13 @@ void BPF_STRUCT_OPS(rusty_running, struct task_struct *p)
 		return;
 	}
 
-	/*
-	 * Record that @p has been active in @domc. Load balancer will only
-	 * consider recently active tasks. Access synchronization rules aren't
-	 * strict. We just need to be right most of the time.
-	 */
-	dap_gen = domc->active_tasks.gen;
-	if (taskc->dom_active_tasks_gen != dap_gen) {
-		u64 idx = __sync_fetch_and_add(&domc->active_tasks.write_idx, 1) %
-			MAX_DOM_ACTIVE_TPTRS;
-
-		if (idx >= MAX_DOM_ACTIVE_TPTRS) {
-			scx_bpf_error("dom_active_tasks[%u][%llu] out of bounds indexing",
-				      domc->id, idx);
-			return;
-		}
-
-		usrptr = (task_ptr)sdt_task_data(p);
-		cast_user(usrptr);
-
-		domc->active_tasks.tasks[idx] = usrptr;
-		taskc->dom_active_tasks_gen = dap_gen;
-	}
+	task_idx_refresh(p, taskc, domc, now);
 
 	if (fifo_sched)
 		return;
 
 	running_update_vtime(p, taskc, domc);
-	taskc->last_run_at = scx_bpf_now();
+	taskc->last_run_at = now;
 }
 
 static void stopping_update_vtime(struct task_struct *p,
@@ -1505,14 +2134,21 @@ static void stopping_update_vtime(struct task_struct *p,
 	taskc->avg_runtime = calc_avg(taskc->avg_runtime, taskc->sum_runtime);
 
 	p->scx.dsq_vtime += scale_inverse_fair(delta, p->scx.weight);
-	taskc->deadline = p->scx.dsq_vtime + task_compute_dl(p, taskc, 0);
+	taskc->deadline = p->scx.dsq_vtime + task_compute_dl(taskc, p->scx.weight);
 }
 
 void BPF_STRUCT_OPS(rusty_stopping, struct task_struct *p, bool runnable)
 {
+	struct pcpu_ctx *pcpuc;
 	struct task_ctx *taskc;
 	dom_ptr domc;
 
+	if (tune_bpf_util && (pcpuc = lookup_pcpu_ctx(bpf_get_smp_processor_id())) &&
+	    pcpuc->running_at) {
+		WRITE_ONCE(pcpuc->busy_ns, pcpuc->busy_ns + scx_bpf_now() - pcpuc->running_at);
+		WRITE_ONCE(pcpuc->running_at, 0);
+	}
+
 	if (fifo_sched)
 		return;
 
@@ -1539,6 +2175,7 @@ void BPF_STRUCT_OPS(rusty_quiescent, struct task_struct *p, u64 deq_flags)
 
 	task_load_adj(taskc, now, false);
 	dom_dcycle_adj(domc, taskc->weight, now, false);
+	dom_task_idx_update(p, taskc, NO_DOM_FOUND, 0);
 
 	if (fifo_sched)
 		return;
@@ -1571,7 +2208,7 @@ static u32 task_pick_domain(struct task_ctx *taskc, struct task_struct *p,
 	if (cpu < 0 || cpu >= MAX_CPUS)
 		return NO_DOM_FOUND;
 
-	taskc->dom_mask = 0;
+	dom_mask_zero(taskc->dom_mask);
 
 	dom = pcpu_ctx[cpu].dom_rr_cur++;
 	task_set_preferred_mempolicy_dom_mask(p, taskc);
@@ -1579,7 +2216,7 @@ static u32 task_pick_domain(struct task_ctx *taskc, struct task_struct *p,
 		dom = (dom + 1) % nr_doms;
 
 		if (cpumask_intersects_domain(cpumask, dom)) {
-			taskc->dom_mask |= 1LLU << dom;
+			dom_mask_set(taskc->dom_mask, dom);
 			/*
 			 * The starting point is round-robin'd and the first
 			 * match should be spread across all the domains.
@@ -1587,10 +2224,10 @@ static u32 task_pick_domain(struct task_ctx *taskc, struct task_struct *p,
 			if (first_dom == NO_DOM_FOUND)
 				first_dom = dom;
 
-			if (taskc->preferred_dom_mask == 0)
+			if (dom_mask_empty(taskc->preferred_dom_mask))
 			       continue;
 
-			if (((1LLU << dom) & taskc->preferred_dom_mask)
+			if (dom_mask_test(taskc->preferred_dom_mask, dom)
 			    && preferred_dom == NO_DOM_FOUND)
 				preferred_dom = dom;
 		}
@@ -1643,11 +2280,9 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(rusty_init_task, struct task_struct *p,
 		return -ENOMEM;
 
 	*taskc = (struct task_ctx) {
-		.dom_active_tasks_gen = -1,
+		.idx_dom = NO_DOM_FOUND,
 		.last_blocked_at = now,
 		.last_woke_at = now,
-		.preferred_dom_mask = 0,
-
 	};
 
 	if (debug >= 2)
@@ -1690,8 +2325,12 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(rusty_init_task, struct task_struct *p,
 void BPF_STRUCT_OPS(rusty_exit_task, struct task_struct *p,
 		    struct scx_exit_task_args *args)
 {
+	struct task_ctx *taskc;
 	long ret;
 
+	if ((taskc = try_lookup_task_ctx(p)))
+		dom_task_idx_update(p, taskc, NO_DOM_FOUND, 0);
+
 	sdt_task_free(p);
 
 	/*
@@ -1708,6 +2347,301 @@ void BPF_STRUCT_OPS(rusty_exit_task, struct task_struct *p,
 
 }
 
+/*
+ * In-BPF load balancing
+ *
+ * If lb_interval_ns is set, a BPF timer periodically derives the domain loads
+ * from the duty cycle buckets and retargets tasks found in the task index of the
+ * most loaded domain to the least loaded one by updating their target_dom,
+ * the same way the userspace load balancer does. The actual migration
+ * happens in rusty_enqueue() through task_set_domain() and dom_xfer_task().
+ *
+ * This reacts without the round trip through userspace but the policy is
+ * simpler. Tasks are moved one domain pair at a time, domains in the same
+ * NUMA node are preferred as pull targets and infeasible weights aren't
+ * accounted for.
+ */
+struct lb_timer {
+	struct bpf_timer timer;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct lb_timer);
+} lb_timer SEC(".maps");
+
+/* domain loads as of the last in-BPF balancing round */
+u64 lb_dom_loads[MAX_DOMS];
+
+static u64 lb_dom_load(dom_ptr domc, u64 now, bool apply_weight)
+{
+	u64 load = 0;
+	u32 bucket;
+
+	bpf_for(bucket, 0, LB_LOAD_BUCKETS) {
+		struct bucket_ctx *bkt = (struct bucket_ctx *)&domc->buckets[bucket];
+		u64 weight = apply_weight ? lb_bucket_weight(bucket) : LB_DEFAULT_WEIGHT;
+
+		dom_dcycle_fold(domc, bucket, now);
+		load += ravg_read(&bkt->rd, now, load_half_life) * weight;
+	}
+
+	return load;
+}
+
+/*
+ * Find the task in @push_id whose load is the closest to @to_xfer and retarget
+ * it to @pull_id. The task index is walked from the class above @to_xfer's
+ * downwards. Returns the load of the retargeted task, 0 if none could be
+ * found.
+ */
+static u64 lb_xfer_task(u32 push_id, u32 pull_id, u64 to_push, u64 to_pull,
+			u64 to_xfer, u64 now, bool apply_weight)
+{
+	struct task_ctx *best = NULL;
+	u64 best_load = 0, best_imbal = to_push + to_pull;
+	u32 class, i;
+	task_ptr tptr;
+	dom_ptr domc;
+
+	if (!(domc = try_lookup_dom_ctx(push_id)))
+		return 0;
+
+	class = min(task_load_class(to_xfer) + 1, LB_TASK_IDX_CLASSES - 1);
+	tptr = domc->task_idx.heads[class];
+
+	bpf_for(i, 0, LB_BPF_MAX_SCAN) {
+		struct task_ctx *taskc;
+		u64 load, imbal;
+
+		/* end of the list, move onto the next lighter class */
+		if (!tptr) {
+			if (!class)
+				break;
+			class--;
+			tptr = domc->task_idx.heads[class];
+			continue;
+		}
+
+		cast_kern(tptr);
+		taskc = (struct task_ctx *)tptr;
+
+		/* @taskc moved while we were walking, skip the rest of the class */
+		if (taskc->idx_dom != push_id || taskc->idx_class != class) {
+			tptr = NULL;
+			continue;
+		}
+		tptr = taskc->idx_next;
+
+		if (taskc->target_dom != push_id ||
+		    !dom_mask_test(taskc->dom_mask, pull_id) ||
+		    (balanced_kworkers && taskc->is_kworker))
+			continue;
+
+		load = task_lb_load(taskc, now, apply_weight);
+		if (!load)
+			continue;
+
+		/* pick the task which reduces the imbalance the most */
+		imbal = abs_diff(to_push, load) + abs_diff(to_pull, load);
+		if (imbal < best_imbal) {
+			best = taskc;
+			best_load = load;
+			best_imbal = imbal;
+		}
+
+		if (abs_diff(load, to_xfer) < to_xfer / 8)
+			break;
+	}
+
+	if (!best)
+		return 0;
+
+	best->target_dom = pull_id;
+	return best_load;
+}
+
+static s32 lb_pick_pull_dom(u32 push_id, u64 thresh, bool same_node)
+{
+	u32 push_node = dom_node_id(push_id), dom_id;
+	u64 min_load = thresh;
+	s32 pull_id = -ENOENT;
+
+	bpf_for(dom_id, 0, nr_doms) {
+		u64 *loadp = MEMBER_VPTR(lb_dom_loads, [dom_id]);
+
+		if (!loadp || dom_id == push_id)
+			continue;
+		if (same_node && dom_node_id(dom_id) != push_node)
+			continue;
+		if (*loadp < min_load) {
+			min_load = *loadp;
+			pull_id = dom_id;
+		}
+	}
+
+	return pull_id;
+}
+
+static void lb_balance(void)
+{
+	bool apply_weight = tune_input.lb_apply_weight;
+	u64 now = scx_bpf_now(), total = 0, avg, margin;
+	u32 dom_id, i;
+
+	bpf_for(dom_id, 0, nr_doms) {
+		u64 *loadp = MEMBER_VPTR(lb_dom_loads, [dom_id]);
+		dom_ptr domc;
+
+		if (!loadp || !(domc = try_lookup_dom_ctx(dom_id)))
+			return;
+
+		*loadp = lb_dom_load(domc, now, apply_weight);
+		total += *loadp;
+	}
+
+	avg = total / nr_doms;
+	margin = avg * LB_IMBAL_HIGH_PCT / 100;
+
+	bpf_for(i, 0, LB_BPF_MAX_XFERS) {
+		u64 push_load = 0, *push_loadp, *pull_loadp, to_push, to_pull, xfer;
+		s32 push_id = -ENOENT, pull_id;
+
+		bpf_for(dom_id, 0, nr_doms) {
+			u64 *loadp = MEMBER_VPTR(lb_dom_loads, [dom_id]);
+
+			if (loadp && *loadp > push_load) {
+				push_load = *loadp;
+				push_id = dom_id;
+			}
+		}
+
+		if (push_id < 0 || push_load <= avg + margin)
+			break;
+
+		pull_id = lb_pick_pull_dom(push_id, avg - margin, true);
+		if (pull_id < 0)
+			pull_id = lb_pick_pull_dom(push_id, avg - margin, false);
+		if (pull_id < 0)
+			break;
+
+		push_loadp = MEMBER_VPTR(lb_dom_loads, [push_id]);
+		pull_loadp = MEMBER_VPTR(lb_dom_loads, [pull_id]);
+		if (!push_loadp || !pull_loadp)
+			break;
+
+		to_push = *push_loadp - avg;
+		to_pull = avg - *pull_loadp;
+		xfer = lb_xfer_task(push_id, pull_id, to_push, to_pull,
+				    min(to_push, to_pull) * LB_XFER_TARGET_PCT / 100,
+				    now, apply_weight);
+		if (!xfer)
+			break;
+
+		*push_loadp -= min(xfer, *push_loadp);
+		*pull_loadp += xfer;
+	}
+}
+
+static int lb_timer_cb(void *map, int *key, struct bpf_timer *timer)
+{
+	int err;
+
+	lb_balance();
+
+	err = bpf_timer_start(timer, lb_interval_ns, 0);
+	if (err)
+		scx_bpf_error("Failed to arm lb timer");
+
+	return 0;
+}
+
+static s32 lb_timer_init(void)
+{
+	struct bpf_timer *timer;
+	u32 key = 0;
+	int err;
+
+	timer = bpf_map_lookup_elem(&lb_timer, &key);
+	if (!timer) {
+		scx_bpf_error("Failed to lookup lb timer");
+		return -ESRCH;
+	}
+
+	bpf_timer_init(timer, &lb_timer, CLOCK_MONOTONIC);
+	bpf_timer_set_callback(timer, lb_timer_cb);
+	err = bpf_timer_start(timer, lb_interval_ns, 0);
+	if (err) {
+		scx_bpf_error("Failed to arm lb timer");
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Fold the per-CPU duty cycle accumulators into all domain buckets. Called via
+ * BPF_PROG_RUN by the userspace load balancer before it reads the buckets.
+ */
+SEC("syscall")
+int BPF_PROG(rusty_fold_dcycles)
+{
+	u64 now = scx_bpf_now();
+	u32 dom_id, bucket;
+
+	bpf_for(dom_id, 0, nr_doms) {
+		dom_ptr domc;
+
+		if (!(domc = try_lookup_dom_ctx(dom_id)))
+			return -ENOENT;
+
+		bpf_for(bucket, 0, LB_LOAD_BUCKETS)
+			dom_dcycle_fold(domc, bucket, now);
+	}
+
+	return 0;
+}
+
+/* scratch task and results of rusty_bench_dl */
+struct task_ctx dl_bench_taskc;
+u64 dl_bench_cached_ns;
+u64 dl_bench_uncached_ns;
+
+/*
+ * Time DL_BENCH_ITERS calls of task_compute_dl() with unchanged inputs, as on
+ * the enqueue following ops.stopping(), and with inputs changing on every
+ * call. Run from userspace with --bench-dl.
+ */
+SEC("syscall")
+int BPF_PROG(rusty_bench_dl)
+{
+	struct task_ctx *taskc = &dl_bench_taskc;
+	u64 started_at, sum = 0;
+	u32 i;
+
+	taskc->avg_runtime = 500 * NSEC_PER_USEC;
+	taskc->waker_freq = 50;
+	taskc->blocked_freq = 200;
+
+	started_at = bpf_ktime_get_ns();
+	bpf_for(i, 0, DL_BENCH_ITERS)
+		sum += task_compute_dl(taskc, 100);
+	dl_bench_cached_ns = bpf_ktime_get_ns() - started_at;
+
+	started_at = bpf_ktime_get_ns();
+	bpf_for(i, 0, DL_BENCH_ITERS) {
+		taskc->avg_runtime = (u64)(i & 0xffff) << 10;
+		taskc->waker_freq = i & 0x3ff;
+		taskc->blocked_freq = (i >> 4) & 0x3ff;
+		sum += task_compute_dl(taskc, 1 + (i & 0xfff));
+	}
+	dl_bench_uncached_ns = bpf_ktime_get_ns() - started_at;
+
+	return sum & 1;
+}
+
 static s32 create_node(u32 node_id)
 {
 	u32 cpu;
@@ -1938,6 +2872,12 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(rusty_init)
 			return ret;
 	}
 
+	if (lb_interval_ns) {
+		ret = lb_timer_init();
+		if (ret)
+			return ret;
+	}
+
 	return 0;
 }
 
@@ -5,6 +5,7 @@
 use crate::bpf_intf;
 use std::collections::BTreeMap;
 
+use anyhow::bail;
 use anyhow::Result;
 use scx_utils::Cpumask;
 use scx_utils::Topology;
@@ -116,6 +117,48 @@ impl DomainGroup {
         })
     }
 
+    /// Build a group of domains which don't map to actual CPUs. Domain i
+    /// belongs to NUMA node dom_nodes[i] and is given dom_nr_cpus[i] CPUs
+    /// numbered after the previous domain's. Used by the load balancer
+    /// simulator.
+    pub fn new_synthetic(dom_nodes: &[usize], dom_nr_cpus: &[usize]) -> Result<Self> {
+        let nr_cpus: usize = dom_nr_cpus.iter().sum();
+        let nr_words = (nr_cpus + 63) / 64;
+        let mut doms = BTreeMap::new();
+        let mut dom_numa_map = BTreeMap::new();
+        let mut span = vec![0u64; nr_words];
+        let mut cpu = 0;
+
+        if dom_nodes.len() != dom_nr_cpus.len() {
+            bail!("Mismatching number of domain nodes and CPU counts");
+        }
+
+        for (dom_id, (&node_id, &nr)) in dom_nodes.iter().zip(dom_nr_cpus.iter()).enumerate() {
+            let mut mask = vec![0u64; nr_words];
+            for _ in 0..nr {
+                mask[cpu / 64] |= 1 << (cpu % 64);
+                span[cpu / 64] |= 1 << (cpu % 64);
+                cpu += 1;
+            }
+            doms.insert(
+                dom_id,
+                Domain {
+                    id: dom_id,
+                    mask: Cpumask::from_vec(mask),
+                    ctx: Arc::new(Mutex::new(None)),
+                },
+            );
+            dom_numa_map.insert(dom_id, node_id);
+        }
+
+        Ok(Self {
+            doms,
+            dom_numa_map,
+            num_numa_nodes: dom_nodes.iter().max().map_or(0, |max| max + 1),
+            span: Cpumask::from_vec(span),
+        })
+    }
+
     pub fn numa_doms(&self, numa_id: &usize) -> Vec<Domain> {
         let mut numa_doms = Vec::new();
         // XXX dom_numa_map never gets updated even if we cross NUMA nodes
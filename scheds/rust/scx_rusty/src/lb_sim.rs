@@ -0,0 +1,667 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! # Load balancer replay simulator
+//!
+//! Drives [`LoadBalancer`] with recorded or synthetic load snapshots instead of
+//! the running scheduler so that changes to the balancing policy can be
+//! evaluated offline. Each snapshot is balanced round after round with the
+//! migrations applied in between until a round finds the domains balanced or
+//! can't migrate anything. The imbalance, the number of migrations and the CPU
+//! cost of each round are reported.
+//!
+//! Migrated tasks take their whole duty cycle with them right away while the
+//! scheduler's running averages follow over load_half_life, so the simulator
+//! converges in fewer rounds than the scheduler would.
+//!
+//! Traces are text files made of snapshots as written by --lb-record:
+//!
+//! ```text
+//! snapshot
+//! apply_weight <0|1>
+//! dom <id> <node> <nr_cpus> <duty cycle of each of the LB_LOAD_BUCKETS buckets>
+//! task <dom> <weight> <dcycle> <is_kworker> <dom_mask> <preferred_dom_mask>
+//! end
+//! ```
+//!
+//! The domain duty cycles cover all the tasks in the domain, the listed tasks
+//! are the ones which can be migrated. Masks are comma separated hex words.
+//! Empty lines and lines starting with '#' are ignored.
+
+use std::fs::File;
+use std::io::BufRead;
+use std::io::BufReader;
+use std::io::Write;
+use std::sync::atomic::AtomicU32;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::Duration;
+use std::time::Instant;
+
+use anyhow::anyhow;
+use anyhow::bail;
+use anyhow::Context;
+use anyhow::Result;
+
+use crate::bpf_intf;
+use crate::load_balance::dom_mask_weight;
+use crate::load_balance::DomMask;
+use crate::load_balance::LbSource;
+use crate::load_balance::LbTask;
+use crate::load_balance::LoadBalancer;
+use crate::load_balance::NR_BUCKETS;
+use crate::load_balance::NR_CLASSES;
+use crate::DomainGroup;
+
+const MAX_ROUNDS: usize = 64;
+const NO_TARGET: u32 = u32::MAX;
+const SYNTHETIC_CPUS_PER_DOM: usize = 8;
+
+#[derive(Clone, Debug)]
+struct SimDom {
+    node: usize,
+    nr_cpus: usize,
+    dcycles: [f64; NR_BUCKETS],
+}
+
+#[derive(Clone, Debug)]
+struct SimTask {
+    dom: usize,
+    task: LbTask,
+}
+
+/// The domain and task loads at the beginning of a load balancing round.
+#[derive(Clone, Debug, Default)]
+pub struct Snapshot {
+    apply_weight: bool,
+    doms: Vec<SimDom>,
+    tasks: Vec<SimTask>,
+}
+
+fn weight_bucket(weight: u32) -> usize {
+    // See weight_to_bucket_idx() in main.bpf.c.
+    (weight as usize * NR_BUCKETS / bpf_intf::consts_LB_MAX_WEIGHT as usize).min(NR_BUCKETS - 1)
+}
+
+fn load_class(task: &LbTask, apply_weight: bool) -> usize {
+    // See task_lb_load() and task_load_class() in main.bpf.c.
+    const RAVG_ONE: f64 = (1u64 << bpf_intf::ravg_consts_RAVG_FRAC_BITS) as f64;
+    let weight = match apply_weight {
+        true => task.weight.min(bpf_intf::consts_LB_MAX_WEIGHT),
+        false => bpf_intf::consts_LB_DEFAULT_WEIGHT,
+    };
+    let load = (task.dcycle * RAVG_ONE) as u64 * weight as u64;
+    (64 - load.leading_zeros() as usize).clamp(1, NR_CLASSES - 1)
+}
+
+fn format_mask(mask: &DomMask) -> String {
+    mask.iter()
+        .map(|word| format!("{:x}", word))
+        .collect::<Vec<_>>()
+        .join(",")
+}
+
+fn parse_mask(s: &str) -> Result<DomMask> {
+    let mut mask = DomMask::default();
+    for (i, word) in s.split(',').enumerate() {
+        if i >= mask.len() {
+            bail!("Too many words in domain mask {:?}", s);
+        }
+        mask[i] = u64::from_str_radix(word, 16)
+            .with_context(|| format!("Invalid domain mask {:?}", s))?;
+    }
+    Ok(mask)
+}
+
+/// Minimal xorshift PRNG so that synthetic snapshots are reproducible.
+struct XorShift(u64);
+
+impl XorShift {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+
+    fn next_f64(&mut self) -> f64 {
+        (self.next() >> 11) as f64 / (1u64 << 53) as f64
+    }
+}
+
+impl Snapshot {
+    /// Capture the current loads of @source.
+    pub fn capture(
+        source: &mut impl LbSource,
+        dom_group: &DomainGroup,
+        apply_weight: bool,
+    ) -> Result<Self> {
+        source.refresh()?;
+
+        let mut snap = Self {
+            apply_weight,
+            ..Default::default()
+        };
+        let mut tasks = Vec::new();
+
+        for (&dom_id, dom) in dom_group.doms() {
+            snap.doms.push(SimDom {
+                node: dom_group.dom_numa_id(&dom_id).unwrap(),
+                nr_cpus: dom.weight(),
+                dcycles: source.dom_dcycles(dom_id),
+            });
+
+            tasks.clear();
+            for class in 0..NR_CLASSES {
+                source.dom_tasks(dom_id, class, &mut tasks);
+            }
+            snap.tasks
+                .extend(tasks.drain(..).map(|task| SimTask { dom: dom_id, task }));
+        }
+
+        Ok(snap)
+    }
+
+    pub fn write(&self, w: &mut impl Write) -> Result<()> {
+        writeln!(w, "snapshot")?;
+        writeln!(w, "apply_weight {}", self.apply_weight as u32)?;
+        for (dom_id, dom) in self.doms.iter().enumerate() {
+            write!(w, "dom {} {} {}", dom_id, dom.node, dom.nr_cpus)?;
+            for dcycle in dom.dcycles.iter() {
+                write!(w, " {}", dcycle)?;
+            }
+            writeln!(w)?;
+        }
+        for SimTask { dom, task } in self.tasks.iter() {
+            writeln!(
+                w,
+                "task {} {} {} {} {} {}",
+                dom,
+                task.weight,
+                task.dcycle,
+                task.is_kworker as u32,
+                format_mask(&task.dom_mask),
+                format_mask(&task.preferred_dom_mask)
+            )?;
+        }
+        writeln!(w, "end")?;
+        Ok(())
+    }
+
+    fn parse_line(&mut self, toks: &[&str]) -> Result<()> {
+        match toks {
+            ["apply_weight", v] => self.apply_weight = v.parse::<u32>()? != 0,
+            ["dom", id, node, nr_cpus, dcycles @ ..] => {
+                if id.parse::<usize>()? != self.doms.len() {
+                    bail!("Domain IDs must be contiguous from 0");
+                }
+                if dcycles.len() != NR_BUCKETS {
+                    bail!("Expected {} bucket duty cycles", NR_BUCKETS);
+                }
+                let mut dom = SimDom {
+                    node: node.parse()?,
+                    nr_cpus: nr_cpus.parse()?,
+                    dcycles: [0.0; NR_BUCKETS],
+                };
+                for (dst, src) in dom.dcycles.iter_mut().zip(dcycles.iter()) {
+                    *dst = src.parse()?;
+                }
+                self.doms.push(dom);
+            }
+            ["task", dom, weight, dcycle, is_kworker, dom_mask, preferred] => {
+                self.tasks.push(SimTask {
+                    dom: dom.parse()?,
+                    task: LbTask {
+                        id: 0,
+                        dcycle: dcycle.parse()?,
+                        weight: weight.parse()?,
+                        dom_mask: parse_mask(dom_mask)?,
+                        preferred_dom_mask: parse_mask(preferred)?,
+                        is_kworker: is_kworker.parse::<u32>()? != 0,
+                    },
+                });
+            }
+            _ => bail!("Unrecognized line"),
+        }
+        Ok(())
+    }
+
+    /// Read all snapshots from the trace at @path.
+    fn read_trace(path: &str) -> Result<Vec<Self>> {
+        let file = File::open(path).with_context(|| format!("Failed to open {:?}", path))?;
+        Self::parse_trace(BufReader::new(file), path)
+    }
+
+    /// Parse all snapshots from @reader. @name is only used in errors.
+    fn parse_trace(reader: impl BufRead, name: &str) -> Result<Vec<Self>> {
+        let mut snaps = Vec::new();
+        let mut cur: Option<Self> = None;
+
+        for (lineno, line) in reader.lines().enumerate() {
+            let line = line?;
+            let toks: Vec<&str> = line.split_whitespace().collect();
+            let err = || format!("{}:{}: {:?}", name, lineno + 1, line);
+
+            match (toks.as_slice(), cur.as_mut()) {
+                ([], _) => {}
+                ([tok, ..], _) if tok.starts_with('#') => {}
+                (["snapshot"], None) => cur = Some(Self::default()),
+                (["end"], Some(_)) => {
+                    let snap = cur.take().unwrap();
+                    snap.validate().with_context(err)?;
+                    snaps.push(snap);
+                }
+                (toks, Some(snap)) => snap.parse_line(toks).with_context(err)?,
+                _ => bail!("{}: unexpected line outside of a snapshot", err()),
+            }
+        }
+
+        if cur.is_some() {
+            bail!("{}: unterminated snapshot", name);
+        }
+        Ok(snaps)
+    }
+
+    fn validate(&self) -> Result<()> {
+        if self.doms.is_empty() {
+            bail!("Snapshot without domains");
+        }
+        if self.tasks.iter().any(|task| task.dom >= self.doms.len()) {
+            bail!("Task in an unknown domain");
+        }
+        let nr_nodes = self.doms.iter().map(|dom| dom.node).max().unwrap() + 1;
+        if (0..nr_nodes).any(|node| !self.doms.iter().any(|dom| dom.node == node)) {
+            bail!("NUMA node IDs must be contiguous from 0");
+        }
+        Ok(())
+    }
+
+    /// Generate a snapshot from "synthetic:NODES:DOMS_PER_NODE:TASKS[:SEED]".
+    /// The tasks have random weights and duty cycles and are piled up on the
+    /// lower domain IDs.
+    fn synthetic(spec: &str) -> Result<Self> {
+        let args: Vec<u64> = spec
+            .split(':')
+            .skip(1)
+            .map(|arg| arg.parse::<u64>())
+            .collect::<Result<_, _>>()
+            .with_context(|| format!("Invalid synthetic spec {:?}", spec))?;
+        let (nr_nodes, doms_per_node, nr_tasks, seed) = match args.as_slice() {
+            [n, d, t] => (*n as usize, *d as usize, *t as usize, 1),
+            [n, d, t, s] => (*n as usize, *d as usize, *t as usize, (*s).max(1)),
+            _ => bail!("Expected synthetic:NODES:DOMS_PER_NODE:TASKS[:SEED]"),
+        };
+        let nr_doms = nr_nodes * doms_per_node;
+        if nr_doms == 0 || nr_doms > bpf_intf::consts_MAX_DOMS as usize {
+            bail!("Invalid number of domains {}", nr_doms);
+        }
+
+        let mut rng = XorShift(seed);
+        let mut all_doms = DomMask::default();
+        for dom_id in 0..nr_doms {
+            all_doms[dom_id / 64] |= 1 << (dom_id % 64);
+        }
+
+        let mut snap = Self {
+            apply_weight: true,
+            doms: (0..nr_doms)
+                .map(|dom_id| SimDom {
+                    node: dom_id / doms_per_node,
+                    nr_cpus: SYNTHETIC_CPUS_PER_DOM,
+                    dcycles: [0.0; NR_BUCKETS],
+                })
+                .collect(),
+            tasks: Vec::with_capacity(nr_tasks),
+        };
+
+        for _ in 0..nr_tasks {
+            // Mostly nice 0 with a tail of heavier and lighter tasks.
+            let weight = match rng.next() % 8 {
+                0 => 10 + rng.next() % 90,
+                1 => 100 + rng.next() % 900,
+                _ => 100,
+            } as u32;
+            let task = LbTask {
+                id: 0,
+                dcycle: 0.05 + 0.95 * rng.next_f64(),
+                weight,
+                dom_mask: all_doms,
+                preferred_dom_mask: DomMask::default(),
+                is_kworker: false,
+            };
+            let dom = ((rng.next_f64().powi(2) * nr_doms as f64) as usize).min(nr_doms - 1);
+
+            snap.doms[dom].dcycles[weight_bucket(weight)] += task.dcycle;
+            snap.tasks.push(SimTask { dom, task });
+        }
+
+        Ok(snap)
+    }
+}
+
+/// [`LbSource`] backed by a [`Snapshot`]. Migrations are applied at the
+/// beginning of the next round.
+struct SimSource {
+    apply_weight: bool,
+    /// Duty cycles of the tasks which can't be migrated.
+    pinned: Vec<[f64; NR_BUCKETS]>,
+    tasks: Vec<SimTask>,
+    targets: Vec<AtomicU32>,
+    dcycles: Vec<[f64; NR_BUCKETS]>,
+    /// Indices of the migratable tasks by domain and load class.
+    task_idx: Vec<Vec<Vec<usize>>>,
+}
+
+impl SimSource {
+    fn new(snap: &Snapshot) -> Self {
+        let mut pinned: Vec<_> = snap.doms.iter().map(|dom| dom.dcycles).collect();
+        for SimTask { dom, task } in snap.tasks.iter() {
+            let dcycle = &mut pinned[*dom][weight_bucket(task.weight)];
+            *dcycle = (*dcycle - task.dcycle).max(0.0);
+        }
+
+        Self {
+            apply_weight: snap.apply_weight,
+            pinned,
+            tasks: snap.tasks.clone(),
+            targets: snap
+                .tasks
+                .iter()
+                .map(|_| AtomicU32::new(NO_TARGET))
+                .collect(),
+            dcycles: Vec::new(),
+            task_idx: vec![vec![Vec::new(); NR_CLASSES]; snap.doms.len()],
+        }
+    }
+
+    fn nr_pending(&self) -> usize {
+        self.targets
+            .iter()
+            .filter(|target| target.load(Ordering::Relaxed) != NO_TARGET)
+            .count()
+    }
+}
+
+impl LbSource for SimSource {
+    fn refresh(&mut self) -> Result<()> {
+        for (sim_task, target) in self.tasks.iter_mut().zip(self.targets.iter()) {
+            let target = target.swap(NO_TARGET, Ordering::Relaxed);
+            if target != NO_TARGET {
+                sim_task.dom = target as usize;
+            }
+        }
+
+        self.dcycles = self.pinned.clone();
+        for classes in self.task_idx.iter_mut() {
+            classes.iter_mut().for_each(|tasks| tasks.clear());
+        }
+
+        for (idx, SimTask { dom, task }) in self.tasks.iter().enumerate() {
+            self.dcycles[*dom][weight_bucket(task.weight)] += task.dcycle;
+            if dom_mask_weight(&task.dom_mask) > 1 {
+                self.task_idx[*dom][load_class(task, self.apply_weight)].push(idx);
+            }
+        }
+        Ok(())
+    }
+
+    fn dom_dcycles(&self, dom_id: usize) -> [f64; NR_BUCKETS] {
+        self.dcycles[dom_id]
+    }
+
+    fn dom_tasks(&self, dom_id: usize, class: usize, tasks: &mut Vec<LbTask>) {
+        for &idx in self.task_idx[dom_id][class].iter() {
+            let mut task = self.tasks[idx].task.clone();
+            task.id = idx as u64;
+            tasks.push(task);
+        }
+    }
+
+    fn set_target_dom(&self, task: u64, dom_id: u32) {
+        self.targets[task as usize].store(dom_id, Ordering::Relaxed);
+    }
+}
+
+/// User + system CPU time of the process, including the node balancing
+/// threads.
+fn cpu_time() -> Duration {
+    let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+    let ret = unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) };
+    assert!(ret == 0);
+    let tv = |tv: libc::timeval| Duration::new(tv.tv_sec as u64, tv.tv_usec as u32 * 1000);
+    tv(usage.ru_utime) + tv(usage.ru_stime)
+}
+
+fn replay_snapshot(id: usize, snap: &Snapshot) -> Result<()> {
+    let dom_nodes: Vec<usize> = snap.doms.iter().map(|dom| dom.node).collect();
+    let dom_nr_cpus: Vec<usize> = snap.doms.iter().map(|dom| dom.nr_cpus).collect();
+    let dom_group = Arc::new(DomainGroup::new_synthetic(&dom_nodes, &dom_nr_cpus)?);
+    let mut source = SimSource::new(snap);
+
+    println!(
+        "snapshot {}: nodes={} doms={} tasks={} apply_weight={}",
+        id,
+        dom_group.nr_nodes(),
+        dom_group.nr_doms(),
+        snap.tasks.len(),
+        snap.apply_weight
+    );
+    println!(
+        "{:>5} {:>12} {:>6} {:>9} {:>9} {:>9} {:>9}",
+        "round", "imbal", "migr", "cpu_us", "hier_us", "xnode_us", "intra_us"
+    );
+
+    let mut nr_migrations = 0;
+    let mut total_cpu = Duration::ZERO;
+    let mut total_wall = Duration::ZERO;
+    let mut outcome = format!("not converged after {} rounds", MAX_ROUNDS);
+
+    for round in 0..MAX_ROUNDS {
+        let (cpu_at, started_at) = (cpu_time(), Instant::now());
+
+        let mut lb = LoadBalancer::new(
+            &mut source,
+            dom_group.clone(),
+            false,
+            snap.apply_weight,
+            true,
+        );
+        lb.load_balance()?;
+        let (balanced, imbal, times) = (lb.is_balanced(), lb.imbalance(), lb.phase_times());
+
+        let cpu = cpu_time().saturating_sub(cpu_at);
+        total_cpu += cpu;
+        total_wall += started_at.elapsed();
+
+        let migrated = source.nr_pending();
+        nr_migrations += migrated;
+
+        println!(
+            "{:>5} {:>12.2} {:>6} {:>9} {:>9} {:>9} {:>9}",
+            round,
+            imbal,
+            migrated,
+            cpu.as_micros(),
+            times.hierarchy.as_micros(),
+            times.between_nodes.as_micros(),
+            times.within_nodes.as_micros()
+        );
+
+        // Count the rounds run, including the last one, the same way as
+        // "not converged after MAX_ROUNDS rounds".
+        if balanced {
+            outcome = format!("converged after {} rounds", round + 1);
+            break;
+        }
+        if migrated == 0 {
+            outcome = format!("stalled after {} rounds", round + 1);
+            break;
+        }
+    }
+
+    println!(
+        "{}, {} migrations, total cpu={}us wall={}us\n",
+        outcome,
+        nr_migrations,
+        total_cpu.as_micros(),
+        total_wall.as_micros()
+    );
+    Ok(())
+}
+
+/// Replay the snapshots of the trace file at @spec, or a synthetic snapshot
+/// if @spec starts with "synthetic:", and print the results.
+pub fn replay(spec: &str) -> Result<()> {
+    let snaps = if spec.starts_with("synthetic:") {
+        vec![Snapshot::synthetic(spec)?]
+    } else {
+        Snapshot::read_trace(spec)?
+    };
+
+    if snaps.is_empty() {
+        return Err(anyhow!("No snapshots in {:?}", spec));
+    }
+
+    for (id, snap) in snaps.iter().enumerate() {
+        replay_snapshot(id, snap).with_context(|| format!("Failed to replay snapshot {}", id))?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn parse(trace: &str) -> Result<Vec<Snapshot>> {
+        Snapshot::parse_trace(trace.as_bytes(), "test")
+    }
+
+    fn dom_line(id: usize, node: usize, dcycle: f64) -> String {
+        let mut line = format!("dom {} {} 4", id, node);
+        for bucket in 0..NR_BUCKETS {
+            let v = if bucket == weight_bucket(100) {
+                dcycle
+            } else {
+                0.0
+            };
+            line += &format!(" {}", v);
+        }
+        line
+    }
+
+    #[test]
+    fn test_trace_round_trip() {
+        let orig = Snapshot::synthetic("synthetic:2:2:100:7").unwrap();
+        let mut buf = Vec::new();
+        orig.write(&mut buf).unwrap();
+        orig.write(&mut buf).unwrap();
+
+        let parsed = parse(std::str::from_utf8(&buf).unwrap()).unwrap();
+        assert_eq!(parsed.len(), 2);
+        for snap in parsed.iter() {
+            assert_eq!(snap.apply_weight, orig.apply_weight);
+            assert_eq!(snap.doms.len(), orig.doms.len());
+            for (a, b) in snap.doms.iter().zip(orig.doms.iter()) {
+                assert_eq!(
+                    (a.node, a.nr_cpus, a.dcycles),
+                    (b.node, b.nr_cpus, b.dcycles)
+                );
+            }
+            assert_eq!(snap.tasks.len(), orig.tasks.len());
+            for (a, b) in snap.tasks.iter().zip(orig.tasks.iter()) {
+                assert_eq!(a.dom, b.dom);
+                assert_eq!(a.task.weight, b.task.weight);
+                assert_eq!(a.task.dcycle, b.task.dcycle);
+                assert_eq!(a.task.dom_mask, b.task.dom_mask);
+                assert_eq!(a.task.preferred_dom_mask, b.task.preferred_dom_mask);
+                assert_eq!(a.task.is_kworker, b.task.is_kworker);
+            }
+        }
+    }
+
+    #[test]
+    fn test_parse_trace() {
+        let trace = format!(
+            "# comment\n\nsnapshot\napply_weight 0\n{}\n{}\n\
+             task 1 100 0.5 1 3 2\nend\n",
+            dom_line(0, 0, 0.0),
+            dom_line(1, 0, 0.5)
+        );
+        let snaps = parse(&trace).unwrap();
+        assert_eq!(snaps.len(), 1);
+        let snap = &snaps[0];
+        assert!(!snap.apply_weight);
+        assert_eq!(snap.doms.len(), 2);
+        assert_eq!(snap.tasks.len(), 1);
+        assert_eq!(snap.tasks[0].dom, 1);
+        assert!(snap.tasks[0].task.is_kworker);
+        assert_eq!(snap.tasks[0].task.dom_mask[0], 3);
+        assert_eq!(snap.tasks[0].task.preferred_dom_mask[0], 2);
+
+        let bad = [
+            // unterminated
+            format!("snapshot\n{}\n", dom_line(0, 0, 0.0)),
+            // outside of a snapshot
+            format!("{}\n", dom_line(0, 0, 0.0)),
+            // non-contiguous domain IDs
+            format!("snapshot\n{}\nend\n", dom_line(1, 0, 0.0)),
+            // non-contiguous node IDs
+            format!("snapshot\n{}\nend\n", dom_line(0, 1, 0.0)),
+            // task in an unknown domain
+            format!(
+                "snapshot\n{}\ntask 1 100 0.5 0 1 0\nend\n",
+                dom_line(0, 0, 0.5)
+            ),
+            // missing buckets
+            "snapshot\ndom 0 0 4 0.0\nend\n".to_string(),
+            // no domains
+            "snapshot\nend\n".to_string(),
+            // unknown line
+            "snapshot\nfoo\nend\n".to_string(),
+        ];
+        for trace in bad.iter() {
+            assert!(parse(trace).is_err(), "{:?} parsed", trace);
+        }
+    }
+
+    #[test]
+    fn test_synthetic() {
+        let snap = Snapshot::synthetic("synthetic:2:3:500:42").unwrap();
+        assert_eq!(snap.doms.len(), 6);
+        assert_eq!(snap.tasks.len(), 500);
+        for (dom_id, dom) in snap.doms.iter().enumerate() {
+            assert_eq!(dom.node, dom_id / 3);
+        }
+
+        // The domain duty cycles add up to the tasks in them.
+        let mut dcycles = vec![[0.0f64; NR_BUCKETS]; snap.doms.len()];
+        for SimTask { dom, task } in snap.tasks.iter() {
+            assert!(task.dcycle > 0.0 && task.dcycle <= 1.0);
+            assert_eq!(dom_mask_weight(&task.dom_mask), 6);
+            dcycles[*dom][weight_bucket(task.weight)] += task.dcycle;
+        }
+        for (dom, sum) in snap.doms.iter().zip(dcycles.iter()) {
+            for (a, b) in dom.dcycles.iter().zip(sum.iter()) {
+                assert!((a - b).abs() < 1e-9);
+            }
+        }
+
+        // The same seed generates the same snapshot, a different one doesn't.
+        let same = Snapshot::synthetic("synthetic:2:3:500:42").unwrap();
+        let other = Snapshot::synthetic("synthetic:2:3:500:43").unwrap();
+        let key = |snap: &Snapshot| -> Vec<(usize, u32, u64)> {
+            snap.tasks
+                .iter()
+                .map(|t| (t.dom, t.task.weight, t.task.dcycle.to_bits()))
+                .collect()
+        };
+        assert_eq!(key(&snap), key(&same));
+        assert_ne!(key(&snap), key(&other));
+
+        assert!(Snapshot::synthetic("synthetic:1:1").is_err());
+        assert!(Snapshot::synthetic("synthetic:0:4:10").is_err());
+        assert!(Snapshot::synthetic("synthetic:1:x:10").is_err());
+    }
+}
@@ -83,7 +83,8 @@
 //!    node and migrate load between the domains inside of each. The cost of
 //!    migrations here are lower than between NUMA nodes. Like with load
 //!    balancing between NUMA nodes, migrations here are just moving tasks
-//!    between domains.
+//!    between domains. As the nodes don't share any domains or tasks, they
+//!    are balanced in parallel, one thread per node.
 //!
 //! The load hierarchy is always created when load_balance() is called on a
 //! LoadBalancer object, but actual load balancing is only performed if the
@@ -105,7 +106,9 @@
 //!
 //! Statistics are exported as a vector of NumaStat objects, which each
 //! contains load balancing statistics for that NUMA node, as well as
-//! statistics for any Domains contained therein as DomainStats objects.
+//! statistics for any Domains contained therein as DomainStats objects. The
+//! time spent in each phase of the last round is available through
+//! phase_times().
 //!
 //! Future Improvements
 //! -------------------
@@ -136,12 +139,18 @@ use std::collections::BTreeMap;
 use std::collections::VecDeque;
 use std::fmt;
 use std::sync::Arc;
+use std::time::Duration;
+use std::time::Instant;
 
 use anyhow::bail;
+use anyhow::Context;
 use anyhow::Result;
+use libbpf_rs::ProgramInput;
 use log::debug;
 use ordered_float::OrderedFloat;
 use scx_utils::ravg::ravg_read;
+use scx_utils::ravg::ravg_read_many;
+use scx_utils::ravg::RavgSnapshot;
 use scx_utils::LoadAggregator;
 use scx_utils::LoadLedger;
 use sorted_vec::SortedVec;
@@ -155,7 +164,7 @@ use crate::DomainGroup;
 const DEFAULT_WEIGHT: f64 = bpf_intf::consts_LB_DEFAULT_WEIGHT as f64;
 const RAVG_FRAC_BITS: u32 = bpf_intf::ravg_consts_RAVG_FRAC_BITS;
 
-fn now_monotonic() -> u64 {
+pub fn now_monotonic() -> u64 {
     let mut time = libc::timespec {
         tv_sec: 0,
         tv_nsec: 0,
@@ -312,12 +321,28 @@ impl LoadEntity {
     }
 }
 
+const DOM_MASK_WORDS: usize = bpf_intf::consts_DOM_MASK_WORDS as usize;
+pub const NR_BUCKETS: usize = bpf_intf::consts_LB_LOAD_BUCKETS as usize;
+pub const NR_CLASSES: usize = bpf_intf::consts_LB_TASK_IDX_CLASSES as usize;
+
+/// Multi-word domain bitmap, see dom_mask_test() in main.bpf.c.
+pub type DomMask = [u64; DOM_MASK_WORDS];
+
+pub fn dom_mask_test(mask: &DomMask, dom_id: u32) -> bool {
+    let (word, bit) = ((dom_id / 64) as usize, dom_id % 64);
+    word < DOM_MASK_WORDS && mask[word] & (1 << bit) != 0
+}
+
+pub fn dom_mask_weight(mask: &DomMask) -> u32 {
+    mask.iter().map(|word| word.count_ones()).sum()
+}
+
 #[derive(Debug)]
 struct TaskInfo {
     taskc: u64,
     load: OrderedFloat<f64>,
-    dom_mask: u64,
-    preferred_dom_mask: u64,
+    dom_mask: DomMask,
+    preferred_dom_mask: DomMask,
     migrated: Cell<bool>,
     is_kworker: bool,
 }
@@ -356,11 +381,7 @@ impl Domain {
         }
     }
 
-    fn transfer_load(&mut self, load: f64, taskc: &mut bpf_intf::task_ctx, other: &mut Domain) {
-        let dom_id: u32 = other.id.try_into().unwrap();
-
-        taskc.target_dom = dom_id;
-
+    fn transfer_load(&mut self, load: f64, other: &mut Domain) {
         self.load.add_load(-load);
         other.load.add_load(load);
     }
@@ -445,14 +466,201 @@ impl LoadOrdered for NumaNode {
 }
 impl_ord_for_type!(NumaNode);
 
-pub struct LoadBalancer<'a, 'b> {
-    skel: &'a mut BpfSkel<'b>,
+/// Time spent in each phase of a load balancing round.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct LbPhaseTimes {
+    /// Reading the loads and building the node / domain hierarchy.
+    pub hierarchy: Duration,
+    /// Balancing between NUMA nodes.
+    pub between_nodes: Duration,
+    /// Balancing within the NUMA nodes, which runs in parallel.
+    pub within_nodes: Duration,
+}
+
+/// A migratable task as reported by [`LbSource::dom_tasks()`].
+#[derive(Clone, Debug)]
+pub struct LbTask {
+    /// Opaque handle which is passed back to [`LbSource::set_target_dom()`].
+    pub id: u64,
+    /// Duty cycle, not scaled by the weight.
+    pub dcycle: f64,
+    pub weight: u32,
+    pub dom_mask: DomMask,
+    pub preferred_dom_mask: DomMask,
+    pub is_kworker: bool,
+}
+
+/// Where [`LoadBalancer`] reads the domain and task loads from and applies
+/// its decisions to. [`BpfLbSource`] backs the running scheduler while the
+/// replay simulator in lb_sim.rs feeds recorded or synthetic snapshots.
+pub trait LbSource: Sync {
+    /// Bring the domain duty cycles up to date. Called at the beginning of
+    /// each round.
+    fn refresh(&mut self) -> Result<()>;
+
+    /// Duty cycle of each load bucket of @dom_id.
+    fn dom_dcycles(&self, dom_id: usize) -> [f64; NR_BUCKETS];
+
+    /// Append the migratable tasks of @dom_id in load class @class, see
+    /// task_load_class() in main.bpf.c. Called concurrently for domains in
+    /// different NUMA nodes.
+    fn dom_tasks(&self, dom_id: usize, class: usize, tasks: &mut Vec<LbTask>);
+
+    /// Migrate the task identified by @task to @dom_id.
+    fn set_target_dom(&self, task: u64, dom_id: u32);
+}
+
+/// [`LbSource`] reading the loads from and migrating the tasks of the running
+/// scheduler. Only the domain and task contexts in the BPF arena are accessed
+/// after creation, so the source can be shared with the node balancing
+/// threads. A new source is created for each load balancing round.
+pub struct BpfLbSource {
+    /// Arena addresses of the domains' dom_ctx.
+    dom_ctxs: Vec<usize>,
+    load_half_life: u32,
+    now_mono: u64,
+}
+
+impl BpfLbSource {
+    pub fn new(skel: &mut BpfSkel, nr_doms: usize) -> Result<Self> {
+        // BPF accumulates duty cycle changes per-CPU. Fold them into the
+        // domain buckets before reading.
+        let input = ProgramInput {
+            ..Default::default()
+        };
+        let prog = &mut skel.progs.rusty_fold_dcycles;
+        prog.test_run(input).context("Failed to fold domain duty cycles")?;
+
+        let dom_ctxs = (0..nr_doms)
+            .map(|dom_id| skel.maps.bss_data.dom_ctxs[dom_id] as usize)
+            .collect();
+
+        Ok(Self {
+            dom_ctxs,
+            load_half_life: skel.maps.rodata_data.load_half_life,
+            now_mono: now_monotonic(),
+        })
+    }
+
+    fn dom_ctx(&self, dom_id: usize) -> &bpf_intf::dom_ctx {
+        unsafe { &*(self.dom_ctxs[dom_id] as *const bpf_intf::dom_ctx) }
+    }
+}
+
+impl LbSource for BpfLbSource {
+    fn refresh(&mut self) -> Result<()> {
+        // The duty cycles were folded when the source was created at the
+        // beginning of this round.
+        self.now_mono = now_monotonic();
+        Ok(())
+    }
+
+    fn dom_dcycles(&self, dom_id: usize) -> [f64; NR_BUCKETS] {
+        let dom_ctx = self.dom_ctx(dom_id);
+        let mut dcycles = [0.0f64; NR_BUCKETS];
+
+        for (bucket, dcycle) in dcycles.iter_mut().enumerate() {
+            let rd = &dom_ctx.buckets[bucket].rd;
+            *dcycle = ravg_read(
+                rd.val,
+                rd.val_at,
+                rd.old,
+                rd.cur,
+                self.now_mono,
+                self.load_half_life,
+                RAVG_FRAC_BITS,
+            );
+        }
+        dcycles
+    }
+
+    fn dom_tasks(&self, dom_id: usize, class: usize, tasks: &mut Vec<LbTask>) {
+        const TOP_TASKS: usize = bpf_intf::consts_LB_DOM_TOP_TASKS as usize;
+
+        let task_idx = &self.dom_ctx(dom_id).task_idx;
+        let mut taskcs = Vec::new();
+        let mut snap = RavgSnapshot::with_capacity(TOP_TASKS);
+        let mut loads = Vec::new();
+
+        // BPF modifies the lists concurrently. Stop walking a class as soon
+        // as we run into a task which moved elsewhere and bound the walk in
+        // case we keep chasing a moving target.
+        let mut budget = task_idx.nr[class] as usize + TOP_TASKS;
+        let mut taskc = task_idx.heads[class];
+
+        while !taskc.is_null() && budget > 0 {
+            let task_ctx = unsafe { &*(taskc as *const bpf_intf::task_ctx) };
+            budget -= 1;
+
+            if task_ctx.idx_dom as usize != dom_id || task_ctx.idx_class as usize != class {
+                break;
+            }
+
+            if task_ctx.target_dom as usize == dom_id && dom_mask_weight(&task_ctx.dom_mask) > 1 {
+                let rd = &task_ctx.dcyc_rd;
+                snap.push(rd.val, rd.val_at, rd.old, rd.cur);
+                taskcs.push(taskc);
+            }
+
+            taskc = task_ctx.idx_next;
+        }
+
+        if taskcs.is_empty() {
+            return;
+        }
+
+        ravg_read_many(
+            &snap,
+            now_monotonic(),
+            self.load_half_life,
+            RAVG_FRAC_BITS,
+            &mut loads,
+        );
+
+        for (&taskc, &dcycle) in taskcs.iter().zip(loads.iter()) {
+            let task_ctx = unsafe { &*(taskc as *const bpf_intf::task_ctx) };
+
+            tasks.push(LbTask {
+                id: taskc as u64,
+                dcycle,
+                weight: task_ctx.weight,
+                dom_mask: task_ctx.dom_mask,
+                preferred_dom_mask: task_ctx.preferred_dom_mask,
+                is_kworker: task_ctx.is_kworker,
+            });
+        }
+    }
+
+    fn set_target_dom(&self, task: u64, dom_id: u32) {
+        // @task is the arena address of the task_ctx. BPF reads target_dom
+        // concurrently and each task is migrated by at most one thread.
+        unsafe {
+            let task_ctx = task as *mut bpf_intf::task_ctx;
+            std::ptr::write_volatile(std::ptr::addr_of_mut!((*task_ctx).target_dom), dom_id);
+        }
+    }
+}
+
+/// The state which finding and migrating tasks needs. Unlike the balancer, it
+/// can be shared with the threads balancing the NUMA nodes in parallel.
+struct BalanceCtx<'s, S: LbSource> {
+    source: &'s S,
+    skip_kworkers: bool,
+    lb_apply_weight: bool,
+    infeas_threshold: f64,
+}
+
+pub struct LoadBalancer<'a, S: LbSource> {
+    source: &'a mut S,
     dom_group: Arc<DomainGroup>,
     skip_kworkers: bool,
 
     infeas_threshold: f64,
 
     nodes: SortedVec<NumaNode>,
+    imbal: f64,
+    balanced: bool,
+    phase_times: LbPhaseTimes,
 
     lb_apply_weight: bool,
     balance_load: bool,
@@ -465,21 +673,24 @@ const_assert_eq!(
     0
 );
 
-impl<'a, 'b> LoadBalancer<'a, 'b> {
+impl<'a, S: LbSource> LoadBalancer<'a, S> {
     pub fn new(
-        skel: &'a mut BpfSkel<'b>,
+        source: &'a mut S,
         dom_group: Arc<DomainGroup>,
         skip_kworkers: bool,
         lb_apply_weight: bool,
         balance_load: bool,
     ) -> Self {
         Self {
-            skel,
+            source,
             skip_kworkers,
 
             infeas_threshold: bpf_intf::consts_LB_MAX_WEIGHT as f64,
 
             nodes: SortedVec::new(),
+            imbal: 0.0f64,
+            balanced: true,
+            phase_times: LbPhaseTimes::default(),
 
             lb_apply_weight: lb_apply_weight.clone(),
             balance_load,
@@ -492,7 +703,9 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
     /// also perform rebalances between NUMA nodes (when running on a
     /// multi-socket host) and domains.
     pub fn load_balance(&mut self) -> Result<()> {
+        let started_at = Instant::now();
         self.create_domain_hierarchy()?;
+        self.phase_times.hierarchy = started_at.elapsed();
 
         if self.balance_load {
             self.perform_balancing()?
@@ -501,6 +714,22 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         Ok(())
     }
 
+    /// Total load above the average across all domains before balancing,
+    /// i.e. the amount of load which had to be moved to reach balance.
+    pub fn imbalance(&self) -> f64 {
+        self.imbal
+    }
+
+    /// Whether all nodes and domains were within their imbalance thresholds
+    /// before balancing, i.e. whether there was nothing to do.
+    pub fn is_balanced(&self) -> bool {
+        self.balanced
+    }
+
+    pub fn phase_times(&self) -> LbPhaseTimes {
+        self.phase_times
+    }
+
     pub fn get_stats(&self) -> BTreeMap<usize, NodeStats> {
         let mut stats = BTreeMap::new();
         for node in self.nodes.iter() {
@@ -536,6 +765,11 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         }
 
         let dom_load_avg = total_load / dom_loads.len() as f64;
+        self.imbal = dom_loads
+            .iter()
+            .map(|load| (load - dom_load_avg).max(0.0f64))
+            .sum();
+
         for (dom_id, load) in dom_loads.iter().enumerate() {
             let numa_id = self.dom_group.dom_numa_id(&dom_id).unwrap();
 
@@ -547,6 +781,14 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
             node.allocate_domain(dom_id, *load, dom_load_avg);
         }
 
+        self.balanced = nodes.iter().all(|node| {
+            node.load.state() == BalanceState::Balanced
+                && node
+                    .domains
+                    .iter()
+                    .all(|dom| dom.load.state() == BalanceState::Balanced)
+        });
+
         for _ in 0..num_numa_nodes {
             self.nodes.insert(nodes.pop().unwrap());
         }
@@ -555,36 +797,21 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
     }
 
     fn calculate_load_avgs(&mut self) -> Result<LoadLedger> {
-        const NUM_BUCKETS: u64 = bpf_intf::consts_LB_LOAD_BUCKETS as u64;
-        let now_mono = now_monotonic();
-        let load_half_life = self.skel.maps.rodata_data.load_half_life;
+        self.source.refresh()?;
 
         let mut aggregator =
             LoadAggregator::new(self.dom_group.weight(), !self.lb_apply_weight.clone());
 
-        for (dom_id, dom) in self.dom_group.doms() {
+        for (dom_id, _dom) in self.dom_group.doms() {
             aggregator.init_domain(*dom_id);
 
-            let dom_ctx = dom.ctx().unwrap();
-
-            for bucket in 0..NUM_BUCKETS {
-                let bucket_ctx = &dom_ctx.buckets[bucket as usize];
-                let rd = &bucket_ctx.rd;
-                let duty_cycle = ravg_read(
-                    rd.val,
-                    rd.val_at,
-                    rd.old,
-                    rd.cur,
-                    now_mono,
-                    load_half_life,
-                    RAVG_FRAC_BITS,
-                );
-
+            let dcycles = self.source.dom_dcycles(*dom_id);
+            for (bucket, &duty_cycle) in dcycles.iter().enumerate() {
                 if duty_cycle == 0.0f64 {
                     continue;
                 }
 
-                let weight = self.bucket_weight(bucket);
+                let weight = self.bucket_weight(bucket as u64);
                 aggregator.record_dom_load(*dom_id, weight, duty_cycle)?;
             }
         }
@@ -618,64 +845,62 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
 
     /// @dom needs to push out tasks to balance loads. Make sure its
     /// tasks_by_load is populated so that the victim tasks can be picked.
-    fn populate_tasks_by_load(&mut self, dom: &mut Domain) -> Result<()> {
+    ///
+    /// The tasks are pulled from the domain's task index which BPF keeps
+    /// bucketed by load class and which only holds runnable tasks. Classes are walked from the heaviest down until
+    /// LB_DOM_TOP_TASKS migratable tasks which still belong to their classes
+    /// are found. As whole classes are consumed, the heaviest tasks of the
+    /// domain are never missed.
+    fn populate_tasks_by_load(ctx: &BalanceCtx<S>, dom: &mut Domain) -> Result<()> {
         if dom.queried_tasks {
             return Ok(());
         }
         dom.queried_tasks = true;
 
-        // Read active_tasks and update read_idx and gen.
-        const MAX_TPTRS: u64 = bpf_intf::consts_MAX_DOM_ACTIVE_TPTRS as u64;
-        let dom_ctx =
-            unsafe { &mut *(self.skel.maps.bss_data.dom_ctxs[dom.id] as *mut bpf_intf::dom_ctx) };
-        let active_tasks = &mut dom_ctx.active_tasks;
-
-        let (mut ridx, widx) = (active_tasks.read_idx, active_tasks.write_idx);
-        active_tasks.read_idx = active_tasks.write_idx;
-        active_tasks.gen += 1;
+        const TOP_TASKS: usize = bpf_intf::consts_LB_DOM_TOP_TASKS as usize;
+        const MAX_WEIGHT: f64 = bpf_intf::consts_LB_MAX_WEIGHT as f64;
+        const RAVG_ONE: f64 = (1u64 << RAVG_FRAC_BITS) as f64;
 
-        if widx - ridx > MAX_TPTRS {
-            ridx = widx - MAX_TPTRS;
-        }
+        let mut tasks = Vec::new();
+        let mut nr_found = 0;
 
-        // Read task_ctx and load.
-        let load_half_life = self.skel.maps.rodata_data.load_half_life;
-        let now_mono = now_monotonic();
+        for class in (0..NR_CLASSES).rev() {
+            tasks.clear();
+            ctx.source.dom_tasks(dom.id, class, &mut tasks);
 
-        for idx in ridx..widx {
-            let taskc = active_tasks.tasks[(idx % MAX_TPTRS) as usize];
-            let task_ctx = unsafe { &*(taskc as *const bpf_intf::task_ctx) };
+            for task in tasks.drain(..) {
+                let (weight, class_weight) = if ctx.lb_apply_weight {
+                    let weight = task.weight as f64;
+                    (weight.min(ctx.infeas_threshold), weight.min(MAX_WEIGHT))
+                } else {
+                    (DEFAULT_WEIGHT, DEFAULT_WEIGHT)
+                };
+
+                // BPF refreshes classes only periodically while tasks run,
+                // so loads may have drifted. Only count the tasks which
+                // still belong to @class. BPF
+                // classifies with the weight capped at LB_MAX_WEIGHT, see
+                // task_lb_load(), which may differ from @weight.
+                let load = task.dcycle * weight;
+                let class_load = task.dcycle * class_weight;
+                let bits = 64 - ((class_load * RAVG_ONE) as u64).leading_zeros() as usize;
+                if bits >= class && !(ctx.skip_kworkers && task.is_kworker) {
+                    nr_found += 1;
+                }
 
-            if task_ctx.target_dom as usize != dom.id {
-                continue;
+                dom.tasks.insert(TaskInfo {
+                    taskc: task.id,
+                    load: OrderedFloat(load),
+                    dom_mask: task.dom_mask,
+                    preferred_dom_mask: task.preferred_dom_mask,
+                    migrated: Cell::new(false),
+                    is_kworker: task.is_kworker,
+                });
             }
 
-            let rd = &task_ctx.dcyc_rd;
-            let mut load = ravg_read(
-                rd.val,
-                rd.val_at,
-                rd.old,
-                rd.cur,
-                now_mono,
-                load_half_life,
-                RAVG_FRAC_BITS,
-            );
-
-            let weight = if self.lb_apply_weight {
-                (task_ctx.weight as f64).min(self.infeas_threshold)
-            } else {
-                DEFAULT_WEIGHT
-            };
-            load *= weight;
-
-            dom.tasks.insert(TaskInfo {
-                taskc: taskc as u64,
-                load: OrderedFloat(load),
-                dom_mask: task_ctx.dom_mask,
-                preferred_dom_mask: task_ctx.preferred_dom_mask,
-                migrated: Cell::new(false),
-                is_kworker: task_ctx.is_kworker,
-            });
+            if nr_found >= TOP_TASKS {
+                break;
+            }
         }
 
         Ok(())
@@ -697,7 +922,7 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
     /// found, move the task between the domains, and return the amount of load
     /// transferred between the two.
     fn try_find_move_task(
-        &mut self,
+        ctx: &BalanceCtx<S>,
         (push_dom, to_push): (&mut Domain, f64),
         (pull_dom, to_pull): (&mut Domain, f64),
         task_filter: impl Fn(&TaskInfo, u32) -> bool,
@@ -706,7 +931,7 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         let to_pull = to_pull.abs();
         let calc_new_imbal = |xfer: f64| (to_push - xfer).abs() + (to_pull - xfer).abs();
 
-        self.populate_tasks_by_load(push_dom)?;
+        Self::populate_tasks_by_load(ctx, push_dom)?;
 
         // We want to pick a task to transfer from push_dom to pull_dom to
         // reduce the load imbalance between the two closest to $to_xfer.
@@ -715,36 +940,26 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         // migratable task while scanning left from $to_xfer and the
         // counterpart while scanning right and picking the better of the
         // two.
+        //
+        // push_dom.tasks is sorted by load and never reordered, migrated
+        // tasks are only flagged. Locate $to_xfer with a binary search
+        // instead of re-sorting the tasks on each transfer.
         let pull_dom_id: u32 = pull_dom.id.try_into().unwrap();
-        let tasks: Vec<TaskInfo> = std::mem::take(&mut push_dom.tasks)
-            .into_vec()
-            .into_iter()
-            .filter(|task| {
-                task.dom_mask & (1 << pull_dom_id) != 0
-                    && !(self.skip_kworkers && task.is_kworker)
-                    && !task.migrated.get()
-            })
-            .collect();
+        let is_candidate = |task: &&TaskInfo| {
+            dom_mask_test(&task.dom_mask, pull_dom_id)
+                && !(ctx.skip_kworkers && task.is_kworker)
+                && !task.migrated.get()
+                && task_filter(task, pull_dom_id)
+        };
+
+        let tasks = push_dom.tasks.as_slice();
+        let split = tasks.partition_point(|task| task.load < OrderedFloat(to_xfer));
 
         let (task, new_imbal) = match (
-            Self::find_first_candidate(
-                tasks
-                    .as_slice()
-                    .iter()
-                    .filter(|x| x.load <= OrderedFloat(to_xfer) && task_filter(x, pull_dom_id))
-                    .rev(),
-            ),
-            Self::find_first_candidate(
-                tasks
-                    .as_slice()
-                    .iter()
-                    .filter(|x| x.load >= OrderedFloat(to_xfer) && task_filter(x, pull_dom_id)),
-            ),
+            Self::find_first_candidate(tasks[..split].iter().rev().filter(is_candidate)),
+            Self::find_first_candidate(tasks[split..].iter().filter(is_candidate)),
         ) {
-            (None, None) => {
-                std::mem::swap(&mut push_dom.tasks, &mut SortedVec::from_unsorted(tasks));
-                return Ok(None);
-            }
+            (None, None) => return Ok(None),
             (Some(task), None) | (None, Some(task)) => (task, calc_new_imbal(*task.load)),
             (Some(task0), Some(task1)) => {
                 let (new_imbal0, new_imbal1) =
@@ -761,25 +976,19 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         // to do for this pair.
         let old_imbal = to_push + to_pull;
         if old_imbal < new_imbal {
-            std::mem::swap(&mut push_dom.tasks, &mut SortedVec::from_unsorted(tasks));
             return Ok(None);
         }
 
         let load = *(task.load);
-        let taskc = task.taskc;
         task.migrated.set(true);
-        std::mem::swap(&mut push_dom.tasks, &mut SortedVec::from_unsorted(tasks));
 
-        push_dom.transfer_load(
-            load,
-            unsafe { &mut *(taskc as *mut bpf_intf::task_ctx) },
-            pull_dom,
-        );
+        ctx.source.set_target_dom(task.taskc, pull_dom_id);
+        push_dom.transfer_load(load, pull_dom);
         Ok(Some(load))
     }
 
     fn transfer_between_nodes(
-        &mut self,
+        ctx: &BalanceCtx<S>,
         push_node: &mut NumaNode,
         pull_node: &mut NumaNode,
     ) -> Result<f64> {
@@ -816,16 +1025,18 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
                     pull_node.domains.insert(pull_dom);
                     break;
                 }
-                let mut transferred = self.try_find_move_task(
+                let mut transferred = Self::try_find_move_task(
+                    ctx,
                     (&mut push_dom, push_imbal),
                     (&mut pull_dom, pull_imbal),
                     |task: &TaskInfo, pull_dom: u32| -> bool {
-                        (task.preferred_dom_mask & (1 << pull_dom)) > 0
+                        dom_mask_test(&task.preferred_dom_mask, pull_dom)
                     },
                     xfer,
                 )?;
                 if transferred.is_none() {
-                    transferred = self.try_find_move_task(
+                    transferred = Self::try_find_move_task(
+                        ctx,
                         (&mut push_dom, push_imbal),
                         (&mut pull_dom, pull_imbal),
                         |_task: &TaskInfo, _pull_dom: u32| -> bool { true },
@@ -856,8 +1067,8 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         Ok(pushed)
     }
 
-    fn balance_between_nodes(&mut self) -> Result<()> {
-        if self.nodes.len() < 2 {
+    fn balance_between_nodes(ctx: &BalanceCtx<S>, nodes: &mut SortedVec<NumaNode>) -> Result<()> {
+        if nodes.len() < 2 {
             return Ok(());
         }
 
@@ -896,36 +1107,36 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         // always sending load to the least-loaded node.
         //
         // Note that we use a VecDeque for the pushers because we're iterating
-        // over self.nodes in descending-load order. Thus, when we're done
-        // iterating and we're adding the popped nodes back into self.nodes, we
+        // over nodes in descending-load order. Thus, when we're done
+        // iterating and we're adding the popped nodes back into nodes, we
         // want to add them back in _ascending_ order so that we don't have to
         // unnecessarily shift any already-re-added nodes to the right in the
         // backing vector. In other words, this lets us do a true append in the
         // SortedVec, rather than doing an insert(list.len() - 2, node). This
         // applies both to iterating over push-imbalanced nodes, and iterating
         // over push-imbalanced domains in the inner loops.
-        let mut pushers = VecDeque::with_capacity(self.nodes.len());
-        let mut pullers = Vec::with_capacity(self.nodes.len());
+        let mut pushers = VecDeque::with_capacity(nodes.len());
+        let mut pullers = Vec::with_capacity(nodes.len());
 
-        while self.nodes.len() >= 2 {
+        while nodes.len() >= 2 {
             // Push from the busiest node
-            let mut push_node = self.nodes.pop().unwrap();
+            let mut push_node = nodes.pop().unwrap();
             if push_node.load.state() != BalanceState::NeedsPush {
-                self.nodes.insert(push_node);
+                nodes.insert(push_node);
                 break;
             }
 
             let push_cutoff = push_node.load.push_cutoff();
             let mut pushed = 0f64;
-            while self.nodes.len() > 0 && pushed < push_cutoff {
+            while nodes.len() > 0 && pushed < push_cutoff {
                 // To the least busy node
-                let mut pull_node = self.nodes.remove_index(0);
+                let mut pull_node = nodes.remove_index(0);
                 let pull_id = pull_node.id;
                 if pull_node.load.state() != BalanceState::NeedsPull {
-                    self.nodes.insert(pull_node);
+                    nodes.insert(pull_node);
                     break;
                 }
-                let migrated = self.transfer_between_nodes(&mut push_node, &mut pull_node)?;
+                let migrated = Self::transfer_between_nodes(ctx, &mut push_node, &mut pull_node)?;
                 pullers.push(pull_node);
                 if migrated > 0.0f64 {
                     // Break after a successful migration so that we can
@@ -940,7 +1151,7 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
                 }
             }
             while !pullers.is_empty() {
-                self.nodes.insert(pullers.pop().unwrap());
+                nodes.insert(pullers.pop().unwrap());
             }
 
             if pushed > 0.0f64 {
@@ -950,13 +1161,13 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         }
 
         while !pushers.is_empty() {
-            self.nodes.insert(pushers.pop_front().unwrap());
+            nodes.insert(pushers.pop_front().unwrap());
         }
 
         Ok(())
     }
 
-    fn balance_within_node(&mut self, node: &mut NumaNode) -> Result<()> {
+    fn balance_within_node(ctx: &BalanceCtx<S>, node: &mut NumaNode) -> Result<()> {
         if node.domains.len() < 2 {
             return Ok(());
         }
@@ -1005,16 +1216,18 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
                     );
                 }
                 let xfer = push_dom.xfer_between(&pull_dom);
-                let mut transferred = self.try_find_move_task(
+                let mut transferred = Self::try_find_move_task(
+                    ctx,
                     (&mut push_dom, push_imbal),
                     (&mut pull_dom, pull_imbal),
                     |task: &TaskInfo, pull_dom: u32| -> bool {
-                        (task.preferred_dom_mask & (1 << pull_dom)) > 0
+                        dom_mask_test(&task.preferred_dom_mask, pull_dom)
                     },
                     xfer,
                 )?;
                 if transferred.is_none() {
-                    transferred = self.try_find_move_task(
+                    transferred = Self::try_find_move_task(
+                        ctx,
                         (&mut push_dom, push_imbal),
                         (&mut pull_dom, pull_imbal),
                         |_task: &TaskInfo, _pull_dom: u32| -> bool { true },
@@ -1056,26 +1269,55 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
     }
 
     fn perform_balancing(&mut self) -> Result<()> {
+        let ctx = BalanceCtx {
+            source: &*self.source,
+            skip_kworkers: self.skip_kworkers,
+            lb_apply_weight: self.lb_apply_weight,
+            infeas_threshold: self.infeas_threshold,
+        };
+
         // First balance load between the NUMA nodes. Balancing here has a
         // higher cost function than balancing between domains inside of NUMA
         // nodes, but the mechanics are the same. Adjustments made here are
         // reflected in intra-node balancing decisions made next.
+        let started_at = Instant::now();
         if self.dom_group.nr_nodes() > 1 {
-            self.balance_between_nodes()?;
+            Self::balance_between_nodes(&ctx, &mut self.nodes)?;
         }
+        self.phase_times.between_nodes = started_at.elapsed();
 
         // Now that the NUMA nodes have been balanced, do another balance round
-        // amongst the domains in each node.
+        // amongst the domains in each node. The nodes share no domains or
+        // tasks and are balanced in parallel.
 
         debug!("Intra node LBs started");
 
         // Assume all nodes are now balanced.
 
+        let started_at = Instant::now();
         let mut nodes = std::mem::take(&mut self.nodes).into_vec();
-        for node in nodes.iter_mut() {
-            self.balance_within_node(node)?;
+        if nodes.len() > 1 {
+            let ctx = &ctx;
+            std::thread::scope(|scope| -> Result<()> {
+                let handles: Vec<_> = nodes
+                    .iter_mut()
+                    .map(|node| scope.spawn(move || Self::balance_within_node(ctx, node)))
+                    .collect();
+                for handle in handles {
+                    match handle.join() {
+                        Ok(res) => res?,
+                        Err(_) => bail!("Intra node load balancing thread panicked"),
+                    }
+                }
+                Ok(())
+            })?;
+        } else {
+            for node in nodes.iter_mut() {
+                Self::balance_within_node(&ctx, node)?;
+            }
         }
         std::mem::swap(&mut self.nodes, &mut SortedVec::from_unsorted(nodes));
+        self.phase_times.within_nodes = started_at.elapsed();
 
         Ok(())
     }
@@ -13,10 +13,16 @@ pub mod tuner;
 use tuner::Tuner;
 
 pub mod load_balance;
+use load_balance::BpfLbSource;
+use load_balance::LbPhaseTimes;
 use load_balance::LoadBalancer;
 
+mod lb_sim;
+
 mod stats;
 use std::collections::BTreeMap;
+use std::io::BufWriter;
+use std::io::Write;
 use std::mem::MaybeUninit;
 use std::sync::atomic::AtomicBool;
 use std::sync::atomic::Ordering;
@@ -44,6 +50,8 @@ use libbpf_rs::skel::Skel;
 use libbpf_rs::skel::SkelBuilder;
 use libbpf_rs::MapCore as _;
 use libbpf_rs::OpenObject;
+use libbpf_rs::ProgramInput;
+use log::debug;
 use log::info;
 use scx_stats::prelude::*;
 use scx_utils::build_id;
@@ -62,6 +70,15 @@ use scx_utils::UserExitInfo;
 use scx_utils::NR_CPU_IDS;
 
 const MAX_DOMS: usize = bpf_intf::consts_MAX_DOMS as usize;
+const DL_MAX_LAT_PRIO: usize = bpf_intf::consts_DL_MAX_LAT_PRIO as usize;
+
+/// Taken from sched_prio_to_weight[] in the kernel's fair.c, indexed by nice
+/// level + 20.
+const SCHED_PRIO_TO_WEIGHT: [u32; 40] = [
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916, 9548, 7620, 6100, 4904,
+    3906, 3121, 2501, 1991, 1586, 1277, 1024, 820, 655, 526, 423, 335, 272, 215, 172, 137, 110, 87,
+    70, 56, 45, 36, 29, 23, 18, 15,
+];
 const MAX_CPUS: usize = bpf_intf::consts_MAX_CPUS as usize;
 
 /// scx_rusty: A multi-domain BPF / userspace hybrid scheduler
@@ -76,9 +93,9 @@ const MAX_CPUS: usize = bpf_intf::consts_MAX_CPUS as usize;
 ///
 /// Second, it drives lower frequency (2s) load balancing. It determines
 /// whether load balancing is necessary by comparing domain load averages.
-/// If there are large enough load differences, it examines upto 1024
-/// recently active tasks on the domain to determine which should be
-/// migrated.
+/// If there are large enough load differences, it examines the heaviest
+/// 1024 or so migratable tasks of the domain, which BPF keeps indexed by load,
+/// to determine which should be migrated.
 ///
 /// The overhead of userspace operations is low. Load balancing is not
 /// performed frequently, but work-conservation is still maintained through
@@ -113,6 +130,15 @@ struct Opts {
     #[clap(short = 'I', long, default_value = "0.1")]
     tune_interval: f64,
 
+    /// Have the tuner use the per-CPU time spent running tasks of this
+    /// scheduler, as accounted by BPF, instead of /proc/stat. This is
+    /// nanosecond accurate and much cheaper, which makes very short tune
+    /// intervals practical, but doesn't count IRQ, softirq, steal or time
+    /// spent in other sched classes as busy. CPUs may thus look less utilized
+    /// in --partial mode or under heavy RT or IRQ load.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    tune_bpf_util: bool,
+
     /// The half-life of task and domain load running averages in seconds.
     #[clap(short = 'l', long, default_value = "1.0")]
     load_half_life: f64,
@@ -156,6 +182,28 @@ struct Opts {
     #[clap(long, action = clap::ArgAction::SetTrue)]
     no_load_balance: bool,
 
+    /// When non-zero, perform load balancing from a BPF timer at this
+    /// interval in seconds instead of from userspace. The BPF load balancer
+    /// reacts faster but uses a simpler policy. Userspace keeps tuning and
+    /// reporting load statistics at --interval. Can't be used with
+    /// --no-load-balance.
+    #[clap(long, default_value = "0", conflicts_with = "no_load_balance")]
+    bpf_lb_interval: f64,
+
+    /// When non-zero, BPF notifies userspace as soon as a domain's runnable
+    /// load deviates from its NUMA node's average by more than this
+    /// percentage and a load balancing round runs right away, at most once
+    /// every --interval / 4. Periodic rounds which find the domains balanced
+    /// then back off, doubling the interval up to 8 times --interval. Only
+    /// applies to userspace load balancing and can't be used with
+    /// --no-load-balance or --bpf-lb-interval.
+    #[clap(
+        long,
+        default_value = "0",
+        conflicts_with_all = ["no_load_balance", "bpf_lb_interval"]
+    )]
+    lb_trigger_pct: u32,
+
     /// Put per-cpu kthreads directly into local dsq's.
     #[clap(short = 'k', long, action = clap::ArgAction::SetTrue)]
     kthreads_local: bool,
@@ -209,6 +257,23 @@ struct Opts {
     #[clap(long)]
     monitor: Option<f64>,
 
+    /// Append a snapshot of the domain and task loads to this file before
+    /// each userspace load balancing round, for use with --lb-replay.
+    #[clap(long)]
+    lb_record: Option<String>,
+
+    /// Replay the load snapshots in this trace file through the load
+    /// balancer and report the convergence, migrations and CPU cost of each
+    /// round. "synthetic:NODES:DOMS_PER_NODE:TASKS[:SEED]" generates a random
+    /// skewed snapshot instead. The scheduler is not launched.
+    #[clap(long)]
+    lb_replay: Option<String>,
+
+    /// Load the BPF scheduler without attaching it, time the deadline
+    /// computation using BPF_PROG_TEST_RUN and exit.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    bench_dl: bool,
+
     /// Exit debug dump buffer length. 0 indicates default.
     #[clap(long, default_value = "0")]
     exit_dump_len: u32,
@@ -227,6 +292,44 @@ struct Opts {
     help_stats: bool,
 }
 
+/// Fill dl_lat_scale_recips[], see task_compute_dl() in main.bpf.c. lat_prio
+/// maps to the weight of nice level 18 - lat_prio, capped at LB_MAX_WEIGHT.
+fn fill_dl_lat_scale_recips(recips: &mut [u32]) {
+    for (lat_prio, recip) in recips.iter_mut().enumerate() {
+        let weight = SCHED_PRIO_TO_WEIGHT[DL_MAX_LAT_PRIO - lat_prio - 1]
+            .min(bpf_intf::consts_LB_MAX_WEIGHT);
+        *recip = ((1u64 << 32) / weight as u64) as u32;
+    }
+}
+
+/// Load the BPF scheduler without attaching it and time task_compute_dl().
+fn bench_dl(opts: &Opts) -> Result<()> {
+    let mut open_object = MaybeUninit::uninit();
+    let mut skel_builder = BpfSkelBuilder::default();
+    skel_builder.obj_builder.debug(opts.verbose > 0);
+    let mut skel = scx_ops_open!(skel_builder, &mut open_object, rusty)?;
+
+    fill_dl_lat_scale_recips(&mut skel.maps.rodata_data.dl_lat_scale_recips);
+    let mut skel = scx_ops_load!(skel, rusty, uei)?;
+
+    let input = ProgramInput {
+        ..Default::default()
+    };
+    skel.progs
+        .rusty_bench_dl
+        .test_run(input)
+        .context("Failed to run rusty_bench_dl")?;
+
+    let iters = bpf_intf::consts_DL_BENCH_ITERS as f64;
+    let bss_data = &skel.maps.bss_data;
+    println!(
+        "task_compute_dl(): cached {:.1} ns/call, uncached {:.1} ns/call",
+        bss_data.dl_bench_cached_ns as f64 / iters,
+        bss_data.dl_bench_uncached_ns as f64 / iters
+    );
+    Ok(())
+}
+
 fn read_cpu_busy_and_total(reader: &procfs::ProcReader) -> Result<(u64, u64)> {
     let cs = reader
         .read_stat()
@@ -265,6 +368,9 @@ struct StatsCtx {
     cpu_total: u64,
     bpf_stats: Vec<u64>,
     time_used: Duration,
+    imbal_secs: f64,
+    nr_lb_triggered: u64,
+    nr_lb_periodic: u64,
 }
 
 impl StatsCtx {
@@ -298,10 +404,20 @@ impl StatsCtx {
             cpu_total: 0,
             bpf_stats: vec![0u64; bpf_intf::stat_idx_RUSTY_NR_STATS as usize],
             time_used: Duration::default(),
+            imbal_secs: 0.0,
+            nr_lb_triggered: 0,
+            nr_lb_periodic: 0,
         }
     }
 
-    fn new(skel: &BpfSkel, proc_reader: &procfs::ProcReader, time_used: Duration) -> Result<Self> {
+    fn new(
+        skel: &BpfSkel,
+        proc_reader: &procfs::ProcReader,
+        time_used: Duration,
+        imbal_secs: f64,
+        nr_lb_triggered: u64,
+        nr_lb_periodic: u64,
+    ) -> Result<Self> {
         let (cpu_busy, cpu_total) = read_cpu_busy_and_total(proc_reader)?;
 
         Ok(Self {
@@ -309,6 +425,9 @@ impl StatsCtx {
             cpu_total,
             bpf_stats: Self::read_bpf_stats(skel)?,
             time_used,
+            imbal_secs,
+            nr_lb_triggered,
+            nr_lb_periodic,
         })
     }
 
@@ -323,6 +442,9 @@ impl StatsCtx {
                 .map(|(lhs, rhs)| sub_or_zero(&lhs, &rhs))
                 .collect(),
             time_used: self.time_used - rhs.time_used,
+            imbal_secs: self.imbal_secs - rhs.imbal_secs,
+            nr_lb_triggered: sub_or_zero(&self.nr_lb_triggered, &rhs.nr_lb_triggered),
+            nr_lb_periodic: sub_or_zero(&self.nr_lb_periodic, &rhs.nr_lb_periodic),
         }
     }
 }
@@ -336,13 +458,26 @@ struct Scheduler<'a> {
     balance_load: bool,
     balanced_kworkers: bool,
 
+    // Drained every loop iteration, sets lb_trigger_pending on events.
+    lb_trigger_rb: libbpf_rs::RingBuffer<'static>,
+    lb_trigger_pending: Arc<AtomicBool>,
+    lb_triggers_enabled: bool,
+    lb_cur_interval: Duration,
+    lb_started_at: Instant,
+    lb_balanced: bool,
+    nr_lb_triggered: u64,
+    nr_lb_periodic: u64,
+
     dom_group: Arc<DomainGroup>,
 
     proc_reader: procfs::ProcReader,
 
     lb_at: SystemTime,
     lb_stats: BTreeMap<usize, NodeStats>,
+    lb_phase_times: LbPhaseTimes,
+    lb_record: Option<BufWriter<std::fs::File>>,
     time_used: Duration,
+    imbal_secs: f64,
 
     tuner: Tuner,
     stats_server: StatsServer<StatsCtx, (StatsCtx, ClusterStats)>,
@@ -385,6 +520,12 @@ impl<'a> Scheduler<'a> {
         skel.maps.rodata_data.nr_doms = domains.nr_doms() as u32;
         skel.maps.rodata_data.nr_cpu_ids = *NR_CPU_IDS as u32;
 
+        // Only allocate the duty cycle locks and per-CPU accumulators for the
+        // domains which actually exist.
+        let nr_dom_buckets = domains.nr_doms() as u32 * bpf_intf::consts_LB_LOAD_BUCKETS;
+        skel.maps.dom_dcycle_locks.set_max_entries(nr_dom_buckets)?;
+        skel.maps.dom_dcycle_pcpu.set_max_entries(nr_dom_buckets)?;
+
         // Any CPU with dom > MAX_DOMS is considered offline by default. There
         // are a few places in the BPF code where we skip over offlined CPUs
         // (e.g. when initializing or refreshing tune params), and elsewhere the
@@ -423,6 +564,8 @@ impl<'a> Scheduler<'a> {
                 left.clone_from_slice(raw_dom_slice);
                 skel.maps.rodata_data.dom_numa_id_map[dom.id()] =
                     numa.try_into().expect("NUMA ID could not fit into 32 bits");
+                skel.maps.rodata_data.node_dom_masks[numa][dom.id() / 64] |= 1 << (dom.id() % 64);
+                skel.maps.rodata_data.node_nr_doms[numa] += 1;
 
                 info!(" DOM[{:02}] mask= {}", dom.id(), dom.mask());
             }
@@ -434,12 +577,24 @@ impl<'a> Scheduler<'a> {
         skel.struct_ops.rusty_mut().exit_dump_len = opts.exit_dump_len;
 
         skel.maps.rodata_data.load_half_life = (opts.load_half_life * 1000000000.0) as u32;
+        if !opts.no_load_balance {
+            skel.maps.rodata_data.lb_interval_ns = (opts.bpf_lb_interval * 1000000000.0) as u64;
+        }
+        let lb_triggers_enabled =
+            !opts.no_load_balance && opts.bpf_lb_interval == 0.0 && opts.lb_trigger_pct > 0;
+        if lb_triggers_enabled {
+            skel.maps.rodata_data.lb_trigger_pct = opts.lb_trigger_pct;
+            skel.maps.rodata_data.lb_trigger_gap_ns = (opts.interval / 4.0 * 1000000000.0) as u64;
+        }
+        fill_dl_lat_scale_recips(&mut skel.maps.rodata_data.dl_lat_scale_recips);
+        skel.maps.rodata_data.balanced_kworkers = opts.balanced_kworkers;
         skel.maps.rodata_data.kthreads_local = opts.kthreads_local;
         skel.maps.rodata_data.fifo_sched = opts.fifo_sched;
         skel.maps.rodata_data.greedy_threshold = opts.greedy_threshold;
         skel.maps.rodata_data.greedy_threshold_x_numa = opts.greedy_threshold_x_numa;
         skel.maps.rodata_data.direct_greedy_numa = opts.direct_greedy_numa;
         skel.maps.rodata_data.mempolicy_affinity = opts.mempolicy_affinity;
+        skel.maps.rodata_data.tune_bpf_util = opts.tune_bpf_util;
         skel.maps.rodata_data.debug = opts.verbose as u32;
 
         // Attach.
@@ -447,6 +602,27 @@ impl<'a> Scheduler<'a> {
         let struct_ops = Some(scx_ops_attach!(skel, rusty)?);
         let stats_server = StatsServer::new(stats::server_data()).launch()?;
 
+        let lb_trigger_pending = Arc::new(AtomicBool::new(false));
+        let pending = lb_trigger_pending.clone();
+        let mut rb_builder = libbpf_rs::RingBufferBuilder::new();
+        rb_builder
+            .add(&skel.maps.lb_triggers, move |data: &[u8]| {
+                if data.len() >= std::mem::size_of::<bpf_intf::lb_trigger>() {
+                    let trig: bpf_intf::lb_trigger =
+                        unsafe { std::ptr::read_unaligned(data.as_ptr() as *const _) };
+                    debug!(
+                        "LB trigger: dom {} load {} avg {}",
+                        trig.dom_id, trig.load, trig.avg
+                    );
+                }
+                pending.store(true, Ordering::Relaxed);
+                0
+            })
+            .context("Failed to add lb_triggers ring buffer")?;
+        let lb_trigger_rb = rb_builder
+            .build()
+            .context("Failed to build lb_triggers ring buffer")?;
+
         for (id, dom) in domains.doms().iter() {
             let id: usize = id
                 .clone()
@@ -462,6 +638,16 @@ impl<'a> Scheduler<'a> {
 
         // Other stuff.
         let proc_reader = procfs::ProcReader::new();
+        let lb_record = match &opts.lb_record {
+            Some(path) => Some(BufWriter::new(
+                std::fs::OpenOptions::new()
+                    .create(true)
+                    .append(true)
+                    .open(path)
+                    .with_context(|| format!("Failed to open {:?}", path))?,
+            )),
+            None => None,
+        };
 
         Ok(Self {
             skel,
@@ -469,15 +655,27 @@ impl<'a> Scheduler<'a> {
 
             sched_interval: Duration::from_secs_f64(opts.interval),
             tune_interval: Duration::from_secs_f64(opts.tune_interval),
-            balance_load: !opts.no_load_balance,
+            balance_load: !opts.no_load_balance && opts.bpf_lb_interval == 0.0,
             balanced_kworkers: opts.balanced_kworkers,
 
+            lb_trigger_rb,
+            lb_trigger_pending,
+            lb_triggers_enabled,
+            lb_cur_interval: Duration::from_secs_f64(opts.interval),
+            lb_started_at: Instant::now(),
+            lb_balanced: false,
+            nr_lb_triggered: 0,
+            nr_lb_periodic: 0,
+
             dom_group: domains.clone(),
             proc_reader,
 
             lb_at: SystemTime::now(),
             lb_stats: BTreeMap::new(),
+            lb_phase_times: LbPhaseTimes::default(),
+            lb_record,
             time_used: Duration::default(),
+            imbal_secs: 0.0,
 
             tuner: Tuner::new(
                 domains,
@@ -485,6 +683,7 @@ impl<'a> Scheduler<'a> {
                 opts.kick_greedy_under,
                 opts.slice_us_underutil * 1000,
                 opts.slice_us_overutil * 1000,
+                opts.tune_bpf_util,
             )?,
             stats_server,
         })
@@ -511,6 +710,14 @@ impl<'a> Scheduler<'a> {
             0.0
         };
 
+        let nr_steals = stat(bpf_intf::stat_idx_RUSTY_STAT_GREEDY_LOCAL)
+            + stat(bpf_intf::stat_idx_RUSTY_STAT_GREEDY_XNUMA);
+        let steal_probes = if nr_steals != 0 {
+            stat(bpf_intf::stat_idx_RUSTY_STAT_STEAL_PROBES) as f64 / nr_steals as f64
+        } else {
+            0.0
+        };
+
         ClusterStats {
             at_us: SystemTime::now()
                 .duration_since(UNIX_EPOCH)
@@ -534,6 +741,12 @@ impl<'a> Scheduler<'a> {
 
             task_get_err: sc.bpf_stats[bpf_intf::stat_idx_RUSTY_STAT_TASK_GET_ERR as usize],
             time_used: sc.time_used.as_secs_f64(),
+            imbal_secs: sc.imbal_secs,
+            lb_hierarchy_ms: self.lb_phase_times.hierarchy.as_secs_f64() * 1000.0,
+            lb_between_nodes_ms: self.lb_phase_times.between_nodes.as_secs_f64() * 1000.0,
+            lb_within_nodes_ms: self.lb_phase_times.within_nodes.as_secs_f64() * 1000.0,
+            lb_triggered: sc.nr_lb_triggered,
+            lb_periodic: sc.nr_lb_periodic,
 
             sync_prev_idle: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_SYNC_PREV_IDLE),
             wake_sync: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_WAKE_SYNC),
@@ -546,6 +759,7 @@ impl<'a> Scheduler<'a> {
             dsq_dispatch: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_DSQ_DISPATCH),
             greedy_local: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_GREEDY_LOCAL),
             greedy_xnuma: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_GREEDY_XNUMA),
+            steal_probes,
             kick_greedy: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_KICK_GREEDY),
             repatriate: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_REPATRIATE),
             dl_clamp: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_DL_CLAMP),
@@ -559,8 +773,17 @@ impl<'a> Scheduler<'a> {
     }
 
     fn lb_step(&mut self) -> Result<()> {
+        self.lb_started_at = Instant::now();
+
+        let mut source = BpfLbSource::new(&mut self.skel, self.dom_group.nr_doms())?;
+        if let Some(file) = self.lb_record.as_mut() {
+            lb_sim::Snapshot::capture(&mut source, &self.dom_group, self.tuner.fully_utilized)?
+                .write(file)?;
+            // Keep the trace complete up to the last snapshot.
+            file.flush().context("Failed to write --lb-record trace")?;
+        }
         let mut lb = LoadBalancer::new(
-            &mut self.skel,
+            &mut source,
             self.dom_group.clone(),
             self.balanced_kworkers,
             self.tuner.fully_utilized.clone(),
@@ -569,11 +792,55 @@ impl<'a> Scheduler<'a> {
 
         lb.load_balance()?;
 
-        self.lb_at = SystemTime::now();
+        // Integrate the imbalance over time so that the userspace and BPF
+        // load balancers can be compared.
+        let now = SystemTime::now();
+        let dur = now.duration_since(self.lb_at).unwrap_or_default();
+        self.imbal_secs += lb.imbalance() * dur.as_secs_f64();
+
+        self.lb_at = now;
         self.lb_stats = lb.get_stats();
+        self.lb_phase_times = lb.phase_times();
+        self.lb_balanced = lb.is_balanced();
+
+        // This round addressed whatever imbalance BPF reported before it.
+        // Triggers which arrived during the round are still in the ring
+        // buffer and will be picked up by the next lb_triggered().
+        self.lb_trigger_pending.store(false, Ordering::Relaxed);
         Ok(())
     }
 
+    /// Drain the trigger ring buffer and return whether BPF reported an
+    /// imbalance which should be acted upon now. A trigger arriving within
+    /// --interval / 4 of the last round is kept pending until then. The
+    /// pending state is cleared by lb_step().
+    fn lb_triggered(&mut self, now: Instant) -> Result<bool> {
+        if !self.lb_triggers_enabled {
+            return Ok(false);
+        }
+
+        self.lb_trigger_rb
+            .consume()
+            .context("Failed to consume LB trigger ring buffer")?;
+
+        if now.duration_since(self.lb_started_at) < self.sched_interval / 4 {
+            return Ok(false);
+        }
+        Ok(self.lb_trigger_pending.load(Ordering::Relaxed))
+    }
+
+    /// Pick the interval until the next periodic round. Without triggers, it's
+    /// always --interval. With them, balanced periodic rounds back off up to 8
+    /// times --interval as BPF will notify us of new imbalances anyway.
+    fn lb_next_interval(&mut self, triggered: bool) -> Duration {
+        if self.lb_triggers_enabled && !triggered && self.lb_balanced {
+            self.lb_cur_interval = (self.lb_cur_interval * 2).min(self.sched_interval * 8);
+        } else {
+            self.lb_cur_interval = self.sched_interval;
+        }
+        self.lb_cur_interval
+    }
+
     fn run(&mut self, shutdown: Arc<AtomicBool>) -> Result<UserExitInfo> {
         let (res_ch, req_ch) = self.stats_server.channels();
         let now = Instant::now();
@@ -593,11 +860,24 @@ impl<'a> Scheduler<'a> {
                 }
             }
 
-            if now >= next_sched_at {
+            // Always drain the ring buffer, periodic rounds included.
+            let triggered = self.lb_triggered(now)? && now < next_sched_at;
+            if now >= next_sched_at || triggered {
                 self.lb_step()?;
-                next_sched_at += self.sched_interval;
-                if next_sched_at < now {
-                    next_sched_at = now + self.sched_interval;
+                if triggered {
+                    self.nr_lb_triggered += 1;
+                } else {
+                    self.nr_lb_periodic += 1;
+                }
+
+                let interval = self.lb_next_interval(triggered);
+                if self.lb_triggers_enabled {
+                    next_sched_at = now + interval;
+                } else {
+                    next_sched_at += interval;
+                    if next_sched_at < now {
+                        next_sched_at = now + interval;
+                    }
                 }
             }
 
@@ -605,7 +885,14 @@ impl<'a> Scheduler<'a> {
 
             match req_ch.recv_deadline(next_sched_at.min(next_tune_at)) {
                 Ok(prev_sc) => {
-                    let cur_sc = StatsCtx::new(&self.skel, &self.proc_reader, self.time_used)?;
+                    let cur_sc = StatsCtx::new(
+                        &self.skel,
+                        &self.proc_reader,
+                        self.time_used,
+                        self.imbal_secs,
+                        self.nr_lb_triggered,
+                        self.nr_lb_periodic,
+                    )?;
                     let delta_sc = cur_sc.delta(&prev_sc);
                     let cstats = self.cluster_stats(&delta_sc, self.lb_stats.clone());
                     res_ch.send((cur_sc, cstats))?;
@@ -661,6 +948,14 @@ fn main() -> Result<()> {
         simplelog::ColorChoice::Auto,
     )?;
 
+    if let Some(spec) = &opts.lb_replay {
+        return lb_sim::replay(spec);
+    }
+
+    if opts.bench_dl {
+        return bench_dl(&opts);
+    }
+
     let shutdown = Arc::new(AtomicBool::new(false));
     let shutdown_clone = shutdown.clone();
     ctrlc::set_handler(move || {
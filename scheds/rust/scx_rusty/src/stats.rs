@@ -122,6 +122,18 @@ pub struct ClusterStats {
     pub task_get_err: u64,
     #[stat(desc = "time spent running scheduler userspace")]
     pub time_used: f64,
+    #[stat(desc = "load above average summed across domains, integrated over time")]
+    pub imbal_secs: f64,
+    #[stat(desc = "last LB round: time spent reading loads and building the hierarchy (ms)")]
+    pub lb_hierarchy_ms: f64,
+    #[stat(desc = "last LB round: time spent balancing between NUMA nodes (ms)")]
+    pub lb_between_nodes_ms: f64,
+    #[stat(desc = "last LB round: time spent balancing within NUMA nodes in parallel (ms)")]
+    pub lb_within_nodes_ms: f64,
+    #[stat(desc = "# of LB rounds triggered by BPF imbalance events")]
+    pub lb_triggered: u64,
+    #[stat(desc = "# of periodic LB rounds")]
+    pub lb_periodic: u64,
 
     #[stat(desc = "% WAKE_SYNC directly dispatched to idle previous CPU")]
     pub sync_prev_idle: f64,
@@ -145,6 +157,8 @@ pub struct ClusterStats {
     pub greedy_local: f64,
     #[stat(desc = "% scheduled from foreign node")]
     pub greedy_xnuma: f64,
+    #[stat(desc = "avg # of foreign DSQs probed per successful steal")]
+    pub steal_probes: f64,
     #[stat(desc = "% foreign domain CPU kicked on enqueue")]
     pub kick_greedy: f64,
     #[stat(desc = "% repatriated to local domain on enqueue")]
@@ -174,6 +188,16 @@ impl ClusterStats {
             self.task_get_err,
             self.time_used * 1000.0,
         )?;
+        writeln!(
+            w,
+            "imbal_secs={:8.2} lb_ms: hier={:5.2} xnode={:5.2} intra={:5.2} lb_rounds: trig={} periodic={}",
+            self.imbal_secs,
+            self.lb_hierarchy_ms,
+            self.lb_between_nodes_ms,
+            self.lb_within_nodes_ms,
+            self.lb_triggered,
+            self.lb_periodic,
+        )?;
         writeln!(
             w,
             "tot={:7} sync_prev_idle={:5.2} wsync={:5.2}",
@@ -193,8 +217,8 @@ impl ClusterStats {
 
         writeln!(
             w,
-            "dsq={:5.2} greedy_local={:5.2} greedy_xnuma={:5.2}",
-            self.dsq_dispatch, self.greedy_local, self.greedy_xnuma,
+            "dsq={:5.2} greedy_local={:5.2} greedy_xnuma={:5.2} steal_probes={:5.2}",
+            self.dsq_dispatch, self.greedy_local, self.greedy_xnuma, self.steal_probes,
         )?;
 
         writeln!(
@@ -10,7 +10,9 @@ use anyhow::anyhow;
 use anyhow::bail;
 use anyhow::Result;
 use scx_utils::Cpumask;
+use scx_utils::NR_CPU_IDS;
 
+use crate::load_balance::now_monotonic;
 use crate::sub_or_zero;
 use crate::BpfSkel;
 use crate::DomainGroup;
@@ -65,6 +67,101 @@ fn calc_util(curr: &procfs::CpuStat, prev: &procfs::CpuStat) -> Result<f64> {
     }
 }
 
+/// Read the busy time of each CPU from the BPF per-CPU contexts. The task
+/// running on a CPU is only accounted when it stops, so add the time it has
+/// been running so far. Racing with BPF can over or under count a bit, which
+/// the utilization clamping absorbs.
+fn read_cpu_busy_ns(skel: &BpfSkel, now: u64) -> Vec<u64> {
+    skel.maps.bss_data.pcpu_ctx[..*NR_CPU_IDS]
+        .iter()
+        .map(|pcpuc| {
+            let busy_ns = unsafe { std::ptr::read_volatile(&pcpuc.busy_ns) };
+            let running_at = unsafe { std::ptr::read_volatile(&pcpuc.running_at) };
+            match running_at {
+                0 => busy_ns,
+                at => busy_ns + now.saturating_sub(at),
+            }
+        })
+        .collect()
+}
+
+/// Where the per-CPU utilization comes from.
+///
+/// `Procfs` counts everything /proc/stat reports as busy including IRQ,
+/// softirq, steal and time spent running tasks of other sched classes, but
+/// parses procfs on every step and only has jiffy resolution.
+///
+/// `Bpf` reads the per-CPU time spent running tasks of this scheduler as
+/// accounted by BPF. It is nanosecond accurate and cheap enough for very
+/// short tuning intervals but ignores everything else, so CPUs can look less
+/// utilized than /proc/stat reports in --partial mode or under heavy RT or
+/// IRQ load.
+enum UtilSource {
+    Procfs {
+        reader: procfs::ProcReader,
+        prev_cpu_stats: BTreeMap<u32, procfs::CpuStat>,
+    },
+    Bpf {
+        prev_busy_ns: Vec<u64>,
+        prev_at: u64,
+    },
+}
+
+impl UtilSource {
+    /// Utilization of each CPU since the last call. CPUs without stats are
+    /// None.
+    fn read(&mut self, skel: &BpfSkel) -> Result<Vec<Option<f64>>> {
+        match self {
+            Self::Procfs {
+                reader,
+                prev_cpu_stats,
+            } => {
+                let curr_cpu_stats = reader
+                    .read_stat()?
+                    .cpus_map
+                    .ok_or_else(|| anyhow!("Expected cpus_map to exist"))?;
+
+                let mut utils = vec![None; *NR_CPU_IDS];
+                for (cpu, util) in utils.iter_mut().enumerate() {
+                    let cpu32 = cpu as u32;
+                    if let (Some(curr), Some(prev)) =
+                        (curr_cpu_stats.get(&cpu32), prev_cpu_stats.get(&cpu32))
+                    {
+                        *util = Some(calc_util(curr, prev)?);
+                    }
+                }
+
+                *prev_cpu_stats = curr_cpu_stats;
+                Ok(utils)
+            }
+            Self::Bpf {
+                prev_busy_ns,
+                prev_at,
+            } => {
+                let now = now_monotonic();
+                let curr_busy_ns = read_cpu_busy_ns(skel, now);
+                let dur_ns = now.saturating_sub(*prev_at);
+
+                let utils = curr_busy_ns
+                    .iter()
+                    .zip(prev_busy_ns.iter())
+                    .map(|(curr, prev)| match dur_ns {
+                        0 => Some(1.0),
+                        dur => {
+                            let busy = sub_or_zero(curr, prev);
+                            Some((busy as f64 / dur as f64).clamp(0.0, 1.0))
+                        }
+                    })
+                    .collect();
+
+                *prev_busy_ns = curr_busy_ns;
+                *prev_at = now;
+                Ok(utils)
+            }
+        }
+    }
+}
+
 pub struct Tuner {
     pub direct_greedy_mask: Cpumask,
     pub kick_greedy_mask: Cpumask,
@@ -75,8 +172,7 @@ pub struct Tuner {
     dom_group: Arc<DomainGroup>,
     direct_greedy_under: f64,
     kick_greedy_under: f64,
-    proc_reader: procfs::ProcReader,
-    prev_cpu_stats: BTreeMap<u32, procfs::CpuStat>,
+    util_source: UtilSource,
 }
 
 impl Tuner {
@@ -86,12 +182,25 @@ impl Tuner {
         kick_greedy_under: f64,
         underutil_slice_ns: u64,
         overutil_slice_ns: u64,
+        bpf_util: bool,
     ) -> Result<Self> {
-        let proc_reader = procfs::ProcReader::new();
-        let prev_cpu_stats = proc_reader
-            .read_stat()?
-            .cpus_map
-            .ok_or_else(|| anyhow!("Expected cpus_map to exist"))?;
+        let util_source = match bpf_util {
+            true => UtilSource::Bpf {
+                prev_busy_ns: vec![0; *NR_CPU_IDS],
+                prev_at: now_monotonic(),
+            },
+            false => {
+                let reader = procfs::ProcReader::new();
+                let prev_cpu_stats = reader
+                    .read_stat()?
+                    .cpus_map
+                    .ok_or_else(|| anyhow!("Expected cpus_map to exist"))?;
+                UtilSource::Procfs {
+                    reader,
+                    prev_cpu_stats,
+                }
+            }
+        };
 
         Ok(Self {
             direct_greedy_mask: Cpumask::new(),
@@ -99,8 +208,7 @@ impl Tuner {
             fully_utilized: false,
             direct_greedy_under: direct_greedy_under / 100.0,
             kick_greedy_under: kick_greedy_under / 100.0,
-            proc_reader,
-            prev_cpu_stats,
+            util_source,
             slice_ns: underutil_slice_ns,
             underutil_slice_ns,
             overutil_slice_ns,
@@ -110,26 +218,18 @@ impl Tuner {
 
     /// Apply a step in the Tuner by:
     ///
-    /// 1. Recording CPU stats from procfs
+    /// 1. Reading the per-CPU utilization from procfs or BPF
     /// 2. Calculating current per-domain and host-wide utilization
     /// 3. Updating direct_greedy_under and kick_greedy_under cpumasks according
     ///    to the observed utilization
     pub fn step(&mut self, skel: &mut BpfSkel) -> Result<()> {
-        let curr_cpu_stats = self
-            .proc_reader
-            .read_stat()?
-            .cpus_map
-            .ok_or_else(|| anyhow!("Expected cpus_map to exist"))?;
+        let cpu_utils = self.util_source.read(skel)?;
         let mut dom_util_sum = vec![0.0f64; self.dom_group.nr_doms()];
 
         let mut avg_util = 0.0f64;
         for (dom_id, dom) in self.dom_group.doms().iter() {
             for cpu in dom.mask().iter() {
-                let cpu32 = cpu as u32;
-                if let (Some(curr), Some(prev)) =
-                    (curr_cpu_stats.get(&cpu32), self.prev_cpu_stats.get(&cpu32))
-                {
-                    let util = calc_util(curr, prev)?;
+                if let Some(util) = cpu_utils.get(cpu).copied().flatten() {
                     dom_util_sum[*dom_id] += util;
                     avg_util += util;
                 }
@@ -176,11 +276,10 @@ impl Tuner {
             self.slice_ns = self.underutil_slice_ns;
         }
         ti.slice_ns = self.slice_ns;
+        ti.lb_apply_weight = self.fully_utilized;
 
         ti.gen += 1;
 
-        self.prev_cpu_stats = curr_cpu_stats;
-
         Ok(())
     }
 }
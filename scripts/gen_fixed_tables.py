@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+
+import math
+from pathlib import Path
+
+warning = \
+"""/*
+ * WARNING: This file is autogenerated from scripts/gen_fixed_tables.py. If
+ * you change the table parameters, update scheds/include/scx/fixed.bpf.h to
+ * match and run the script from the root directory to update this file.
+ */
+
+"""
+
+# Must match enum scx_fixed_consts in scheds/include/scx/fixed.bpf.h.
+FIXED_SHIFT = 16
+FIXED_ONE = 1 << FIXED_SHIFT
+LOG2_TBL_BITS = 6
+EXP2_TBL_BITS = 6
+WMULT_SHIFT = 32
+
+# Taken from sched_prio_to_weight[] in kernel/sched/core.c.
+sched_prio_to_weight = [
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15,
+]
+
+# Taken from sched_prio_to_wmult[] in kernel/sched/core.c. The kernel's
+# values aren't consistently rounded, so copy them instead of computing.
+sched_prio_to_wmult = [
+     48388,     59856,     76040,     92818,    118348,
+    147320,    184698,    229616,    287308,    360437,
+    449829,    563644,    704093,    875809,   1099582,
+   1376151,   1717300,   2157191,   2708050,   3363326,
+   4194304,   5237765,   6557202,   8165337,  10153587,
+  12820798,  15790321,  19976592,  24970740,  31350126,
+  39045157,  49367440,  61356676,  76695844,  95443717,
+ 119304647, 148102320, 186737708, 238609294, 286331153,
+]
+
+
+def log2_frac_table():
+    n = 1 << LOG2_TBL_BITS
+    return [round(math.log2(1 + i / n) * FIXED_ONE) for i in range(n)]
+
+
+def exp2_frac_table():
+    n = 1 << EXP2_TBL_BITS
+    return [round(2 ** (i / n) * FIXED_ONE) for i in range(n)]
+
+
+def prio_to_wmult_table():
+    for w, wmult in zip(sched_prio_to_weight, sched_prio_to_wmult):
+        assert abs(wmult - (1 << WMULT_SHIFT) / w) <= 1, f"bad wmult {wmult} for {w}"
+    return sched_prio_to_wmult
+
+
+def check(name, tbl, lo, hi):
+    assert all(a < b for a, b in zip(tbl, tbl[1:])), f"{name} not monotonic"
+    assert lo <= tbl[0] and tbl[-1] < hi, f"{name} out of range"
+
+
+def write_table(f, comment, ctype, name, tbl, per_line):
+    f.write("/*\n")
+    for line in comment:
+        f.write(f" * {line}\n".rstrip() + "\n")
+    f.write(" */\n")
+    f.write(f"static const {ctype} {name}[{len(tbl)}] = {{\n")
+    for i in range(0, len(tbl), per_line):
+        f.write("\t" + ", ".join(str(v) for v in tbl[i:i + per_line]) + ",\n")
+    f.write("};\n\n")
+
+
+def gen_fixed_tables_bpf_h():
+    log2_tbl = log2_frac_table()
+    exp2_tbl = exp2_frac_table()
+    wmult_tbl = prio_to_wmult_table()
+
+    check("log2", log2_tbl, 0, FIXED_ONE)
+    check("exp2", exp2_tbl, FIXED_ONE, 2 * FIXED_ONE)
+    assert all(a < b for a, b in zip(wmult_tbl, wmult_tbl[1:])), "wmult not monotonic"
+
+    autogen = Path(__file__).parent.parent / "scheds/include/scx/fixed_tables.autogen.bpf.h"
+    with open(autogen, "w") as f:
+        f.write(warning)
+        write_table(f, [f"[i] = log2(1 + i / {1 << LOG2_TBL_BITS}) * {FIXED_ONE}"],
+                    "u32", "scx_fixed_log2_frac", log2_tbl, 8)
+        write_table(f, [f"[i] = 2^(i / {1 << EXP2_TBL_BITS}) * {FIXED_ONE}"],
+                    "u32", "scx_fixed_exp2_frac", exp2_tbl, 8)
+        write_table(f, [f"[i] = 2^{WMULT_SHIFT} / sched_prio_to_weight[i], the same as the",
+                        "kernel's sched_prio_to_wmult[]."],
+                    "u32", "scx_prio_to_wmult", wmult_tbl, 5)
+
+
+"""
+    Helper script for generating the lookup tables used by the fixed-point
+    math helpers in scheds/include/scx/fixed_impl.bpf.h.
+"""
+if __name__ == "__main__":
+    gen_fixed_tables_bpf_h()